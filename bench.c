@@ -0,0 +1,3949 @@
+/* ----------------------------------------------------------------------------
+SOURCE FILE
+
+Name:		bench.c
+
+Program:	Port Forwarder
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Functions:
+	int main(int argc, char** argv)
+
+Description:
+  Microbenchmarks for the forwarding hot path. Run with `make bench`, or run
+  bench.exe with the name of a single benchmark to run only that one. The io
+  offload, balance and latency benchmarks need root. `bench.exe replay <file.pcap>`
+  replays a capture along with the synthetic traffic.
+
+Revisions:
+	(none)
+
+---------------------------------------------------------------------------- */
+
+#include "portforward.h"
+
+#include <fcntl.h>
+#include <linux/ethtool.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/rtnetlink.h>
+#include <linux/sockios.h>
+#include <linux/veth.h>
+#include <net/if.h>
+#include <net/route.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+// number of timed operations per measurement
+#define BENCH_OPS 2000000
+
+// number of targets flows are spread over
+#define BENCH_TARGETS 16
+
+// snat addresses the connection tables are given, enough ports for 2M flows
+#define BENCH_SNAT 32
+
+// flows per thread in the worker benchmark
+#define BENCH_FLOWS 4096
+
+// the metrics benchmark, rounds of each and packets per round
+#define BENCH_METRICS_ROUNDS  1001
+#define BENCH_METRICS_PACKETS 50000
+
+// loopback ports of the proxy benchmark, and what it sends
+#define BENCH_PROXY_PORT    18080
+#define BENCH_TARGET_PORT   18081
+#define BENCH_ROUND_TRIPS   20000
+#define BENCH_STREAM_BYTES  (1024LL * 1024 * 1024)
+
+// the io benchmark, packets per run and the flows they are spread over
+#define BENCH_IO_PACKETS    500000
+#define BENCH_IO_FLOWS      64
+#define BENCH_IO_PORT       8080
+
+// the offload benchmark, the forwarder's address on the client side (the
+// target side is the next /24), the target, and the stream sent through
+#define BENCH_OFFLOAD_FORWARDER  0x0a000001
+#define BENCH_OFFLOAD_TARGET     0x0a000102
+#define BENCH_OFFLOAD_BYTES      (256LL * 1024 * 1024)
+
+// the maglev benchmark, synthetic clients spread over a forward's targets
+#define BENCH_MAGLEV_FLOWS  1000000
+
+// the config benchmark, the first port forwarded and how many, each to two hosts
+#define BENCH_CONFIG_PORT   10000
+#define BENCH_CONFIG_PORTS  50000
+
+// the balance benchmark, two quick targets on one host and a slow one
+// behind a delay line, and the requests made through each policy
+#define BENCH_BALANCE_TARGETS   3
+#define BENCH_BALANCE_DELAY_US  10000
+#define BENCH_BALANCE_REQUESTS  300
+#define BENCH_DELAY_FRAMES      1024
+
+// the latency benchmark, round trips made before timing starts, the timed
+// ones are BENCH_ROUND_TRIPS
+#define BENCH_LATENCY_WARM  1000
+
+// the sync benchmark, connections opened and reset per run
+#define BENCH_SYNC_FLOWS  65536
+
+// the replay benchmark, flows of small and of full sized packets, SYNs in
+// the storm, and the target a capture's server is replaced by
+#define BENCH_REPLAY_FLOWS    65536
+#define BENCH_REPLAY_LARGE    4096
+#define BENCH_REPLAY_STORM    1000000
+#define BENCH_REPLAY_TARGET   0x0a0f0001
+
+// sink so the compiler can't drop the work being timed
+volatile unsigned long bench_sink = 0;
+
+// calls to malloc, calloc and realloc so far, see __wrap_malloc
+static unsigned long bench_allocs = 0;
+
+// a capture for the replay benchmark, named after it on the command line
+static const char* bench_pcap = 0;
+
+// set by a check that failed, the run exits non-zero
+static int bench_failed = 0;
+
+// the allocator behind the wrappers
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void* ptr, size_t size);
+
+// one thread of the worker benchmark
+struct bench_thread{
+  pthread_t thread;
+  pthread_barrier_t* barrier;
+  struct pf_worker worker;
+  struct pf_target* targets;
+  unsigned int client;
+  int metrics;
+  double ns;
+};
+
+// traffic for the replay benchmark, packets back to back in memory with
+// the first warm of them run before timing. A target's packet answers an
+// earlier packet of its client, or -1, and is sent to the snat address and
+// port that one was given
+struct bench_replay{
+  char* data;
+  size_t size;
+  size_t capacity;
+  size_t* offsets;
+  int* lengths;
+  long* answers;
+  size_t count;
+  size_t slots;
+  size_t warm;
+};
+
+// one direction of the delay line, frames waiting to be passed on
+struct bench_frame{
+  double due;
+  int out;
+  int length;
+  char data[2048];
+};
+
+// the delay line of the balance benchmark, bridging two interfaces
+struct bench_delay{
+  int fds[2];
+  double delay;
+  volatile int done;
+  struct bench_frame frames[BENCH_DELAY_FRAMES];
+};
+
+// a forwarder over the targets of the balance benchmark
+struct bench_balance{
+  struct pf_config config;
+  struct pf_target targets[BENCH_BALANCE_TARGETS];
+};
+
+// one run of the io benchmark
+struct bench_io{
+  struct pf_config config;
+  struct pf_target target;
+  int length;
+  volatile int done;
+  unsigned long sent;
+  double start;
+};
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Now
+
+Prototype:  static double now(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  Monotonic time in nanoseconds
+
+Description:
+  Timer for the benchmarks.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static double now(void) {
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Cycles
+
+Prototype:  static unsigned long cycles(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  The time stamp counter, or 0 where there isn't one
+
+Description:
+  Cycle counter for the benchmarks. The tsc ticks at a fixed rate, so it
+  only matches the core's cycles when the clock isn't boosted or scaled.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static unsigned long cycles(void) {
+
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  return 0;
+#endif
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Wrap Malloc
+
+Prototype:  void *__wrap_malloc(size_t size)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  size_t size
+    as malloc
+
+Return Values:
+  as malloc
+
+Description:
+  The benchmark is linked with --wrap=malloc, so every call the forwarder's
+  code makes to malloc comes here first to be counted. The same goes for
+  calloc and realloc below.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+void *__wrap_malloc(size_t size) {
+
+  __atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return __real_malloc(size);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Wrap Calloc
+
+Prototype:  void *__wrap_calloc(size_t count, size_t size)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  size_t count, size
+    as calloc
+
+Return Values:
+  as calloc
+
+Description:
+  Counts a call to calloc.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+void *__wrap_calloc(size_t count, size_t size) {
+
+  __atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return __real_calloc(count, size);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Wrap Realloc
+
+Prototype:  void *__wrap_realloc(void* ptr, size_t size)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  void* ptr
+  size_t size
+    as realloc
+
+Return Values:
+  as realloc
+
+Description:
+  Counts a call to realloc.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+void *__wrap_realloc(void* ptr, size_t size) {
+
+  __atomic_fetch_add(&bench_allocs, 1, __ATOMIC_RELAXED);
+  return __real_realloc(ptr, size);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Nat
+
+Prototype:  static void bench_nat(struct pf_conntrack* ct)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_conntrack* ct
+    a table set up by conntrack_init
+
+Return Values:
+  void
+
+Description:
+  Gives a table BENCH_SNAT snat addresses, all of their ports, as a lone
+  worker's table would have.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void bench_nat(struct pf_conntrack* ct) {
+
+  unsigned int addrs[BENCH_SNAT];
+  int i;
+
+  for (i = 0; i < BENCH_SNAT; i++) {
+    addrs[i] = htonl(0xc0a80100 + i);
+  }
+  conntrack_nat(ct, addrs, BENCH_SNAT, 1, 0);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Conntrack
+
+Prototype:  static void bench_conntrack(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  void
+
+Description:
+  Fills the connection table with 10 to 1M flows and times lookups from both
+  directions, plus an insert/remove pair, at each size. Lookups pick flows in
+  a random order so the larger tables pay their real cache misses.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Flows are given snat ports, and looked up by them from the target side
+
+---------------------------------------------------------------------------- */
+static void bench_conntrack(void) {
+
+  static const size_t sizes[] = {10, 100, 1000, 10000, 100000, 1000000};
+
+  struct pf_target targets[BENCH_TARGETS];
+  struct pf_load loads[BENCH_TARGETS] = {{0}};
+  struct pf_conntrack ct;
+  struct pf_host** flows;
+  struct pf_host* host;
+  unsigned int* order;
+  unsigned long sum;
+  double start, client_ns, target_ns, churn_ns;
+  size_t s, i, n;
+
+  printf("conntrack: ns per operation\n");
+  printf("%10s %10s %10s %14s\n", "flows", "client", "target", "add+remove");
+
+  for (i = 0; i < BENCH_TARGETS; i++) {
+    targets[i].host = htonl(0x0a010000 + i);
+    targets[i].port.a_port = htons(8000 + i);
+    targets[i].port.b_port = htons(80);
+    targets[i].load = &loads[i];
+  }
+
+  order = (unsigned int*)malloc(sizeof(unsigned int) * BENCH_OPS);
+
+  for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    n = sizes[s];
+
+    flows = (struct pf_host**)malloc(sizeof(struct pf_host*) * n);
+    conntrack_init(&ct, n + 1, 0);
+    bench_nat(&ct);
+
+    // clients are spread over 1024 ports on as many hosts as needed
+    for (i = 0; i < n; i++) {
+      flows[i] = add_host(&ct, htonl(0xc0000000 + (i >> 10)), htons(1024 + (i & 1023)),
+        &targets[i % BENCH_TARGETS]);
+    }
+
+    srand(n);
+    for (i = 0; i < BENCH_OPS; i++) {
+      order[i] = ((unsigned int)rand() << 16 ^ rand()) % n;
+    }
+
+    // client side lookups
+    sum = 0;
+    start = now();
+    for (i = 0; i < BENCH_OPS; i++) {
+      host = flows[order[i]];
+      sum += (unsigned long)find_host(&ct, host->host, host->port, host->target->port.a_port);
+    }
+    client_ns = (now() - start) / BENCH_OPS;
+
+    // target side lookups
+    start = now();
+    for (i = 0; i < BENCH_OPS; i++) {
+      host = flows[order[i]];
+      sum += (unsigned long)find_host_by_target(&ct, host->target->host,
+        host->target->port.b_port, ct.nat[host->nat_addr].addr, host->nat_port);
+    }
+    target_ns = (now() - start) / BENCH_OPS;
+
+    // connection churn at a steady table size
+    start = now();
+    for (i = 0; i < BENCH_OPS / 4; i++) {
+      host = add_host(&ct, htonl(0xd0000000 + i), htons(2000), &targets[0]);
+      remove_host(&ct, host);
+    }
+    churn_ns = (now() - start) / (BENCH_OPS / 4);
+
+    bench_sink += sum;
+    printf("%10zu %10.1f %10.1f %14.1f\n", n, client_ns, target_ns, churn_ns);
+
+    conntrack_free(&ct);
+    free(flows);
+  }
+
+  free(order);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Checksum
+
+Prototype:  static void bench_checksum(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  void
+
+Description:
+  Checks every checksum kernel this cpu supports against the original word
+  loop on buffers of random data, length and alignment, then times each
+  kernel on buffers from 40B to 64KB. A kernel that differs fails the run.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Fills each buffer with new random data, reports the first length and
+  offset a kernel differs at and fails the run
+
+---------------------------------------------------------------------------- */
+static void bench_checksum(void) {
+
+  static const char* kernels[] = {"word", "scalar", "sse2", "avx2"};
+  static const int sizes[] = {40, 64, 128, 256, 576, 1500, 4096, 9000, 16384, 65535};
+
+  unsigned char* data;
+  unsigned short expect;
+  unsigned long sum;
+  double start, ns;
+  size_t k, s;
+  int i, j, len, offset, reps, failed;
+
+  data = (unsigned char*)malloc(IP_DATA_LEN + 64);
+  srand(1);
+  for (i = 0; i < IP_DATA_LEN + 64; i++) {
+    data[i] = rand();
+  }
+
+  // randomized equivalence against the original loop
+  for (k = 1; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+    if (csum_select(kernels[k]) == -1) {
+      printf("checksum: %s not supported\n", kernels[k]);
+      continue;
+    }
+
+    failed = 0;
+    for (i = 0; i < 20000; i++) {
+      len = rand() % (i < 10000 ? 128 : IP_DATA_LEN);
+      offset = rand() % 64;
+      for (j = 0; j < len; j++) {
+        data[offset + j] = rand();
+      }
+
+      csum_select("word");
+      expect = csum((unsigned short*)(data + offset), len);
+      csum_select(kernels[k]);
+
+      if (csum((unsigned short*)(data + offset), len) != expect && !failed++) {
+        printf("checksum: %s differs from word first at length %d, offset %d\n", kernels[k],
+          len, offset);
+      }
+    }
+    printf("checksum: %s matches word on %d of 20000 random buffers\n", kernels[k], 20000 - failed);
+    if (failed) {
+      bench_failed = 1;
+    }
+  }
+
+  printf("\nchecksum: ns per buffer\n");
+  printf("%8s", "bytes");
+  for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+    printf(" %10s", kernels[k]);
+  }
+  printf("\n");
+
+  for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    printf("%8d", sizes[s]);
+    reps = 50000000 / (sizes[s] + 64);
+
+    for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+      if (csum_select(kernels[k]) == -1) {
+        printf(" %10s", "-");
+        continue;
+      }
+
+      // warm up first so wide vector units are powered on
+      sum = 0;
+      for (i = 0; i < reps / 4; i++) {
+        sum += csum((unsigned short*)(data + (i & 7)), sizes[s]);
+      }
+
+      start = now();
+      for (i = 0; i < reps; i++) {
+        sum += csum((unsigned short*)(data + (i & 7)), sizes[s]);
+      }
+      ns = (now() - start) / reps;
+      bench_sink += sum;
+
+      printf(" %10.1f", ns);
+    }
+    printf("\n");
+  }
+
+  csum_init();
+  free(data);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Expiry
+
+Prototype:  static void bench_expiry(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  void
+
+Description:
+  Opens 10K to 1M flows in the same tick and lets them all idle out at once,
+  the worst case for the timer wheel. Reports the total time to expire them
+  and the longest single call, which is how long a forwarding loop would be
+  held up.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void bench_expiry(void) {
+
+  static const size_t sizes[] = {10000, 100000, 1000000};
+
+  struct pf_target targets[BENCH_TARGETS];
+  struct pf_load loads[BENCH_TARGETS] = {{0}};
+  struct pf_conntrack ct;
+  unsigned long tick;
+  double start, call, total, worst;
+  size_t s, i, calls;
+
+  printf("expiry: all flows idle out in the same tick\n");
+  printf("%10s %12s %10s %14s\n", "flows", "total ms", "calls", "worst call us");
+
+  // a client port is only unique per forwarded port, so 65536 flows per target
+  for (i = 0; i < BENCH_TARGETS; i++) {
+    targets[i].host = htonl(0x0a010000 + i);
+    targets[i].port.a_port = htons(8000 + i);
+    targets[i].port.b_port = htons(80);
+    targets[i].load = &loads[i];
+  }
+
+  for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    conntrack_init(&ct, sizes[s], 0);
+    bench_nat(&ct);
+
+    for (i = 0; i < sizes[s]; i++) {
+      add_host(&ct, htonl(0xc0000000 + (i >> 10)), htons(i & 0xffff), &targets[i >> 16]);
+    }
+
+    // run the clock to the SYN timeout, then until every flow is gone
+    tick = ct.now + ct.timeouts[CT_SYN_SENT];
+    total = worst = 0;
+    calls = 0;
+    while (ct.count) {
+      start = now();
+      conntrack_advance(&ct, tick, CT_EXPIRE_BUDGET);
+      call = now() - start;
+
+      total += call;
+      worst = call > worst ? call : worst;
+      calls++;
+    }
+
+    printf("%10zu %12.1f %10zu %14.1f\n", sizes[s], total / 1e6, calls, worst / 1e3);
+    conntrack_free(&ct);
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Dispatch
+
+Prototype:  static void bench_dispatch(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  void
+
+Description:
+  Times finding the target of a packet with 1 to 10000 forwards configured,
+  for packets to a forwarded port, from a target, and for traffic that isn't
+  forwarded at all. The linear scan the dispatch tables replaced is timed
+  alongside for comparison.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void bench_dispatch(void) {
+
+  static const size_t sizes[] = {1, 10, 100, 1000, 10000};
+
+  struct pf_config config = {0};
+  struct pf_target* targets;
+  struct pf_target* target;
+  unsigned short* ports;
+  unsigned long sum = 0;
+  double start, to_ns, from_ns, miss_ns, scan_ns;
+  size_t s, i, j, n;
+
+  printf("dispatch: ns per lookup\n");
+  printf("%10s %10s %10s %10s %10s\n", "forwards", "to", "from", "miss", "scan");
+
+  ports = (unsigned short*)malloc(sizeof(unsigned short) * BENCH_OPS);
+
+  for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    n = sizes[s];
+
+    targets = (struct pf_target*)malloc(sizeof(struct pf_target) * n);
+    for (i = 0; i < n; i++) {
+      targets[i].host = htonl(0x0a010000 + i);
+      targets[i].port.a_port = htons(10000 + i);
+      targets[i].port.b_port = htons(80 + (i & 7));
+    }
+    forward_init(targets, n, &config);
+
+    srand(n);
+    for (i = 0; i < BENCH_OPS; i++) {
+      ports[i] = rand() % n;
+    }
+
+    // heading to a target
+    start = now();
+    for (i = 0; i < BENCH_OPS; i++) {
+      sum += (unsigned long)find_dest_target(0, htons(10000 + ports[i]));
+    }
+    to_ns = (now() - start) / BENCH_OPS;
+
+    // coming back from a target
+    start = now();
+    for (i = 0; i < BENCH_OPS; i++) {
+      target = &targets[ports[i]];
+      sum += (unsigned long)find_source_target(target->host, target->port.b_port);
+    }
+    from_ns = (now() - start) / BENCH_OPS;
+
+    // not forwarded, both tests fail
+    start = now();
+    for (i = 0; i < BENCH_OPS; i++) {
+      sum += (unsigned long)find_source_target(htonl(0xc0000001), htons(40000 + ports[i]));
+      sum += (unsigned long)find_dest_target(0, htons(443));
+    }
+    miss_ns = (now() - start) / BENCH_OPS;
+
+    // the old linear scan, heading to a target
+    start = now();
+    for (i = 0; i < BENCH_OPS / 16; i++) {
+      for (j = 0; j < n; j++) {
+        if (targets[j].port.a_port == htons(10000 + ports[i])) {
+          sum += j;
+          break;
+        }
+      }
+    }
+    scan_ns = (now() - start) / (BENCH_OPS / 16);
+
+    bench_sink += sum;
+    printf("%10zu %10.1f %10.1f %10.1f %10.1f\n", n, to_ns, from_ns, miss_ns, scan_ns);
+
+    free(targets);
+  }
+
+  forward_init(0, 0, &config);
+  free(ports);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Packet
+
+Prototype:  static void bench_packet(char* buffer, int length, unsigned int saddr,
+              unsigned short sport, unsigned int daddr, unsigned short dport,
+              int syn)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  char* buffer
+    filled with the tcp packet
+  int length
+    its length, at least 40 bytes
+  unsigned int saddr, daddr
+    the addresses (network order)
+  unsigned short sport, dport
+    the ports (network order)
+  int syn
+    whether to set SYN, otherwise ACK
+
+Return Values:
+  void
+
+Description:
+  Builds a checksummed packet to feed forward_packet.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void bench_packet(char* buffer, int length, unsigned int saddr, unsigned short sport,
+  unsigned int daddr, unsigned short dport, int syn) {
+
+  struct iphdr* ip_header = (struct iphdr*)buffer;
+  struct tcphdr* tcp_header = (struct tcphdr*)(buffer + sizeof(struct iphdr));
+
+  memset(buffer, 0, length);
+  ip_header->version = 4;
+  ip_header->ihl = 5;
+  ip_header->tot_len = htons(length);
+  ip_header->ttl = 64;
+  ip_header->protocol = IPPROTO_TCP;
+  ip_header->saddr = saddr;
+  ip_header->daddr = daddr;
+  ip_header->check = csum((unsigned short*)ip_header, sizeof(struct iphdr));
+
+  tcp_header->source = sport;
+  tcp_header->dest = dport;
+  tcp_header->doff = 5;
+  tcp_header->syn = syn;
+  tcp_header->ack = !syn;
+  tcp_header->check = tcp_csum(ip_header, tcp_header);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Flows
+
+Prototype:  static char *bench_flows(struct bench_thread* self)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct bench_thread* self
+    the thread, with its targets and client address set
+
+Return Values:
+  BENCH_FLOWS pairs of 64 byte packets, from the client then from the
+  target, for the caller to free
+
+Description:
+  Gives the thread its connection table, and its metrics if it keeps them,
+  and opens BENCH_FLOWS flows in it with a SYN each.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static char *bench_flows(struct bench_thread* self) {
+
+  struct sockaddr_in dst_addr;
+  struct pf_target* target;
+  struct iphdr* ip_header;
+  struct tcphdr* tcp_header;
+  char* packets;
+  char buffer[64];
+  size_t i;
+
+  conntrack_init(&self->worker.conntrack, BENCH_FLOWS, 0);
+  bench_nat(&self->worker.conntrack);
+  packets = (char*)malloc(BENCH_FLOWS * 2 * 64);
+  if (self->metrics) {
+    posix_memalign((void**)&self->worker.metrics, 64, sizeof(struct pf_metrics) * BENCH_TARGETS);
+    memset(self->worker.metrics, 0, sizeof(struct pf_metrics) * BENCH_TARGETS);
+  }
+
+  // a SYN opens each flow, then keep a packet for each direction
+  for (i = 0; i < BENCH_FLOWS; i++) {
+    target = &self->targets[i % BENCH_TARGETS];
+    bench_packet(buffer, 64, self->client, htons(1024 + i), htonl(0xc0a80005), target->port.a_port, 1);
+    forward_packet(&self->worker, buffer, 64, &dst_addr);
+    ip_header = (struct iphdr*)buffer;
+    tcp_header = (struct tcphdr*)(buffer + sizeof(struct iphdr));
+
+    bench_packet(packets + i * 128, 64, self->client, htons(1024 + i), htonl(0xc0a80005),
+      target->port.a_port, 0);
+    bench_packet(packets + i * 128 + 64, 64, target->host, target->port.b_port, ip_header->saddr,
+      tcp_header->source, 0);
+  }
+
+  return packets;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Worker
+
+Prototype:  static void *bench_worker(void* arg)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  void* arg
+    the bench_thread to run
+
+Return Values:
+  0
+
+Description:
+  Opens BENCH_FLOWS flows in the thread's own connection table, then times
+  forward_packet over packets alternating from clients and from targets.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Can keep metrics as the workers do
+
+  Andrew Burian
+  2026-10-18
+  Targets answer the snat address and port the SYN went out from
+
+  Andrew Burian
+  2026-10-18
+  The flows are opened by bench_flows
+
+---------------------------------------------------------------------------- */
+static void *bench_worker(void* arg) {
+
+  struct bench_thread* self = (struct bench_thread*)arg;
+  struct sockaddr_in dst_addr;
+  char* packets;
+  char buffer[64];
+  unsigned long sum = 0;
+  double start;
+  size_t i, flow;
+
+  packets = bench_flows(self);
+
+  pthread_barrier_wait(self->barrier);
+
+  start = now();
+  for (i = 0; i < BENCH_OPS; i++) {
+    flow = (i * 2654435761u) % (BENCH_FLOWS * 2);
+    memcpy(buffer, packets + flow * 64, 64);
+    sum += forward_packet(&self->worker, buffer, 64, &dst_addr);
+  }
+  self->ns = now() - start;
+
+  bench_sink += sum;
+  free(packets);
+  free(self->worker.metrics);
+  self->worker.metrics = 0;
+  conntrack_free(&self->worker.conntrack);
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Workers
+
+Prototype:  static void bench_workers(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  void
+
+Description:
+  Runs forward_packet on 1 to nproc threads at once, each with its own
+  connection table as the forwarding workers have, and reports the total
+  rate. Shows how the shared-nothing workers scale before any I/O.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void bench_workers(void) {
+
+  struct pf_target targets[BENCH_TARGETS];
+  struct pf_config config = {0};
+  struct bench_thread* threads;
+  pthread_barrier_t barrier;
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  double slowest;
+  int n, i;
+
+  config.ip = htonl(0xc0a80005);
+  config.checksum = CSUM_INCREMENTAL;
+  for (i = 0; i < BENCH_TARGETS; i++) {
+    targets[i].host = htonl(0x0a010000 + i);
+    targets[i].port.a_port = htons(8000 + i);
+    targets[i].port.b_port = htons(80);
+  }
+  forward_init(targets, BENCH_TARGETS, &config);
+
+  threads = (struct bench_thread*)calloc(cpus, sizeof(struct bench_thread));
+
+  printf("workers: forward_packet with %d flows per thread\n", BENCH_FLOWS);
+  printf("%10s %14s %14s\n", "threads", "ns/packet", "Mpackets/sec");
+
+  for (n = 1; n <= cpus; n *= 2) {
+    pthread_barrier_init(&barrier, 0, n);
+    for (i = 0; i < n; i++) {
+      threads[i].barrier = &barrier;
+      threads[i].targets = targets;
+      threads[i].client = htonl(0xc0000000 + i);
+      pthread_create(&threads[i].thread, 0, bench_worker, &threads[i]);
+    }
+
+    slowest = 0;
+    for (i = 0; i < n; i++) {
+      pthread_join(threads[i].thread, 0);
+      if (threads[i].ns > slowest) {
+        slowest = threads[i].ns;
+      }
+    }
+    pthread_barrier_destroy(&barrier);
+
+    printf("%10d %14.1f %14.2f\n", n, slowest / BENCH_OPS, n * BENCH_OPS / slowest * 1e3);
+  }
+
+  free(threads);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Compare
+
+Prototype:  static int bench_compare(const void* a, const void* b)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  const void* a
+  const void* b
+    two times
+
+Return Values:
+  <0, 0 or >0 as a is shorter, the same or longer
+
+Description:
+  qsort comparator for the percentiles of the benchmarks' times.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Shared by the metrics benchmark, was latency_compare
+
+---------------------------------------------------------------------------- */
+static int bench_compare(const void* a, const void* b) {
+
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+
+  return (x > y) - (x < y);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Metrics
+
+Prototype:  static void bench_metrics(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  void
+
+Description:
+  Times forward_packet on one thread with and without the per target
+  metrics, to show what counting costs at the highest packet rate. Both
+  run over the same connection table and packets, on one pinned cpu, in
+  many short rounds that alternate which goes first. The overhead is the
+  median of the rounds' differences, so a slow round of either one is
+  compared against its neighbour rather than against the best of the other.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Pinned, interleaved rounds over one table, reported as medians, instead
+  of the best of 20 runs of each, which varied more than the overhead
+
+---------------------------------------------------------------------------- */
+static void bench_metrics(void) {
+
+  struct pf_target targets[BENCH_TARGETS];
+  struct pf_config config = {0};
+  struct bench_thread thread;
+  struct pf_metrics* metrics;
+  struct sockaddr_in dst_addr;
+  cpu_set_t before, pinned;
+  double times[2][BENCH_METRICS_ROUNDS];
+  double overheads[BENCH_METRICS_ROUNDS];
+  double start;
+  char* packets;
+  char buffer[64];
+  unsigned long sum = 0;
+  size_t n, flow;
+  int round, i, with;
+
+  config.ip = htonl(0xc0a80005);
+  config.checksum = CSUM_INCREMENTAL;
+  memset(targets, 0, sizeof(targets));
+  for (i = 0; i < BENCH_TARGETS; i++) {
+    targets[i].host = htonl(0x0a010000 + i);
+    targets[i].port.a_port = htons(8000 + i);
+    targets[i].port.b_port = htons(80);
+  }
+  forward_init(targets, BENCH_TARGETS, &config);
+
+  // one cpu for the whole run, so the rounds compared never migrate
+  pthread_getaffinity_np(pthread_self(), sizeof(before), &before);
+  CPU_ZERO(&pinned);
+  CPU_SET(sched_getcpu(), &pinned);
+  pthread_setaffinity_np(pthread_self(), sizeof(pinned), &pinned);
+
+  memset(&thread, 0, sizeof(thread));
+  thread.targets = targets;
+  thread.client = htonl(0xc0000000);
+  thread.metrics = 1;
+  packets = bench_flows(&thread);
+  metrics = thread.worker.metrics;
+
+  // the first round of each only warms up
+  for (round = -1; round < BENCH_METRICS_ROUNDS; round++) {
+    for (i = 0; i < 2; i++) {
+      with = (round + i) & 1;
+      thread.worker.metrics = with ? metrics : 0;
+      start = now();
+      for (n = 0; n < BENCH_METRICS_PACKETS; n++) {
+        flow = (n * 2654435761u) % (BENCH_FLOWS * 2);
+        memcpy(buffer, packets + flow * 64, 64);
+        sum += forward_packet(&thread.worker, buffer, 64, &dst_addr);
+      }
+      if (round >= 0) {
+        times[with][round] = (now() - start) / BENCH_METRICS_PACKETS;
+      }
+    }
+    if (round >= 0) {
+      overheads[round] = 100.0 * (times[1][round] - times[0][round]) / times[0][round];
+    }
+  }
+  pthread_setaffinity_np(pthread_self(), sizeof(before), &before);
+
+  qsort(times[0], BENCH_METRICS_ROUNDS, sizeof(double), bench_compare);
+  qsort(times[1], BENCH_METRICS_ROUNDS, sizeof(double), bench_compare);
+  qsort(overheads, BENCH_METRICS_ROUNDS, sizeof(double), bench_compare);
+
+  printf("metrics: forward_packet with %d flows, ns per packet, medians of %d rounds\n",
+    BENCH_FLOWS, BENCH_METRICS_ROUNDS);
+  printf("%10s %10s %10s %16s\n", "without", "with", "overhead", "middle half");
+  printf("%10.1f %10.1f %9.1f%% %7.1f%% %6.1f%%\n", times[0][BENCH_METRICS_ROUNDS / 2],
+    times[1][BENCH_METRICS_ROUNDS / 2], overheads[BENCH_METRICS_ROUNDS / 2],
+    overheads[BENCH_METRICS_ROUNDS / 4], overheads[BENCH_METRICS_ROUNDS * 3 / 4]);
+
+  bench_sink += sum;
+  free(packets);
+  free(metrics);
+  conntrack_free(&thread.worker.conntrack);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Replay Add
+
+Prototype:  static char *replay_add(struct bench_replay* replay, int length)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct bench_replay* replay
+    the traffic to add to
+  int length
+    the length of the packet
+
+Return Values:
+  Where to write the packet
+
+Description:
+  Makes room for one more packet at the end of a replay, on a 64 byte
+  boundary as a receive buffer would be. It answers no packet until told
+  otherwise.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Keeps the packet each one answers
+
+---------------------------------------------------------------------------- */
+static char *replay_add(struct bench_replay* replay, int length) {
+
+  size_t offset = replay->size;
+
+  if (replay->count == replay->slots) {
+    replay->slots = replay->slots ? replay->slots * 2 : 1024;
+    replay->offsets = (size_t*)realloc(replay->offsets, sizeof(size_t) * replay->slots);
+    replay->lengths = (int*)realloc(replay->lengths, sizeof(int) * replay->slots);
+    replay->answers = (long*)realloc(replay->answers, sizeof(long) * replay->slots);
+  }
+
+  replay->size += (length + 63) & ~63;
+  if (replay->size > replay->capacity) {
+    while (replay->size > replay->capacity) {
+      replay->capacity = replay->capacity ? replay->capacity * 2 : 1 << 20;
+    }
+    replay->data = (char*)realloc(replay->data, replay->capacity);
+  }
+
+  replay->offsets[replay->count] = offset;
+  replay->lengths[replay->count] = length;
+  replay->answers[replay->count] = -1;
+  replay->count++;
+
+  return replay->data + offset;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Replay Free
+
+Prototype:  static void replay_free(struct bench_replay* replay)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct bench_replay* replay
+    the traffic to free
+
+Return Values:
+  void
+
+Description:
+  Frees a replay and empties it for reuse.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void replay_free(struct bench_replay* replay) {
+
+  free(replay->data);
+  free(replay->offsets);
+  free(replay->lengths);
+  free(replay->answers);
+  memset(replay, 0, sizeof(struct bench_replay));
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Replay Flows
+
+Prototype:  static void replay_flows(struct bench_replay* replay,
+              struct pf_target* targets, int flows, int length)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct bench_replay* replay
+    the traffic to add to
+  struct pf_target* targets
+    the BENCH_TARGETS targets the flows are spread over
+  int flows
+    the number of flows
+  int length
+    the length of their packets
+
+Return Values:
+  void
+
+Description:
+  Adds the handshakes of a number of flows as the warm up of a replay, then
+  a packet from the client and one from the target of each, visiting the
+  flows in a scattered order as a busy link would. The target's packets
+  answer their client's SYN.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Target packets answer the SYN of their flow
+
+---------------------------------------------------------------------------- */
+static void replay_flows(struct bench_replay* replay, struct pf_target* targets, int flows,
+  int length) {
+
+  struct pf_target* target;
+  struct tcphdr* tcp_header;
+  char* packet;
+  int i, flow;
+
+  for (i = 0; i < flows; i++) {
+    target = &targets[i % BENCH_TARGETS];
+    bench_packet(replay_add(replay, 40), 40, htonl(0xc0000000 + (i >> 10)),
+      htons(1024 + (i & 1023)), htonl(0xc0a80005), target->port.a_port, 1);
+
+    packet = replay_add(replay, 40);
+    replay->answers[replay->count - 1] = replay->count - 2;
+    bench_packet(packet, 40, target->host, target->port.b_port, htonl(0xc0a80005),
+      htons(1024 + (i & 1023)), 1);
+    tcp_header = (struct tcphdr*)(packet + sizeof(struct iphdr));
+    tcp_header->ack = 1;
+    tcp_header->check = 0;
+    tcp_header->check = tcp_csum((struct iphdr*)packet, tcp_header);
+  }
+  replay->warm = replay->count;
+
+  for (i = 0; i < flows; i++) {
+    flow = (i * 2654435761u) % flows;
+    target = &targets[flow % BENCH_TARGETS];
+    bench_packet(replay_add(replay, length), length, htonl(0xc0000000 + (flow >> 10)),
+      htons(1024 + (flow & 1023)), htonl(0xc0a80005), target->port.a_port, 0);
+    bench_packet(replay_add(replay, length), length, target->host, target->port.b_port,
+      htonl(0xc0a80005), htons(1024 + (flow & 1023)), 0);
+    replay->answers[replay->count - 1] = flow * 2;
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Replay Client
+
+Prototype:  static size_t replay_client(struct bench_replay* replay, long* latest,
+              size_t slots, unsigned int addr, unsigned short port,
+              unsigned short to_port)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct bench_replay* replay
+    the traffic
+  long* latest
+    a table of the latest packet from each client, -1 in empty slots
+  size_t slots
+    its size, a power of 2 and more than there are clients
+  unsigned int addr
+  unsigned short port
+    the client's address and port
+  unsigned short to_port
+    the port it sends to
+
+Return Values:
+  The slot of the client, or the empty slot it belongs in
+
+Description:
+  Finds a client of a capture by its connection. The packets themselves are
+  the keys, so the table only holds their indexes.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static size_t replay_client(struct bench_replay* replay, long* latest, size_t slots,
+  unsigned int addr, unsigned short port, unsigned short to_port) {
+
+  struct iphdr* ip_header;
+  struct tcphdr* tcp_header;
+  size_t slot;
+
+  slot = ((addr * 2654435761u) ^ ((unsigned int)port << 16 | to_port) * 0x85ebca6bu) & (slots - 1);
+  for (; latest[slot] != -1; slot = (slot + 1) & (slots - 1)) {
+    ip_header = (struct iphdr*)(replay->data + replay->offsets[latest[slot]]);
+    tcp_header = (struct tcphdr*)((char*)ip_header + ip_header->ihl * 4);
+    if (ip_header->saddr == addr && tcp_header->source == port && tcp_header->dest == to_port) {
+      break;
+    }
+  }
+
+  return slot;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Replay Pcap
+
+Prototype:  static struct pf_target *replay_pcap(struct bench_replay* replay,
+              const char* path, size_t* targetCount)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct bench_replay* replay
+    the traffic to add to
+  const char* path
+    a pcap file of raw ip, ethernet or linux cooked captures
+  size_t* targetCount
+    set to the number of targets returned
+
+Return Values:
+  The targets to replay the capture against, or 0 on error with the reason
+  printed
+
+Description:
+  Loads the ipv4 packets of a capture taken at a server. The server, the
+  destination of the first SYN, stands in for the forwarder: every port it
+  is sent to is forwarded to the same port on BENCH_REPLAY_TARGET, and its
+  own packets are made to come from there, so they replay as the target's
+  replies. Each answers the latest packet of its client before it.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  The server's packets answer their client's
+
+---------------------------------------------------------------------------- */
+static struct pf_target *replay_pcap(struct bench_replay* replay, const char* path,
+  size_t* targetCount) {
+
+  static unsigned char ports[65536];
+
+  struct pf_target* targets;
+  struct iphdr* ip_header;
+  struct tcphdr* tcp_header;
+  unsigned int header[6], record[4];
+  unsigned int server = 0;
+  unsigned char* frame;
+  long* latest;
+  size_t i, slot, slots, count = 0;
+  int swap, link, skip, length;
+  FILE* file;
+
+  if ((file = fopen(path, "r")) == 0) {
+    perror("Opening capture");
+    return 0;
+  }
+
+  if (fread(header, sizeof(header), 1, file) != 1) {
+    fprintf(stderr, "%s: not a pcap file\n", path);
+    fclose(file);
+    return 0;
+  }
+
+  // the magic number is written in the byte order of the capturing host
+  swap = header[0] == 0xd4c3b2a1 || header[0] == 0x4d3cb2a1;
+  if (!swap && header[0] != 0xa1b2c3d4 && header[0] != 0xa1b23c4d) {
+    fprintf(stderr, "%s: not a pcap file\n", path);
+    fclose(file);
+    return 0;
+  }
+  link = swap ? __builtin_bswap32(header[5]) : header[5];
+
+  frame = (unsigned char*)malloc(IP_DATA_LEN + 64);
+  memset(ports, 0, sizeof(ports));
+
+  while (fread(record, sizeof(record), 1, file) == 1) {
+    length = swap ? __builtin_bswap32(record[2]) : record[2];
+    if (length > IP_DATA_LEN + 64 || fread(frame, length, 1, file) != 1) {
+      break;
+    }
+
+    // find the ip header behind the link layer
+    switch (link) {
+      case 1: // ethernet, maybe with a vlan tag
+        skip = 14;
+        if (length >= 18 && frame[12] == 0x81 && frame[13] == 0x00) {
+          skip = 18;
+        }
+        if (length < skip || frame[skip - 2] != 0x08 || frame[skip - 1] != 0x00) {
+          continue;
+        }
+        break;
+      case 113: // linux cooked
+        skip = 16;
+        if (length < skip || frame[14] != 0x08 || frame[15] != 0x00) {
+          continue;
+        }
+        break;
+      case 101: // raw ip
+      case 228: // raw ipv4
+        skip = 0;
+        break;
+      default:
+        fprintf(stderr, "%s: unsupported link type %d\n", path, link);
+        free(frame);
+        fclose(file);
+        return 0;
+    }
+
+    ip_header = (struct iphdr*)(frame + skip);
+    if (length - skip < (int)sizeof(struct iphdr) || ip_header->version != 4) {
+      continue;
+    }
+    memcpy(replay_add(replay, length - skip), ip_header, length - skip);
+
+    // the first SYN names the server
+    tcp_header = (struct tcphdr*)((char*)ip_header + ip_header->ihl * 4);
+    if (ip_header->protocol != IPPROTO_TCP
+      || ip_header->ihl * 4 + (int)sizeof(struct tcphdr) > length - skip) {
+      continue;
+    }
+    if (!server && tcp_header->syn && !tcp_header->ack) {
+      server = ip_header->daddr;
+    }
+    if (server && ip_header->daddr == server && !ports[ntohs(tcp_header->dest)]) {
+      ports[ntohs(tcp_header->dest)] = 1;
+      count++;
+    }
+  }
+  free(frame);
+  fclose(file);
+
+  if (!server) {
+    fprintf(stderr, "%s: no SYN to replay against\n", path);
+    return 0;
+  }
+
+  targets = (struct pf_target*)calloc(count, sizeof(struct pf_target));
+  for (i = 0, count = 0; i < 65536; i++) {
+    if (ports[i]) {
+      targets[count].host = htonl(BENCH_REPLAY_TARGET);
+      targets[count].port.a_port = htons(i);
+      targets[count].port.b_port = htons(i);
+      targets[count].weight = 1;
+      count++;
+    }
+  }
+
+  // the server's own packets become the target's, answering their client
+  for (slots = 1024; slots < replay->count * 2; slots <<= 1);
+  latest = (long*)malloc(sizeof(long) * slots);
+  memset(latest, 0xff, sizeof(long) * slots);
+  for (i = 0; i < replay->count; i++) {
+    ip_header = (struct iphdr*)(replay->data + replay->offsets[i]);
+    tcp_header = (struct tcphdr*)((char*)ip_header + ip_header->ihl * 4);
+    if (ip_header->protocol == IPPROTO_TCP
+      && ip_header->ihl * 4 + (int)sizeof(struct tcphdr) <= replay->lengths[i]) {
+      if (ip_header->saddr == server) {
+        slot = replay_client(replay, latest, slots, ip_header->daddr, tcp_header->dest,
+          tcp_header->source);
+        replay->answers[i] = latest[slot];
+      }
+      else if (ip_header->daddr == server) {
+        slot = replay_client(replay, latest, slots, ip_header->saddr, tcp_header->source,
+          tcp_header->dest);
+        latest[slot] = i;
+      }
+    }
+    if (ip_header->saddr == server) {
+      ip_header->check = csum_replace4(ip_header->check, server, htonl(BENCH_REPLAY_TARGET));
+      ip_header->saddr = htonl(BENCH_REPLAY_TARGET);
+    }
+  }
+  free(latest);
+
+  *targetCount = count;
+  return targets;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Replay Answer
+
+Prototype:  static void replay_answer(struct bench_replay* replay, size_t i,
+              unsigned int* addrs, unsigned short* ports)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct bench_replay* replay
+    the traffic
+  size_t i
+    the packet
+  unsigned int* addrs
+  unsigned short* ports
+    the snat address and port each packet went out from, 0 for those that
+    weren't forwarded to a target
+
+Return Values:
+  void
+
+Description:
+  Sends a target's packet to where the packet it answers went out from, as
+  the target would have, since the forwarder picks a different snat port for
+  a connection each time the traffic is replayed.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void replay_answer(struct bench_replay* replay, size_t i, unsigned int* addrs,
+  unsigned short* ports) {
+
+  struct iphdr* ip_header = (struct iphdr*)(replay->data + replay->offsets[i]);
+  struct tcphdr* tcp_header = (struct tcphdr*)((char*)ip_header + ip_header->ihl * 4);
+  long answers = replay->answers[i];
+
+  if (answers == -1 || !ports[answers]) {
+    return;
+  }
+
+  ip_header->check = csum_replace4(ip_header->check, ip_header->daddr, addrs[answers]);
+  tcp_header->check = csum_replace4(tcp_header->check, ip_header->daddr, addrs[answers]);
+  tcp_header->check = csum_replace2(tcp_header->check, tcp_header->dest, ports[answers]);
+  ip_header->daddr = addrs[answers];
+  tcp_header->dest = ports[answers];
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Replay Forward
+
+Prototype:  static void replay_forward(struct pf_worker* worker,
+              struct bench_replay* replay, size_t i, char* buffer,
+              unsigned int* addrs, unsigned short* ports)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_worker* worker
+    the worker to forward with
+  struct bench_replay* replay
+    the traffic
+  size_t i
+    the packet
+  char* buffer
+    the receive buffer
+  unsigned int* addrs
+  unsigned short* ports
+    the snat address and port each packet went out from, filled in for this
+    one if it goes to a target
+
+Return Values:
+  void
+
+Description:
+  Forwards a packet untimed, the warm up and anything else that has to run
+  before the timing starts.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void replay_forward(struct pf_worker* worker, struct bench_replay* replay, size_t i,
+  char* buffer, unsigned int* addrs, unsigned short* ports) {
+
+  struct sockaddr_in dst_addr;
+  struct iphdr* ip_header = (struct iphdr*)buffer;
+
+  replay_answer(replay, i, addrs, ports);
+  memcpy(buffer, replay->data + replay->offsets[i], replay->lengths[i]);
+  if (forward_packet(worker, buffer, replay->lengths[i], &dst_addr) == VERDICT_TO_TARGET) {
+    addrs[i] = ip_header->saddr;
+    ports[i] = ((struct tcphdr*)(buffer + ip_header->ihl * 4))->source;
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Replay Run
+
+Prototype:  static void replay_run(const char* name, struct bench_replay* replay,
+              struct pf_target* targets, size_t targetCount,
+              struct pf_config* config, size_t max_flows, size_t passes)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  const char* name
+    what the traffic is called in the results
+  struct bench_replay* replay
+    the traffic
+  struct pf_target* targets
+  size_t targetCount
+  struct pf_config* config
+    the forwarder to replay it through
+  size_t max_flows
+    the size of the connection table
+  size_t passes
+    times to replay the packets after the warm up
+
+Return Values:
+  void
+
+Description:
+  Runs the warm up packets through forward_packet on a fresh worker, then
+  times the rest, and prints the cost per packet less the cost of copying
+  each one into the receive buffer, which is timed on its own first. The
+  allocations are the calls the forwarder's code made to malloc, calloc
+  and realloc while timed.
+
+  Targets' packets are sent to the snat ports of the connections they
+  answer before they are timed. If any answer a packet after the warm up,
+  the rest are run through once untimed to find those ports.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Gives the worker snat addresses, and sends the targets' packets to them
+
+---------------------------------------------------------------------------- */
+static void replay_run(const char* name, struct bench_replay* replay, struct pf_target* targets,
+  size_t targetCount, struct pf_config* config, size_t max_flows, size_t passes) {
+
+  struct pf_worker worker;
+  struct sockaddr_in dst_addr;
+  unsigned long verdicts[VERDICT_TO_CLIENT - VERDICT_MALFORMED + 1] = {0};
+  unsigned long start_cycles, copy_cycles, allocs, sum = 0;
+  double start, copy_ns, packets;
+  unsigned int* addrs;
+  unsigned short* ports;
+  size_t pass, i;
+  char* buffer;
+
+  forward_init(targets, targetCount, config);
+  memset(&worker, 0, sizeof(worker));
+  conntrack_init(&worker.conntrack, max_flows, 0);
+  bench_nat(&worker.conntrack);
+  buffer = (char*)malloc(IP_DATA_LEN + 64);
+  addrs = (unsigned int*)calloc(replay->count, sizeof(unsigned int));
+  ports = (unsigned short*)calloc(replay->count, sizeof(unsigned short));
+
+  for (i = 0; i < replay->warm; i++) {
+    replay_forward(&worker, replay, i, buffer, addrs, ports);
+  }
+
+  // answers to packets only sent while timed
+  for (i = replay->warm; i < replay->count && replay->answers[i] < (long)replay->warm; i++);
+  if (i < replay->count) {
+    for (i = replay->warm; i < replay->count; i++) {
+      replay_forward(&worker, replay, i, buffer, addrs, ports);
+    }
+  }
+  for (i = replay->warm; i < replay->count; i++) {
+    replay_answer(replay, i, addrs, ports);
+  }
+
+  start = now();
+  start_cycles = cycles();
+  for (pass = 0; pass < passes; pass++) {
+    for (i = replay->warm; i < replay->count; i++) {
+      memcpy(buffer, replay->data + replay->offsets[i], replay->lengths[i]);
+      sum += buffer[0];
+    }
+  }
+  copy_cycles = cycles() - start_cycles;
+  copy_ns = now() - start;
+
+  allocs = bench_allocs;
+  start = now();
+  start_cycles = cycles();
+  for (pass = 0; pass < passes; pass++) {
+    for (i = replay->warm; i < replay->count; i++) {
+      memcpy(buffer, replay->data + replay->offsets[i], replay->lengths[i]);
+      verdicts[forward_packet(&worker, buffer, replay->lengths[i], &dst_addr)
+        - VERDICT_MALFORMED]++;
+    }
+  }
+  start_cycles = cycles() - start_cycles;
+  start = now() - start;
+  allocs = bench_allocs - allocs;
+
+  packets = (double)passes * (replay->count - replay->warm);
+  bench_sink += sum;
+  printf("%-12s %9.0f %8.1f %8.1f %8.3f %7.1f %7.1f %7.1f %7.1f %7.1f\n", name, packets,
+    (start - copy_ns) / packets, (start_cycles - copy_cycles) / packets, allocs / packets,
+    100.0 * (verdicts[VERDICT_TO_TARGET - VERDICT_MALFORMED]
+      + verdicts[VERDICT_TO_CLIENT - VERDICT_MALFORMED]) / packets,
+    100.0 * verdicts[VERDICT_IGNORE - VERDICT_MALFORMED] / packets,
+    100.0 * verdicts[VERDICT_MISS - VERDICT_MALFORMED] / packets,
+    100.0 * verdicts[VERDICT_FULL - VERDICT_MALFORMED] / packets,
+    100.0 * verdicts[VERDICT_MALFORMED - VERDICT_MALFORMED] / packets);
+
+  free(buffer);
+  free(addrs);
+  free(ports);
+  conntrack_free(&worker.conntrack);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Replay
+
+Prototype:  static void bench_replay(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  void
+
+Description:
+  Replays kinds of traffic through forward_packet from memory, with no
+  sockets involved, as a baseline for changes to the hot path: established
+  flows of small and full sized packets, a SYN storm that overflows the
+  connection table, traffic that matches no connection, and a pcap file if
+  one was given after the benchmark's name. Reports the time, tsc cycles
+  and allocations per packet, and the share of each verdict.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void bench_replay(void) {
+
+  struct pf_target targets[BENCH_TARGETS];
+  struct pf_target* captured;
+  struct pf_config config = {0};
+  struct bench_replay replay = {0};
+  size_t i, count;
+
+  config.ip = htonl(0xc0a80005);
+  config.checksum = CSUM_INCREMENTAL;
+  memset(targets, 0, sizeof(targets));
+  for (i = 0; i < BENCH_TARGETS; i++) {
+    targets[i].host = htonl(0x0a010000 + i);
+    targets[i].port.a_port = htons(8000 + i);
+    targets[i].port.b_port = htons(80);
+    targets[i].weight = 1;
+  }
+
+  printf("replay: forward_packet over traffic in memory, per packet and %% of packets\n");
+  printf("%-12s %9s %8s %8s %8s %7s %7s %7s %7s %7s\n", "traffic", "packets", "ns", "cycles",
+    "allocs", "sent", "ignored", "missed", "full", "bad");
+
+  replay_flows(&replay, targets, BENCH_REPLAY_FLOWS, 40);
+  replay_run("established", &replay, targets, BENCH_TARGETS, &config, BENCH_REPLAY_FLOWS * 2,
+    BENCH_OPS / (BENCH_REPLAY_FLOWS * 2));
+  replay_free(&replay);
+
+  replay_flows(&replay, targets, BENCH_REPLAY_LARGE, 1500);
+  replay_run("1500B", &replay, targets, BENCH_TARGETS, &config, BENCH_REPLAY_LARGE * 2,
+    BENCH_OPS / 4 / (BENCH_REPLAY_LARGE * 2));
+  config.checksum = CSUM_FULL;
+  replay_run("1500B full", &replay, targets, BENCH_TARGETS, &config, BENCH_REPLAY_LARGE * 2,
+    BENCH_OPS / 4 / (BENCH_REPLAY_LARGE * 2));
+  config.checksum = CSUM_INCREMENTAL;
+  replay_free(&replay);
+
+  // new clients until well past a full table
+  for (i = 0; i < BENCH_REPLAY_STORM; i++) {
+    bench_packet(replay_add(&replay, 40), 40, htonl(0xc1000000 + (i >> 10)),
+      htons(1024 + (i & 1023)), htonl(0xc0a80005), targets[i % BENCH_TARGETS].port.a_port, 1);
+  }
+  replay_run("syn storm", &replay, targets, BENCH_TARGETS, &config, BENCH_REPLAY_FLOWS, 1);
+  replay_free(&replay);
+
+  // strays to forwarded ports from clients and targets, and to other ports
+  for (i = 0; i < BENCH_REPLAY_FLOWS; i++) {
+    switch (i & 3) {
+      case 0:
+      case 1:
+        bench_packet(replay_add(&replay, 40), 40, htonl(0xc2000000 + (i >> 10)),
+          htons(1024 + (i & 1023)), htonl(0xc0a80005), targets[i % BENCH_TARGETS].port.a_port, 0);
+        break;
+      case 2:
+        bench_packet(replay_add(&replay, 40), 40, targets[i % BENCH_TARGETS].host,
+          targets[i % BENCH_TARGETS].port.b_port, htonl(0xc0a80005), htons(1024 + (i & 1023)), 0);
+        break;
+      case 3:
+        bench_packet(replay_add(&replay, 40), 40, htonl(0xc2000000 + (i >> 10)),
+          htons(1024 + (i & 1023)), htonl(0xc0a80005), htons(22), 0);
+        break;
+    }
+  }
+  replay_run("misses", &replay, targets, BENCH_TARGETS, &config, BENCH_REPLAY_FLOWS,
+    BENCH_OPS / BENCH_REPLAY_FLOWS);
+  replay_free(&replay);
+
+  if (bench_pcap) {
+    if ((captured = replay_pcap(&replay, bench_pcap, &count)) != 0) {
+      replay_run("pcap", &replay, captured, count, &config, BENCH_REPLAY_FLOWS * 16,
+        replay.count < BENCH_OPS ? BENCH_OPS / replay.count : 1);
+      free(captured);
+    }
+    replay_free(&replay);
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Target
+
+Prototype:  static void *bench_target(void* arg)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  void* arg
+    the listening socket
+
+Return Values:
+  0
+
+Description:
+  The target of the proxy benchmark, serving one connection at a time. The
+  first byte picks what it does: 'e' echoes everything back, 's' reads until
+  end of file and then replies with the number of bytes read.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void *bench_target(void* arg) {
+
+  int listener = *(int*)arg;
+  char buffer[65536];
+  long long total;
+  ssize_t n;
+  char mode;
+  int fd;
+
+  while ((fd = accept(listener, 0, 0)) != -1) {
+    if (read(fd, &mode, 1) == 1) {
+      total = 0;
+      while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        if (mode == 'e' && write(fd, buffer, n) != n) {
+          break;
+        }
+        total += n;
+      }
+      if (mode == 's') {
+        write(fd, &total, sizeof(total));
+      }
+    }
+    close(fd);
+  }
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Connect
+
+Prototype:  static int bench_connect(unsigned int host, unsigned short port,
+              char mode)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  unsigned int host
+    the address to connect to (host order)
+  unsigned short port
+    the port to connect to
+  char mode
+    the first byte to send
+
+Return Values:
+  The connected socket, or -1 if nothing listens after a second
+
+Description:
+  Connects to the target or a forwarder, retrying while the forwarder
+  starts up.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int bench_connect(unsigned int host, unsigned short port, char mode) {
+
+  struct sockaddr_in addr = {0};
+  int on = 1;
+  int tries;
+  int fd;
+
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(host);
+  addr.sin_port = htons(port);
+
+  for (tries = 0; tries < 100; tries++) {
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+      write(fd, &mode, 1);
+      return fd;
+    }
+    close(fd);
+    usleep(10000);
+  }
+
+  return -1;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Proxy Run
+
+Prototype:  static void *bench_proxy_run(void* arg)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  void* arg
+    the target to proxy to
+
+Return Values:
+  0
+
+Description:
+  Runs the proxy engine until the thread is sent SIGINT.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void *bench_proxy_run(void* arg) {
+
+  static struct pf_config config;
+
+  config.ip = htonl(INADDR_LOOPBACK);
+  config.mode = MODE_PROXY;
+  config.workers = 1;
+  config.max_flows = 16;
+  proxy((struct pf_target*)arg, 1, &config);
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Proxy
+
+Prototype:  static void bench_proxy(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  void
+
+Description:
+  Compares talking to a loopback target directly with talking to it through
+  the proxy engine: round trip latency of 1 byte messages, and throughput of
+  a 1GB stream. The raw packet engine can't be run this way, it needs root,
+  the firewall rules and a second host (see the README for comparing it on
+  network namespaces).
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void bench_proxy(void) {
+
+  static const struct {
+    const char* name;
+    unsigned short port;
+  } paths[] = {
+    {"direct", BENCH_TARGET_PORT},
+    {"proxy", BENCH_PROXY_PORT},
+  };
+
+  struct pf_target target;
+  struct sockaddr_in addr = {0};
+  pthread_t target_thread, proxy_thread;
+  sigset_t stop;
+  char buffer[65536];
+  long long sent, received;
+  double start, rtt_us, mb_per_sec;
+  size_t p;
+  int listener, fd, i;
+  int on = 1;
+
+  // the target
+  listener = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(BENCH_TARGET_PORT);
+  if (bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(listener, 16) == -1) {
+    perror("proxy: target");
+    close(listener);
+    return;
+  }
+  pthread_create(&target_thread, 0, bench_target, &listener);
+
+  // the proxy, stopped the way ctrl-c would
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &stop, 0);
+
+  target.host = htonl(INADDR_LOOPBACK);
+  target.port.a_port = htons(BENCH_PROXY_PORT);
+  target.port.b_port = htons(BENCH_TARGET_PORT);
+  pthread_create(&proxy_thread, 0, bench_proxy_run, &target);
+
+  printf("proxy: loopback, 1 byte round trips and a 1GB stream\n");
+  printf("%10s %14s %14s\n", "path", "rtt us", "MB/sec");
+
+  for (p = 0; p < sizeof(paths) / sizeof(paths[0]); p++) {
+
+    // latency
+    if ((fd = bench_connect(INADDR_LOOPBACK, paths[p].port, 'e')) == -1) {
+      printf("%10s %14s %14s\n", paths[p].name, "-", "-");
+      continue;
+    }
+    start = now();
+    for (i = 0; i < BENCH_ROUND_TRIPS; i++) {
+      if (write(fd, buffer, 1) != 1 || read(fd, buffer, 1) != 1) {
+        break;
+      }
+    }
+    rtt_us = (now() - start) / BENCH_ROUND_TRIPS / 1e3;
+    close(fd);
+
+    // throughput
+    fd = bench_connect(INADDR_LOOPBACK, paths[p].port, 's');
+    received = 0;
+    start = now();
+    for (sent = 0; sent < BENCH_STREAM_BYTES; sent += sizeof(buffer)) {
+      if (write(fd, buffer, sizeof(buffer)) != sizeof(buffer)) {
+        break;
+      }
+    }
+    shutdown(fd, SHUT_WR);
+    read(fd, &received, sizeof(received));
+    mb_per_sec = received / 1048576.0 / ((now() - start) / 1e9);
+    close(fd);
+
+    printf("%10s %14.1f %14.1f\n", paths[p].name, rtt_us, mb_per_sec);
+  }
+
+  pthread_kill(proxy_thread, SIGINT);
+  pthread_join(proxy_thread, 0);
+
+  shutdown(listener, SHUT_RDWR);
+  pthread_join(target_thread, 0);
+  close(listener);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Io Send
+
+Prototype:  static void *bench_io_send(void* arg)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  void* arg
+    the bench_io run to send for
+
+Return Values:
+  0
+
+Description:
+  The client side of the io benchmark. Opens BENCH_IO_FLOWS flows with a SYN
+  each, then sends BENCH_IO_PACKETS packets round robin over them through a
+  raw socket as fast as it can.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void *bench_io_send(void* arg) {
+
+  struct bench_io* run = (struct bench_io*)arg;
+  struct sockaddr_in addr = {0};
+  char* packets;
+  int hdrincl = 1;
+  int fd, i;
+
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  fd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+  setsockopt(fd, IPPROTO_IP, IP_HDRINCL, &hdrincl, sizeof(hdrincl));
+  packets = (char*)malloc((size_t)BENCH_IO_FLOWS * 2 * run->length);
+
+  // a broken tcp checksum keeps the kernel from answering with resets,
+  // rewriting adjusts it and so leaves it just as broken
+  for (i = 0; i < BENCH_IO_FLOWS * 2; i++) {
+    bench_packet(packets + (size_t)i * run->length, run->length, htonl(0x7f000002),
+      htons(1024 + i % BENCH_IO_FLOWS), htonl(INADDR_LOOPBACK), htons(BENCH_IO_PORT),
+      i < BENCH_IO_FLOWS);
+    ((struct tcphdr*)(packets + (size_t)i * run->length + sizeof(struct iphdr)))->check ^= 0x5555;
+  }
+
+  run->start = now();
+  for (i = 0; i < BENCH_IO_FLOWS + BENCH_IO_PACKETS; i++) {
+    if (sendto(fd, packets + (size_t)(i < BENCH_IO_FLOWS ? i : BENCH_IO_FLOWS + i % BENCH_IO_FLOWS)
+      * run->length, run->length, 0, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+      break;
+    }
+  }
+  run->sent = i;
+  run->done = 1;
+
+  free(packets);
+  close(fd);
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Io Run
+
+Prototype:  static void *bench_io_run(void* arg)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  void* arg
+    the bench_io run, with the config to forward with
+
+Return Values:
+  0
+
+Description:
+  Runs the forwarding engine until the thread is sent SIGINT.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void *bench_io_run(void* arg) {
+
+  struct bench_io* run = (struct bench_io*)arg;
+
+  forward(&run->target, 1, &run->config);
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Io
+
+Prototype:  static void bench_io(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  void
+
+Description:
+  Compares the classic recvfrom / sendto loop with the io_uring backend at 64
+  and 1500 byte packets. The forwarder, a client and a target all live on the
+  loopback of a network namespace of our own, so it needs root but no
+  firewall rules. A raw socket with a filter counts the packets that come out
+  the target side, the rate is taken from the first packet sent to the last
+  one forwarded. The client sends as fast as it can, so whatever the
+  forwarder can't keep up with is dropped on its socket and shows up as the
+  difference between sent and forwarded.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void bench_io(void) {
+
+  static const struct {
+    const char* name;
+    int io;
+  } engines[] = {
+    {"classic", IO_RAW},
+    {"io_uring", IO_URING},
+  };
+  static const int lengths[] = {64, 1500};
+
+  // accept tcp to the target port only
+  struct sock_filter code[] = {
+    BPF_STMT(BPF_LD | BPF_H | BPF_ABS, sizeof(struct iphdr) + 2),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 80, 0, 1),
+    BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+    BPF_STMT(BPF_RET | BPF_K, 0),
+  };
+  struct sock_fprog filter = {sizeof(code) / sizeof(code[0]), code};
+  struct timeval timeout = {0, 200000};
+  struct bench_io run;
+  struct ifreq lo;
+  pthread_t forward_thread, send_thread;
+  sigset_t stop;
+  char buffer[IP_DATA_LEN];
+  unsigned long forwarded;
+  double last, seconds;
+  size_t e, l;
+  int fd, out, devnull;
+
+  // a loopback of our own
+  if (unshare(CLONE_NEWNET) == -1) {
+    perror("io: needs root");
+    return;
+  }
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  memset(&lo, 0, sizeof(lo));
+  strcpy(lo.ifr_name, "lo");
+  ioctl(fd, SIOCGIFFLAGS, &lo);
+  lo.ifr_flags |= IFF_UP;
+  ioctl(fd, SIOCSIFFLAGS, &lo);
+  close(fd);
+
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &stop, 0);
+
+  printf("io: %d packets over %d flows through loopback\n", BENCH_IO_PACKETS, BENCH_IO_FLOWS);
+  printf("%10s %8s %10s %10s %14s\n", "engine", "bytes", "sent", "forwarded", "Mpackets/sec");
+
+  for (l = 0; l < sizeof(lengths) / sizeof(lengths[0]); l++) {
+    for (e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+
+      memset(&run, 0, sizeof(run));
+      run.length = lengths[l];
+      run.target.host = htonl(0x7f000003);
+      run.target.port.a_port = htons(BENCH_IO_PORT);
+      run.target.port.b_port = htons(80);
+      run.config.ip = htonl(INADDR_LOOPBACK);
+      run.config.snat = &run.config.ip;
+      run.config.snatCount = 1;
+      run.config.io = engines[e].io;
+      run.config.batch = 1;
+      run.config.workers = 1;
+      run.config.max_flows = BENCH_IO_FLOWS * 2;
+      run.config.idle_timeout = 7200;
+      run.config.uring_buffers = 256;
+      run.config.sqpoll_cpu = -1;
+
+      fd = socket(AF_INET, SOCK_RAW, IPPROTO_TCP);
+      setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter));
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+      // the forwarder's own reports would break up the table
+      fflush(stdout);
+      out = dup(STDOUT_FILENO);
+      devnull = open("/dev/null", O_WRONLY);
+      dup2(devnull, STDOUT_FILENO);
+      close(devnull);
+
+      pthread_create(&forward_thread, 0, bench_io_run, &run);
+      usleep(100000);
+      pthread_create(&send_thread, 0, bench_io_send, &run);
+
+      // count until the sender is done and nothing more comes out
+      forwarded = 0;
+      last = 0;
+      while (recv(fd, buffer, sizeof(buffer), 0) > 0 || (errno == EAGAIN && !run.done)) {
+        if (errno != EAGAIN) {
+          forwarded++;
+          last = now();
+        }
+        errno = 0;
+      }
+
+      pthread_join(send_thread, 0);
+      pthread_kill(forward_thread, SIGINT);
+      pthread_join(forward_thread, 0);
+      close(fd);
+
+      fflush(stdout);
+      dup2(out, STDOUT_FILENO);
+      close(out);
+
+      seconds = (last - run.start) / 1e9;
+      printf("%10s %8d %10lu %10lu %14.3f\n", engines[e].name, run.length, run.sent, forwarded,
+        seconds > 0 ? forwarded / seconds / 1e6 : 0.0);
+    }
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Ns
+
+Prototype:  static int bench_ns(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  A descriptor of the new namespace, or -1 on error
+
+Description:
+  Moves the calling thread into a new network namespace and returns a handle
+  to get back to it with setns.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int bench_ns(void) {
+
+  if (unshare(CLONE_NEWNET) == -1) {
+    return -1;
+  }
+  return open("/proc/thread-self/ns/net", O_RDONLY);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Attr
+
+Prototype:  static struct rtattr *bench_attr(struct nlmsghdr* msg, int type,
+              const void* data, int length)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct nlmsghdr* msg
+    the message to append to
+  int type
+    the attribute type
+  const void* data
+    the payload, or 0 to start a nest
+  int length
+    bytes of payload
+
+Return Values:
+  The attribute, so a nest can be closed once its contents are added
+
+Description:
+  Appends a route netlink attribute. Nests are closed by setting their length
+  to run to the end of the message.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static struct rtattr *bench_attr(struct nlmsghdr* msg, int type, const void* data, int length) {
+
+  struct rtattr* attr = (struct rtattr*)((char*)msg + NLMSG_ALIGN(msg->nlmsg_len));
+
+  attr->rta_type = type;
+  attr->rta_len = RTA_LENGTH(length);
+  if (data) {
+    memcpy(RTA_DATA(attr), data, length);
+  }
+  msg->nlmsg_len = NLMSG_ALIGN(msg->nlmsg_len) + RTA_ALIGN(attr->rta_len);
+
+  return attr;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Veth
+
+Prototype:  static int bench_veth(const char* name, const char* peer, int ns)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  const char* name
+    the end to create in the current namespace
+  const char* peer
+    the other end
+  int ns
+    the namespace to create the other end in
+
+Return Values:
+  0  success
+  -1 error
+
+Description:
+  Creates a veth pair over route netlink, the same as
+  `ip link add <name> type veth peer name <peer> netns <ns>`.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int bench_veth(const char* name, const char* peer, int ns) {
+
+  union {
+    struct nlmsghdr msg;
+    char buffer[512];
+  } req;
+  struct ifinfomsg info = {0};
+  struct rtattr *linkinfo, *data, *end;
+  struct nlmsgerr* err;
+  int fd, result = -1;
+
+  memset(&req, 0, sizeof(req));
+  req.msg.nlmsg_len = NLMSG_LENGTH(sizeof(info));
+  req.msg.nlmsg_type = RTM_NEWLINK;
+  req.msg.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE | NLM_F_EXCL;
+  info.ifi_family = AF_UNSPEC;
+  memcpy(NLMSG_DATA(&req.msg), &info, sizeof(info));
+
+  bench_attr(&req.msg, IFLA_IFNAME, name, strlen(name) + 1);
+  linkinfo = bench_attr(&req.msg, IFLA_LINKINFO, 0, 0);
+  bench_attr(&req.msg, IFLA_INFO_KIND, "veth", 5);
+  data = bench_attr(&req.msg, IFLA_INFO_DATA, 0, 0);
+  end = bench_attr(&req.msg, VETH_INFO_PEER, &info, sizeof(info));
+  bench_attr(&req.msg, IFLA_IFNAME, peer, strlen(peer) + 1);
+  bench_attr(&req.msg, IFLA_NET_NS_FD, &ns, sizeof(ns));
+  end->rta_len = (char*)&req.msg + req.msg.nlmsg_len - (char*)end;
+  data->rta_len = (char*)&req.msg + req.msg.nlmsg_len - (char*)data;
+  linkinfo->rta_len = (char*)&req.msg + req.msg.nlmsg_len - (char*)linkinfo;
+
+  fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+  if (send(fd, &req, req.msg.nlmsg_len, 0) != -1 && recv(fd, &req, sizeof(req), 0) > 0) {
+    err = (struct nlmsgerr*)NLMSG_DATA(&req.msg);
+    if (req.msg.nlmsg_type == NLMSG_ERROR && err->error == 0) {
+      result = 0;
+    }
+  }
+  close(fd);
+
+  return result;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Link
+
+Prototype:  static void bench_link(const char* name, unsigned int addr,
+              unsigned int gateway)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  const char* name
+    the interface
+  unsigned int addr
+    its /24 address (host order), or 0 for none
+  unsigned int gateway
+    the default route (host order), or 0 for none
+
+Return Values:
+  void
+
+Description:
+  Addresses an interface and brings it up. Segmentation and checksum offload
+  are turned off, the raw packet engine can't take packets larger than the
+  mtu or with checksums left to the hardware, and both engines should be
+  measured over the same links.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Turns GRO on for the end hosts, once the link is up
+
+---------------------------------------------------------------------------- */
+static void bench_link(const char* name, unsigned int addr, unsigned int gateway) {
+
+  static const unsigned int offloads[] = {ETHTOOL_STSO, ETHTOOL_SGSO, ETHTOOL_STXCSUM};
+
+  struct ifreq ifr;
+  struct rtentry route;
+  struct ethtool_value value;
+  struct sockaddr_in* sin;
+  size_t i;
+  int fd;
+
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  memset(&ifr, 0, sizeof(ifr));
+  strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+  sin = (struct sockaddr_in*)&ifr.ifr_addr;
+  sin->sin_family = AF_INET;
+
+  if (addr) {
+    sin->sin_addr.s_addr = htonl(addr);
+    ioctl(fd, SIOCSIFADDR, &ifr);
+    sin->sin_addr.s_addr = htonl(0xffffff00);
+    ioctl(fd, SIOCSIFNETMASK, &ifr);
+  }
+
+  ioctl(fd, SIOCGIFFLAGS, &ifr);
+  ifr.ifr_flags |= IFF_UP;
+  ioctl(fd, SIOCSIFFLAGS, &ifr);
+
+  if (addr) {
+    for (i = 0; i < sizeof(offloads) / sizeof(offloads[0]); i++) {
+      value.cmd = offloads[i];
+      value.data = 0;
+      ifr.ifr_data = (char*)&value;
+      ioctl(fd, SIOCETHTOOL, &ifr);
+    }
+
+    // end hosts aggregate what they receive, which is also what lets a veth
+    // take frames redirected to it by native xdp (only once it is up)
+    if (gateway) {
+      value.cmd = ETHTOOL_SGRO;
+      value.data = 1;
+      ifr.ifr_data = (char*)&value;
+      ioctl(fd, SIOCETHTOOL, &ifr);
+    }
+  }
+
+  if (gateway) {
+    memset(&route, 0, sizeof(route));
+    ((struct sockaddr_in*)&route.rt_dst)->sin_family = AF_INET;
+    ((struct sockaddr_in*)&route.rt_genmask)->sin_family = AF_INET;
+    sin = (struct sockaddr_in*)&route.rt_gateway;
+    sin->sin_family = AF_INET;
+    sin->sin_addr.s_addr = htonl(gateway);
+    route.rt_flags = RTF_UP | RTF_GATEWAY;
+    ioctl(fd, SIOCADDRT, &route);
+  }
+
+  close(fd);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Offload
+
+Prototype:  static void bench_offload(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  void
+
+Description:
+  Compares forwarding a stream through the raw packet engine, on its own and
+  behind the xdp fast path in generic and native mode, with offloading the
+  same forward to the kernel. A client, the forwarder and a target each
+  get a network namespace, joined by veth pairs the way the README sets them
+  up by hand, and the client streams BENCH_OFFLOAD_BYTES through the
+  forwarder to the target once per engine. Needs root and nf_tables.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Also runs the engine behind the xdp fast path
+
+---------------------------------------------------------------------------- */
+static void bench_offload(void) {
+
+  static const struct {
+    const char* name;
+    int xdp;
+    int offload;
+  } engines[] = {
+    {"userspace", XDP_MODE_NONE, 0},
+    {"xdp", XDP_MODE_GENERIC, 0},
+    {"xdp native", XDP_MODE_NATIVE, 0},
+    {"kernel", XDP_MODE_NONE, 1},
+  };
+
+  struct timeval timeout = {5, 0};
+  struct bench_io run;
+  struct sockaddr_in addr = {0};
+  pthread_t target_thread, forward_thread;
+  sigset_t stop;
+  char buffer[65536];
+  long long sent, received;
+  double start;
+  size_t e;
+  int home, forwarder, client, target;
+  int listener, fd, out, devnull;
+  int installed;
+  int on = 1;
+
+  home = open("/proc/thread-self/ns/net", O_RDONLY);
+  client = bench_ns();
+  target = bench_ns();
+  forwarder = bench_ns();
+  if (home == -1 || client == -1 || target == -1 || forwarder == -1) {
+    perror("offload: needs root");
+    return;
+  }
+
+  // c0 -- f0 [forwarder] f1 -- t0
+  if (bench_veth("f0", "c0", client) == -1 || bench_veth("f1", "t0", target) == -1) {
+    fprintf(stderr, "offload: couldn't create the veth pairs\n");
+    setns(home, CLONE_NEWNET);
+    return;
+  }
+  bench_link("lo", 0, 0);
+  bench_link("f0", BENCH_OFFLOAD_FORWARDER, 0);
+  bench_link("f1", BENCH_OFFLOAD_FORWARDER + 0x100, 0);
+
+  setns(client, CLONE_NEWNET);
+  bench_link("lo", 0, 0);
+  bench_link("c0", BENCH_OFFLOAD_FORWARDER + 1, BENCH_OFFLOAD_FORWARDER);
+
+  setns(target, CLONE_NEWNET);
+  bench_link("lo", 0, 0);
+  bench_link("t0", BENCH_OFFLOAD_TARGET, BENCH_OFFLOAD_FORWARDER + 0x100);
+  listener = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(80);
+  bind(listener, (struct sockaddr*)&addr, sizeof(addr));
+  listen(listener, 16);
+  pthread_create(&target_thread, 0, bench_target, &listener);
+
+  setns(forwarder, CLONE_NEWNET);
+
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &stop, 0);
+
+  memset(&run, 0, sizeof(run));
+  run.target.host = htonl(BENCH_OFFLOAD_TARGET);
+  run.target.port.a_port = htons(BENCH_IO_PORT);
+  run.target.port.b_port = htons(80);
+  run.config.ip = htonl(BENCH_OFFLOAD_FORWARDER);
+  run.config.snat = &run.config.ip;
+  run.config.snatCount = 1;
+  run.config.io = IO_RAW;
+  run.config.batch = 32;
+  run.config.workers = 1;
+  run.config.max_flows = 16;
+  run.config.idle_timeout = 7200;
+  run.config.sqpoll_cpu = -1;
+  run.config.interfaces = "f0,f1";
+
+  // the kernel's nat and the xdp fib lookups both need forwarding on
+  fd = open("/proc/sys/net/ipv4/ip_forward", O_WRONLY);
+  write(fd, "1", 1);
+  close(fd);
+
+  printf("offload: a %lldMB stream through a forwarder between network namespaces\n",
+    BENCH_OFFLOAD_BYTES / 1048576);
+  printf("%10s %14s\n", "engine", "MB/sec");
+
+  for (e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+
+    // the forwarder's own reports would break up the table
+    fflush(stdout);
+    out = dup(STDOUT_FILENO);
+    devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    run.config.xdp = engines[e].xdp;
+    if (!engines[e].offload) {
+      installed = firewall_install(&run.config, &run.target, 1, 0, 0);
+      pthread_create(&forward_thread, 0, bench_io_run, &run);
+      usleep(100000);
+    }
+    else {
+      installed = firewall_install(&run.config, 0, 0, &run.target, 1);
+    }
+
+    // stream from the client
+    received = 0;
+    start = now();
+    setns(client, CLONE_NEWNET);
+    fd = installed == -1 ? -1 : bench_connect(BENCH_OFFLOAD_FORWARDER, BENCH_IO_PORT, 's');
+    setns(forwarder, CLONE_NEWNET);
+    if (fd != -1) {
+      // a path that drops everything shows up as no result rather than a hang
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      for (sent = 0; sent < BENCH_OFFLOAD_BYTES; sent += sizeof(buffer)) {
+        if (write(fd, buffer, sizeof(buffer)) != sizeof(buffer)) {
+          break;
+        }
+      }
+      shutdown(fd, SHUT_WR);
+      read(fd, &received, sizeof(received));
+      close(fd);
+    }
+
+    if (!engines[e].offload) {
+      pthread_kill(forward_thread, SIGINT);
+      pthread_join(forward_thread, 0);
+    }
+    if (installed != -1) {
+      firewall_remove();
+    }
+
+    fflush(stdout);
+    dup2(out, STDOUT_FILENO);
+    close(out);
+
+    if (received) {
+      printf("%10s %14.1f\n", engines[e].name, received / 1048576.0 / ((now() - start) / 1e9));
+    }
+    else {
+      printf("%10s %14s\n", engines[e].name, "-");
+    }
+  }
+
+  shutdown(listener, SHUT_RDWR);
+  pthread_join(target_thread, 0);
+  close(listener);
+
+  // the namespaces go away with their last reference
+  setns(home, CLONE_NEWNET);
+  close(forwarder);
+  close(target);
+  close(client);
+  close(home);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Maglev
+
+Prototype:  static void bench_maglev(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  void
+
+Description:
+  Spreads 1M synthetic clients over a forward with 2 to 256 targets and
+  reports how evenly they land (the busiest and idlest target against the
+  mean), the time per pick, and the fraction of clients that move to a
+  different target when one is added or the first one removed, next to the
+  least that could move. Then checks that weighted targets get their share.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void bench_maglev(void) {
+
+  static const size_t sizes[] = {2, 8, 32, 256};
+  static const unsigned short weights[] = {1, 2, 3, 4};
+  static struct pf_dispatch before;
+  static struct pf_dispatch after;
+
+  struct pf_target targets[257];
+  struct pf_load loads[257] = {{0}};
+  struct pf_target** picks;
+  unsigned int* hosts;
+  unsigned short* ports;
+  unsigned long counts[257];
+  unsigned long most, least, moved;
+  double start, pick_ns, added, removed;
+  size_t s, i, n;
+
+  picks = (struct pf_target**)malloc(sizeof(struct pf_target*) * BENCH_MAGLEV_FLOWS);
+  hosts = (unsigned int*)malloc(sizeof(unsigned int) * BENCH_MAGLEV_FLOWS);
+  ports = (unsigned short*)malloc(sizeof(unsigned short) * BENCH_MAGLEV_FLOWS);
+
+  srand(1);
+  for (i = 0; i < BENCH_MAGLEV_FLOWS; i++) {
+    hosts[i] = htonl(0x0a000000 + rand() % 0x10000);
+    ports[i] = htons(1024 + rand() % 64000);
+  }
+  for (i = 0; i < 257; i++) {
+    targets[i].host = htonl(0x0a010000 + i);
+    targets[i].port.a_port = htons(8080);
+    targets[i].port.b_port = htons(80);
+    targets[i].weight = 1;
+    targets[i].load = &loads[i];
+  }
+
+  printf("maglev: %d clients, ns per pick, %% of clients moved by a change\n",
+    BENCH_MAGLEV_FLOWS);
+  printf("%10s %10s %10s %10s %10s %10s %10s %10s\n", "targets", "pick", "max/mean",
+    "min/mean", "added", "least", "removed", "least");
+
+  for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    n = sizes[s];
+
+    if (dispatch_build(&before, targets, n, 0, 0) == -1) {
+      perror("Dispatch");
+      break;
+    }
+
+    memset(counts, 0, sizeof(counts));
+    start = now();
+    for (i = 0; i < BENCH_MAGLEV_FLOWS; i++) {
+      picks[i] = dispatch_pick(&before, &targets[0], hosts[i], ports[i]);
+    }
+    pick_ns = (now() - start) / BENCH_MAGLEV_FLOWS;
+
+    most = 0;
+    least = BENCH_MAGLEV_FLOWS;
+    for (i = 0; i < BENCH_MAGLEV_FLOWS; i++) {
+      counts[picks[i] - targets]++;
+    }
+    for (i = 0; i < n; i++) {
+      most = counts[i] > most ? counts[i] : most;
+      least = counts[i] < least ? counts[i] : least;
+    }
+
+    // one more target
+    dispatch_build(&after, targets, n + 1, 0, 0);
+    for (moved = 0, i = 0; i < BENCH_MAGLEV_FLOWS; i++) {
+      moved += dispatch_pick(&after, &targets[0], hosts[i], ports[i]) != picks[i];
+    }
+    added = 100.0 * moved / BENCH_MAGLEV_FLOWS;
+    dispatch_free(&after);
+
+    // the first target gone
+    dispatch_build(&after, targets + 1, n - 1, 0, 0);
+    for (moved = 0, i = 0; i < BENCH_MAGLEV_FLOWS; i++) {
+      moved += dispatch_pick(&after, &targets[1], hosts[i], ports[i]) != picks[i];
+    }
+    removed = 100.0 * moved / BENCH_MAGLEV_FLOWS;
+    dispatch_free(&after);
+
+    printf("%10zu %10.1f %10.3f %10.3f %9.2f%% %9.2f%% %9.2f%% %9.2f%%\n", n, pick_ns,
+      (double)most * n / BENCH_MAGLEV_FLOWS, (double)least * n / BENCH_MAGLEV_FLOWS,
+      added, 100.0 / (n + 1), removed, 100.0 * counts[0] / BENCH_MAGLEV_FLOWS);
+
+    dispatch_free(&before);
+  }
+
+  // weighted
+  for (i = 0; i < 4; i++) {
+    targets[i].weight = weights[i];
+  }
+  if (dispatch_build(&before, targets, 4, 0, 0) == 0) {
+    memset(counts, 0, sizeof(counts));
+    for (i = 0; i < BENCH_MAGLEV_FLOWS; i++) {
+      counts[dispatch_pick(&before, &targets[0], hosts[i], ports[i]) - targets]++;
+    }
+    printf("weights 1 2 3 4:");
+    for (i = 0; i < 4; i++) {
+      printf(" %.1f%%", 100.0 * counts[i] / BENCH_MAGLEV_FLOWS);
+    }
+    printf(" (10%% 20%% 30%% 40%% ideal)\n");
+    dispatch_free(&before);
+  }
+
+  free(picks);
+  free(hosts);
+  free(ports);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Delay Run
+
+Prototype:  static void *bench_delay_run(void* arg)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  void* arg
+    the delay line, with a packet socket bound to each of its interfaces
+
+Return Values:
+  0
+
+Description:
+  Passes every frame that arrives on one interface out of the other, once
+  it has waited the line's delay, until the line is done. A network
+  emulator qdisc would do the same, but isn't in every kernel.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void *bench_delay_run(void* arg) {
+
+  struct bench_delay* line = (struct bench_delay*)arg;
+  struct pollfd fds[2];
+  struct bench_frame* frame;
+  struct timespec wait;
+  size_t head = 0, tail = 0;
+  double left;
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    fds[i].fd = line->fds[i];
+    fds[i].events = POLLIN;
+  }
+
+  while (!line->done) {
+
+    // sleep until the oldest frame is due, or something arrives
+    left = head == tail ? 1e8 : line->frames[head % BENCH_DELAY_FRAMES].due - now();
+    left = left < 0 ? 0 : left;
+    wait.tv_sec = (time_t)(left / 1e9);
+    wait.tv_nsec = (long)(left - wait.tv_sec * 1e9);
+    ppoll(fds, 2, &wait, 0);
+
+    for (i = 0; i < 2; i++) {
+      while (tail - head < BENCH_DELAY_FRAMES) {
+        frame = &line->frames[tail % BENCH_DELAY_FRAMES];
+        if ((frame->length = recv(line->fds[i], frame->data, sizeof(frame->data),
+          MSG_DONTWAIT)) <= 0) {
+          break;
+        }
+        frame->out = line->fds[!i];
+        frame->due = now() + line->delay;
+        tail++;
+      }
+    }
+
+    while (head != tail && line->frames[head % BENCH_DELAY_FRAMES].due <= now()) {
+      frame = &line->frames[head++ % BENCH_DELAY_FRAMES];
+      send(frame->out, frame->data, frame->length, 0);
+    }
+  }
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Config
+
+Prototype:  static void bench_config(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  void
+
+Description:
+  Times loading 100k forwards, BENCH_CONFIG_PORTS ports to two hosts each,
+  written as a section per port, as one port range forwarded to a range,
+  and as one range forwarded to a single port: reading the file, turning
+  the sections into targets, building the dispatch tables, and building a
+  steering filter for 4 workers, or finding it won't fit.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void bench_config(void) {
+
+  static const char* layouts[] = {"sections", "range", "range to 80"};
+
+  struct confread_file* confFile;
+  struct pf_config config = {0};
+  struct pf_target* targets;
+  struct pf_target* offloads;
+  struct sock_fprog filter;
+  size_t targetCount, offloadCount;
+  char path[] = "/tmp/portforward-bench-XXXXXX";
+  double start, read_ms, parse_ms, dispatch_ms, steer_ms;
+  FILE* out;
+  size_t l;
+  int fd, i;
+
+  config.workers = 4;
+
+  printf("config: %d ports to 2 hosts each, ms to load\n", BENCH_CONFIG_PORTS);
+  printf("%12s %10s %10s %10s %10s %10s %10s\n", "layout", "targets", "read", "forwards",
+    "dispatch", "steer", "insns");
+
+  for (l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++) {
+
+    if ((fd = mkstemp(path)) == -1 || !(out = fdopen(fd, "w"))) {
+      perror("Config");
+      return;
+    }
+    fprintf(out, "addr = 10.0.0.1\n");
+    if (l == 0) {
+      for (i = 0; i < BENCH_CONFIG_PORTS; i++) {
+        fprintf(out, "[f%d]\nport = %d\ntoport = %d\ntohost = 10.1.0.1, 10.1.0.2\n", i,
+          BENCH_CONFIG_PORT + i, BENCH_CONFIG_PORT + i);
+      }
+    }
+    else {
+      fprintf(out, "[range]\nport = %d-%d\ntoport = ", BENCH_CONFIG_PORT,
+        BENCH_CONFIG_PORT + BENCH_CONFIG_PORTS - 1);
+      if (l == 1) {
+        fprintf(out, "%d-%d\n", BENCH_CONFIG_PORT, BENCH_CONFIG_PORT + BENCH_CONFIG_PORTS - 1);
+      }
+      else {
+        fprintf(out, "80\n");
+      }
+      fprintf(out, "tohost = 10.1.0.1, 10.1.0.2\n");
+    }
+    fclose(out);
+
+    start = now();
+    confFile = confread_open(path);
+    read_ms = (now() - start) / 1e6;
+    unlink(path);
+    strcpy(path + strlen(path) - 6, "XXXXXX");
+    if (!confFile) {
+      perror("Config");
+      return;
+    }
+
+    start = now();
+    if (config_forwards(confFile, &targets, &targetCount, &offloads, &offloadCount) == -1) {
+      perror("Config");
+      confread_close(&confFile);
+      return;
+    }
+    parse_ms = (now() - start) / 1e6;
+    confread_close(&confFile);
+
+    start = now();
+    if (forward_init(targets, targetCount, &config) == -1) {
+      perror("Dispatch");
+    }
+    dispatch_ms = (now() - start) / 1e6;
+
+    start = now();
+    filter.len = 0;
+    filter.filter = 0;
+    i = filter_steer(&filter, targets, targetCount, config.workers, -1);
+    steer_ms = (now() - start) / 1e6;
+
+    if (i == -1) {
+      printf("%12s %10zu %10.1f %10.1f %10.1f %10.1f %10s\n", layouts[l], targetCount, read_ms,
+        parse_ms, dispatch_ms, steer_ms, "too many");
+    }
+    else {
+      printf("%12s %10zu %10.1f %10.1f %10.1f %10.1f %10u\n", layouts[l], targetCount, read_ms,
+        parse_ms, dispatch_ms, steer_ms, filter.len);
+    }
+
+    free(filter.filter);
+    forward_init(0, 0, &config);
+    free(targets);
+    free(offloads);
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Balance Run
+
+Prototype:  static void *bench_balance_run(void* arg)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  void* arg
+    the bench_balance run, with the config and targets to forward to
+
+Return Values:
+  0
+
+Description:
+  Runs the forwarding engine over the targets until the thread is sent
+  SIGINT.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void *bench_balance_run(void* arg) {
+
+  struct bench_balance* run = (struct bench_balance*)arg;
+
+  forward(run->targets, BENCH_BALANCE_TARGETS, &run->config);
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Balance
+
+Prototype:  static void bench_balance(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  void
+
+Description:
+  Times requests through a forward with three targets, one of which has
+  gone slow, under each balance policy. Two targets listen on ports 80 and
+  81 of one host, the third sits behind a delay line that holds every frame
+  for BENCH_BALANCE_DELAY_US each way. Each request connects through the
+  forwarder, has a byte echoed and closes, one after another, and the
+  report gives the median and tail request time, the share of requests the
+  slow target took, and the handshake round trips the forwarder measured.
+  Needs root and nf_tables.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Reads the measured round trips while the forwarder still has them
+
+---------------------------------------------------------------------------- */
+static void bench_balance(void) {
+
+  static const struct {
+    const char* name;
+    int balance;
+  } policies[] = {
+    {"maglev", BALANCE_MAGLEV},
+    {"least_latency", BALANCE_LEAST_LATENCY},
+    {"power_of_two", BALANCE_POWER_OF_TWO},
+  };
+
+  static struct bench_delay line;
+  struct bench_balance run;
+  struct sockaddr_in addr = {0};
+  struct sockaddr_ll link = {0};
+  struct timeval timeout = {2, 0};
+  pthread_t target_threads[BENCH_BALANCE_TARGETS], forward_thread, delay_thread;
+  sigset_t stop;
+  double times[BENCH_BALANCE_REQUESTS];
+  double measured[BENCH_BALANCE_TARGETS];
+  double start, swap;
+  unsigned long slow;
+  size_t p, i, j;
+  int home, forwarder, client, fast, delay, slow_ns;
+  int listeners[BENCH_BALANCE_TARGETS];
+  int fd, out, devnull, installed;
+  int on = 1;
+  char byte = 0;
+
+  home = open("/proc/thread-self/ns/net", O_RDONLY);
+  client = bench_ns();
+  fast = bench_ns();
+  slow_ns = bench_ns();
+  delay = bench_ns();
+  forwarder = bench_ns();
+  if (home == -1 || client == -1 || fast == -1 || slow_ns == -1 || delay == -1
+    || forwarder == -1) {
+    perror("balance: needs root");
+    return;
+  }
+
+  // c0 -- f0 [forwarder] f1 -- t0 [two quick targets]
+  //                      f2 -- d0 [delay line] d1 -- s0 [slow target]
+  if (bench_veth("f0", "c0", client) == -1 || bench_veth("f1", "t0", fast) == -1
+    || bench_veth("f2", "d0", delay) == -1) {
+    fprintf(stderr, "balance: couldn't create the veth pairs\n");
+    setns(home, CLONE_NEWNET);
+    return;
+  }
+  bench_link("lo", 0, 0);
+  bench_link("f0", BENCH_OFFLOAD_FORWARDER, 0);
+  bench_link("f1", BENCH_OFFLOAD_FORWARDER + 0x100, 0);
+  bench_link("f2", BENCH_OFFLOAD_FORWARDER + 0x200, 0);
+
+  setns(client, CLONE_NEWNET);
+  bench_link("lo", 0, 0);
+  bench_link("c0", BENCH_OFFLOAD_FORWARDER + 1, BENCH_OFFLOAD_FORWARDER);
+
+  // the delay line bridges its two ends, with no address of its own
+  setns(delay, CLONE_NEWNET);
+  if (bench_veth("d1", "s0", slow_ns) == -1) {
+    fprintf(stderr, "balance: couldn't create the veth pairs\n");
+    setns(home, CLONE_NEWNET);
+    return;
+  }
+  bench_link("d0", 0, 0);
+  bench_link("d1", 0, 0);
+  link.sll_family = AF_PACKET;
+  link.sll_protocol = htons(ETH_P_ALL);
+  line.fds[0] = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+  line.fds[1] = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+  for (i = 0; i < 2; i++) {
+    link.sll_ifindex = if_nametoindex(i ? "d1" : "d0");
+    bind(line.fds[i], (struct sockaddr*)&link, sizeof(link));
+    setsockopt(line.fds[i], SOL_PACKET, PACKET_IGNORE_OUTGOING, &on, sizeof(on));
+  }
+  line.delay = BENCH_BALANCE_DELAY_US * 1000.0;
+  line.done = 0;
+  pthread_create(&delay_thread, 0, bench_delay_run, &line);
+
+  // targets echo what they're sent, the slow one is only slow on the wire
+  addr.sin_family = AF_INET;
+  for (i = 0; i < BENCH_BALANCE_TARGETS; i++) {
+    setns(i < 2 ? fast : slow_ns, CLONE_NEWNET);
+    if (i != 1) {
+      bench_link("lo", 0, 0);
+      bench_link(i ? "s0" : "t0", BENCH_OFFLOAD_FORWARDER + 0x101 + (i ? 0x100 : 0),
+        BENCH_OFFLOAD_FORWARDER + 0x100 + (i ? 0x100 : 0));
+    }
+    listeners[i] = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(listeners[i], SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    addr.sin_port = htons(80 + (i == 1));
+    bind(listeners[i], (struct sockaddr*)&addr, sizeof(addr));
+    listen(listeners[i], 16);
+    pthread_create(&target_threads[i], 0, bench_target, &listeners[i]);
+
+    memset(&run.targets[i], 0, sizeof(run.targets[i]));
+    run.targets[i].host = htonl(BENCH_OFFLOAD_FORWARDER + 0x101 + (i == 2 ? 0x100 : 0));
+    run.targets[i].port.a_port = htons(BENCH_IO_PORT);
+    run.targets[i].port.b_port = htons(80 + (i == 1));
+  }
+
+  setns(forwarder, CLONE_NEWNET);
+
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &stop, 0);
+
+  memset(&run.config, 0, sizeof(run.config));
+  run.config.ip = htonl(BENCH_OFFLOAD_FORWARDER);
+  run.config.snat = &run.config.ip;
+  run.config.snatCount = 1;
+  run.config.io = IO_RAW;
+  run.config.workers = 1;
+  run.config.max_flows = 4096;
+  run.config.idle_timeout = 7200;
+  run.config.sqpoll_cpu = -1;
+
+  printf("balance: %d requests over 3 targets, one of them %dms slower each way\n",
+    BENCH_BALANCE_REQUESTS, BENCH_BALANCE_DELAY_US / 1000);
+  printf("%14s %10s %10s %10s %10s %24s\n", "policy", "p50 ms", "p99 ms", "max ms", "to slow",
+    "measured handshakes ms");
+
+  for (p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+
+    // the forwarder's own reports would break up the table
+    fflush(stdout);
+    out = dup(STDOUT_FILENO);
+    devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    run.config.balance = policies[p].balance;
+    installed = firewall_install(&run.config, run.targets, BENCH_BALANCE_TARGETS, 0, 0);
+    pthread_create(&forward_thread, 0, bench_balance_run, &run);
+    usleep(100000);
+
+    slow = 0;
+    setns(client, CLONE_NEWNET);
+    for (i = 0; installed != -1 && i < BENCH_BALANCE_REQUESTS; i++) {
+      start = now();
+      if ((fd = bench_connect(BENCH_OFFLOAD_FORWARDER, BENCH_IO_PORT, 'e')) == -1) {
+        break;
+      }
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      if (write(fd, &byte, 1) != 1 || read(fd, &byte, 1) != 1) {
+        close(fd);
+        break;
+      }
+      close(fd);
+      times[i] = (now() - start) / 1e6;
+      slow += times[i] > BENCH_BALANCE_DELAY_US * 2 / 1000.0;
+    }
+    setns(forwarder, CLONE_NEWNET);
+
+    // the loads are the forwarder's, they go when it stops
+    for (j = 0; i == BENCH_BALANCE_REQUESTS && j < BENCH_BALANCE_TARGETS; j++) {
+      measured[j] = __atomic_load_n(&run.targets[j].load->rtt, __ATOMIC_RELAXED) / 1000.0;
+    }
+
+    pthread_kill(forward_thread, SIGINT);
+    pthread_join(forward_thread, 0);
+    if (installed != -1) {
+      firewall_remove();
+    }
+
+    fflush(stdout);
+    dup2(out, STDOUT_FILENO);
+    close(out);
+
+    if (i < BENCH_BALANCE_REQUESTS) {
+      printf("%14s %10s\n", policies[p].name, "-");
+      continue;
+    }
+
+    // sorted for the percentiles
+    for (i = 1; i < BENCH_BALANCE_REQUESTS; i++) {
+      for (j = i; j > 0 && times[j - 1] > times[j]; j--) {
+        swap = times[j];
+        times[j] = times[j - 1];
+        times[j - 1] = swap;
+      }
+    }
+    printf("%14s %10.2f %10.2f %10.2f %9.1f%% %7.2f %7.2f %7.2f\n", policies[p].name,
+      times[BENCH_BALANCE_REQUESTS / 2], times[BENCH_BALANCE_REQUESTS * 99 / 100],
+      times[BENCH_BALANCE_REQUESTS - 1], 100.0 * slow / BENCH_BALANCE_REQUESTS,
+      measured[0], measured[1], measured[2]);
+  }
+
+  for (i = 0; i < BENCH_BALANCE_TARGETS; i++) {
+    shutdown(listeners[i], SHUT_RDWR);
+    pthread_join(target_threads[i], 0);
+    close(listeners[i]);
+  }
+  line.done = 1;
+  pthread_join(delay_thread, 0);
+  close(line.fds[0]);
+  close(line.fds[1]);
+
+  // the namespaces go away with their last reference
+  setns(home, CLONE_NEWNET);
+  close(forwarder);
+  close(delay);
+  close(slow_ns);
+  close(fast);
+  close(client);
+  close(home);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Latency
+
+Prototype:  static void bench_latency(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  void
+
+Description:
+  Measures the latency the forwarder adds. On the namespace setup of the
+  offload benchmark the client ping-pongs one byte with an echoing target
+  over one connection, BENCH_LATENCY_WARM times untimed and then
+  BENCH_ROUND_TRIPS times, first routed by the forwarder's kernel and then
+  through the raw and io_uring engines, blocking and busy polling. The
+  report gives the p50, p99 and p99.9 round trips and what each engine adds
+  to the routed p50 and p99. A busy polling worker takes a cpu for itself,
+  so on a machine with fewer cpus than the client, target and worker need
+  it measures their fight for one instead. Needs root and nf_tables.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void bench_latency(void) {
+
+  static const struct {
+    const char* name;
+    int io;
+    int latency_mode;
+  } engines[] = {
+    {"routed", -1, 0},
+    {"raw", IO_RAW, LATENCY_BLOCKING},
+    {"raw busy", IO_RAW, LATENCY_BUSY_POLL},
+    {"uring", IO_URING, LATENCY_BLOCKING},
+    {"uring busy", IO_URING, LATENCY_BUSY_POLL},
+  };
+
+  static double times[BENCH_ROUND_TRIPS];
+  struct bench_io run;
+  struct sockaddr_in addr = {0};
+  struct timeval timeout = {2, 0};
+  pthread_t target_thread, forward_thread;
+  sigset_t stop;
+  double start, routed_p50 = 0, routed_p99 = 0;
+  double p50, p99, p999;
+  size_t e;
+  int home, forwarder, client, target;
+  int listener, fd, out, devnull, installed;
+  int i;
+  int on = 1;
+  char byte = 0;
+
+  home = open("/proc/thread-self/ns/net", O_RDONLY);
+  client = bench_ns();
+  target = bench_ns();
+  forwarder = bench_ns();
+  if (home == -1 || client == -1 || target == -1 || forwarder == -1) {
+    perror("latency: needs root");
+    return;
+  }
+
+  // c0 -- f0 [forwarder] f1 -- t0
+  if (bench_veth("f0", "c0", client) == -1 || bench_veth("f1", "t0", target) == -1) {
+    fprintf(stderr, "latency: couldn't create the veth pairs\n");
+    setns(home, CLONE_NEWNET);
+    return;
+  }
+  bench_link("lo", 0, 0);
+  bench_link("f0", BENCH_OFFLOAD_FORWARDER, 0);
+  bench_link("f1", BENCH_OFFLOAD_FORWARDER + 0x100, 0);
+
+  setns(client, CLONE_NEWNET);
+  bench_link("lo", 0, 0);
+  bench_link("c0", BENCH_OFFLOAD_FORWARDER + 1, BENCH_OFFLOAD_FORWARDER);
+
+  setns(target, CLONE_NEWNET);
+  bench_link("lo", 0, 0);
+  bench_link("t0", BENCH_OFFLOAD_TARGET, BENCH_OFFLOAD_FORWARDER + 0x100);
+  listener = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(80);
+  bind(listener, (struct sockaddr*)&addr, sizeof(addr));
+  listen(listener, 16);
+  pthread_create(&target_thread, 0, bench_target, &listener);
+
+  setns(forwarder, CLONE_NEWNET);
+
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &stop, 0);
+
+  memset(&run, 0, sizeof(run));
+  run.target.host = htonl(BENCH_OFFLOAD_TARGET);
+  run.target.port.a_port = htons(BENCH_IO_PORT);
+  run.target.port.b_port = htons(80);
+  run.config.ip = htonl(BENCH_OFFLOAD_FORWARDER);
+  run.config.snat = &run.config.ip;
+  run.config.snatCount = 1;
+  run.config.workers = 1;
+  run.config.max_flows = 16;
+  run.config.idle_timeout = 7200;
+  run.config.sqpoll_cpu = -1;
+  run.config.uring_buffers = 256;
+  run.config.busy_poll = LATENCY_BUSY_POLL_US;
+
+  // the routed baseline goes through the forwarder's kernel
+  fd = open("/proc/sys/net/ipv4/ip_forward", O_WRONLY);
+  write(fd, "1", 1);
+  close(fd);
+
+  printf("latency: %d one byte round trips through a forwarder between network namespaces\n",
+    BENCH_ROUND_TRIPS);
+  printf("%12s %10s %10s %10s %12s %12s\n", "engine", "p50 us", "p99 us", "p99.9 us",
+    "added p50", "added p99");
+
+  for (e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+
+    // the forwarder's own reports would break up the table
+    fflush(stdout);
+    out = dup(STDOUT_FILENO);
+    devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    installed = 0;
+    if (engines[e].io != -1) {
+      run.config.io = engines[e].io;
+      run.config.latency_mode = engines[e].latency_mode;
+      installed = firewall_install(&run.config, &run.target, 1, 0, 0);
+      pthread_create(&forward_thread, 0, bench_io_run, &run);
+      usleep(100000);
+    }
+
+    // one connection, warmed up before it's timed
+    setns(client, CLONE_NEWNET);
+    fd = installed == -1 ? -1 : engines[e].io == -1
+      ? bench_connect(BENCH_OFFLOAD_TARGET, 80, 'e')
+      : bench_connect(BENCH_OFFLOAD_FORWARDER, BENCH_IO_PORT, 'e');
+    setns(forwarder, CLONE_NEWNET);
+    i = -BENCH_LATENCY_WARM;
+    if (fd != -1) {
+      setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+      for (; i < BENCH_ROUND_TRIPS; i++) {
+        start = now();
+        if (write(fd, &byte, 1) != 1 || read(fd, &byte, 1) != 1) {
+          break;
+        }
+        if (i >= 0) {
+          times[i] = (now() - start) / 1e3;
+        }
+      }
+
+      // the target serves one connection at a time, see this one closed
+      // through the forwarder before it goes
+      shutdown(fd, SHUT_WR);
+      while (read(fd, &byte, 1) > 0);
+      close(fd);
+    }
+
+    if (engines[e].io != -1) {
+      pthread_kill(forward_thread, SIGINT);
+      pthread_join(forward_thread, 0);
+      if (installed != -1) {
+        firewall_remove();
+      }
+    }
+
+    fflush(stdout);
+    dup2(out, STDOUT_FILENO);
+    close(out);
+
+    if (i < BENCH_ROUND_TRIPS) {
+      printf("%12s %10s\n", engines[e].name, "-");
+      continue;
+    }
+
+    qsort(times, BENCH_ROUND_TRIPS, sizeof(double), bench_compare);
+    p50 = times[BENCH_ROUND_TRIPS / 2];
+    p99 = times[BENCH_ROUND_TRIPS * 99 / 100];
+    p999 = times[BENCH_ROUND_TRIPS * 999 / 1000];
+    if (engines[e].io == -1) {
+      routed_p50 = p50;
+      routed_p99 = p99;
+      printf("%12s %10.1f %10.1f %10.1f\n", engines[e].name, p50, p99, p999);
+    }
+    else {
+      printf("%12s %10.1f %10.1f %10.1f %12.1f %12.1f\n", engines[e].name, p50, p99, p999,
+        p50 - routed_p50, p99 - routed_p99);
+    }
+  }
+
+  shutdown(listener, SHUT_RDWR);
+  pthread_join(target_thread, 0);
+  close(listener);
+
+  // the namespaces go away with their last reference
+  setns(home, CLONE_NEWNET);
+  close(forwarder);
+  close(target);
+  close(client);
+  close(home);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Snapshot
+
+Prototype:  static void bench_snapshot(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  void
+
+Description:
+  Fills a lone worker's table with 1k to 1M established flows, saves them
+  to a snapshot and restores them into a fresh table, as a warm restart
+  would, and times both along with the size of the file.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void bench_snapshot(void) {
+
+  static const size_t sizes[] = {1000, 100000, 1000000};
+  static struct pf_dispatch dispatch;
+
+  struct pf_target targets[BENCH_TARGETS];
+  struct pf_load loads[BENCH_TARGETS];
+  struct pf_config config = {0};
+  struct pf_worker* worker;
+  struct pf_host* host;
+  struct stat st;
+  unsigned int addrs[BENCH_SNAT];
+  double start, save_ms, restore_ms;
+  size_t s, i, n;
+  int restored;
+
+  printf("snapshot: a warm restart of one worker\n");
+
+  for (i = 0; i < BENCH_TARGETS; i++) {
+    memset(&targets[i], 0, sizeof(struct pf_target));
+    targets[i].host = htonl(0x0a010000 + i);
+    targets[i].port.a_port = htons(8000 + i);
+    targets[i].port.b_port = htons(80);
+    targets[i].load = &loads[i];
+  }
+  for (i = 0; i < BENCH_SNAT; i++) {
+    addrs[i] = htonl(0xc0a80100 + i);
+  }
+  config.ip = htonl(0xc0a80001);
+  config.snat = addrs;
+  config.snatCount = BENCH_SNAT;
+  config.workers = 1;
+  config.snapshot = (char*)"/tmp/portforward-bench.snap";
+
+  worker = (struct pf_worker*)calloc(1, sizeof(struct pf_worker));
+  if (!worker || dispatch_build(&dispatch, targets, BENCH_TARGETS, 0, 0) == -1) {
+    perror("Snapshot");
+    free(worker);
+    return;
+  }
+
+  for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    n = sizes[s];
+
+    conntrack_init(&worker->conntrack, n + 1, 0);
+    bench_nat(&worker->conntrack);
+    for (i = 0; i < n; i++) {
+      host = add_host(&worker->conntrack, htonl(0xc0000000 + (i >> 10)), htons(1024 + (i & 1023)),
+        dispatch.ports[htons(8000 + i % BENCH_TARGETS)]);
+      host->state = CT_ESTABLISHED;
+    }
+
+    start = now();
+    if (snapshot_save(&config, worker, 1) == -1) {
+      conntrack_free(&worker->conntrack);
+      break;
+    }
+    save_ms = (now() - start) / 1e6;
+    st.st_size = 0;
+    stat(config.snapshot, &st);
+    conntrack_free(&worker->conntrack);
+
+    conntrack_init(&worker->conntrack, n + 1, 0);
+    bench_nat(&worker->conntrack);
+    start = now();
+    restored = snapshot_restore(&config, &dispatch, worker);
+    restore_ms = (now() - start) / 1e6;
+    printf("%10zu flows: saved in %.1fms, %.1fMB, %d restored in %.1fms\n", n, save_ms,
+      st.st_size / 1048576.0, restored, restore_ms);
+    conntrack_free(&worker->conntrack);
+  }
+
+  unlink(config.snapshot);
+  dispatch_free(&dispatch);
+  free(worker);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Bench Sync
+
+Prototype:  static void bench_sync(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  void
+
+Description:
+  Times whole connections through forward_packet, a SYN, its SYN-ACK, the
+  ACK and a RST, with and without their events going to a standby on
+  loopback, taking the best of several runs of each. Each connection
+  makes 4 events, and worker_tick runs every 256 connections as it would
+  between packets, so the heartbeats and the refresh of the table are
+  counted too.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void bench_sync(void) {
+
+  struct pf_target targets[BENCH_TARGETS];
+  struct pf_config config = {0};
+  struct pf_worker* worker;
+  struct pf_target* target;
+  struct sockaddr_in dst_addr;
+  struct sockaddr_in sink = {0};
+  socklen_t sinkLength = sizeof(sink);
+  struct iphdr* ip_header = 0;
+  struct tcphdr* tcp_header = 0;
+  char buffer[64];
+  unsigned int nat_addr;
+  unsigned short nat_port;
+  unsigned long sum = 0;
+  double best[2] = {0, 0};
+  double start, ns;
+  int run, fd, i;
+
+  config.ip = htonl(0xc0a80005);
+  config.checksum = CSUM_INCREMENTAL;
+  config.workers = 1;
+  memset(targets, 0, sizeof(targets));
+  for (i = 0; i < BENCH_TARGETS; i++) {
+    targets[i].host = htonl(0x0a010000 + i);
+    targets[i].port.a_port = htons(8000 + i);
+    targets[i].port.b_port = htons(80);
+  }
+  forward_init(targets, BENCH_TARGETS, &config);
+
+  // a standby that never reads, the kernel drops what doesn't fit
+  sink.sin_family = AF_INET;
+  sink.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1
+    || bind(fd, (struct sockaddr*)&sink, sizeof(sink)) == -1
+    || getsockname(fd, (struct sockaddr*)&sink, &sinkLength) == -1) {
+    perror("Sync");
+    return;
+  }
+  config.sync_peer = sink.sin_addr.s_addr;
+  config.sync_peer_port = sink.sin_port;
+
+  worker = (struct pf_worker*)calloc(1, sizeof(struct pf_worker));
+  ip_header = (struct iphdr*)buffer;
+  tcp_header = (struct tcphdr*)(buffer + sizeof(struct iphdr));
+
+  // alternate so drift in clock speed hits both the same
+  for (run = 0; run < 10; run++) {
+    memset(&worker->stats, 0, sizeof(worker->stats));
+    conntrack_init(&worker->conntrack, BENCH_SYNC_FLOWS + 1, 0);
+    bench_nat(&worker->conntrack);
+    if (run & 1) {
+      worker->conntrack.sync = sync_open(&config, &worker->stats, 0);
+    }
+
+    start = now();
+    for (i = 0; i < BENCH_SYNC_FLOWS; i++) {
+      target = &targets[i % BENCH_TARGETS];
+      bench_packet(buffer, 64, htonl(0xc0000000 + (i >> 10)), htons(1024 + (i & 1023)),
+        config.ip, target->port.a_port, 1);
+      sum += forward_packet(worker, buffer, 64, &dst_addr);
+      nat_addr = ip_header->saddr;
+      nat_port = tcp_header->source;
+
+      // the target's SYN-ACK to the snat address and port
+      bench_packet(buffer, 64, target->host, target->port.b_port, nat_addr, nat_port, 1);
+      tcp_header->ack = 1;
+      tcp_header->check = 0;
+      tcp_header->check = tcp_csum(ip_header, tcp_header);
+      sum += forward_packet(worker, buffer, 64, &dst_addr);
+
+      bench_packet(buffer, 64, htonl(0xc0000000 + (i >> 10)), htons(1024 + (i & 1023)),
+        config.ip, target->port.a_port, 0);
+      sum += forward_packet(worker, buffer, 64, &dst_addr);
+
+      bench_packet(buffer, 64, htonl(0xc0000000 + (i >> 10)), htons(1024 + (i & 1023)),
+        config.ip, target->port.a_port, 0);
+      tcp_header->rst = 1;
+      tcp_header->check = 0;
+      tcp_header->check = tcp_csum(ip_header, tcp_header);
+      sum += forward_packet(worker, buffer, 64, &dst_addr);
+
+      if (!(i & 255)) {
+        worker_tick(worker);
+      }
+    }
+    ns = (now() - start) / BENCH_SYNC_FLOWS;
+    if (!best[run & 1] || ns < best[run & 1]) {
+      best[run & 1] = ns;
+    }
+
+    if (worker->conntrack.sync) {
+      sync_close(worker->conntrack.sync);
+      worker->conntrack.sync = 0;
+    }
+    conntrack_free(&worker->conntrack);
+  }
+
+  printf("sync: a connection opened and reset through forward_packet, ns per connection\n");
+  printf("%10s %10s %14s %16s\n", "without", "with", "ns per event", "events/datagram");
+  printf("%10.1f %10.1f %14.1f %16.1f\n", best[0], best[1], (best[1] - best[0]) / 4,
+    worker->stats.sync_batches ? (double)worker->stats.sync_events / worker->stats.sync_batches : 0.0);
+
+  bench_sink += sum;
+  close(fd);
+  free(worker);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Main
+
+Prototype:	int main(int argc, char** argv)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+	Command line args, optionally the name of one benchmark to run, and a
+  capture for the replay benchmark
+
+Return Values:
+	0  success
+  -1 unknown benchmark
+
+Description:
+	Runs the benchmarks.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+int main(int argc, char** argv) {
+
+  static const struct {
+    const char* name;
+    void (*run)(void);
+  } benches[] = {
+    {"conntrack", bench_conntrack},
+    {"checksum", bench_checksum},
+    {"expiry", bench_expiry},
+    {"dispatch", bench_dispatch},
+    {"maglev", bench_maglev},
+    {"config", bench_config},
+    {"workers", bench_workers},
+    {"metrics", bench_metrics},
+    {"replay", bench_replay},
+    {"proxy", bench_proxy},
+    {"io", bench_io},
+    {"offload", bench_offload},
+    {"balance", bench_balance},
+    {"latency", bench_latency},
+    {"snapshot", bench_snapshot},
+    {"sync", bench_sync},
+  };
+
+  size_t i;
+  int ran = 0;
+
+  csum_init();
+
+  if (argc > 2) {
+    bench_pcap = argv[2];
+  }
+
+  for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+    if (argc > 1 && strcmp(argv[1], benches[i].name) != 0) {
+      continue;
+    }
+    benches[i].run();
+    printf("\n");
+    ran = 1;
+  }
+
+  if (!ran) {
+    fprintf(stderr, "Unknown benchmark: %s\n", argv[1]);
+    return -1;
+  }
+
+  return bench_failed ? -1 : 0;
+}
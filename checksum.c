@@ -11,33 +11,500 @@ Developer:	Andrew Burian
 Created On:	2015-03-15
 
 Functions:
-  unsigned short tcp_csum(unsigned short *packet)
+  unsigned short tcp_csum(struct iphdr *ip_header, struct tcphdr *tcp_header)
   unsigned short csum(unsigned short *buf, int nwords)
+  unsigned short csum_replace4(unsigned short check, unsigned int from,
+    unsigned int to)
+  unsigned short csum_replace2(unsigned short check, unsigned short from,
+    unsigned short to)
+
+  void csum_init(void)
+  int csum_select(const char* name)
+  const char *csum_kernel(void)
+  unsigned int csum_partial(const void *buf, int len, unsigned int sum)
+  unsigned short csum_fold(unsigned int sum)
 
 Description:
   Contains all checksum functions used in the application.
 
 Revisions:
-	(none)
+  Andrew Burian
+  2026-10-18
+  Added the incremental checksum updates
+
+  Andrew Burian
+  2026-10-18
+  Added vectorized summing kernels picked at startup by cpu features
 
 ---------------------------------------------------------------------------- */
 
 #include "portforward.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#define CSUM_X86
+#include <immintrin.h>
+#endif
+
+// the summing kernel picked by csum_init
+static unsigned int csum_partial_word(const void *buf, int len, unsigned int sum);
+static unsigned int (*csum_partial_impl)(const void*, int, unsigned int) = csum_partial_word;
+static const char *csum_impl_name = "word";
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Checksum Partial Word
+
+Prototype:  static unsigned int csum_partial_word(const void *buf, int len,
+              unsigned int sum)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  const void *buf
+    the start of the data to sum
+  int len
+    the number of bytes to sum
+  unsigned int sum
+    the sum so far
+
+Return Values:
+  The ones' complement sum of the data added to sum, folded to 32b
+
+Description:
+  The original csum loop, one 16b word per iteration. Kept as the reference
+  the other kernels are checked against.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static unsigned int csum_partial_word(const void *buf, int len, unsigned int sum){
+
+  const unsigned short *word = (const unsigned short*)buf;
+  unsigned long long total = sum;
+
+  for(; len > 1; len -= 2)  {
+    total += *word++;
+  }
+
+  // add the left-over byte
+  if(len > 0)
+    total += *(const unsigned char *)word;
+
+  while (total >> 32) {
+    total = (total & 0xffffffff) + (total >> 32);
+  }
+
+  return (unsigned int)total;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Checksum Partial Scalar
+
+Prototype:  static unsigned int csum_partial_scalar(const void *buf, int len,
+              unsigned int sum)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  as csum_partial_word
+
+Return Values:
+  The ones' complement sum of the data added to sum, folded to 32b
+
+Description:
+  Portable kernel. Adds 32b words into a 64b accumulator, four at a time, so
+  carries only need folding once at the end. Since 2^16 = 1 in ones'
+  complement arithmetic, summing 32b words gives the same 16b result as
+  summing 16b words. Also finishes off the tail for the vector kernels.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static unsigned int csum_partial_scalar(const void *buf, int len, unsigned int sum){
+
+  const unsigned char *data = (const unsigned char*)buf;
+  unsigned long long total = sum;
+  unsigned int w0, w1, w2, w3;
+
+  for(; len >= 16; len -= 16, data += 16){
+    memcpy(&w0, data, 4);
+    memcpy(&w1, data + 4, 4);
+    memcpy(&w2, data + 8, 4);
+    memcpy(&w3, data + 12, 4);
+    total += (unsigned long long)w0 + w1 + w2 + w3;
+  }
+
+  for(; len >= 4; len -= 4, data += 4){
+    memcpy(&w0, data, 4);
+    total += w0;
+  }
+
+  // the last 1-3 bytes, zero padded as the word loop would see them
+  if(len > 0){
+    w0 = 0;
+    memcpy(&w0, data, len);
+    total += w0;
+  }
+
+  while (total >> 32) {
+    total = (total & 0xffffffff) + (total >> 32);
+  }
+
+  return (unsigned int)total;
+}
+
+#ifdef CSUM_X86
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Checksum Partial SSE2
+
+Prototype:  static unsigned int csum_partial_sse2(const void *buf, int len,
+              unsigned int sum)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  as csum_partial_word
+
+Return Values:
+  The ones' complement sum of the data added to sum, folded to 32b
+
+Description:
+  Widens each 16B block of 32b words to 64b lanes and adds them into two
+  vector accumulators. The tail is finished by the scalar kernel.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+__attribute__((target("sse2")))
+static unsigned int csum_partial_sse2(const void *buf, int len, unsigned int sum){
+
+  const unsigned char *data = (const unsigned char*)buf;
+  __m128i zero = _mm_setzero_si128();
+  __m128i acc0 = _mm_setzero_si128();
+  __m128i acc1 = _mm_setzero_si128();
+  __m128i block;
+  unsigned long long lanes[2];
+  unsigned long long total;
+
+  for(; len >= 16; len -= 16, data += 16){
+    block = _mm_loadu_si128((const __m128i*)data);
+    acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(block, zero));
+    acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(block, zero));
+  }
+
+  _mm_storeu_si128((__m128i*)lanes, _mm_add_epi64(acc0, acc1));
+  total = (lanes[0] & 0xffffffff) + (lanes[0] >> 32)
+    + (lanes[1] & 0xffffffff) + (lanes[1] >> 32) + sum;
+
+  while (total >> 32) {
+    total = (total & 0xffffffff) + (total >> 32);
+  }
+
+  return csum_partial_scalar(data, len, (unsigned int)total);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Checksum Partial AVX2
+
+Prototype:  static unsigned int csum_partial_avx2(const void *buf, int len,
+              unsigned int sum)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  as csum_partial_word
+
+Return Values:
+  The ones' complement sum of the data added to sum, folded to 32b
+
+Description:
+  The SSE2 kernel with 32B blocks, two blocks per iteration. Stays in avx
+  code down to the last 16B so there are no avx/sse transitions per call.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+__attribute__((target("avx2")))
+static unsigned int csum_partial_avx2(const void *buf, int len, unsigned int sum){
+
+  const unsigned char *data = (const unsigned char*)buf;
+  __m256i acc0 = _mm256_setzero_si256();
+  __m256i acc1 = _mm256_setzero_si256();
+  __m256i block0, block1;
+  __m128i half;
+  unsigned long long lanes[2];
+  unsigned long long total;
+
+  for(; len >= 64; len -= 64, data += 64){
+    block0 = _mm256_loadu_si256((const __m256i*)data);
+    block1 = _mm256_loadu_si256((const __m256i*)(data + 32));
+    acc0 = _mm256_add_epi64(acc0, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(block0)));
+    acc1 = _mm256_add_epi64(acc1, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(block0, 1)));
+    acc0 = _mm256_add_epi64(acc0, _mm256_cvtepu32_epi64(_mm256_castsi256_si128(block1)));
+    acc1 = _mm256_add_epi64(acc1, _mm256_cvtepu32_epi64(_mm256_extracti128_si256(block1, 1)));
+  }
+
+  // remaining 16B blocks
+  for(; len >= 16; len -= 16, data += 16){
+    half = _mm_loadu_si128((const __m128i*)data);
+    acc0 = _mm256_add_epi64(acc0, _mm256_cvtepu32_epi64(half));
+  }
+
+  acc0 = _mm256_add_epi64(acc0, acc1);
+  half = _mm_add_epi64(_mm256_castsi256_si128(acc0), _mm256_extracti128_si256(acc0, 1));
+  _mm_storeu_si128((__m128i*)lanes, half);
+  total = (lanes[0] & 0xffffffff) + (lanes[0] >> 32)
+    + (lanes[1] & 0xffffffff) + (lanes[1] >> 32) + sum;
+
+  while (total >> 32) {
+    total = (total & 0xffffffff) + (total >> 32);
+  }
+
+  // avoid the penalty for mixing avx with legacy sse code in the tail
+  _mm256_zeroupper();
+
+  return csum_partial_scalar(data, len, (unsigned int)total);
+}
+
+#endif
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Checksum Select
+
+Prototype:  int csum_select(const char* name)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  const char* name
+    the kernel to use: "word", "scalar", "sse2" or "avx2"
+
+Return Values:
+  0  success
+  -1 unknown kernel, or not supported by this cpu
+
+Description:
+  Switches the summing kernel used by csum_partial.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+int csum_select(const char* name){
+
+  if(!strcmp(name, "word")){
+    csum_partial_impl = csum_partial_word;
+  }
+  else if(!strcmp(name, "scalar")){
+    csum_partial_impl = csum_partial_scalar;
+  }
+#ifdef CSUM_X86
+  else if(!strcmp(name, "sse2") && __builtin_cpu_supports("sse2")){
+    csum_partial_impl = csum_partial_sse2;
+  }
+  else if(!strcmp(name, "avx2") && __builtin_cpu_supports("avx2")){
+    csum_partial_impl = csum_partial_avx2;
+  }
+#endif
+  else{
+    return -1;
+  }
+
+  csum_impl_name = name;
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Checksum Init
+
+Prototype:  void csum_init(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  void
+
+Description:
+  Picks the fastest kernel this cpu supports, then checks it against the word
+  kernel over random buffers of every length up to 256B at every alignment.
+  If they ever disagree the portable kernel is used instead.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+void csum_init(void){
+
+  static const char *kernels[] = {"avx2", "sse2", "scalar"};
+  unsigned char data[256 + 8];
+  unsigned int seed = 1;
+  size_t i;
+  int len, offset;
+
+  for(i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++){
+    if(csum_select(kernels[i]) == 0){
+      break;
+    }
+  }
+
+  for(i = 0; i < sizeof(data); i++){
+    seed = seed * 1103515245 + 12345;
+    data[i] = seed >> 16;
+  }
+
+  for(len = 0; len <= 256; len++){
+    for(offset = 0; offset < 8; offset++){
+      if(csum_fold(csum_partial_impl(data + offset, len, 0))
+        != csum_fold(csum_partial_word(data + offset, len, 0))){
+        fprintf(stderr, "Checksum kernel %s failed self test, using scalar\n", csum_impl_name);
+        csum_select("scalar");
+        return;
+      }
+    }
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Checksum Kernel
+
+Prototype:  const char *csum_kernel(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  The name of the kernel in use
+
+Description:
+  For reporting which kernel csum_init picked.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+const char *csum_kernel(void){
+
+  return csum_impl_name;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Checksum Partial
+
+Prototype:  unsigned int csum_partial(const void *buf, int len, unsigned int sum)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  const void *buf
+    the start of the data to sum
+  int len
+    the number of bytes to sum
+  unsigned int sum
+    the sum of any data before this block, 0 to start
+
+Return Values:
+  The running ones' complement sum, to be finished with csum_fold
+
+Description:
+  Adds a block to a running checksum using the selected kernel. Blocks can be
+  chained so headers can be summed where they are, as long as every block
+  but the last is an even number of bytes long.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+unsigned int csum_partial(const void *buf, int len, unsigned int sum){
+
+  return csum_partial_impl(buf, len, sum);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Checksum Fold
+
+Prototype:  unsigned short csum_fold(unsigned int sum)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  unsigned int sum
+    a running sum from csum_partial
+
+Return Values:
+  The finished checksum
+
+Description:
+  Folds the carries back into 16b and complements the result.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+unsigned short csum_fold(unsigned int sum){
+
+  // turn the 32 bit words to 16 bit.
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+
+  return (unsigned short)~sum;
+}
+
 /* ----------------------------------------------------------------------------
 FUNCTION
 
 Name:		TCP Checksum
 
-Prototype:  unsigned short tcp_csum(unsigned short *packet)
+Prototype:  unsigned short tcp_csum(struct iphdr *ip_header, struct tcphdr *tcp_header)
 
 Developer:	Andrew Burian
 
 Created On:	2015-03-15
 
 Parameters:
-  unsigned short *packet
-    the start of the tcp packet to checksum
+  struct iphdr *ip_header
+    the ip header of the packet
+  struct tcphdr *tcp_header
+    the start of the tcp segment to checksum, with the check field zeroed
 
 Return Values:
   The checksum of the data block
@@ -52,43 +519,34 @@ Revisions:
   Fixed the algorithm. The TCP header wasn't being copied fully because it
   was in network byte order. also it now takes into account tcp header options.
 
+  Andrew Burian
+  2026-10-18
+  Sums the pseudo header and the segment in place instead of copying them
+  into a malloc'd buffer.
+
 ---------------------------------------------------------------------------- */
 unsigned short tcp_csum(struct iphdr *ip_header, struct tcphdr *tcp_header){
 
   unsigned short total_len = ntohs(ip_header->tot_len);
-  unsigned short checksum;
+  unsigned int sum;
 
-  // tcp lengths
-  int tcpopt_len = (tcp_header->doff * 4) - 20;
-  int tcpdatalen = total_len - (tcp_header->doff*4) - (ip_header->ihl*4);
+  // tcp length, header and options included
+  int tcp_len = total_len - (ip_header->ihl*4);
 
   // pseudo header
   struct pseudoTcpHeader pseudohead;
-  int totaltcp_len = sizeof(struct pseudoTcpHeader) + sizeof(struct tcphdr) + tcpopt_len + tcpdatalen;
-  unsigned short *psuedoheader_tcpsegment = (unsigned short*)malloc(totaltcp_len);
-
 
   pseudohead.ip_src = ip_header->saddr;
   pseudohead.ip_dst = ip_header->daddr;
   pseudohead.zero = 0;
   pseudohead.protocol = IPPROTO_TCP;
-  pseudohead.tcp_len = htons(sizeof(struct tcphdr) + tcpopt_len + tcpdatalen);
-
-
-  // put the pseudo header into memory
-  memcpy((unsigned char*)psuedoheader_tcpsegment, &pseudohead, sizeof(struct pseudoTcpHeader));
-  // put the tcp header into memory
-  memcpy((unsigned char*)psuedoheader_tcpsegment + sizeof(struct pseudoTcpHeader), (unsigned char*)tcp_header, sizeof(struct tcphdr));
-  // put the tcp options into memory
-  memcpy((unsigned char*)psuedoheader_tcpsegment + sizeof(struct pseudoTcpHeader) + sizeof(struct tcphdr), (unsigned char*)ip_header + (ip_header->ihl * 4) + sizeof(struct tcphdr), tcpopt_len);
-  // put the tcp data into memory
-  memcpy((unsigned char*)psuedoheader_tcpsegment + sizeof(struct pseudoTcpHeader) + sizeof(struct tcphdr) + tcpopt_len, (unsigned char*)tcp_header + (tcp_header->doff * 4), tcpdatalen);
+  pseudohead.tcp_len = htons(tcp_len);
 
-  checksum = csum(psuedoheader_tcpsegment, totaltcp_len);
+  // sum the pseudo header, then the segment where it sits
+  sum = csum_partial(&pseudohead, sizeof(struct pseudoTcpHeader), 0);
+  sum = csum_partial(tcp_header, tcp_len, sum);
 
-  free(psuedoheader_tcpsegment);
-
-  return checksum;
+  return csum_fold(sum);
 }
 
 /* ----------------------------------------------------------------------------
@@ -120,21 +578,103 @@ Revisions:
   Jordan Marling
   Changed from words to bytes
 
+  Andrew Burian
+  2026-10-18
+  The summing is done by csum_partial, with the fastest kernel for this cpu.
+  The original loop is kept as the "word" kernel.
+
 ---------------------------------------------------------------------------- */
 unsigned short csum(unsigned short *buf, int nwords){
 
-  unsigned long sum;
+  return csum_fold(csum_partial(buf, nwords, 0));
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Checksum Replace 4
+
+Prototype:  unsigned short csum_replace4(unsigned short check, unsigned int from,
+              unsigned int to)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  unsigned short check
+    the current checksum field
+  unsigned int from
+    the old value of the 32b field that changed, as it sits in the packet
+  unsigned int to
+    the new value of the field, as it will sit in the packet
+
+Return Values:
+  The updated checksum field
 
+Description:
+  Incrementally updates a checksum for one changed 32b field, per RFC 1624
+  eqn. 3: HC' = ~(~HC + ~m + m'). The result is the same as recomputing the
+  checksum over the whole block.
 
-  for(sum = 0; nwords > 1; nwords -= 2)  {
-    sum += *buf++;
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+unsigned short csum_replace4(unsigned short check, unsigned int from, unsigned int to){
+
+  unsigned long sum = (unsigned short)~check;
+
+  // both 16b halves of the field
+  sum += (unsigned short)~from;
+  sum += (unsigned short)~(from >> 16);
+  sum += (unsigned short)to;
+  sum += (unsigned short)(to >> 16);
+
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
   }
 
-  // add the left-over byte
-  if(nwords > 0)
-    sum += *(unsigned char *)buf;
+  return (unsigned short)~sum;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Checksum Replace 2
+
+Prototype:  unsigned short csum_replace2(unsigned short check, unsigned short from,
+              unsigned short to)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  unsigned short check
+    the current checksum field
+  unsigned short from
+    the old value of the 16b field that changed, as it sits in the packet
+  unsigned short to
+    the new value of the field, as it will sit in the packet
+
+Return Values:
+  The updated checksum field
+
+Description:
+  Same as csum_replace4 for a single 16b field (a port).
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+unsigned short csum_replace2(unsigned short check, unsigned short from, unsigned short to){
+
+  unsigned long sum = (unsigned short)~check;
+
+  sum += (unsigned short)~from;
+  sum += to;
 
-  // turn the 32 bit words to 16 bit.
   while (sum >> 16) {
     sum = (sum & 0xffff) + (sum >> 16);
   }
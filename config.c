@@ -0,0 +1,342 @@
+/* ----------------------------------------------------------------------------
+SOURCE FILE
+
+Name:		config.c
+
+Program:	Port Forwarder
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Functions:
+  int config_forwards(struct confread_file* confFile, struct pf_target** targets,
+    size_t* targetCount, struct pf_target** offloads, size_t* offloadCount)
+
+Description:
+  Reads the forward sections of the config, at startup and again whenever
+  the forwarder is told to reload it.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Sections can forward ranges and lists of ports
+
+---------------------------------------------------------------------------- */
+
+#include "portforward.h"
+
+// targets the arrays start with, doubled whenever they fill
+#define CONFIG_MIN_TARGETS 64
+
+static long config_ports(char* value, unsigned short* ports);
+static int config_reserve(struct pf_target** array, size_t* capacity, size_t needed);
+
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Config Forwards
+
+Prototype:  int config_forwards(struct confread_file* confFile,
+              struct pf_target** targets, size_t* targetCount,
+              struct pf_target** offloads, size_t* offloadCount)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct confread_file* confFile
+    the open config
+  struct pf_target** targets
+  size_t* targetCount
+    set to a new array of the forwards done by the forwarder, a target for
+    each host of each port of each section
+  struct pf_target** offloads
+  size_t* offloadCount
+    set to a new array of the forwards offloaded to the kernel, one for
+    each port
+
+Return Values:
+  0  success
+  -1 out of memory
+
+Description:
+  Moved out of main so a reload reads the sections the same way. Malformed
+  sections are ignored with a warning.
+
+  port and toport are lists of ports and lo-hi ranges. The ports of port
+  are forwarded in order to those of toport, or all to toport if it is a
+  single port, so a range of ten thousand ports is one section. The arrays
+  grow by doubling, so loading is linear in the number of forwards.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Port ranges and lists, and the arrays grow by doubling instead of a
+  realloc for every host and every malformed section
+
+  Andrew Burian
+  2026-10-18
+  Parses a weight with strtoul, rejecting an empty one or one with
+  trailing characters
+
+---------------------------------------------------------------------------- */
+int config_forwards(struct confread_file* confFile, struct pf_target** targets,
+  size_t* targetCount, struct pf_target** offloads, size_t* offloadCount){
+
+  struct confread_section* sec = 0;
+
+  // the ports of a section and where they go, in network order
+  unsigned short* aPorts = 0;
+  unsigned short* bPorts = 0;
+  long aCount = 0;
+  long bCount = 0;
+
+  // the hosts of a forward section and their weights
+  struct pf_target* hosts = 0;
+  size_t hostSlots = 0;
+  size_t backends = 0;
+  unsigned long weight = 0;
+  char* star = 0;
+  char* end = 0;
+
+  size_t targetSlots = 0;
+  size_t offloadSlots = 0;
+
+  // counter
+  size_t i = 0;
+  long p = 0;
+  int j = 0;
+
+  char* value = 0;
+  char* token = 0;
+  char* save = 0;
+
+  *targets = 0;
+  *targetCount = 0;
+  *offloads = 0;
+  *offloadCount = 0;
+
+  aPorts = (unsigned short*)malloc(sizeof(unsigned short) * 65536);
+  bPorts = (unsigned short*)malloc(sizeof(unsigned short) * 65536);
+  if(!aPorts || !bPorts || config_reserve(targets, &targetSlots, confFile->count) == -1){
+    free(aPorts);
+    free(bPorts);
+    return -1;
+  }
+
+  // setup the targets
+  for(j = 1; j < confFile->count; ++j){ // to skip root
+    sec = confFile->sections[j];
+
+    // check to see all sections are there
+    if(!confread_find_value(sec, "port") || !confread_find_value(sec, "toport")
+      || !confread_find_value(sec, "tohost")){
+
+      // error
+      fprintf(stderr, "Forward section %s malformed: missing field.\nIgnored.\n", sec->name);
+      continue;
+    }
+
+    // check to see we can scan the ports, toport is one port or one for each port
+    value = strdup(confread_find_value(sec, "port"));
+    aCount = value ? config_ports(value, aPorts) : -1;
+    free(value);
+    value = strdup(confread_find_value(sec, "toport"));
+    bCount = value ? config_ports(value, bPorts) : -1;
+    free(value);
+    if(aCount < 1 || bCount < 1){
+
+      // error
+      fprintf(stderr, "Forward section %s malformed: port NaN\nIgnored\n", sec->name);
+      continue;
+    }
+    if(bCount != 1 && bCount != aCount){
+
+      // error
+      fprintf(stderr, "Forward section %s malformed: %ld ports to %ld toports\nIgnored\n",
+        sec->name, aCount, bCount);
+      continue;
+    }
+
+    // the hosts, a list of addresses each with an optional *weight
+    value = strdup(confread_find_value(sec, "tohost"));
+    backends = 0;
+    for(token = value ? strtok_r(value, ", ", &save) : 0; token; token = strtok_r(0, ", ", &save)){
+      weight = 1;
+      if((star = strchr(token, '*'))){
+        *star = 0;
+        weight = strtoul(star + 1, &end, 10);
+        if(end == star + 1 || *end || weight < 1 || weight > MAGLEV_MAX_WEIGHT){
+          break;
+        }
+      }
+      if(config_reserve(&hosts, &hostSlots, backends + 1) == -1){
+        break;
+      }
+      memset(&hosts[backends], 0, sizeof(struct pf_target));
+      if((hosts[backends].host = inet_addr(token)) == INADDR_NONE){
+        break;
+      }
+      hosts[backends].weight = (unsigned short int)weight;
+      ++backends;
+    }
+    free(value);
+
+    if(token || !backends){
+      // error
+      fprintf(stderr, "Forward section %s malformed: invalid host.\nIgnored.\n", sec->name);
+      continue;
+    }
+
+    // forwards the kernel's nat takes, left out of the userspace engine
+    if((value = confread_find_value(sec, "offload")) && strcmp(value, "none")){
+      if(strcmp(value, "kernel")){
+        fprintf(stderr, "Forward section %s malformed: unknown offload %s.\nIgnored.\n",
+          sec->name, value);
+        continue;
+      }
+      if(backends > 1){
+        fprintf(stderr, "Forward section %s offloaded to its first host only\n", sec->name);
+      }
+      if(config_reserve(offloads, &offloadSlots, *offloadCount + aCount) == -1){
+        break;
+      }
+      for(p = 0; p < aCount; ++p){
+        (*offloads)[*offloadCount] = hosts[0];
+        (*offloads)[*offloadCount].port.a_port = aPorts[p];
+        (*offloads)[*offloadCount].port.b_port = bPorts[bCount == 1 ? 0 : p];
+        ++*offloadCount;
+      }
+      continue;
+    }
+
+    // a target for each host of each port, the hosts of a port together
+    if(config_reserve(targets, &targetSlots, *targetCount + aCount * backends) == -1){
+      break;
+    }
+    for(p = 0; p < aCount; ++p){
+      for(i = 0; i < backends; ++i){
+        (*targets)[*targetCount] = hosts[i];
+        (*targets)[*targetCount].port.a_port = aPorts[p];
+        (*targets)[*targetCount].port.b_port = bPorts[bCount == 1 ? 0 : p];
+        ++*targetCount;
+      }
+    }
+  }
+
+  free(aPorts);
+  free(bPorts);
+  free(hosts);
+
+  return j < confFile->count ? -1 : 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Config Ports
+
+Prototype:  static long config_ports(char* value, unsigned short* ports)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  char* value
+    a comma separated list of ports and lo-hi ranges, cut up by strtok_r
+  unsigned short* ports
+    room for 65536 ports, set to the ports in order (network order)
+
+Return Values:
+  the number of ports
+  -1 malformed, or more than 65536 ports
+
+Description:
+  Reads a port or toport value, e.g. 8080, or 30000-39999, or
+  80, 443, 8000-8100.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static long config_ports(char* value, unsigned short* ports){
+
+  char* token = 0;
+  char* save = 0;
+  char* end = 0;
+  unsigned long lo = 0;
+  unsigned long hi = 0;
+  long count = 0;
+
+  for(token = strtok_r(value, ", ", &save); token; token = strtok_r(0, ", ", &save)){
+    lo = strtoul(token, &end, 10);
+    hi = lo;
+    if(*end == '-'){
+      hi = strtoul(end + 1, &end, 10);
+    }
+    if(end == token || *end || lo > hi || hi > 65535 || count + (long)(hi - lo) >= 65536){
+      return -1;
+    }
+    for(; lo <= hi; ++lo){
+      ports[count++] = htons((unsigned short)lo);
+    }
+  }
+
+  return count;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Config Reserve
+
+Prototype:  static int config_reserve(struct pf_target** array, size_t* capacity,
+              size_t needed)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_target** array
+    the array, or a null pointer
+  size_t* capacity
+    the targets it has room for
+  size_t needed
+    the targets it must have room for
+
+Return Values:
+  0  success
+  -1 out of memory, the array is left as it was
+
+Description:
+  Grows an array of targets by doubling, so filling it one target at a
+  time costs a few reallocs instead of one per target.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int config_reserve(struct pf_target** array, size_t* capacity, size_t needed){
+
+  struct pf_target* grown = 0;
+  size_t size = *capacity ? *capacity : CONFIG_MIN_TARGETS;
+
+  if(needed <= *capacity){
+    return 0;
+  }
+  while(size < needed){
+    size <<= 1;
+  }
+  if(!(grown = (struct pf_target*)realloc(*array, sizeof(struct pf_target) * size))){
+    return -1;
+  }
+  *array = grown;
+  *capacity = size;
+
+  return 0;
+}
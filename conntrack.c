@@ -0,0 +1,1372 @@
+/* ----------------------------------------------------------------------------
+SOURCE FILE
+
+Name:		conntrack.c
+
+Program:	Port Forwarder
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Functions:
+  int conntrack_init(struct pf_conntrack* ct, size_t max_flows, int flags)
+  void conntrack_free(struct pf_conntrack* ct)
+  int conntrack_nat(struct pf_conntrack* ct, unsigned int* addrs,
+    int addrCount, int workers, int worker)
+  struct pf_host *add_host(struct pf_conntrack* ct, unsigned int host,
+    unsigned int port, struct pf_target* target)
+  void remove_host(struct pf_conntrack* ct, struct pf_host* host)
+  struct pf_host *find_host(struct pf_conntrack* ct, unsigned int host,
+    unsigned int port, unsigned int to_port)
+  struct pf_host *find_host_by_target(struct pf_conntrack* ct,
+    unsigned int target_host, unsigned int target_port, unsigned int addr,
+    unsigned int port)
+  unsigned long conntrack_update(struct pf_conntrack* ct, struct pf_host* host,
+    struct tcphdr* tcp_header, int from_client)
+  size_t conntrack_expire(struct pf_conntrack* ct)
+  size_t conntrack_advance(struct pf_conntrack* ct, unsigned long now,
+    size_t budget)
+  size_t conntrack_restore(struct pf_conntrack* ct, struct pf_host* hosts,
+    size_t count)
+
+Description:
+  The connection table. Every forwarded connection is kept in two hash
+  indexes at once: one keyed on the client's address and port and the port
+  it connected to (for packets heading to a target) and one keyed on the
+  target's address and port plus the snat address and port the connection
+  was given (for packets coming back from a target), so each is keyed on
+  the whole of its side's 4-tuple. Both lookups, inserts and removals are
+  O(1) expected. Entries come from a pool of fixed size allocated up front;
+  once it is used up new connections are refused.
+
+  The target side of a connection is translated to an address of the snat
+  pool and a port of it no other connection on that address is using, so
+  clients that happen to pick the same port never collide, and the pool
+  holds about 64k connections per address. Each address keeps a ring of its
+  free ports, taken from the front and given back at the back, so picking
+  one is O(1) and a port sits out as long as possible before it is reused.
+  A worker's rings only hold the ports the steering programs send to it.
+
+  Each connection follows the tcp state of its packets and idles out after a
+  timeout that depends on the state. Idle timers live in a hierarchical timer
+  wheel: slots further out cover more ticks, and their entries are moved to
+  nearer slots when they come round. Seeing a packet only moves the entry's
+  deadline, the entry is placed again only when its slot comes round, so the
+  forwarding path never touches the wheel. Expiry does a bounded amount of
+  work per call, so a large batch of flows going idle at once is spread over
+  several calls instead of stalling the forwarding loop.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Tcp state tracking and idle expiry
+
+  Andrew Burian
+  2026-10-18
+  Entries come from a fixed pool
+
+  Andrew Burian
+  2026-10-18
+  Established connections are handed to the xdp fast path
+
+  Andrew Burian
+  2026-10-18
+  Handshakes are timed and open connections counted for each target
+
+  Andrew Burian
+  2026-10-18
+  Handshake round trips are handed back for the metrics
+
+  Andrew Burian
+  2026-10-18
+  Connections are translated to a port of the snat pool on the target
+  side, and indexed on both sides' full tuples
+
+  Andrew Burian
+  2026-10-18
+  Connections can be put back as a snapshot left them
+
+  Andrew Burian
+  2026-10-18
+  Every new, changed and removed connection is sent to a standby
+
+---------------------------------------------------------------------------- */
+
+#include "portforward.h"
+
+#include <sys/mman.h>
+
+// smallest bucket count the table will use
+#define CONNTRACK_MIN_BUCKETS 64
+
+// seconds to idle in each tcp state, established is set by idle_timeout
+static const unsigned long ct_timeouts[CT_STATES] = {
+  30,     // CT_SYN_SENT
+  30,     // CT_SYN_RECV
+  7200,   // CT_ESTABLISHED
+  120,    // CT_FIN_WAIT
+  120,    // CT_TIME_WAIT
+  10,     // CT_CLOSE
+};
+
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Flow Hash
+
+Prototype:  static size_t flow_hash(unsigned int seed, unsigned int host,
+              unsigned int addr, unsigned int port_a, unsigned int port_b)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  unsigned int seed
+    the per-table random seed
+  unsigned int host
+    the remote address of the key
+  unsigned int addr
+    our address of the key, 0 where it's always the forwarder's
+  unsigned int port_a, port_b
+    the ports of the key
+
+Return Values:
+  The hash of the key
+
+Description:
+  Multiplicative hash of the key. The seed is picked at startup so that remote
+  hosts can't choose ports that all land in the same bucket.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Takes our address too, for keys on the snat side
+
+---------------------------------------------------------------------------- */
+static size_t flow_hash(unsigned int seed, unsigned int host,
+  unsigned int addr, unsigned int port_a, unsigned int port_b) {
+
+  unsigned long long h;
+
+  h = ((unsigned long long)(host ^ seed) << 32) | (port_a << 16) | port_b;
+  h ^= (unsigned long long)addr * 0xD6E8FEB86659FD93ULL;
+  h *= 0x9E3779B97F4A7C15ULL;
+  h ^= h >> 29;
+  h *= 0xBF58476D1CE4E5B9ULL;
+
+  return (size_t)(h >> 32);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Client Bucket / Target Bucket
+
+Prototype:  static struct pf_host **client_bucket(struct pf_conntrack* ct,
+              unsigned int host, unsigned int port, unsigned int to_port)
+            static struct pf_host **target_bucket(struct pf_conntrack* ct,
+              unsigned int target_host, unsigned int target_port,
+              unsigned int addr, unsigned int port)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  The head of the chain the key lives in
+
+Description:
+  Picks the chain of each index that a key belongs to.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static struct pf_host **client_bucket(struct pf_conntrack* ct,
+  unsigned int host, unsigned int port, unsigned int to_port) {
+
+  return &ct->client_buckets[flow_hash(ct->seed, host, 0, port, to_port) & ct->mask];
+}
+
+static struct pf_host **target_bucket(struct pf_conntrack* ct,
+  unsigned int target_host, unsigned int target_port, unsigned int addr, unsigned int port) {
+
+  return &ct->target_buckets[flow_hash(ct->seed, target_host, addr, target_port, port) & ct->mask];
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Link Host
+
+Prototype:  static void link_host(struct pf_conntrack* ct, struct pf_host* host)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_conntrack* ct
+    the table
+  struct pf_host* host
+    the entry to add to both indexes
+
+Return Values:
+  void
+
+Description:
+  Pushes the entry onto the front of its chain in both indexes.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void link_host(struct pf_conntrack* ct, struct pf_host* host) {
+
+  struct pf_host** bucket;
+
+  bucket = client_bucket(ct, host->host, host->port, host->target->port.a_port);
+  host->client_next = *bucket;
+  *bucket = host;
+
+  bucket = target_bucket(ct, host->target->host, host->target->port.b_port,
+    ct->nat[host->nat_addr].addr, host->nat_port);
+  host->target_next = *bucket;
+  *bucket = host;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Timer Link / Timer Unlink
+
+Prototype:  static void timer_link(struct pf_host** head, struct pf_host* host)
+            static void timer_unlink(struct pf_host* host)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_host** head
+    the wheel slot or due list to add to
+  struct pf_host* host
+    the entry
+
+Return Values:
+  void
+
+Description:
+  Adds an entry to, or takes it off, whichever timer list it is on.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void timer_link(struct pf_host** head, struct pf_host* host) {
+
+  host->timer_next = *head;
+  host->timer_pprev = head;
+  if (*head) {
+    (*head)->timer_pprev = &host->timer_next;
+  }
+  *head = host;
+}
+
+static void timer_unlink(struct pf_host* host) {
+
+  if (!host->timer_pprev) {
+    return;
+  }
+
+  *host->timer_pprev = host->timer_next;
+  if (host->timer_next) {
+    host->timer_next->timer_pprev = host->timer_pprev;
+  }
+  host->timer_next = 0;
+  host->timer_pprev = 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Timer Arm
+
+Prototype:  static void timer_arm(struct pf_conntrack* ct, struct pf_host* host)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_conntrack* ct
+    the table
+  struct pf_host* host
+    the entry, off every timer list, with its deadline set
+
+Return Values:
+  void
+
+Description:
+  Puts an entry in the slot that comes round at or before its deadline: on
+  the first level if it is due within 64 ticks, the second within 64*64, and
+  so on. Deadlines past the last level are placed as far out as it reaches.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void timer_arm(struct pf_conntrack* ct, struct pf_host* host) {
+
+  unsigned long when = host->expires;
+  unsigned long delta;
+  int level;
+
+  if (when <= ct->tick) {
+    timer_link(&ct->due, host);
+    return;
+  }
+
+  delta = when - ct->tick;
+  for (level = 0; level < CT_WHEEL_LEVELS - 1; level++) {
+    if (delta < 1UL << ((level + 1) * CT_WHEEL_BITS)) {
+      break;
+    }
+  }
+  if (delta >= 1UL << (CT_WHEEL_LEVELS * CT_WHEEL_BITS)) {
+    when = ct->tick + (1UL << (CT_WHEEL_LEVELS * CT_WHEEL_BITS)) - 1;
+  }
+
+  timer_link(&ct->wheel[level][(when >> (level * CT_WHEEL_BITS)) & (CT_WHEEL_SLOTS - 1)], host);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Conntrack Clock
+
+Prototype:  static unsigned long conntrack_clock(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  The monotonic time in ticks
+
+Description:
+  The coarse clock is enough for 100ms ticks and is much cheaper to read.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static unsigned long conntrack_clock(void) {
+
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec * (1000 / CT_TICK_MS) + now.tv_nsec / (CT_TICK_MS * 1000000L);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Conntrack Init
+
+Prototype:  int conntrack_init(struct pf_conntrack* ct, size_t max_flows, int flags)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_conntrack* ct
+    the table to set up
+  size_t max_flows
+    the most connections the table will hold, 0 for CT_DEFAULT_FLOWS
+  int flags
+    CT_HUGEPAGES to back the table with huge pages, CT_MLOCK to lock it in
+    memory
+
+Return Values:
+  0  success
+  -1 out of memory
+
+Description:
+  Allocates everything the table will ever use in one mapping: both bucket
+  arrays, with at least as many buckets as flows, and a pool of entries.
+  Every page is touched now, so a connection storm never waits on the
+  allocator or on page faults. Huge pages and locking are best effort, a
+  warning is printed if they can't be had.
+
+  The hash seed is picked and the idle timers started with the default
+  timeouts. No connection can be added until conntrack_nat has given the
+  table its snat addresses.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Starts the idle timers
+
+  Andrew Burian
+  2026-10-18
+  Entries come from a fixed pool allocated here, the table no longer grows
+
+---------------------------------------------------------------------------- */
+int conntrack_init(struct pf_conntrack* ct, size_t max_flows, int flags) {
+
+  size_t count = CONNTRACK_MIN_BUCKETS;
+  size_t buckets_bytes;
+  size_t huge_bytes;
+  struct timespec now;
+  char* memory = MAP_FAILED;
+  size_t i;
+
+  if (max_flows == 0) {
+    max_flows = CT_DEFAULT_FLOWS;
+  }
+  while (count < max_flows) {
+    count <<= 1;
+  }
+
+  buckets_bytes = count * sizeof(struct pf_host*);
+  ct->bytes = buckets_bytes * 2 + max_flows * sizeof(struct pf_host);
+  ct->hugepages = 0;
+  ct->locked = 0;
+
+  if (flags & CT_HUGEPAGES) {
+    huge_bytes = (ct->bytes + CT_HUGEPAGE_SIZE - 1) & ~(size_t)(CT_HUGEPAGE_SIZE - 1);
+    memory = mmap(0, huge_bytes, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    if (memory == MAP_FAILED) {
+      fprintf(stderr, "No huge pages for the connection table, using normal pages\n");
+    }
+    else {
+      ct->bytes = huge_bytes;
+      ct->hugepages = 1;
+    }
+  }
+  if (memory == MAP_FAILED) {
+    memory = mmap(0, ct->bytes, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (memory == MAP_FAILED) {
+      return -1;
+    }
+  }
+
+  if (flags & CT_MLOCK) {
+    if (mlock(memory, ct->bytes) == -1) {
+      perror("Lock Connection Table");
+    }
+    else {
+      ct->locked = 1;
+    }
+  }
+
+  // anonymous memory is zeroed, so the buckets start empty
+  ct->client_buckets = (struct pf_host**)memory;
+  ct->target_buckets = (struct pf_host**)(memory + buckets_bytes);
+  ct->pool = (struct pf_host*)(memory + buckets_bytes * 2);
+  ct->capacity = max_flows;
+
+  // thread the pool onto the free list in order
+  ct->free_list = 0;
+  for (i = max_flows; i > 0; i--) {
+    ct->pool[i - 1].client_next = ct->free_list;
+    ct->free_list = &ct->pool[i - 1];
+  }
+
+  ct->mask = count - 1;
+  ct->count = 0;
+  ct->xdp = 0;
+  ct->sync = 0;
+  ct->nat = 0;
+  ct->natCount = 0;
+  ct->natNext = 0;
+  ct->natPorts = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  ct->seed = (unsigned int)(now.tv_nsec ^ now.tv_sec ^ getpid());
+
+  memset(ct->wheel, 0, sizeof(ct->wheel));
+  ct->due = 0;
+  ct->cascade = CT_WHEEL_LEVELS;
+  ct->now = conntrack_clock();
+  ct->tick = ct->now;
+  for (i = 0; i < CT_STATES; i++) {
+    ct->timeouts[i] = ct_timeouts[i] * (1000 / CT_TICK_MS);
+  }
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Conntrack Free
+
+Prototype:  void conntrack_free(struct pf_conntrack* ct)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_conntrack* ct
+    the table to free
+
+Return Values:
+  void
+
+Description:
+  Releases the table's mapping, entries and all, and its snat ports.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Unmaps the pool instead of freeing entries one by one
+
+  Andrew Burian
+  2026-10-18
+  Frees the snat ports
+
+---------------------------------------------------------------------------- */
+void conntrack_free(struct pf_conntrack* ct) {
+
+  if (!ct->client_buckets) {
+    return;
+  }
+
+  munmap(ct->client_buckets, ct->bytes);
+  if (ct->nat) {
+    free(ct->nat[0].ports);
+    free(ct->nat);
+  }
+
+  ct->client_buckets = 0;
+  ct->nat = 0;
+  ct->natCount = 0;
+  ct->target_buckets = 0;
+  ct->pool = 0;
+  ct->free_list = 0;
+  ct->capacity = 0;
+  ct->count = 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Conntrack Nat
+
+Prototype:  int conntrack_nat(struct pf_conntrack* ct, unsigned int* addrs,
+              int addrCount, int workers, int worker)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_conntrack* ct
+    the table, set up by conntrack_init
+  unsigned int* addrs
+    the snat addresses, in network order
+  int addrCount
+    the number of them
+  int workers
+    the number of workers flows are spread over
+  int worker
+    the worker the table belongs to
+
+Return Values:
+  0  success
+  -1 out of memory
+
+Description:
+  Gives the table the ports from NAT_FIRST_PORT up of every snat address
+  that filter_worker steers to this worker, so packets a target sends to
+  one reach the worker the connection's client is on. Every address gets
+  them in its own shuffled order, so the ports handed out can't be guessed
+  from one another.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+int conntrack_nat(struct pf_conntrack* ct, unsigned int* addrs, int addrCount, int workers,
+  int worker) {
+
+  unsigned short int* ports;
+  unsigned short int swap;
+  unsigned int seed = ct->seed;
+  size_t count = 0;
+  size_t i, j;
+  int port, a;
+
+  for (port = NAT_FIRST_PORT; port < 65536; port++) {
+    count += filter_worker(port, workers) == worker;
+  }
+
+  ct->nat = (struct pf_nat*)calloc(addrCount, sizeof(struct pf_nat));
+  ports = (unsigned short int*)malloc(sizeof(unsigned short int) * count * addrCount);
+  if (!ct->nat || !ports) {
+    free(ct->nat);
+    free(ports);
+    ct->nat = 0;
+    return -1;
+  }
+
+  for (i = 0, port = NAT_FIRST_PORT; port < 65536; port++) {
+    if (filter_worker(port, workers) == worker) {
+      ports[i++] = htons((unsigned short int)port);
+    }
+  }
+
+  for (a = 0; a < addrCount; a++) {
+    ct->nat[a].addr = addrs[a];
+    ct->nat[a].ports = ports + count * a;
+    ct->nat[a].head = 0;
+    ct->nat[a].free = count;
+
+    if (a) {
+      memcpy(ct->nat[a].ports, ports, sizeof(unsigned short int) * count);
+    }
+    for (i = count; i > 1; i--) {
+      j = (size_t)rand_r(&seed) % i;
+      swap = ct->nat[a].ports[i - 1];
+      ct->nat[a].ports[i - 1] = ct->nat[a].ports[j];
+      ct->nat[a].ports[j] = swap;
+    }
+  }
+
+  ct->natCount = addrCount;
+  ct->natNext = 0;
+  ct->natPorts = count;
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Add Host
+
+Prototype:  struct pf_host *add_host(struct pf_conntrack* ct, unsigned int host,
+              unsigned int port, struct pf_target* target)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_conntrack* ct
+    the table to add to
+  unsigned int host
+    the client's address
+  unsigned int port
+    the client's port
+  struct pf_target* target
+    the target the client is being forwarded to
+
+Return Values:
+  The new entry, or a null pointer if the table is full or every snat port
+  of this worker is in use
+
+Description:
+  Adds a new forwarded connection to both indexes. It starts out in
+  CT_SYN_SENT, as connections are only added on the client's SYN, which is
+  timed so the target's answer gives its handshake round trip.
+
+  The connection is given the next free port of the snat addresses in
+  turn, skipping any that have none left.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Starts the connection's idle timer
+
+  Andrew Burian
+  2026-10-18
+  Takes the entry from the pool, the table never grows
+
+  Andrew Burian
+  2026-10-18
+  Times the handshake and counts the connection against its target
+
+  Andrew Burian
+  2026-10-18
+  Holds a reference to the target, so a reload keeps it until it's let go
+
+  Andrew Burian
+  2026-10-18
+  Gives the connection a snat address and port
+
+  Andrew Burian
+  2026-10-18
+  Sends the new connection to the standby
+
+---------------------------------------------------------------------------- */
+struct pf_host *add_host(struct pf_conntrack* ct, unsigned int host,
+  unsigned int port, struct pf_target* target) {
+
+  struct pf_host* entry;
+  struct pf_nat* nat = 0;
+  int tries;
+
+  if (!(entry = ct->free_list)) {
+    return 0;
+  }
+
+  // the next address with a port to spare
+  for (tries = 0; tries < ct->natCount; tries++) {
+    nat = &ct->nat[ct->natNext];
+    if (++ct->natNext == ct->natCount) {
+      ct->natNext = 0;
+    }
+    if (nat->free) {
+      break;
+    }
+  }
+  if (tries == ct->natCount) {
+    return 0;
+  }
+  ct->free_list = entry->client_next;
+
+  entry->nat_addr = (unsigned short int)(nat - ct->nat);
+  entry->nat_port = nat->ports[nat->head];
+  if (++nat->head == ct->natPorts) {
+    nat->head = 0;
+  }
+  nat->free--;
+
+  entry->host = host;
+  entry->port = port;
+  entry->target = target;
+  entry->state = CT_SYN_SENT;
+  entry->fins = 0;
+  entry->syn_at = (unsigned int)dispatch_clock();
+  entry->expires = ct->now + ct->timeouts[CT_SYN_SENT];
+  entry->timer_pprev = 0;
+
+  link_host(ct, entry);
+  timer_arm(ct, entry);
+  ct->count++;
+  __atomic_fetch_add(&target->load->flows, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&target->refs, 1, __ATOMIC_RELAXED);
+
+  if (ct->sync) {
+    sync_flow(ct->sync, ct, entry, 0);
+  }
+
+  return entry;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Remove Host
+
+Prototype:  void remove_host(struct pf_conntrack* ct, struct pf_host* host)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_conntrack* ct
+    the table to remove from
+  struct pf_host* host
+    the entry to remove, as returned by one of the find functions
+
+Return Values:
+  void
+
+Description:
+  Unlinks the entry from both indexes and its timer and returns it to the
+  pool, and its snat port to the back of its address's ring.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Stops the connection's idle timer
+
+  Andrew Burian
+  2026-10-18
+  Returns the entry to the pool
+
+  Andrew Burian
+  2026-10-18
+  Takes the connection out of the xdp fast path
+
+  Andrew Burian
+  2026-10-18
+  Takes the connection off its target's count, one that never got an
+  answer counts as a failed handshake
+
+  Andrew Burian
+  2026-10-18
+  Lets go of the target last, after which a reload may free it
+
+  Andrew Burian
+  2026-10-18
+  Gives back the snat port
+
+  Andrew Burian
+  2026-10-18
+  Tells the standby the connection is gone
+
+---------------------------------------------------------------------------- */
+void remove_host(struct pf_conntrack* ct, struct pf_host* host) {
+
+  struct pf_nat* nat = &ct->nat[host->nat_addr];
+  struct pf_host** link;
+
+  for (link = client_bucket(ct, host->host, host->port, host->target->port.a_port); *link != 0;
+    link = &(*link)->client_next) {
+    if (*link == host) {
+      *link = host->client_next;
+      break;
+    }
+  }
+
+  for (link = target_bucket(ct, host->target->host, host->target->port.b_port, nat->addr,
+    host->nat_port); *link != 0; link = &(*link)->target_next) {
+    if (*link == host) {
+      *link = host->target_next;
+      break;
+    }
+  }
+
+  timer_unlink(host);
+
+  if (ct->xdp) {
+    xdp_flow_remove(ct->xdp, host, nat->addr);
+  }
+  if (ct->sync) {
+    sync_flow(ct->sync, ct, host, 1);
+  }
+
+  // still open as far as its target's count goes, and never answered
+  if (host->state < CT_TIME_WAIT) {
+    __atomic_fetch_sub(&host->target->load->flows, 1, __ATOMIC_RELAXED);
+  }
+  if (host->state == CT_SYN_SENT) {
+    dispatch_measure(host->target, BALANCE_FAILED_US);
+  }
+  __atomic_fetch_sub(&host->target->refs, 1, __ATOMIC_RELEASE);
+
+  nat->ports[(nat->head + nat->free) % ct->natPorts] = host->nat_port;
+  nat->free++;
+
+  host->client_next = ct->free_list;
+  ct->free_list = host;
+  ct->count--;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Find Host
+
+Prototype:  struct pf_host *find_host(struct pf_conntrack* ct, unsigned int host,
+              unsigned int port, unsigned int to_port)
+
+Developer:	Jordan Marling
+
+Created On:	2015-03-13
+
+Parameters:
+  ct: The connection table
+  host: The host to find
+  port: The port to find
+  to_port: The forwarded port it connected to
+
+Return Values:
+  A pointer to the forwarded host or a null pointer if one wasn't found.
+
+Description:
+  This function finds the forwarding client from the host and port.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Moved from forward.c, now a hash lookup instead of a scan of the hosts array
+
+  Andrew Burian
+  2026-10-18
+  Also matches the forwarded port, so one client port can be used for
+  two forwards at once
+
+---------------------------------------------------------------------------- */
+struct pf_host *find_host(struct pf_conntrack* ct, unsigned int host, unsigned int port,
+  unsigned int to_port) {
+
+  struct pf_host* entry;
+
+  //return if we find a host match
+  for (entry = *client_bucket(ct, host, port, to_port); entry != 0; entry = entry->client_next) {
+    if (entry->host == host && entry->port == port && entry->target->port.a_port == to_port) {
+      return entry;
+    }
+  }
+
+  // return a null pointer if a host isn't found
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Find Host By Target
+
+Prototype:  struct pf_host *find_host_by_target(struct pf_conntrack* ct,
+              unsigned int target_host, unsigned int target_port,
+              unsigned int addr, unsigned int port)
+
+Developer:	Jordan Marling
+
+Created On:	2015-03-13
+
+Parameters:
+  ct: The connection table
+  target_host: The target to find
+  target_port: The target's port
+  addr: The snat address the target sent to
+  port: The snat port the target sent to
+
+Return Values:
+  A pointer to the forwarded host or a null pointer if one wasn't found.
+
+Description:
+  This function finds the forwarding client from the target host and port.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Moved from forward.c, now a hash lookup instead of a scan of the hosts array.
+  Also matches the target port so two forwards to one host can't be confused.
+
+  Andrew Burian
+  2026-10-18
+  Matches the snat address and port the connection was given instead of
+  the client's port
+
+---------------------------------------------------------------------------- */
+struct pf_host *find_host_by_target(struct pf_conntrack* ct, unsigned int target_host,
+  unsigned int target_port, unsigned int addr, unsigned int port) {
+
+  struct pf_host* entry;
+
+  //return if we find a host match
+  for (entry = *target_bucket(ct, target_host, target_port, addr, port); entry != 0;
+    entry = entry->target_next) {
+    if (entry->nat_port == port && entry->target->host == target_host
+      && entry->target->port.b_port == target_port && ct->nat[entry->nat_addr].addr == addr) {
+      return entry;
+    }
+  }
+
+  // return a null pointer if a host isn't found
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Conntrack Update
+
+Prototype:  unsigned long conntrack_update(struct pf_conntrack* ct,
+              struct pf_host* host, struct tcphdr* tcp_header, int from_client)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_conntrack* ct
+    the table
+  struct pf_host* host
+    the connection the packet belongs to
+  struct tcphdr* tcp_header
+    the packet's tcp header
+  int from_client
+    1 if the packet came from the client, 0 if from the target
+
+Return Values:
+  The handshake round trip in microseconds if the packet is the target's
+  SYN-ACK, otherwise 0
+
+Description:
+  Moves the connection along the tcp state machine and pushes back its idle
+  deadline. A RST closes the connection from either side, a FIN from one side
+  half closes it and from both sides closes it. A new SYN from the client
+  opens a closed connection again.
+
+  Only a state change re-arms the timer, since a shorter timeout may be due
+  before the slot the entry is in. Otherwise the deadline is simply moved and
+  the wheel sorts it out when the slot comes round.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Hands newly established connections to the xdp fast path
+
+  Andrew Burian
+  2026-10-18
+  Samples the target's handshake round trip and counts its open connections
+
+  Andrew Burian
+  2026-10-18
+  Returns the handshake round trip for the metrics
+
+  Andrew Burian
+  2026-10-18
+  Sends every change of state to the standby
+
+---------------------------------------------------------------------------- */
+unsigned long conntrack_update(struct pf_conntrack* ct, struct pf_host* host,
+  struct tcphdr* tcp_header, int from_client) {
+
+  unsigned long rtt = 0;
+  int state = host->state;
+
+  if (tcp_header->rst) {
+    state = CT_CLOSE;
+  }
+  else if (tcp_header->syn) {
+    if (!tcp_header->ack && from_client && (state == CT_CLOSE || state == CT_TIME_WAIT)) {
+      state = CT_SYN_SENT;
+      host->fins = 0;
+    }
+    else if (tcp_header->ack && !from_client && state == CT_SYN_SENT) {
+      state = CT_SYN_RECV;
+    }
+  }
+  else if (tcp_header->fin) {
+    host->fins |= from_client ? CT_FIN_CLIENT : CT_FIN_TARGET;
+    state = host->fins == (CT_FIN_CLIENT | CT_FIN_TARGET) ? CT_TIME_WAIT : CT_FIN_WAIT;
+  }
+  else if (state == CT_SYN_RECV && from_client && tcp_header->ack) {
+    state = CT_ESTABLISHED;
+  }
+
+  host->expires = ct->now + ct->timeouts[state];
+
+  if (state != host->state) {
+
+    // the target's answer to the SYN, refused or accepted
+    if (host->state == CT_SYN_SENT && !from_client) {
+      if (state == CT_SYN_RECV) {
+        // under a microsecond still counts as one, 0 is no answer
+        if (!(rtt = (unsigned int)dispatch_clock() - host->syn_at)) {
+          rtt = 1;
+        }
+      }
+      dispatch_measure(host->target, rtt ? rtt : BALANCE_FAILED_US);
+    }
+
+    // closed and reopened connections leave and rejoin their target's count
+    if (host->state < CT_TIME_WAIT && state >= CT_TIME_WAIT) {
+      __atomic_fetch_sub(&host->target->load->flows, 1, __ATOMIC_RELAXED);
+    }
+    else if (host->state >= CT_TIME_WAIT && state < CT_TIME_WAIT) {
+      __atomic_fetch_add(&host->target->load->flows, 1, __ATOMIC_RELAXED);
+      host->syn_at = (unsigned int)dispatch_clock();
+    }
+
+    host->state = state;
+    timer_unlink(host);
+    timer_arm(ct, host);
+
+    // from here on the fast path can take the connection's packets
+    if (ct->xdp && state == CT_ESTABLISHED) {
+      xdp_flow_add(ct->xdp, host, ct->nat[host->nat_addr].addr);
+    }
+    if (ct->sync) {
+      sync_flow(ct->sync, ct, host, 0);
+    }
+  }
+
+  return rtt;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Conntrack Expire
+
+Prototype:  size_t conntrack_expire(struct pf_conntrack* ct)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_conntrack* ct
+    the table
+
+Return Values:
+  The number of connections removed
+
+Description:
+  Reads the clock and expires idle connections, doing at most
+  CT_EXPIRE_BUDGET entries of work. Called from the forwarding loops on every
+  pass, which costs a clock read when nothing is due.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+size_t conntrack_expire(struct pf_conntrack* ct) {
+
+  return conntrack_advance(ct, conntrack_clock(), CT_EXPIRE_BUDGET);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Conntrack Advance
+
+Prototype:  size_t conntrack_advance(struct pf_conntrack* ct, unsigned long now,
+              size_t budget)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_conntrack* ct
+    the table
+  unsigned long now
+    the current time in ticks
+  size_t budget
+    most entries to look at before returning
+
+Return Values:
+  The number of connections removed
+
+Description:
+  Turns the wheel up to now. On every tick the first level slot for that tick
+  comes round, and each time a level wraps the next level's slot does too.
+  Each slot's chain becomes the due list in one step, then each entry on it
+  is either removed, if its deadline has passed, or placed in the wheel again.
+
+  Whatever the budget doesn't cover stays on the due list (or in the wheel)
+  for the next call. Connections seen in the meantime are not lost, since
+  their deadline is checked again when they are taken off the due list.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Asks the xdp fast path when a connection was last seen before expiring it
+
+---------------------------------------------------------------------------- */
+size_t conntrack_advance(struct pf_conntrack* ct, unsigned long now, size_t budget) {
+
+  struct pf_host** slot;
+  struct pf_host* host;
+  unsigned long seen;
+  size_t work = 0;
+  size_t expired = 0;
+  int level;
+
+  ct->now = now;
+
+  // nothing to time out, catch up at once
+  if (ct->count == 0) {
+    ct->tick = now;
+    ct->cascade = CT_WHEEL_LEVELS;
+    return 0;
+  }
+
+  for (;;) {
+
+    // everything that has come round so far
+    while ((host = ct->due) != 0) {
+      if (work++ == budget) {
+        return expired;
+      }
+
+      timer_unlink(host);
+
+      // packets the fast path forwarded never came through here
+      if (ct->xdp && host->expires <= ct->tick) {
+        seen = xdp_flow_seen(ct->xdp, host, ct->nat[host->nat_addr].addr)
+          + ct->timeouts[host->state];
+        if (seen > host->expires) {
+          host->expires = seen;
+        }
+      }
+
+      if (host->expires <= ct->tick) {
+        remove_host(ct, host);
+        expired++;
+      }
+      else {
+        timer_arm(ct, host);
+      }
+    }
+
+    // the next slot of this tick, the whole chain is moved at once
+    if (ct->cascade < CT_WHEEL_LEVELS) {
+      level = ct->cascade++;
+      slot = &ct->wheel[level][(ct->tick >> (level * CT_WHEEL_BITS)) & (CT_WHEEL_SLOTS - 1)];
+      if (*slot) {
+        ct->due = *slot;
+        ct->due->timer_pprev = &ct->due;
+        *slot = 0;
+      }
+
+      // the next level only comes round when this one wraps
+      if (ct->tick & ((1UL << ((level + 1) * CT_WHEEL_BITS)) - 1)) {
+        ct->cascade = CT_WHEEL_LEVELS;
+      }
+      continue;
+    }
+
+    if (ct->tick >= now) {
+      return expired;
+    }
+    ct->tick++;
+    ct->cascade = 0;
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Conntrack Restore
+
+Prototype:  size_t conntrack_restore(struct pf_conntrack* ct,
+              struct pf_host* hosts, size_t count)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_conntrack* ct
+    the table, given its snat addresses by conntrack_nat and with nothing
+    added to it yet
+  struct pf_host* hosts
+    the connections to put back: their client, target, snat address (an
+    index into the table's pool) and port, tcp state and fins, and in
+    expires the ticks they have left to idle
+  size_t count
+    the number of them
+
+Return Values:
+  the number of connections put back
+
+Description:
+  Adds connections with the snat ports they already had, as a warm restart
+  finds them in a snapshot, instead of giving them new ones. A connection
+  is skipped if its port isn't one of this table's, is already taken, or
+  the table is full. Established ones are handed to the xdp fast path.
+
+  The ports taken are marked as they go and cut out of the free rings in
+  one pass at the end, so putting back n connections is O(n + ports).
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+size_t conntrack_restore(struct pf_conntrack* ct, struct pf_host* hosts, size_t count) {
+
+  struct pf_host* entry;
+  struct pf_host* host;
+  struct pf_nat* nat;
+  unsigned char* ours;
+  unsigned char* taken;
+  unsigned short int port;
+  unsigned int now = (unsigned int)dispatch_clock();
+  size_t restored = 0;
+  size_t i, kept, from, to;
+  int a;
+
+  if (!ct->natCount) {
+    return 0;
+  }
+
+  // the ports this table hands out, every address has the same ones, and
+  // the ones taken on each address
+  ours = (unsigned char*)calloc(65536 / 8, 1);
+  taken = (unsigned char*)calloc((size_t)ct->natCount * (65536 / 8), 1);
+  if (!ours || !taken) {
+    free(ours);
+    free(taken);
+    return 0;
+  }
+  for (i = 0; i < ct->nat[0].free; i++) {
+    port = ct->nat[0].ports[(ct->nat[0].head + i) % ct->natPorts];
+    ours[port >> 3] |= 1 << (port & 7);
+  }
+
+  for (i = 0; i < count && ct->free_list; i++) {
+    host = &hosts[i];
+    port = host->nat_port;
+    if (host->nat_addr >= ct->natCount || host->state >= CT_STATES
+      || !(ours[port >> 3] & (1 << (port & 7)))
+      || taken[host->nat_addr * (65536 / 8) + (port >> 3)] & (1 << (port & 7))
+      || find_host(ct, host->host, host->port, host->target->port.a_port)) {
+      continue;
+    }
+    taken[host->nat_addr * (65536 / 8) + (port >> 3)] |= 1 << (port & 7);
+
+    entry = ct->free_list;
+    ct->free_list = entry->client_next;
+
+    entry->host = host->host;
+    entry->port = host->port;
+    entry->nat_addr = host->nat_addr;
+    entry->nat_port = port;
+    entry->target = host->target;
+    entry->state = host->state;
+    entry->fins = host->fins;
+    entry->syn_at = now;
+    entry->expires = ct->now + (host->expires < ct->timeouts[host->state]
+      ? host->expires : ct->timeouts[host->state]);
+    entry->timer_pprev = 0;
+
+    link_host(ct, entry);
+    timer_arm(ct, entry);
+    ct->count++;
+    if (entry->state < CT_TIME_WAIT) {
+      __atomic_fetch_add(&entry->target->load->flows, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&entry->target->refs, 1, __ATOMIC_RELAXED);
+
+    if (ct->xdp && entry->state == CT_ESTABLISHED) {
+      xdp_flow_add(ct->xdp, entry, ct->nat[entry->nat_addr].addr);
+    }
+    restored++;
+  }
+
+  // close up the rings over the ports taken, keeping the rest in order
+  for (a = 0; restored && a < ct->natCount; a++) {
+    nat = &ct->nat[a];
+    from = to = nat->head;
+    for (i = 0, kept = 0; i < nat->free; i++) {
+      port = nat->ports[from];
+      if (++from == ct->natPorts) {
+        from = 0;
+      }
+      if (!(taken[a * (65536 / 8) + (port >> 3)] & (1 << (port & 7)))) {
+        nat->ports[to] = port;
+        if (++to == ct->natPorts) {
+          to = 0;
+        }
+        kept++;
+      }
+    }
+    nat->free = kept;
+  }
+
+  free(ours);
+  free(taken);
+
+  return restored;
+}
@@ -0,0 +1,920 @@
+/* ----------------------------------------------------------------------------
+SOURCE FILE
+
+Name:		dispatch.c
+
+Program:	Port Forwarder
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Functions:
+  int dispatch_build(struct pf_dispatch* dispatch, struct pf_target* targets,
+    size_t targetCount, struct pf_target** draining, size_t drainingCount)
+  void dispatch_free(struct pf_dispatch* dispatch)
+  struct pf_target *dispatch_backend(struct pf_dispatch* dispatch,
+    unsigned int host, unsigned int port)
+  struct pf_target *dispatch_find(struct pf_dispatch* dispatch,
+    unsigned int port, unsigned int host, unsigned int to_port)
+  struct pf_target *dispatch_pick(struct pf_dispatch* dispatch,
+    struct pf_target* target, unsigned int host, unsigned int port)
+  struct pf_target *dispatch_balance(struct pf_dispatch* dispatch,
+    struct pf_target* target, unsigned int host, unsigned int port, int policy)
+  unsigned long dispatch_clock(void)
+  void dispatch_measure(struct pf_target* target, unsigned long rtt)
+  void dispatch_report(struct pf_dispatch* dispatch)
+
+Description:
+  The forwards compiled into lookup tables, so matching a packet to its
+  forward costs the same however many forwards there are.
+
+  Packets heading to a target are matched on their destination port alone,
+  through a table with a slot for every port. Packets coming back from a
+  target are matched on its address and port through a small hash index,
+  guarded by a table of the ports any target uses so most packets that are
+  not ours never get as far as hashing.
+
+  Ports are used as they appear on the wire (network order) as indexes.
+
+  A port with several targets gets a Maglev lookup table: every target fills
+  slots in the order of its own permutation of the table, taking turns in
+  proportion to its weight, so each ends up with its share of slots and a
+  new connection is given a target by hashing the client into the table.
+  Adding or removing a target only moves the slots it gains or gives up,
+  so most clients keep hashing to the same target. A permutation depends
+  only on the target's address, so every port of a range forwarded to the
+  same hosts gets the same table, and they share one.
+
+  Targets also carry what the workers measure of them: the round trip of
+  their handshakes and the connections open to them. The least_latency and
+  power_of_two policies weigh those up to steer new connections away from
+  slow or busy targets, starting from the target the Maglev table picks.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Maglev tables for ports with several targets
+
+  Andrew Burian
+  2026-10-18
+  Latency aware policies from the measured handshake round trips
+
+  Andrew Burian
+  2026-10-18
+  Ports with the same hosts share a Maglev table
+
+---------------------------------------------------------------------------- */
+
+#include "portforward.h"
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Backend Hash
+
+Prototype:  static size_t backend_hash(unsigned int host, unsigned int port)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  unsigned int host
+    the target address
+  unsigned int port
+    the target port
+
+Return Values:
+  The hash of the pair
+
+Description:
+  Multiplicative hash of a target address and port. Addresses are in network
+  order, so the bits that differ between targets are mixed down before the
+  low bits are used.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static size_t backend_hash(unsigned int host, unsigned int port) {
+
+  unsigned long long h;
+
+  h = ((unsigned long long)host << 16 | port) * 0x9E3779B97F4A7C15ULL;
+  h ^= h >> 29;
+  h *= 0xBF58476D1CE4E5B9ULL;
+
+  return (size_t)(h >> 32);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Maglev Size
+
+Prototype:  static size_t maglev_size(size_t weight)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  size_t weight
+    the total weight of the targets sharing the table
+
+Return Values:
+  The number of slots for the table
+
+Description:
+  The smallest prime of at least MAGLEV_MIN_SIZE and MAGLEV_SCALE slots per
+  unit of weight. Keeping the size fixed for all but the largest forwards
+  means adding or removing a target doesn't move every slot.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static size_t maglev_size(size_t weight) {
+
+  size_t size = MAGLEV_MIN_SIZE;
+  size_t d;
+
+  if (size < weight * MAGLEV_SCALE) {
+    size = weight * MAGLEV_SCALE | 1;
+  }
+
+  for (;; size += 2) {
+    for (d = 3; d * d <= size && size % d; d += 2);
+    if (d * d > size) {
+      return size;
+    }
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Maglev Fill
+
+Prototype:  static int maglev_fill(struct pf_maglev* maglev)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_maglev* maglev
+    the table to fill, with its backends and size set
+
+Return Values:
+  0  success
+  -1 out of memory
+
+Description:
+  Each backend's permutation of the table starts at an offset and steps by
+  a skip, both hashed from its address, so a backend gets the same
+  preferences whatever else shares the table, and whatever its port. A
+  second backend on the same address is told apart by the count of those
+  before it. The backends take turns
+  claiming the next free slot in their permutation, a backend of weight n
+  claiming n slots a turn, until the table is full. The size is prime, so
+  every permutation reaches every slot.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Permutations are hashed from the address alone, so ranges can share them
+
+---------------------------------------------------------------------------- */
+static int maglev_fill(struct pf_maglev* maglev) {
+
+  size_t* next;
+  size_t* skip;
+  size_t filled = 0;
+  size_t i, j, w, slot, seen;
+
+  if (!(next = (size_t*)malloc(sizeof(size_t) * maglev->count * 2))) {
+    return -1;
+  }
+  skip = next + maglev->count;
+
+  for (i = 0; i < maglev->count; i++) {
+    for (j = 0, seen = 0; j < i; j++) {
+      seen += maglev->backends[j]->host == maglev->backends[i]->host;
+    }
+    next[i] = backend_hash(maglev->backends[i]->host, seen) % maglev->size;
+    skip[i] = backend_hash(~maglev->backends[i]->host, seen) % (maglev->size - 1) + 1;
+  }
+
+  // 0xffff marks a free slot, there are never that many backends
+  memset(maglev->table, 0xff, sizeof(unsigned short) * maglev->size);
+
+  while (filled < maglev->size) {
+    for (i = 0; i < maglev->count && filled < maglev->size; i++) {
+      for (w = maglev->backends[i]->weight ? maglev->backends[i]->weight : 1;
+        w && filled < maglev->size; w--) {
+
+        do {
+          slot = next[i];
+          next[i] = (next[i] + skip[i]) % maglev->size;
+        } while (maglev->table[slot] != 0xffff);
+
+        maglev->table[slot] = (unsigned short)i;
+        filled++;
+      }
+    }
+  }
+
+  free(next);
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Maglev Share
+
+Prototype:  static int maglev_share(struct pf_maglev* maglev,
+              struct pf_maglev** owners)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_maglev* maglev
+    the table to fill, with its backends and size set
+  struct pf_maglev** owners
+    65536 slots, hashed by backend addresses and weights, of the tables
+    filled so far
+
+Return Values:
+  0  success
+  -1 out of memory
+
+Description:
+  Points the table at one already filled for the same addresses and weights
+  in the same order, which maglev_fill would fill the same way, or fills a
+  new one. A port range forwarded to several hosts then costs one table,
+  not one per port.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int maglev_share(struct pf_maglev* maglev, struct pf_maglev** owners) {
+
+  struct pf_maglev* owner;
+  size_t sig = 0;
+  size_t h, i;
+
+  for (i = 0; i < maglev->count; i++) {
+    sig = backend_hash(sig ^ maglev->backends[i]->host,
+      maglev->backends[i]->weight ? maglev->backends[i]->weight : 1);
+  }
+
+  for (h = sig; (owner = owners[h & 0xffff]); h++) {
+    if (owner->count != maglev->count) {
+      continue;
+    }
+    for (i = 0; i < maglev->count; i++) {
+      if (owner->backends[i]->host != maglev->backends[i]->host
+        || (owner->backends[i]->weight ? owner->backends[i]->weight : 1)
+        != (maglev->backends[i]->weight ? maglev->backends[i]->weight : 1)) {
+        break;
+      }
+    }
+    if (i == maglev->count) {
+      maglev->table = owner->table;
+      maglev->shared = 1;
+      return 0;
+    }
+  }
+
+  if (!(maglev->table = (unsigned short*)malloc(sizeof(unsigned short) * maglev->size))) {
+    return -1;
+  }
+  owners[h & 0xffff] = maglev;
+
+  return maglev_fill(maglev);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Backend Cost
+
+Prototype:  static unsigned long backend_cost(struct pf_target* target,
+              unsigned long now)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_target* target
+    the target
+  unsigned long now
+    the current time in microseconds
+
+Return Values:
+  What sending one more connection to the target is expected to cost
+
+Description:
+  The handshake round trip times the connections open to the target, one
+  more included, divided by its weight. The round trip halves for every
+  BALANCE_DECAY_US it hasn't been measured, so a target that was once slow
+  is tried again. A target with no round trip to go on is free while it has
+  nothing open and costly while its first handshakes are outstanding, so a
+  target that never answers gets one connection at a time.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static unsigned long backend_cost(struct pf_target* target, unsigned long now) {
+
+  unsigned long rtt, age;
+  long flows;
+
+  rtt = __atomic_load_n(&target->load->rtt, __ATOMIC_RELAXED);
+  age = (now - __atomic_load_n(&target->load->rtt_at, __ATOMIC_RELAXED)) / BALANCE_DECAY_US;
+  rtt = age < 64 ? rtt >> age : 0;
+
+  if ((flows = __atomic_load_n(&target->load->flows, __ATOMIC_RELAXED)) < 0) {
+    flows = 0;
+  }
+  if (!rtt) {
+    rtt = flows ? BALANCE_FAILED_US : 0;
+  }
+
+  return rtt * (flows + 1) * MAGLEV_MAX_WEIGHT / (target->weight ? target->weight : 1);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Dispatch Build
+
+Prototype:  int dispatch_build(struct pf_dispatch* dispatch,
+              struct pf_target* targets, size_t targetCount,
+              struct pf_target** draining, size_t drainingCount)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_dispatch* dispatch
+    the tables to fill
+  struct pf_target* targets
+    the array of targets
+  size_t targetCount
+    the number of targets in the array
+  struct pf_target** draining
+    targets a reload removed that still have connections, or a null pointer
+  size_t drainingCount
+    the number of them
+
+Return Values:
+  0  success
+  -1 out of memory
+
+Description:
+  Fills the tables from the targets. Targets sharing a port are balanced
+  through a Maglev table for the port. If two share a target address and
+  port, the first one in the config is used for packets coming back from it,
+  which only matters to connections the worker doesn't know.
+
+  Draining targets are only added where no target has their port or their
+  address and port, so their connections' packets are still recognised, and
+  are never balanced to.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Builds a Maglev table for every port with more than one target
+
+  Andrew Burian
+  2026-10-18
+  Takes the draining targets of a reload
+
+  Andrew Burian
+  2026-10-18
+  Ports with the same hosts share their Maglev table
+
+---------------------------------------------------------------------------- */
+int dispatch_build(struct pf_dispatch* dispatch, struct pf_target* targets,
+  size_t targetCount, struct pf_target** draining, size_t drainingCount) {
+
+  struct pf_target* target;
+  struct pf_target** slot;
+  struct pf_maglev* maglev;
+  struct pf_maglev** owners;
+  unsigned int* counts;
+  size_t* weights;
+  size_t size = 16;
+  size_t i, h;
+
+  memset(dispatch->ports, 0, sizeof(dispatch->ports));
+  memset(dispatch->maglev, 0, sizeof(dispatch->maglev));
+  memset(dispatch->backend_ports, 0, sizeof(dispatch->backend_ports));
+
+  // at most half full so probes stay short
+  while (size < (targetCount + drainingCount) * 2) {
+    size <<= 1;
+  }
+
+  if (!(dispatch->backends = (struct pf_target**)calloc(size, sizeof(struct pf_target*)))) {
+    return -1;
+  }
+  dispatch->mask = size - 1;
+
+  // the draining targets go in behind the current ones
+  for (i = 0; i < targetCount + drainingCount; i++) {
+    target = i < targetCount ? &targets[i] : draining[i - targetCount];
+
+    if (!dispatch->ports[target->port.a_port]) {
+      dispatch->ports[target->port.a_port] = target;
+    }
+
+    dispatch->backend_ports[target->port.b_port] = 1;
+
+    // linear probe for a free slot, unless the pair is already in
+    for (h = backend_hash(target->host, target->port.b_port); ; h++) {
+      slot = &dispatch->backends[h & dispatch->mask];
+      if (!*slot) {
+        *slot = target;
+        break;
+      }
+      if ((*slot)->host == target->host && (*slot)->port.b_port == target->port.b_port) {
+        break;
+      }
+    }
+  }
+
+  // count the targets and their weight on every port
+  if (!(counts = (unsigned int*)calloc(65536, sizeof(unsigned int)))) {
+    return -1;
+  }
+  if (!(weights = (size_t*)calloc(65536, sizeof(size_t)))) {
+    free(counts);
+    return -1;
+  }
+  if (!(owners = (struct pf_maglev**)calloc(65536, sizeof(struct pf_maglev*)))) {
+    free(counts);
+    free(weights);
+    return -1;
+  }
+  for (i = 0; i < targetCount; i++) {
+    counts[targets[i].port.a_port]++;
+    weights[targets[i].port.a_port] += targets[i].weight ? targets[i].weight : 1;
+  }
+
+  // a table for each port with more than one, backends in config order
+  for (i = 0; i < targetCount; i++) {
+
+    h = targets[i].port.a_port;
+    if (counts[h] < 2 || counts[h] >= 0xffff) {
+      continue;
+    }
+
+    if (!(maglev = dispatch->maglev[h])) {
+      size = maglev_size(weights[h]);
+      if (!(maglev = (struct pf_maglev*)calloc(1, sizeof(struct pf_maglev)))) {
+        break;
+      }
+      if (!(maglev->backends = (struct pf_target**)malloc(sizeof(struct pf_target*) * counts[h]))) {
+        free(maglev);
+        break;
+      }
+      maglev->size = size;
+      dispatch->maglev[h] = maglev;
+    }
+
+    maglev->backends[maglev->count++] = &targets[i];
+    if (maglev->count == counts[h] && maglev_share(maglev, owners) == -1) {
+      break;
+    }
+  }
+
+  free(counts);
+  free(weights);
+  free(owners);
+
+  if (i < targetCount) {
+    dispatch_free(dispatch);
+    return -1;
+  }
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Dispatch Free
+
+Prototype:  void dispatch_free(struct pf_dispatch* dispatch)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_dispatch* dispatch
+    the tables to release
+
+Return Values:
+  void
+
+Description:
+  Frees the hash index and the Maglev tables. The tables stay valid but
+  empty.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Frees the Maglev tables
+
+  Andrew Burian
+  2026-10-18
+  Shared Maglev tables are freed by the port that filled them
+
+---------------------------------------------------------------------------- */
+void dispatch_free(struct pf_dispatch* dispatch) {
+
+  size_t i;
+
+  for (i = 0; i < 65536; i++) {
+    if (dispatch->maglev[i]) {
+      if (!dispatch->maglev[i]->shared) {
+        free(dispatch->maglev[i]->table);
+      }
+      free(dispatch->maglev[i]->backends);
+      free(dispatch->maglev[i]);
+      dispatch->maglev[i] = 0;
+    }
+  }
+
+  free(dispatch->backends);
+  dispatch->backends = 0;
+  dispatch->mask = 0;
+  memset(dispatch->ports, 0, sizeof(dispatch->ports));
+  memset(dispatch->backend_ports, 0, sizeof(dispatch->backend_ports));
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Dispatch Backend
+
+Prototype:  struct pf_target *dispatch_backend(struct pf_dispatch* dispatch,
+              unsigned int host, unsigned int port)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_dispatch* dispatch
+    the tables
+  unsigned int host
+    the source address of the packet
+  unsigned int port
+    the source port of the packet
+
+Return Values:
+  The target the packet came from, or a null pointer
+
+Description:
+  Finds the forward whose target sent a packet.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+struct pf_target *dispatch_backend(struct pf_dispatch* dispatch, unsigned int host,
+  unsigned int port) {
+
+  struct pf_target* target;
+  size_t h;
+
+  // no target uses this port, the usual case for traffic that isn't ours
+  if (!dispatch->backend_ports[port & 0xffff]) {
+    return 0;
+  }
+
+  for (h = backend_hash(host, port); ; h++) {
+    target = dispatch->backends[h & dispatch->mask];
+    if (!target || (target->host == host && target->port.b_port == port)) {
+      return target;
+    }
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Dispatch Find
+
+Prototype:  struct pf_target *dispatch_find(struct pf_dispatch* dispatch,
+              unsigned int port, unsigned int host, unsigned int to_port)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_dispatch* dispatch
+    the tables
+  unsigned int port
+    the forwarded port
+  unsigned int host
+    the target's address
+  unsigned int to_port
+    the target's port
+
+Return Values:
+  The target forwarding port to host:to_port, or a null pointer if there
+  is no such forward
+
+Description:
+  Finds one forward exactly, for connections that already have a target,
+  e.g. from a snapshot. Costs a scan of the port's targets.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+struct pf_target *dispatch_find(struct pf_dispatch* dispatch, unsigned int port,
+  unsigned int host, unsigned int to_port) {
+
+  struct pf_target* target = dispatch->ports[port & 0xffff];
+  struct pf_maglev* maglev = dispatch->maglev[port & 0xffff];
+  size_t i;
+
+  if (maglev) {
+    for (i = 0; i < maglev->count; i++) {
+      if (maglev->backends[i]->host == host && maglev->backends[i]->port.b_port == to_port) {
+        return maglev->backends[i];
+      }
+    }
+    return 0;
+  }
+
+  return target && target->host == host && target->port.b_port == to_port ? target : 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Dispatch Pick
+
+Prototype:  struct pf_target *dispatch_pick(struct pf_dispatch* dispatch,
+              struct pf_target* target, unsigned int host, unsigned int port)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_dispatch* dispatch
+    the tables
+  struct pf_target* target
+    the forward a new connection is for, as found by its port
+  unsigned int host
+    the client's address
+  unsigned int port
+    the client's port
+
+Return Values:
+  The target to send the connection to
+
+Description:
+  Gives a new connection one of the targets of its port, through the
+  port's Maglev table. The hash isn't seeded, so every worker, and every
+  run, picks the same target for a client. Ports with one target just get
+  it back.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+struct pf_target *dispatch_pick(struct pf_dispatch* dispatch, struct pf_target* target,
+  unsigned int host, unsigned int port) {
+
+  struct pf_maglev* maglev;
+
+  if (!(maglev = dispatch->maglev[target->port.a_port])) {
+    return target;
+  }
+
+  return maglev->backends[maglev->table[backend_hash(host, port) % maglev->size]];
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Dispatch Balance
+
+Prototype:  struct pf_target *dispatch_balance(struct pf_dispatch* dispatch,
+              struct pf_target* target, unsigned int host, unsigned int port,
+              int policy)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_dispatch* dispatch
+    the tables
+  struct pf_target* target
+    the forward a new connection is for, as found by its port
+  unsigned int host
+    the client's address
+  unsigned int port
+    the client's port
+  int policy
+    BALANCE_MAGLEV, BALANCE_LEAST_LATENCY or BALANCE_POWER_OF_TWO
+
+Return Values:
+  The target to send the connection to
+
+Description:
+  Gives a new connection one of the targets of its port by the policy.
+  least_latency takes the cheapest of all the targets, looking from the one
+  the Maglev table picks so ties don't all land on the first. power_of_two
+  takes the cheaper of the Maglev pick and one other target, also hashed
+  from the client, which costs the same however many targets there are and
+  doesn't herd every new connection onto one target between samples.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+struct pf_target *dispatch_balance(struct pf_dispatch* dispatch, struct pf_target* target,
+  unsigned int host, unsigned int port, int policy) {
+
+  struct pf_maglev* maglev;
+  unsigned long now, cost, best;
+  size_t first, i, j;
+
+  if (policy == BALANCE_MAGLEV || !(maglev = dispatch->maglev[target->port.a_port])) {
+    return dispatch_pick(dispatch, target, host, port);
+  }
+
+  now = dispatch_clock();
+  first = maglev->table[backend_hash(host, port) % maglev->size];
+  best = backend_cost(maglev->backends[first], now);
+
+  if (policy == BALANCE_POWER_OF_TWO) {
+    // any other target, so the two choices always differ
+    j = backend_hash(~host, port) % (maglev->count - 1);
+    j += j >= first;
+    return backend_cost(maglev->backends[j], now) < best ? maglev->backends[j]
+      : maglev->backends[first];
+  }
+
+  for (i = 1, j = first; i < maglev->count; i++) {
+    cost = backend_cost(maglev->backends[(first + i) % maglev->count], now);
+    if (cost < best) {
+      best = cost;
+      j = (first + i) % maglev->count;
+    }
+  }
+
+  return maglev->backends[j];
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Dispatch Clock
+
+Prototype:  unsigned long dispatch_clock(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  The monotonic time in microseconds
+
+Description:
+  The clock handshakes are timed with.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+unsigned long dispatch_clock(void) {
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Dispatch Measure
+
+Prototype:  void dispatch_measure(struct pf_target* target, unsigned long rtt)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_target* target
+    the target a handshake was made with
+  unsigned long rtt
+    microseconds from the SYN to the target's answer, BALANCE_FAILED_US if
+    it refused or never answered
+
+Return Values:
+  void
+
+Description:
+  Folds a handshake round trip into the target's EWMA, the first sample
+  (or the first after a long quiet) taken as it is. Workers sample the same
+  targets without a lock, a sample lost to a race is no great loss.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+void dispatch_measure(struct pf_target* target, unsigned long rtt) {
+
+  unsigned long now = dispatch_clock();
+  unsigned long old, age;
+
+  old = __atomic_load_n(&target->load->rtt, __ATOMIC_RELAXED);
+  age = (now - __atomic_load_n(&target->load->rtt_at, __ATOMIC_RELAXED)) / BALANCE_DECAY_US;
+  old = age < 64 ? old >> age : 0;
+
+  if (old) {
+    rtt = old - (old >> BALANCE_EWMA_SHIFT) + (rtt >> BALANCE_EWMA_SHIFT);
+  }
+
+  __atomic_store_n(&target->load->rtt, rtt ? rtt : 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&target->load->rtt_at, now, __ATOMIC_RELAXED);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Dispatch Report
+
+Prototype:  void dispatch_report(struct pf_dispatch* dispatch)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_dispatch* dispatch
+    the tables
+
+Return Values:
+  void
+
+Description:
+  Prints the measured handshake round trip and the open connections of every
+  target of a port with more than one.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+void dispatch_report(struct pf_dispatch* dispatch) {
+
+  struct pf_target* target;
+  struct in_addr addr;
+  unsigned long rtt;
+  size_t i, j;
+
+  for (i = 0; i < 65536; i++) {
+    if (!dispatch->maglev[i]) {
+      continue;
+    }
+    for (j = 0; j < dispatch->maglev[i]->count; j++) {
+      target = dispatch->maglev[i]->backends[j];
+      addr.s_addr = target->host;
+      rtt = __atomic_load_n(&target->load->rtt, __ATOMIC_RELAXED);
+      if (rtt) {
+        printf("Target %s:%hu (port %hu): handshake %.3fms, %ld connections open\n",
+          inet_ntoa(addr), ntohs(target->port.b_port), ntohs(target->port.a_port), rtt / 1000.0,
+          __atomic_load_n(&target->load->flows, __ATOMIC_RELAXED));
+      }
+      else {
+        printf("Target %s:%hu (port %hu): no handshakes yet, %ld connections open\n",
+          inet_ntoa(addr), ntohs(target->port.b_port), ntohs(target->port.a_port),
+          __atomic_load_n(&target->load->flows, __ATOMIC_RELAXED));
+      }
+    }
+  }
+}
@@ -0,0 +1,491 @@
+/* ----------------------------------------------------------------------------
+SOURCE FILE
+
+Name:		filter.c
+
+Program:	Port Forwarder
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Functions:
+  int filter_steer(struct sock_fprog* prog, struct pf_target* targets,
+    size_t targetCount, int workers, int worker)
+  int filter_worker(unsigned short int port, int workers)
+  unsigned long filter_segments(void)
+  unsigned long filter_drops(int descriptor)
+
+Description:
+  Generates the classic BPF programs the kernel runs on our behalf.
+
+  Flows are spread over workers by their client port. Packets from the client
+  carry it as the source port. Packets coming back from a target carry the
+  snat port the forwarder picked for the connection as the destination port,
+  and that port is picked so filter_worker maps it to the client port's
+  worker. So both directions of a flow hash to the same worker.
+
+  The socket filters double as the forwarder's packet filter, only the
+  forwarded traffic is copied up to the workers.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Targets are matched by ranges of ports, so port range forwards fit
+
+  Andrew Burian
+  2026-10-18
+  Socket filters drop what isn't forwarded, filter_segments and filter_drops
+  for counting it
+
+  Andrew Burian
+  2026-10-18
+  filter_worker, so the ports picked for targets to answer to can be kept
+  to the worker the client's port steers to
+
+  Andrew Burian
+  2026-10-18
+  Describes the snat port return traffic carries
+
+---------------------------------------------------------------------------- */
+
+#include "portforward.h"
+
+#include <linux/if_packet.h>
+#include <linux/sock_diag.h>
+
+// offsets from the start of the ip header, usable wherever the filter runs
+#define NET_PROTOCOL  (SKF_NET_OFF + 9)
+#define NET_SADDR     (SKF_NET_OFF + 12)
+#define NET_IHL       (SKF_NET_OFF + 0)
+
+// offsets from the start of the tcp header, with its offset in X
+#define NET_SPORT     (SKF_NET_OFF + 0)
+#define NET_DPORT     (SKF_NET_OFF + 2)
+
+// instructions used per range of target ports to recognise packets coming from it,
+// and per range of forwarded ports to recognise packets heading to one
+#define STEER_PER_RANGE 6
+#define FILTER_PER_RANGE 3
+
+// multiplier spreading client ports over workers
+#define STEER_MIX 2654435761u
+
+// consecutive ports of a target address, in host order
+struct steer_range{
+  unsigned int host;
+  unsigned int lo;
+  unsigned int hi;
+};
+
+static size_t range_merge(struct steer_range* ranges, size_t count);
+static int range_compare(const void* a, const void* b);
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Filter Steer
+
+Prototype:  int filter_steer(struct sock_fprog* prog, struct pf_target* targets,
+              size_t targetCount, int workers, int worker)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct sock_fprog* prog
+    filled with the program, the caller frees prog->filter
+  struct pf_target* targets
+    the array of targets
+  size_t targetCount
+    the number of targets in the array
+  int workers
+    the number of workers flows are spread over
+  int worker
+    -1 for a PACKET_FANOUT_CBPF program that returns the worker of a packet,
+    or a worker index for a socket filter that only accepts its packets
+    (workers may be 1)
+
+Return Values:
+  0  success
+  -1 too many targets to fit a program
+
+Description:
+  Builds the steering program. The client port is the destination port if
+  the packet comes from a target (the same test find_source_target makes),
+  and the source port otherwise. The worker is a hash of the client port mod
+  workers. Targets on one address with consecutive ports are tested as one
+  range, so a port range forward costs a few instructions.
+
+  A socket filter also drops everything that isn't forwarded before it is
+  copied to us: packets from no target must be to a forwarded port (the
+  test find_dest_target makes), and a packet socket's copies of our own
+  sends are dropped too.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Tests ranges of target ports instead of every target
+
+  Andrew Burian
+  2026-10-18
+  Socket filters drop packets that aren't to a forwarded port or from a
+  target, and outgoing packets
+
+---------------------------------------------------------------------------- */
+int filter_steer(struct sock_fprog* prog, struct pf_target* targets, size_t targetCount,
+  int workers, int worker) {
+
+  struct sock_filter* code;
+  struct steer_range* ranges;
+  struct steer_range* ports;
+  size_t rangeCount = 0;
+  size_t portCount = 0;
+  size_t length;
+  size_t pc = 0;
+  size_t use_dport, to_us, found, key, reject;
+  size_t i;
+
+  // sorted by address and port, then consecutive ports merged, the
+  // forwarded ports likewise with no address
+  ranges = (struct steer_range*)malloc(sizeof(struct steer_range) * (targetCount + 1));
+  ports = (struct steer_range*)malloc(sizeof(struct steer_range) * (targetCount + 1));
+  if (!ranges || !ports) {
+    free(ranges);
+    free(ports);
+    return -1;
+  }
+  for (i = 0; i < targetCount; i++) {
+    ranges[i].host = ntohl(targets[i].host);
+    ranges[i].lo = ranges[i].hi = ntohs(targets[i].port.b_port);
+    ports[i].host = 0;
+    ports[i].lo = ports[i].hi = ntohs(targets[i].port.a_port);
+  }
+  rangeCount = range_merge(ranges, targetCount);
+  portCount = worker < 0 ? 0 : range_merge(ports, targetCount);
+
+  if (worker < 0) {
+    length = 16 + rangeCount * STEER_PER_RANGE;
+  }
+  else {
+    length = 22 + rangeCount * STEER_PER_RANGE + portCount * FILTER_PER_RANGE;
+  }
+  if (length > BPF_MAXINSNS
+    || !(code = (struct sock_filter*)calloc(length, sizeof(struct sock_filter)))) {
+    free(ranges);
+    free(ports);
+    return -1;
+  }
+
+  // where the jumps land
+  use_dport = 9 + rangeCount * STEER_PER_RANGE;
+  to_us = use_dport + 2;
+  found = to_us + 2 + portCount * FILTER_PER_RANGE;
+  key = worker < 0 ? use_dport + 1 : found + 1;
+  reject = length - 1;
+
+  // 0-2: tcp only
+  code[pc++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS, NET_PROTOCOL);
+  code[pc++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, IPPROTO_TCP, 1, 0);
+  code[pc] = (struct sock_filter)BPF_STMT(BPF_JMP | BPF_JA, reject - (pc + 1));
+  pc++;
+
+  // 3-6: X = ip header length
+  code[pc++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_ABS, NET_IHL);
+  code[pc++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_AND | BPF_K, 0xf);
+  code[pc++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_LSH | BPF_K, 2);
+  code[pc++] = (struct sock_filter)BPF_STMT(BPF_MISC | BPF_TAX, 0);
+
+  // 7: A = source port
+  code[pc++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_IND, NET_SPORT);
+
+  // 8...: per range, from one of its ports and its host means the client port is the dport
+  for (i = 0; i < rangeCount; i++) {
+    code[pc++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, ranges[i].lo, 0, 4);
+    code[pc++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, ranges[i].hi, 3, 0);
+    code[pc++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, NET_SADDR);
+    code[pc++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ranges[i].host, 0, 1);
+    code[pc] = (struct sock_filter)BPF_STMT(BPF_JMP | BPF_JA, use_dport - (pc + 1));
+    pc++;
+    code[pc++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_IND, NET_SPORT);
+  }
+
+  // not from a target, the source port is the client port, if it's forwarded at all
+  code[pc] = (struct sock_filter)BPF_STMT(BPF_JMP | BPF_JA, (worker < 0 ? key : to_us) - (pc + 1));
+  pc++;
+
+  // use_dport: from a target
+  code[pc++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_IND, NET_DPORT);
+
+  if (worker >= 0) {
+    code[pc] = (struct sock_filter)BPF_STMT(BPF_JMP | BPF_JA, key - (pc + 1));
+    pc++;
+
+    // to_us: to one of the forwarded ports, the same test find_dest_target makes
+    code[pc++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_IND, NET_DPORT);
+    for (i = 0; i < portCount; i++) {
+      code[pc++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, ports[i].lo, 0, 2);
+      code[pc++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, ports[i].hi, 1, 0);
+      code[pc] = (struct sock_filter)BPF_STMT(BPF_JMP | BPF_JA, found - (pc + 1));
+      pc++;
+    }
+    code[pc] = (struct sock_filter)BPF_STMT(BPF_JMP | BPF_JA, reject - (pc + 1));
+    pc++;
+
+    // found: back to the source port
+    code[pc++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_IND, NET_SPORT);
+  }
+
+  free(ranges);
+  free(ports);
+
+  // key: the worker, mixed first since connect() favours even ports
+  code[pc++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, STEER_MIX);
+  code[pc++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16);
+  code[pc++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, workers);
+
+  if (worker < 0) {
+    // fanout, return the worker (non tcp goes to worker 0)
+    code[pc++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+    code[pc++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+    code[pc++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+  }
+  else {
+    // socket filter, accept only this worker's packets, and never our own
+    // packets going out (packet sockets see those)
+    code[pc++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, worker, 0, 3);
+    code[pc++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_PKTTYPE);
+    code[pc++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, PACKET_OUTGOING, 1, 0);
+    code[pc++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+    code[pc++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+  }
+
+  prog->len = pc;
+  prog->filter = code;
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Range Merge
+
+Prototype:  static size_t range_merge(struct steer_range* ranges, size_t count)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct steer_range* ranges
+    single ports, merged in place
+  size_t count
+    the number of them
+
+Return Values:
+  the number of ranges left
+
+Description:
+  Sorts the ports by address and port, and merges consecutive and repeated
+  ports of the same address into ranges.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static size_t range_merge(struct steer_range* ranges, size_t count) {
+
+  size_t merged = 0;
+  size_t i;
+
+  qsort(ranges, count, sizeof(struct steer_range), range_compare);
+  for (i = 0; i < count; i++) {
+    if (merged && ranges[merged - 1].host == ranges[i].host
+      && ranges[merged - 1].hi + 1 >= ranges[i].lo) {
+      if (ranges[i].hi > ranges[merged - 1].hi) {
+        ranges[merged - 1].hi = ranges[i].hi;
+      }
+      continue;
+    }
+    ranges[merged++] = ranges[i];
+  }
+
+  return merged;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Range Compare
+
+Prototype:  static int range_compare(const void* a, const void* b)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  const void* a
+  const void* b
+    the ranges to compare
+
+Return Values:
+  <0, 0 or >0 as a sorts before, with or after b
+
+Description:
+  Orders ranges by address, then by first port, for qsort.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int range_compare(const void* a, const void* b) {
+
+  const struct steer_range* x = (const struct steer_range*)a;
+  const struct steer_range* y = (const struct steer_range*)b;
+
+  if (x->host != y->host) {
+    return x->host < y->host ? -1 : 1;
+  }
+  return (int)x->lo - (int)y->lo;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Filter Worker
+
+Prototype:  int filter_worker(unsigned short int port, int workers)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  unsigned short int port
+    a client port, or a port a target answers to, in host order
+  int workers
+    the number of workers flows are spread over
+
+Return Values:
+  the worker the steering programs send the port's packets to
+
+Description:
+  The same hash the programs take, in the filter's 32 bit arithmetic.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+int filter_worker(unsigned short int port, int workers) {
+
+  return (int)((((unsigned int)port * STEER_MIX) >> 16) % (unsigned int)workers);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Filter Segments
+
+Prototype:  unsigned long filter_segments(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  (none)
+
+Return Values:
+  the TCP segments the host has received, InSegs of /proc/net/snmp
+  0 if it can't be read
+
+Description:
+  The kernel doesn't count what a classic socket filter drops, so the
+  packets filtered out are counted as the segments the host received less
+  those the workers were handed. Every forwarded packet reaches the host's
+  tcp stack as well as the workers (its reset is what the nftables rules
+  drop), so it is counted once in each.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+unsigned long filter_segments(void) {
+
+  FILE* snmp;
+  char names[1024];
+  char values[1024];
+  char* name;
+  char* value;
+  char* nameSave = 0;
+  char* valueSave = 0;
+  unsigned long segments = 0;
+
+  if (!(snmp = fopen("/proc/net/snmp", "r"))) {
+    return 0;
+  }
+
+  // a line of names, then a line of values
+  while (fgets(names, sizeof(names), snmp)) {
+    if (strncmp(names, "Tcp:", 4) || !fgets(values, sizeof(values), snmp)) {
+      continue;
+    }
+    name = strtok_r(names, " \n", &nameSave);
+    value = strtok_r(values, " \n", &valueSave);
+    while (name && value) {
+      if (!strcmp(name, "InSegs")) {
+        segments = strtoul(value, 0, 10);
+        break;
+      }
+      name = strtok_r(0, " \n", &nameSave);
+      value = strtok_r(0, " \n", &valueSave);
+    }
+    break;
+  }
+  fclose(snmp);
+
+  return segments;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Filter Drops
+
+Prototype:  unsigned long filter_drops(int descriptor)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  int descriptor
+    a worker's raw socket
+
+Return Values:
+  the packets that passed the socket's filter but were dropped with its
+  receive buffer full, 0 if the kernel can't say
+
+Description:
+  Read through SO_MEMINFO, so the packets a socket filter passed but the
+  socket lost aren't counted as filtered out.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+unsigned long filter_drops(int descriptor) {
+
+  unsigned int meminfo[SK_MEMINFO_VARS] = {0};
+  socklen_t length = sizeof(meminfo);
+
+  if (getsockopt(descriptor, SOL_SOCKET, SO_MEMINFO, meminfo, &length) == -1
+    || length <= SK_MEMINFO_DROPS * sizeof(unsigned int)) {
+    return 0;
+  }
+
+  return meminfo[SK_MEMINFO_DROPS];
+}
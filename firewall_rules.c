@@ -10,100 +10,1612 @@ Developer:	Jordan Marling
 Created On:	2015-03-21
 
 Functions:
-  void firewall_invoke_srcport(int port)
-  void firewall_invoke_dstport(int port)
+  int firewall_install(struct pf_config* config, struct pf_target* targets,
+    size_t targetCount, struct pf_target* offloads, size_t offloadCount)
+  int firewall_update(struct pf_config* config, struct pf_target* targets,
+    size_t targetCount)
+  int firewall_offload(struct pf_config* config, struct pf_target* offloads,
+    size_t offloadCount)
+  void firewall_remove(void)
 
 Description:
   Contains functions to invoke firewall rules needed by application.
 
+  The kernel answers the packets we forward with resets, since it knows of
+  no connection on those ports. The rules drop outgoing resets from any
+  forwarded port and to any target port. They live in an nftables table of
+  their own, with the ports held in two sets, and are written straight to
+  the kernel over netlink in one transaction, so there's no iptables or nft
+  binary to run and installing thousands of forwards costs one syscall.
+
+  Forwards offloaded to the kernel get a map from their port to their target
+  in the same table, and nat rules that dnat and snat them the way the
+  userspace engine rewrites packets, so they never leave the kernel.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  The iptables rules per port are replaced by an nftables table with port
+  sets, installed and removed in one netlink transaction
+
+  Andrew Burian
+  2026-10-18
+  Forwards can be offloaded to the kernel's nat
+
+  Andrew Burian
+  2026-10-18
+  What's installed is remembered, so a reload only adds and removes the
+  ports that changed
+
+---------------------------------------------------------------------------- */
+
+
+#include "portforward.h"
+
+#include <linux/netfilter.h>
+#include <linux/netfilter/nf_conntrack_tuple_common.h>
+#include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netlink.h>
+
+
+// the table holding everything, and its chain and sets
+#define FIREWALL_TABLE  "portforward"
+#define FIREWALL_CHAIN  "output"
+#define FIREWALL_SPORTS "sports"
+#define FIREWALL_DPORTS "dports"
+
+// chains and the map of forwards offloaded to the kernel's nat
+#define FIREWALL_PREROUTING  "prerouting"
+#define FIREWALL_POSTROUTING "postrouting"
+#define FIREWALL_OFFLOADS    "offloads"
+
+// set ids, so rules can refer to sets made in the same transaction
+#define FIREWALL_SPORTS_ID 1
+#define FIREWALL_DPORTS_ID 2
+#define FIREWALL_OFFLOADS_ID 3
+
+// nft's types for a set of ports, and for an address and port
+#define FIREWALL_TYPE_PORT   13
+#define FIREWALL_TYPE_TARGET ((7 << 6) | 13)
+
+// ports are looked up as 4 byte keys, zero padded the way registers are.
+// sets of 2 byte keys get the kernel's bitmap type, which takes time
+// quadratic in the number of ports to fill, where a hash takes linear
+#define FIREWALL_KEY_LEN 4
+
+// set elements sent per message, and deepest attribute nesting
+#define FIREWALL_ELEMS_PER_MSG 2048
+#define FIREWALL_MAX_NEST 8
+
+// sets are made to hold twice their ports and this many more, so a reload
+// can add to them, past that the table is rebuilt
+#define FIREWALL_SPARE_PORTS 256
+
+// a netlink batch being built
+struct fw_batch{
+  char* data;
+  size_t len;
+  size_t size;
+  size_t msg;
+  size_t nests[FIREWALL_MAX_NEST];
+  int depth;
+  unsigned int seq;
+  int acks;
+};
+
+// what the table holds, by port in network order
+struct fw_state{
+  unsigned char sports[65536];
+  unsigned char dports[65536];
+  unsigned char oports[65536];
+  unsigned int ohosts[65536];
+  unsigned short otports[65536];
+
+  // the most ports each set was made to hold, and whether the offload map
+  // and its nat chains are in
+  int sports_size;
+  int dports_size;
+  int oports_size;
+  int nat;
+};
+
+// the table as last installed, or a null pointer
+static struct fw_state* installed = 0;
+
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Batch Put
+
+Prototype:  static void *batch_put(struct fw_batch* batch, size_t len)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct fw_batch* batch
+    the batch
+  size_t len
+    bytes to append, padded to netlink alignment
+
+Return Values:
+  The zeroed space appended, or a null pointer if out of memory
+
+Description:
+  Grows the batch by len bytes.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void *batch_put(struct fw_batch* batch, size_t len) {
+
+  char* data;
+  size_t size = batch->size ? batch->size : 65536;
+
+  len = NLMSG_ALIGN(len);
+  while (batch->len + len > size) {
+    size <<= 1;
+  }
+  if (size != batch->size) {
+    if (!(data = (char*)realloc(batch->data, size))) {
+      return 0;
+    }
+    batch->data = data;
+    batch->size = size;
+  }
+
+  data = batch->data + batch->len;
+  memset(data, 0, len);
+  batch->len += len;
+  return data;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Batch Msg
+
+Prototype:  static int batch_msg(struct fw_batch* batch, int type, int flags)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct fw_batch* batch
+    the batch
+  int type
+    an NFT_MSG_ type, or NFNL_MSG_BATCH_BEGIN / NFNL_MSG_BATCH_END
+  int flags
+    NLM_F_ flags beyond NLM_F_REQUEST
+
+Return Values:
+  0  success
+  -1 out of memory
+
+Description:
+  Starts a message. Every nf_tables message asks for an ack, so batch_send
+  knows when the kernel is done with all of them.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int batch_msg(struct fw_batch* batch, int type, int flags) {
+
+  struct nlmsghdr* nlh;
+  struct nfgenmsg* nfg;
+  int nft = type != NFNL_MSG_BATCH_BEGIN && type != NFNL_MSG_BATCH_END;
+
+  batch->msg = batch->len;
+  if (!(nlh = (struct nlmsghdr*)batch_put(batch, NLMSG_HDRLEN + sizeof(struct nfgenmsg)))) {
+    return -1;
+  }
+  nfg = (struct nfgenmsg*)NLMSG_DATA(nlh);
+
+  nlh->nlmsg_len = NLMSG_HDRLEN + sizeof(struct nfgenmsg);
+  nlh->nlmsg_type = nft ? (NFNL_SUBSYS_NFTABLES << 8) | type : type;
+  nlh->nlmsg_flags = NLM_F_REQUEST | flags | (nft ? NLM_F_ACK : 0);
+  nlh->nlmsg_seq = ++batch->seq;
+  nfg->nfgen_family = nft ? NFPROTO_IPV4 : AF_UNSPEC;
+  nfg->version = NFNETLINK_V0;
+  nfg->res_id = nft ? 0 : htons(NFNL_SUBSYS_NFTABLES);
+
+  batch->acks += nft;
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Batch Attr
+
+Prototype:  static int batch_attr(struct fw_batch* batch, int type,
+              const void* data, size_t len)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct fw_batch* batch
+    the batch
+  int type
+    the attribute type
+  const void* data
+    its value
+  size_t len
+    the length of the value
+
+Return Values:
+  0  success
+  -1 out of memory
+
+Description:
+  Appends an attribute to the current message, and to any open nests.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int batch_attr(struct fw_batch* batch, int type, const void* data, size_t len) {
+
+  struct nlattr* nla;
+
+  if (!(nla = (struct nlattr*)batch_put(batch, NLA_HDRLEN + len))) {
+    return -1;
+  }
+  nla->nla_type = type;
+  nla->nla_len = NLA_HDRLEN + len;
+  if (len) {
+    memcpy((char*)nla + NLA_HDRLEN, data, len);
+  }
+
+  ((struct nlmsghdr*)(batch->data + batch->msg))->nlmsg_len = batch->len - batch->msg;
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Batch U32
+
+Prototype:  static int batch_u32(struct fw_batch* batch, int type,
+              unsigned int value)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  as batch_attr, with a number for the value
+
+Return Values:
+  as batch_attr
+
+Description:
+  Appends a number attribute. nf_tables takes them in network order.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int batch_u32(struct fw_batch* batch, int type, unsigned int value) {
+
+  value = htonl(value);
+  return batch_attr(batch, type, &value, sizeof(value));
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Batch Str
+
+Prototype:  static int batch_str(struct fw_batch* batch, int type,
+              const char* value)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  as batch_attr, with a string for the value
+
+Return Values:
+  as batch_attr
+
+Description:
+  Appends a string attribute, with its terminator.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int batch_str(struct fw_batch* batch, int type, const char* value) {
+
+  return batch_attr(batch, type, value, strlen(value) + 1);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Batch Nest
+
+Prototype:  static int batch_nest(struct fw_batch* batch, int type)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct fw_batch* batch
+    the batch
+  int type
+    the attribute type, or 0 to close the innermost nest
+
+Return Values:
+  0  success
+  -1 out of memory
+
+Description:
+  Opens a nested attribute, which takes in everything appended until it is
+  closed.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int batch_nest(struct fw_batch* batch, int type) {
+
+  struct nlattr* nla;
+
+  if (type == 0) {
+    nla = (struct nlattr*)(batch->data + batch->nests[--batch->depth]);
+    nla->nla_len = batch->len - batch->nests[batch->depth];
+    return 0;
+  }
+
+  batch->nests[batch->depth++] = batch->len;
+  if (batch_attr(batch, type | NLA_F_NESTED, 0, 0) == -1) {
+    return -1;
+  }
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Batch Expr
+
+Prototype:  static int batch_expr(struct fw_batch* batch, const char* name)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct fw_batch* batch
+    the batch, inside a rule's expression list
+  const char* name
+    the expression, or 0 to close the one open
+
+Return Values:
+  0  success
+  -1 out of memory
+
+Description:
+  Opens an expression of a rule, its attributes follow until it is closed.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int batch_expr(struct fw_batch* batch, const char* name) {
+
+  if (!name) {
+    batch_nest(batch, 0);
+    return batch_nest(batch, 0);
+  }
+
+  if (batch_nest(batch, NFTA_LIST_ELEM) == -1 || batch_str(batch, NFTA_EXPR_NAME, name) == -1) {
+    return -1;
+  }
+  return batch_nest(batch, NFTA_EXPR_DATA);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Batch Data
+
+Prototype:  static int batch_data(struct fw_batch* batch, int type,
+              const void* data, size_t len)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct fw_batch* batch
+    the batch
+  int type
+    the attribute holding the value
+  const void* data
+    the value, in the byte order it is compared in
+  size_t len
+    its length
+
+Return Values:
+  0  success
+  -1 out of memory
+
+Description:
+  Appends a value the way nf_tables takes data to compare or set.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int batch_data(struct fw_batch* batch, int type, const void* data, size_t len) {
+
+  if (batch_nest(batch, type) == -1 || batch_attr(batch, NFTA_DATA_VALUE, data, len) == -1) {
+    return -1;
+  }
+  return batch_nest(batch, 0);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Batch Send
+
+Prototype:  static int batch_send(struct fw_batch* batch)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct fw_batch* batch
+    the finished batch
+
+Return Values:
+  0  the kernel applied the whole batch
+  -1 error, with the reason printed, nothing was applied
+
+Description:
+  Sends the batch in one go and waits for the kernel to ack every message in
+  it. nf_tables applies a batch as a single transaction: if any message
+  fails, none of them take effect.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int batch_send(struct fw_batch* batch) {
+
+  struct sockaddr_nl kernel = {0};
+  struct timeval timeout = {1, 0};
+  struct nlmsghdr* nlh;
+  struct nlmsgerr* err;
+  char reply[8192];
+  int size = batch->len + 4096;
+  int on = 1;
+  int fd, acks = 0, error = 0;
+  ssize_t n;
+
+  kernel.nl_family = AF_NETLINK;
+
+  if ((fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER)) == -1) {
+    perror("Netlink Socket");
+    return -1;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  // acks without a copy of the message they ack
+  setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &on, sizeof(on));
+
+  // the whole batch goes in one message, which has to fit the send buffer
+  if (setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)) == -1) {
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  }
+
+  if (sendto(fd, batch->data, batch->len, 0, (struct sockaddr*)&kernel, sizeof(kernel)) == -1) {
+    perror("Netlink Send");
+    close(fd);
+    return -1;
+  }
+
+  // an ack or an error for every message, stopping at the first error
+  while (acks < batch->acks && !error) {
+    if ((n = recv(fd, reply, sizeof(reply), 0)) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error = errno;
+      break;
+    }
+    for (nlh = (struct nlmsghdr*)reply; NLMSG_OK(nlh, n); nlh = NLMSG_NEXT(nlh, n)) {
+      if (nlh->nlmsg_type != NLMSG_ERROR) {
+        continue;
+      }
+      err = (struct nlmsgerr*)NLMSG_DATA(nlh);
+      if (err->error) {
+        error = -err->error;
+        break;
+      }
+      acks++;
+    }
+  }
+
+  close(fd);
+
+  if (error) {
+    errno = error;
+    perror("nftables");
+    return -1;
+  }
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Batch Chain
+
+Prototype:  static int batch_chain(struct fw_batch* batch, const char* name,
+              const char* type, int hook, int priority)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct fw_batch* batch
+    the batch
+  const char* name
+    the chain
+  const char* type
+    "filter" or "nat"
+  int hook
+    the netfilter hook it is attached to
+  int priority
+    its priority at the hook
+
+Return Values:
+  0  success
+  -1 out of memory
+
+Description:
+  Adds a base chain to the table.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int batch_chain(struct fw_batch* batch, const char* name, const char* type, int hook,
+  int priority) {
+
+  int failed = 0;
+
+  failed |= batch_msg(batch, NFT_MSG_NEWCHAIN, NLM_F_CREATE);
+  failed |= batch_str(batch, NFTA_CHAIN_TABLE, FIREWALL_TABLE);
+  failed |= batch_str(batch, NFTA_CHAIN_NAME, name);
+  failed |= batch_str(batch, NFTA_CHAIN_TYPE, type);
+  failed |= batch_nest(batch, NFTA_CHAIN_HOOK);
+  failed |= batch_u32(batch, NFTA_HOOK_HOOKNUM, hook);
+  failed |= batch_u32(batch, NFTA_HOOK_PRIORITY, (unsigned int)priority);
+  failed |= batch_nest(batch, 0);
+
+  return failed ? -1 : 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Batch Rule
+
+Prototype:  static int batch_rule(struct fw_batch* batch, int offset,
+              const char* set, int set_id)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct fw_batch* batch
+    the batch
+  int offset
+    where in the tcp header the port to match is, 0 for the source port or 2
+    for the destination
+  const char* set
+    the set of ports to match
+  int set_id
+    its id
+
+Return Values:
+  0  success
+  -1 out of memory
+
+Description:
+  Adds the rule
+    meta l4proto tcp tcp flags & rst == rst tcp sport|dport @set drop
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int batch_rule(struct fw_batch* batch, int offset, const char* set, int set_id) {
+
+  unsigned char tcp = IPPROTO_TCP;
+  unsigned char rst = 0x04;
+  unsigned char zero = 0;
+  int failed = 0;
+
+  failed |= batch_msg(batch, NFT_MSG_NEWRULE, NLM_F_CREATE | NLM_F_APPEND);
+  failed |= batch_str(batch, NFTA_RULE_TABLE, FIREWALL_TABLE);
+  failed |= batch_str(batch, NFTA_RULE_CHAIN, FIREWALL_CHAIN);
+  failed |= batch_nest(batch, NFTA_RULE_EXPRESSIONS);
+
+  // tcp only
+  failed |= batch_expr(batch, "meta");
+  failed |= batch_u32(batch, NFTA_META_KEY, NFT_META_L4PROTO);
+  failed |= batch_u32(batch, NFTA_META_DREG, NFT_REG_1);
+  failed |= batch_expr(batch, 0);
+  failed |= batch_expr(batch, "cmp");
+  failed |= batch_u32(batch, NFTA_CMP_SREG, NFT_REG_1);
+  failed |= batch_u32(batch, NFTA_CMP_OP, NFT_CMP_EQ);
+  failed |= batch_data(batch, NFTA_CMP_DATA, &tcp, 1);
+  failed |= batch_expr(batch, 0);
+
+  // with RST set
+  failed |= batch_expr(batch, "payload");
+  failed |= batch_u32(batch, NFTA_PAYLOAD_DREG, NFT_REG_1);
+  failed |= batch_u32(batch, NFTA_PAYLOAD_BASE, NFT_PAYLOAD_TRANSPORT_HEADER);
+  failed |= batch_u32(batch, NFTA_PAYLOAD_OFFSET, 13);
+  failed |= batch_u32(batch, NFTA_PAYLOAD_LEN, 1);
+  failed |= batch_expr(batch, 0);
+  failed |= batch_expr(batch, "bitwise");
+  failed |= batch_u32(batch, NFTA_BITWISE_SREG, NFT_REG_1);
+  failed |= batch_u32(batch, NFTA_BITWISE_DREG, NFT_REG_1);
+  failed |= batch_u32(batch, NFTA_BITWISE_LEN, 1);
+  failed |= batch_data(batch, NFTA_BITWISE_MASK, &rst, 1);
+  failed |= batch_data(batch, NFTA_BITWISE_XOR, &zero, 1);
+  failed |= batch_expr(batch, 0);
+  failed |= batch_expr(batch, "cmp");
+  failed |= batch_u32(batch, NFTA_CMP_SREG, NFT_REG_1);
+  failed |= batch_u32(batch, NFTA_CMP_OP, NFT_CMP_NEQ);
+  failed |= batch_data(batch, NFTA_CMP_DATA, &zero, 1);
+  failed |= batch_expr(batch, 0);
+
+  // on one of our ports
+  failed |= batch_expr(batch, "payload");
+  failed |= batch_u32(batch, NFTA_PAYLOAD_DREG, NFT_REG_1);
+  failed |= batch_u32(batch, NFTA_PAYLOAD_BASE, NFT_PAYLOAD_TRANSPORT_HEADER);
+  failed |= batch_u32(batch, NFTA_PAYLOAD_OFFSET, offset);
+  failed |= batch_u32(batch, NFTA_PAYLOAD_LEN, 2);
+  failed |= batch_expr(batch, 0);
+  failed |= batch_expr(batch, "lookup");
+  failed |= batch_u32(batch, NFTA_LOOKUP_SREG, NFT_REG_1);
+  failed |= batch_str(batch, NFTA_LOOKUP_SET, set);
+  failed |= batch_u32(batch, NFTA_LOOKUP_SET_ID, set_id);
+  failed |= batch_expr(batch, 0);
+
+  // dropped
+  failed |= batch_expr(batch, "immediate");
+  failed |= batch_u32(batch, NFTA_IMMEDIATE_DREG, NFT_REG_VERDICT);
+  failed |= batch_nest(batch, NFTA_IMMEDIATE_DATA);
+  failed |= batch_nest(batch, NFTA_DATA_VERDICT);
+  failed |= batch_u32(batch, NFTA_VERDICT_CODE, NF_DROP);
+  failed |= batch_nest(batch, 0);
+  failed |= batch_nest(batch, 0);
+  failed |= batch_expr(batch, 0);
+
+  failed |= batch_nest(batch, 0);
+
+  return failed ? -1 : 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Batch Elems
+
+Prototype:  static int batch_elems(struct fw_batch* batch, int type,
+              const char* name, int set_id, const unsigned char* ports,
+              struct fw_state* map)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct fw_batch* batch
+    the batch
+  int type
+    NFT_MSG_NEWSETELEM or NFT_MSG_DELSETELEM
+  const char* name
+    the set
+  int set_id
+    its id
+  const unsigned char* ports
+    65536 flags, indexed by port in network order, of the ports to add or
+    delete
+  struct fw_state* map
+    0 for a set, or for a map, the state holding the target each port maps to
+
+Return Values:
+  0  success
+  -1 out of memory
+
+Description:
+  Adds or deletes ports of a set, a few thousand per message. Split out of
+  batch_set so a reload can change a set in place.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int batch_elems(struct fw_batch* batch, int type, const char* name, int set_id,
+  const unsigned char* ports, struct fw_state* map) {
+
+  unsigned char key[FIREWALL_KEY_LEN] = {0};
+  unsigned char data[FIREWALL_KEY_LEN * 2] = {0};
+  unsigned short port;
+  int failed = 0;
+  int count = 0;
+  int i;
+
+  for (i = 0; i < 65536; i++) {
+    if (!ports[i]) {
+      continue;
+    }
+
+    if (count % FIREWALL_ELEMS_PER_MSG == 0) {
+      if (count) {
+        failed |= batch_nest(batch, 0);
+      }
+      failed |= batch_msg(batch, type, type == NFT_MSG_NEWSETELEM ? NLM_F_CREATE : 0);
+      failed |= batch_str(batch, NFTA_SET_ELEM_LIST_TABLE, FIREWALL_TABLE);
+      failed |= batch_str(batch, NFTA_SET_ELEM_LIST_SET, name);
+      failed |= batch_u32(batch, NFTA_SET_ELEM_LIST_SET_ID, set_id);
+      failed |= batch_nest(batch, NFTA_SET_ELEM_LIST_ELEMENTS);
+    }
+
+    port = (unsigned short)i;
+    memcpy(key, &port, sizeof(port));
+    failed |= batch_nest(batch, NFTA_LIST_ELEM);
+    failed |= batch_data(batch, NFTA_SET_ELEM_KEY, key, sizeof(key));
+    if (map && type == NFT_MSG_NEWSETELEM) {
+      memcpy(data, &map->ohosts[i], sizeof(map->ohosts[i]));
+      memcpy(data + FIREWALL_KEY_LEN, &map->otports[i], sizeof(map->otports[i]));
+      failed |= batch_data(batch, NFTA_SET_ELEM_DATA, data, sizeof(data));
+    }
+    failed |= batch_nest(batch, 0);
+    count++;
+  }
+  if (count) {
+    failed |= batch_nest(batch, 0);
+  }
+
+  return failed ? -1 : 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Batch Set
+
+Prototype:  static int batch_set(struct fw_batch* batch, const char* name,
+              int set_id, const unsigned char* ports, int size,
+              struct fw_state* map)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct fw_batch* batch
+    the batch
+  const char* name
+    the set
+  int set_id
+    its id
+  const unsigned char* ports
+    65536 flags, indexed by port in network order, of the ports to add
+  int size
+    the most ports the set will hold
+  struct fw_state* map
+    0 for a set, or for a map, the state holding the target each port maps to
+
+Return Values:
+  0  success
+  -1 out of memory
+
+Description:
+  Adds a set of ports, and its ports. A map takes each port to the address
+  and port of its target, laid out the way nat reads them from registers.
+
 Revisions:
-	(none)
+  Andrew Burian
+  2026-10-18
+  Made with room to spare for reloads, the ports are added by batch_elems
 
 ---------------------------------------------------------------------------- */
+static int batch_set(struct fw_batch* batch, const char* name, int set_id,
+  const unsigned char* ports, int size, struct fw_state* map) {
 
+  unsigned char key[FIREWALL_KEY_LEN] = {0};
+  unsigned char data[FIREWALL_KEY_LEN * 2] = {0};
+  int failed = 0;
 
-#include "portforward.h"
+  failed |= batch_msg(batch, NFT_MSG_NEWSET, NLM_F_CREATE);
+  failed |= batch_str(batch, NFTA_SET_TABLE, FIREWALL_TABLE);
+  failed |= batch_str(batch, NFTA_SET_NAME, name);
+  failed |= batch_u32(batch, NFTA_SET_ID, set_id);
+  failed |= batch_u32(batch, NFTA_SET_KEY_TYPE, FIREWALL_TYPE_PORT);
+  failed |= batch_u32(batch, NFTA_SET_KEY_LEN, sizeof(key));
+  if (map) {
+    failed |= batch_u32(batch, NFTA_SET_FLAGS, NFT_SET_MAP);
+    failed |= batch_u32(batch, NFTA_SET_DATA_TYPE, FIREWALL_TYPE_TARGET);
+    failed |= batch_u32(batch, NFTA_SET_DATA_LEN, sizeof(data));
+  }
 
+  // sized up front, so the kernel can pick a hash table that never grows
+  failed |= batch_nest(batch, NFTA_SET_DESC);
+  failed |= batch_u32(batch, NFTA_SET_DESC_SIZE, size);
+  failed |= batch_nest(batch, 0);
 
-#define FIREWALL_RULE "iptables -%c OUTPUT -p tcp %s %d --tcp-flags RST RST -j DROP > /dev/null 2>&1"
-#define FIREWALL_RULE_MAX_LEN 97
+  failed |= batch_elems(batch, NFT_MSG_NEWSETELEM, name, set_id, ports, map);
 
+  return failed ? -1 : 0;
+}
 
 /* ----------------------------------------------------------------------------
 FUNCTION
 
-Name:		Invoke Firewall Source Port
+Name:		Batch Nat
 
-Prototype:  void firewall_invoke_srcport(int port)
+Prototype:  static int batch_nat(struct fw_batch* batch, unsigned int ip)
 
-Developer:	Jordan Marling
+Developer:	Andrew Burian
 
-Created On:	2015-03-21
+Created On:	2026-10-18
 
 Parameters:
-  int port
-    The source port to not allow resets from
+  struct fw_batch* batch
+    the batch, after the offloads map
+  unsigned int ip
+    the forwarder's address (network order)
 
 Return Values:
-  void
+  0  success
+  -1 out of memory
+
+Description:
+  Adds the chains and rules that forward the offloaded ports in the kernel,
+  the same rewrite the userspace engine does:
+    prerouting:   ip daddr <ip> tcp dport @offloads dnat to the mapped target
+    postrouting:  ct original ip daddr <ip> ct original proto-dst @offloads
+                  snat to <ip>
+  so the client talks to us, and the target sees us as the client.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int batch_nat(struct fw_batch* batch, unsigned int ip) {
+
+  unsigned char tcp = IPPROTO_TCP;
+  unsigned char original = IP_CT_DIR_ORIGINAL;
+  int failed = 0;
+
+  failed |= batch_chain(batch, FIREWALL_PREROUTING, "nat", NF_INET_PRE_ROUTING, -100);
+  failed |= batch_chain(batch, FIREWALL_POSTROUTING, "nat", NF_INET_POST_ROUTING, 100);
+
+  // dnat connections to an offloaded port on our address
+  failed |= batch_msg(batch, NFT_MSG_NEWRULE, NLM_F_CREATE | NLM_F_APPEND);
+  failed |= batch_str(batch, NFTA_RULE_TABLE, FIREWALL_TABLE);
+  failed |= batch_str(batch, NFTA_RULE_CHAIN, FIREWALL_PREROUTING);
+  failed |= batch_nest(batch, NFTA_RULE_EXPRESSIONS);
+
+  failed |= batch_expr(batch, "meta");
+  failed |= batch_u32(batch, NFTA_META_KEY, NFT_META_L4PROTO);
+  failed |= batch_u32(batch, NFTA_META_DREG, NFT_REG_1);
+  failed |= batch_expr(batch, 0);
+  failed |= batch_expr(batch, "cmp");
+  failed |= batch_u32(batch, NFTA_CMP_SREG, NFT_REG_1);
+  failed |= batch_u32(batch, NFTA_CMP_OP, NFT_CMP_EQ);
+  failed |= batch_data(batch, NFTA_CMP_DATA, &tcp, 1);
+  failed |= batch_expr(batch, 0);
+
+  failed |= batch_expr(batch, "payload");
+  failed |= batch_u32(batch, NFTA_PAYLOAD_DREG, NFT_REG_1);
+  failed |= batch_u32(batch, NFTA_PAYLOAD_BASE, NFT_PAYLOAD_NETWORK_HEADER);
+  failed |= batch_u32(batch, NFTA_PAYLOAD_OFFSET, 16);
+  failed |= batch_u32(batch, NFTA_PAYLOAD_LEN, 4);
+  failed |= batch_expr(batch, 0);
+  failed |= batch_expr(batch, "cmp");
+  failed |= batch_u32(batch, NFTA_CMP_SREG, NFT_REG_1);
+  failed |= batch_u32(batch, NFTA_CMP_OP, NFT_CMP_EQ);
+  failed |= batch_data(batch, NFTA_CMP_DATA, &ip, sizeof(ip));
+  failed |= batch_expr(batch, 0);
+
+  // the map loads the target address into the first 32 bit register, its port the next
+  failed |= batch_expr(batch, "payload");
+  failed |= batch_u32(batch, NFTA_PAYLOAD_DREG, NFT_REG_1);
+  failed |= batch_u32(batch, NFTA_PAYLOAD_BASE, NFT_PAYLOAD_TRANSPORT_HEADER);
+  failed |= batch_u32(batch, NFTA_PAYLOAD_OFFSET, 2);
+  failed |= batch_u32(batch, NFTA_PAYLOAD_LEN, 2);
+  failed |= batch_expr(batch, 0);
+  failed |= batch_expr(batch, "lookup");
+  failed |= batch_u32(batch, NFTA_LOOKUP_SREG, NFT_REG_1);
+  failed |= batch_u32(batch, NFTA_LOOKUP_DREG, NFT_REG32_00);
+  failed |= batch_str(batch, NFTA_LOOKUP_SET, FIREWALL_OFFLOADS);
+  failed |= batch_u32(batch, NFTA_LOOKUP_SET_ID, FIREWALL_OFFLOADS_ID);
+  failed |= batch_expr(batch, 0);
+
+  failed |= batch_expr(batch, "nat");
+  failed |= batch_u32(batch, NFTA_NAT_TYPE, NFT_NAT_DNAT);
+  failed |= batch_u32(batch, NFTA_NAT_FAMILY, NFPROTO_IPV4);
+  failed |= batch_u32(batch, NFTA_NAT_REG_ADDR_MIN, NFT_REG32_00);
+  failed |= batch_u32(batch, NFTA_NAT_REG_PROTO_MIN, NFT_REG32_01);
+  failed |= batch_expr(batch, 0);
+
+  failed |= batch_nest(batch, 0);
+
+  // snat them on the way to the target
+  failed |= batch_msg(batch, NFT_MSG_NEWRULE, NLM_F_CREATE | NLM_F_APPEND);
+  failed |= batch_str(batch, NFTA_RULE_TABLE, FIREWALL_TABLE);
+  failed |= batch_str(batch, NFTA_RULE_CHAIN, FIREWALL_POSTROUTING);
+  failed |= batch_nest(batch, NFTA_RULE_EXPRESSIONS);
+
+  failed |= batch_expr(batch, "ct");
+  failed |= batch_u32(batch, NFTA_CT_KEY, NFT_CT_DST_IP);
+  failed |= batch_attr(batch, NFTA_CT_DIRECTION, &original, 1);
+  failed |= batch_u32(batch, NFTA_CT_DREG, NFT_REG_1);
+  failed |= batch_expr(batch, 0);
+  failed |= batch_expr(batch, "cmp");
+  failed |= batch_u32(batch, NFTA_CMP_SREG, NFT_REG_1);
+  failed |= batch_u32(batch, NFTA_CMP_OP, NFT_CMP_EQ);
+  failed |= batch_data(batch, NFTA_CMP_DATA, &ip, sizeof(ip));
+  failed |= batch_expr(batch, 0);
+
+  failed |= batch_expr(batch, "ct");
+  failed |= batch_u32(batch, NFTA_CT_KEY, NFT_CT_PROTO_DST);
+  failed |= batch_attr(batch, NFTA_CT_DIRECTION, &original, 1);
+  failed |= batch_u32(batch, NFTA_CT_DREG, NFT_REG_1);
+  failed |= batch_expr(batch, 0);
+  failed |= batch_expr(batch, "lookup");
+  failed |= batch_u32(batch, NFTA_LOOKUP_SREG, NFT_REG_1);
+  failed |= batch_str(batch, NFTA_LOOKUP_SET, FIREWALL_OFFLOADS);
+  failed |= batch_u32(batch, NFTA_LOOKUP_SET_ID, FIREWALL_OFFLOADS_ID);
+  failed |= batch_expr(batch, 0);
+
+  failed |= batch_expr(batch, "immediate");
+  failed |= batch_u32(batch, NFTA_IMMEDIATE_DREG, NFT_REG_1);
+  failed |= batch_data(batch, NFTA_IMMEDIATE_DATA, &ip, sizeof(ip));
+  failed |= batch_expr(batch, 0);
+  failed |= batch_expr(batch, "nat");
+  failed |= batch_u32(batch, NFTA_NAT_TYPE, NFT_NAT_SNAT);
+  failed |= batch_u32(batch, NFTA_NAT_FAMILY, NFPROTO_IPV4);
+  failed |= batch_u32(batch, NFTA_NAT_REG_ADDR_MIN, NFT_REG_1);
+  failed |= batch_expr(batch, 0);
+
+  failed |= batch_nest(batch, 0);
+
+  return failed ? -1 : 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Set Size
+
+Prototype:  static int set_size(const unsigned char* ports)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  const unsigned char* ports
+    65536 flags of the ports in a set
+
+Return Values:
+  the number of ports in it
 
 Description:
-  Invokes a firewall rule to not allow TCP RST packets outgoing on the source
-  port.
+  Counts the ports of a set.
 
 Revisions:
   (none)
 
 ---------------------------------------------------------------------------- */
-void firewall_invoke_srcport(int port) {
+static int set_size(const unsigned char* ports) {
 
-  char rule[FIREWALL_RULE_MAX_LEN];
+  int count = 0;
+  int i;
 
-  // delete rule
-  sprintf(rule, FIREWALL_RULE, 'D', "--sport", port);
-  system(rule);
+  for (i = 0; i < 65536; i++) {
+    count += ports[i];
+  }
 
-  // add rule
-  sprintf(rule, FIREWALL_RULE, 'A', "--sport", port);
-  system(rule);
+  return count;
 }
 
 /* ----------------------------------------------------------------------------
 FUNCTION
 
-Name:		Invoke Firewall Destination Port
+Name:		Set Room
 
-Prototype:  void firewall_invoke_dstport(int port)
+Prototype:  static int set_room(int count)
 
-Developer:	Jordan Marling
+Developer:	Andrew Burian
 
-Created On:	2015-03-21
+Created On:	2026-10-18
+
+Parameters:
+  int count
+    the ports a set is made with
+
+Return Values:
+  the most ports it's made to hold
+
+Description:
+  Leaves room for reloads to add ports without rebuilding the table.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int set_room(int count) {
+
+  count = count * 2 + FIREWALL_SPARE_PORTS;
+  return count > 65536 ? 65536 : count;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		State Forwards
+
+Prototype:  static void state_forwards(struct fw_state* state,
+              struct pf_target* targets, size_t targetCount)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct fw_state* state
+    the table to fill
+  struct pf_target* targets
+    the forwards done in userspace
+  size_t targetCount
+    the number of them
+
+Return Values:
+  void
+
+Description:
+  Sets the ports that must not be reset to those of the forwards.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void state_forwards(struct fw_state* state, struct pf_target* targets,
+  size_t targetCount) {
+
+  size_t i;
+
+  memset(state->sports, 0, sizeof(state->sports));
+  memset(state->dports, 0, sizeof(state->dports));
+  for (i = 0; i < targetCount; i++) {
+    state->sports[targets[i].port.a_port] = 1;
+    state->dports[targets[i].port.b_port] = 1;
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		State Offloads
+
+Prototype:  static void state_offloads(struct fw_state* state,
+              struct pf_target* offloads, size_t offloadCount)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
 
 Parameters:
-  int port
-    The destination port to not allow resets from
+  struct fw_state* state
+    the table to fill
+  struct pf_target* offloads
+    the forwards offloaded to the kernel
+  size_t offloadCount
+    the number of them
 
 Return Values:
   void
 
 Description:
-  Invokes a firewall rule to not allow TCP RST packets outgoing on the destination
-  port.
+  Sets the offloads map to the forwards, the first forward on a port wins,
+  as in the dispatch tables.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void state_offloads(struct fw_state* state, struct pf_target* offloads,
+  size_t offloadCount) {
+
+  size_t i;
+
+  memset(state->oports, 0, sizeof(state->oports));
+  for (i = 0; i < offloadCount; i++) {
+    if (!state->oports[offloads[i].port.a_port]) {
+      state->oports[offloads[i].port.a_port] = 1;
+      state->ohosts[offloads[i].port.a_port] = offloads[i].host;
+      state->otports[offloads[i].port.a_port] = offloads[i].port.b_port;
+    }
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Firewall Build
+
+Prototype:  static int firewall_build(struct pf_config* config,
+              struct fw_state* next)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_config* config
+    the global settings, for the forwarder's address
+  struct fw_state* next
+    the table to install, kept as the installed one on success
+
+Return Values:
+  0  success
+  -1 error, with the reason printed
+
+Description:
+  Installs the whole table in one transaction, replacing any table already
+  there, so there's never a moment without rules. Moved out of
+  firewall_install so a reload that outgrows the sets can rebuild them.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int firewall_build(struct pf_config* config, struct fw_state* next) {
+
+  struct fw_batch batch = {0};
+  int offloaded = set_size(next->oports);
+  int failed = 0;
+
+  next->sports_size = set_room(set_size(next->sports));
+  next->dports_size = set_room(set_size(next->dports));
+  next->oports_size = set_room(offloaded);
+  next->nat = offloaded > 0;
+
+  failed |= batch_msg(&batch, NFNL_MSG_BATCH_BEGIN, 0);
+
+  // add then delete, so an old table is gone and a missing one isn't an error
+  failed |= batch_msg(&batch, NFT_MSG_NEWTABLE, NLM_F_CREATE);
+  failed |= batch_str(&batch, NFTA_TABLE_NAME, FIREWALL_TABLE);
+  failed |= batch_msg(&batch, NFT_MSG_DELTABLE, 0);
+  failed |= batch_str(&batch, NFTA_TABLE_NAME, FIREWALL_TABLE);
+
+  failed |= batch_msg(&batch, NFT_MSG_NEWTABLE, NLM_F_CREATE);
+  failed |= batch_str(&batch, NFTA_TABLE_NAME, FIREWALL_TABLE);
+
+  failed |= batch_chain(&batch, FIREWALL_CHAIN, "filter", NF_INET_LOCAL_OUT, 0);
+  failed |= batch_set(&batch, FIREWALL_SPORTS, FIREWALL_SPORTS_ID, next->sports,
+    next->sports_size, 0);
+  failed |= batch_set(&batch, FIREWALL_DPORTS, FIREWALL_DPORTS_ID, next->dports,
+    next->dports_size, 0);
+  failed |= batch_rule(&batch, 0, FIREWALL_SPORTS, FIREWALL_SPORTS_ID);
+  failed |= batch_rule(&batch, 2, FIREWALL_DPORTS, FIREWALL_DPORTS_ID);
+
+  if (next->nat) {
+    failed |= batch_set(&batch, FIREWALL_OFFLOADS, FIREWALL_OFFLOADS_ID, next->oports,
+      next->oports_size, next);
+    failed |= batch_nat(&batch, config->ip);
+  }
+
+  failed |= batch_msg(&batch, NFNL_MSG_BATCH_END, 0);
+
+  if (failed) {
+    perror("Firewall Rules");
+    free(batch.data);
+    return -1;
+  }
+
+  failed = batch_send(&batch);
+  free(batch.data);
+
+  if (!failed) {
+    if (installed != next) {
+      free(installed);
+    }
+    installed = next;
+  }
+
+  return failed;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Firewall Apply
+
+Prototype:  static int firewall_apply(struct pf_config* config,
+              struct fw_state* next)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_config* config
+    the global settings, for the forwarder's address
+  struct fw_state* next
+    the table wanted, kept as the installed one on success and freed
+    otherwise
+
+Return Values:
+  0  success
+  -1 error, with the reason printed, the installed rules are left as they
+     were
+
+Description:
+  Changes the installed table into next in one transaction that only adds
+  and deletes the ports that differ, so the ports left alone never lose
+  their rules. A map entry whose target changed is deleted and added again.
+  If a set would outgrow the room it was made with, or offloads appear
+  where there were no nat rules, the whole table is rebuilt instead. Logs
+  what changed and how long it took.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int firewall_apply(struct pf_config* config, struct fw_state* next) {
+
+  struct fw_batch batch = {0};
+  struct timespec start, end;
+  unsigned char* add[3];
+  unsigned char* del[3];
+  int added = 0;
+  int removed = 0;
+  int failed = 0;
+  int i, j;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (set_size(next->sports) > installed->sports_size
+    || set_size(next->dports) > installed->dports_size
+    || set_size(next->oports) > installed->oports_size
+    || (!installed->nat && set_size(next->oports))) {
+
+    if (firewall_build(config, next) == -1) {
+      free(next);
+      return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Firewall rules rebuilt with room for more ports in %.2fms\n",
+      (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    return 0;
+  }
+  next->sports_size = installed->sports_size;
+  next->dports_size = installed->dports_size;
+  next->oports_size = installed->oports_size;
+  next->nat = installed->nat;
+
+  // the ports to add to and delete from each set
+  for (i = 0; i < 3; i++) {
+    add[i] = (unsigned char*)calloc(65536, 1);
+    del[i] = (unsigned char*)calloc(65536, 1);
+    failed |= !add[i] || !del[i];
+  }
+  if (failed) {
+    perror("Firewall Rules");
+    for (i = 0; i < 3; i++) {
+      free(add[i]);
+      free(del[i]);
+    }
+    free(next);
+    return -1;
+  }
+  for (j = 0; j < 65536; j++) {
+    add[0][j] = next->sports[j] && !installed->sports[j];
+    del[0][j] = !next->sports[j] && installed->sports[j];
+    add[1][j] = next->dports[j] && !installed->dports[j];
+    del[1][j] = !next->dports[j] && installed->dports[j];
+    add[2][j] = next->oports[j] && (!installed->oports[j]
+      || next->ohosts[j] != installed->ohosts[j] || next->otports[j] != installed->otports[j]);
+    del[2][j] = installed->oports[j] && (!next->oports[j] || add[2][j]);
+    added += add[0][j] + add[1][j] + add[2][j];
+    removed += del[0][j] + del[1][j] + del[2][j];
+  }
+
+  if (added || removed) {
+    failed |= batch_msg(&batch, NFNL_MSG_BATCH_BEGIN, 0);
+    failed |= batch_elems(&batch, NFT_MSG_DELSETELEM, FIREWALL_SPORTS, FIREWALL_SPORTS_ID,
+      del[0], 0);
+    failed |= batch_elems(&batch, NFT_MSG_DELSETELEM, FIREWALL_DPORTS, FIREWALL_DPORTS_ID,
+      del[1], 0);
+    failed |= batch_elems(&batch, NFT_MSG_NEWSETELEM, FIREWALL_SPORTS, FIREWALL_SPORTS_ID,
+      add[0], 0);
+    failed |= batch_elems(&batch, NFT_MSG_NEWSETELEM, FIREWALL_DPORTS, FIREWALL_DPORTS_ID,
+      add[1], 0);
+    if (next->nat) {
+      failed |= batch_elems(&batch, NFT_MSG_DELSETELEM, FIREWALL_OFFLOADS, FIREWALL_OFFLOADS_ID,
+        del[2], next);
+      failed |= batch_elems(&batch, NFT_MSG_NEWSETELEM, FIREWALL_OFFLOADS, FIREWALL_OFFLOADS_ID,
+        add[2], next);
+    }
+    failed |= batch_msg(&batch, NFNL_MSG_BATCH_END, 0);
+
+    if (failed) {
+      perror("Firewall Rules");
+    }
+    else {
+      failed = batch_send(&batch);
+    }
+    free(batch.data);
+  }
+
+  for (i = 0; i < 3; i++) {
+    free(add[i]);
+    free(del[i]);
+  }
+
+  if (failed) {
+    free(next);
+    return -1;
+  }
+
+  free(installed);
+  installed = next;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (added || removed) {
+    printf("Firewall rules updated, %d ports added and %d removed in %.2fms\n", added, removed,
+      (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+  }
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Firewall Install
+
+Prototype:  int firewall_install(struct pf_config* config, struct pf_target* targets,
+              size_t targetCount, struct pf_target* offloads, size_t offloadCount)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_config* config
+    the global settings, for the forwarder's address
+  struct pf_target* targets
+    the forwards done in userspace
+  size_t targetCount
+    the number of them
+  struct pf_target* offloads
+    the forwards offloaded to the kernel
+  size_t offloadCount
+    the number of them
+
+Return Values:
+  0  success
+  -1 error, with the reason printed
+
+Description:
+  Installs the rules to not allow TCP RST packets outgoing on any forwarded
+  port or to any target port, and the nat rules for offloaded forwards. A
+  table left over from an earlier run is replaced in the same transaction,
+  so there's never a moment without rules. Logs how long it took.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Also installs the forwards offloaded to the kernel
+
+  Andrew Burian
+  2026-10-18
+  The table is built by firewall_build, and remembered for reloads
+
+---------------------------------------------------------------------------- */
+int firewall_install(struct pf_config* config, struct pf_target* targets, size_t targetCount,
+  struct pf_target* offloads, size_t offloadCount) {
+
+  struct timespec start, end;
+  struct fw_state* next;
+  int failed;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  next = (struct fw_state*)calloc(1, sizeof(struct fw_state));
+  if (!next) {
+    perror("Firewall Rules");
+    return -1;
+  }
+  state_forwards(next, targets, targetCount);
+  state_offloads(next, offloads, offloadCount);
+
+  failed = firewall_build(config, next);
+  if (failed) {
+    free(next);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (!failed) {
+    printf("Firewall rules for %zu forwards and %zu offloads installed in %.2fms\n", targetCount,
+      offloadCount, (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+  }
+
+  return failed;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Firewall Update
+
+Prototype:  int firewall_update(struct pf_config* config, struct pf_target* targets,
+              size_t targetCount)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_config* config
+    the global settings, for the forwarder's address
+  struct pf_target* targets
+    every forward done in userspace after a reload, draining ones included
+  size_t targetCount
+    the number of them
+
+Return Values:
+  0  success, or no rules were installed
+  -1 error, with the reason printed, the rules are left as they were
+
+Description:
+  Brings the reset rules in line with a reloaded set of forwards, adding
+  and deleting only the ports that changed.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+int firewall_update(struct pf_config* config, struct pf_target* targets, size_t targetCount) {
+
+  struct fw_state* next;
+
+  if (!installed) {
+    return 0;
+  }
+
+  next = (struct fw_state*)malloc(sizeof(struct fw_state));
+  if (!next) {
+    perror("Firewall Rules");
+    return -1;
+  }
+  memcpy(next, installed, sizeof(struct fw_state));
+  state_forwards(next, targets, targetCount);
+
+  return firewall_apply(config, next);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Firewall Offload
+
+Prototype:  int firewall_offload(struct pf_config* config, struct pf_target* offloads,
+              size_t offloadCount)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_config* config
+    the global settings, for the forwarder's address
+  struct pf_target* offloads
+    the forwards offloaded to the kernel after a reload
+  size_t offloadCount
+    the number of them
+
+Return Values:
+  0  success, or no rules were installed
+  -1 error, with the reason printed, the rules are left as they were
+
+Description:
+  Brings the offloads map in line with a reload, adding and deleting only
+  the ports that changed. Connections the kernel already tracks keep their
+  nat until they close.
 
 Revisions:
   (none)
 
 ---------------------------------------------------------------------------- */
-void firewall_invoke_dstport(int port) {
+int firewall_offload(struct pf_config* config, struct pf_target* offloads, size_t offloadCount) {
+
+  struct fw_state* next;
+
+  if (!installed) {
+    return 0;
+  }
+
+  next = (struct fw_state*)malloc(sizeof(struct fw_state));
+  if (!next) {
+    perror("Firewall Rules");
+    return -1;
+  }
+  memcpy(next, installed, sizeof(struct fw_state));
+  state_offloads(next, offloads, offloadCount);
+
+  return firewall_apply(config, next);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Firewall Remove
+
+Prototype:  void firewall_remove(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  void
+
+Description:
+  Deletes the table firewall_install made, and every rule and set in it.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Forgets the installed table
+
+---------------------------------------------------------------------------- */
+void firewall_remove(void) {
 
-  char rule[FIREWALL_RULE_MAX_LEN];
+  struct fw_batch batch = {0};
+  int failed = 0;
 
-  // delete rule
-  sprintf(rule, FIREWALL_RULE, 'D', "--dport", port);
-  system(rule);
+  failed |= batch_msg(&batch, NFNL_MSG_BATCH_BEGIN, 0);
+  failed |= batch_msg(&batch, NFT_MSG_DELTABLE, 0);
+  failed |= batch_str(&batch, NFTA_TABLE_NAME, FIREWALL_TABLE);
+  failed |= batch_msg(&batch, NFNL_MSG_BATCH_END, 0);
 
-  // add rule
-  sprintf(rule, FIREWALL_RULE, 'A', "--dport", port);
-  system(rule);
+  if (!failed) {
+    batch_send(&batch);
+  }
+  free(batch.data);
 
+  free(installed);
+  installed = 0;
 }
@@ -11,39 +11,140 @@ Developer:	Jordan Marling
 Created On:	2015-03-15
 
 Functions:
-  void forward(struct pf_target* targets, size_t targetCount)
+  void forward(struct pf_target* targets, size_t targetCount, struct pf_config* config)
+  int forward_init(struct pf_target* targets, size_t targetCount, struct pf_config* config)
+  int forward_packet(struct pf_worker* worker, char* buffer, int datagram_length,
+    struct sockaddr_in* dst_addr)
+  void rewrite_packet(struct iphdr* ip_header, struct tcphdr* tcp_header,
+    unsigned int saddr, unsigned int daddr, unsigned short sport,
+    unsigned short dport)
   struct pf_target *find_source_target(unsigned int host, unsigned int port)
   struct pf_target *find_dest_target(unsigned int host, unsigned int port)
-  struct pf_target *find_host(unsigned int host, unsigned int port)
-  struct pf_target *find_host_by_target(unsigned int target_host, unsigned int port)
+  void worker_pin(int id, int cpu)
+  void worker_busy_poll(int id, int socket_descriptor)
+  void worker_tick(struct pf_worker* worker)
 
 Description:
   The core of the forwarding engine
 
 Revisions:
-  (none)
+  Andrew Burian
+  2026-10-18
+  Known hosts moved into the hashed connection table in conntrack.c
+
+  Andrew Burian
+  2026-10-18
+  Forwarding is done by worker threads
+
+  Andrew Burian
+  2026-10-18
+  Targets are found through the dispatch tables
+
+  Andrew Burian
+  2026-10-18
+  Established connections can be forwarded by the xdp fast path
+
+  Andrew Burian
+  2026-10-18
+  Ports with several targets are balanced over them
+
+  Andrew Burian
+  2026-10-18
+  Per target metrics kept by each worker
+
+  Andrew Burian
+  2026-10-18
+  The forwards are reloaded on SIGHUP, into a new table the workers are
+  switched to without stopping
+
+  Andrew Burian
+  2026-10-18
+  Workers can busy poll their sockets instead of sleeping on them
+
+  Andrew Burian
+  2026-10-18
+  Connections can be saved on exit and restored by the next start
+
+  Andrew Burian
+  2026-10-18
+  Connections are replicated to a standby, which takes over with them
 
 ---------------------------------------------------------------------------- */
 
 
 #include "portforward.h"
+#include <sys/mman.h>
 
 // Globals
 
-// the array of targets
-struct pf_target* targets = 0;
-size_t targetCount = 0;
-
-// known hosts
-struct pf_host* hosts = 0;
-size_t hostCount = 0;
+// the targets compiled for lookup, replaced whole on a reload and never
+// changed in place, so the workers read it without locks
+static struct pf_table* table = 0;
+
+// bumped after a new table is swapped in, every worker copies it between
+// packets, so once they all have it none can still be reading the old one
+static unsigned long epoch = 0;
+
+// an array of targets a table has pointed into, newest first. It is kept
+// until no connection uses any of its targets, only the ones a reload
+// read are ours to free
+struct pf_generation{
+  struct pf_target* targets;
+  size_t targetCount;
+  int owned;
+  struct pf_generation* next;
+};
+static struct pf_generation* generations = 0;
+
+// metrics slots each worker has, target ids stay below it
+static size_t slots = 0;
+
+// the load of each target id, which every copy of the target points to, in
+// chunks that never move once the workers can see them
+#define LOAD_CHUNK 1024
+static struct pf_load** loads = 0;
+static size_t loadChunks = 0;
+
+// global settings
+struct pf_config* config = 0;
+
+// the xdp fast path in front of the workers
+static struct pf_xdp* xdp = 0;
+
+// the thread running forward, told by a failed worker to shut down
+static pthread_t forwarder;
+
+// listening loop
+static volatile sig_atomic_t running = 1;
+
+static int worker_open(struct pf_worker* worker, int id);
+static void *worker_run(void* arg);
+static void worker_close(struct pf_worker* worker);
+static void forward_single(struct pf_worker* worker);
+static void forward_batched(struct pf_worker* worker);
+static void count_packet(struct pf_metrics* metrics, int dir, struct tcphdr* tcp_header,
+  int length);
+static int forward_reload(struct pf_worker* workers, struct pf_metrics_server* metrics);
+static size_t target_hash(const struct pf_target* target);
+static void forward_drain(struct pf_worker* workers, struct pf_metrics_server* metrics);
+static void forward_filtered(struct pf_worker* workers, int workerCount,
+  unsigned long segments);
+static int forward_publish(struct pf_worker* workers, struct pf_metrics_server* metrics,
+  struct pf_target* targets, size_t targetCount, struct pf_target** draining,
+  size_t drainingCount);
+static void forward_synchronize(struct pf_worker* workers);
+static void forward_sweep(void);
+static void table_free(struct pf_table* old);
+static struct pf_load *forward_load(size_t id);
+static void forward_free(void);
 
 /* ----------------------------------------------------------------------------
 FUNCTION
 
 Name:		Forward
 
-Prototype:  void forward(struct pf_target* targets, size_t targetCount);
+Prototype:  void forward(struct pf_target* m_targets, size_t m_targetCount,
+              struct pf_config* m_config);
 
 Developer:	Jordan Marling
 
@@ -54,356 +155,2233 @@ Parameters:
     the array of targets
   size_t m_targetCount
     the number of targets in the array
-  unsigned int ip
-    the local ip address of the port forwarder machine
+  struct pf_config* m_config
+    the global settings, including the local ip address of the forwarder
 
 Return Values:
   None
 
 Description:
   Listens for TCP packets coming in, then forwards them based on the data
-  in the targets and hosts arrays.
+  in the targets and hosts arrays. Runs until SIGINT or SIGTERM, SIGHUP
+  reloads the forwards from the config.
 
 Revisions:
   Andrew Burian
   2015-03-15
   Added args so that it could be moved out of main.c
 
+  Andrew Burian
+  2026-10-18
+  Hosts are looked up, added and removed through the connection table
+
+  Andrew Burian
+  2026-10-18
+  Takes the global settings, headers are rewritten through rewrite_packet
+
+  Andrew Burian
+  2026-10-18
+  The loop is run per packet or in batches, counters reported on shutdown
+
+  Andrew Burian
+  2026-10-18
+  Runs the packet_mmap backend when it is configured
+
+  Andrew Burian
+  2026-10-18
+  Runs the configured number of workers, each with its own sockets and
+  connection table, until SIGINT or SIGTERM
+
+  Andrew Burian
+  2026-10-18
+  Loads the xdp fast path in front of the workers when it is configured
+
+  Andrew Burian
+  2026-10-18
+  SIGUSR1 prints the targets' measured handshakes, as does the report
+
+  Andrew Burian
+  2026-10-18
+  Keeps per target metrics in every worker and serves them, counts lookup misses
+
+  Andrew Burian
+  2026-10-18
+  SIGHUP reloads the forwards, and removed targets are let go once their
+  connections have closed
+
+  Andrew Burian
+  2026-10-18
+  Reports how much the socket filters dropped, on exit and on SIGUSR1
+
+  Andrew Burian
+  2026-10-18
+  Locks all of its memory in busy poll mode, so a spinning worker never
+  waits on a page fault
+
+  Andrew Burian
+  2026-10-18
+  Restores the snapshot's connections before the workers start and saves
+  them once they stop, and reports when the first packet went out
+
+  Andrew Burian
+  2026-10-18
+  Stands by for the active forwarder when it is a standby, and reports
+  what was sent to the standby
+
 ---------------------------------------------------------------------------- */
-void forward(struct pf_target* m_targets, size_t m_targetCount, unsigned int ip) {
+void forward(struct pf_target* m_targets, size_t m_targetCount, struct pf_config* m_config) {
 
-  // socket descriptors
-  int socket_descriptor;
+  // the workers
+  struct pf_worker* workers;
+  struct pf_stats total = {0};
+  struct pf_metrics_server* metrics = 0;
+  cpu_set_t cpus;
+  size_t flows = 0;
+  size_t table_bytes = 0;
+  int opened = 0;
+  int started = 0;
 
-  // ip variables
-  char buffer[IP_DATA_LEN];
-  int datagram_length;
-  struct iphdr *ip_header;
-  int hdrincl = 1;
+  // when the first packet went out, once any worker has forwarded one
+  unsigned long first = 0;
 
-  // transport layer
-  struct tcphdr *tcp_header;
-  struct sockaddr_in dst_addr = {0};
+  // the host's TCP segments when the socket filters went on
+  unsigned long segments = 0;
 
-  // listening loop
-  int running = 1;
+  // shutdown signals
+  sigset_t stop;
+  int sig;
 
-  // forwarding
-  struct pf_target *target;
-  struct pf_host *host;
+  // how often removed targets are checked for their last connection
+  struct timespec drain = {RELOAD_DRAIN_MS / 1000, (RELOAD_DRAIN_MS % 1000) * 1000000L};
+
+  // timing
+  struct timespec start, end;
+  double seconds;
 
   // counter
   int i;
 
   // set globals
-  targets = m_targets;
-  targetCount = m_targetCount;
+  if (forward_init(m_targets, m_targetCount, m_config) == -1) {
+    perror("Dispatch Tables");
+    return;
+  }
 
-  // setup sockets
-  if ((socket_descriptor = socket(AF_INET, SOCK_RAW, IPPROTO_TCP)) == -1) {
-    perror("TCP Server Socket");
+  // ctrl-c and kill are only taken by this thread, the workers inherit the mask,
+  // SIGUSR1 asks for the targets' measurements, SIGHUP for a reload and
+  // SIGUSR2 has a standby take over
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGINT);
+  sigaddset(&stop, SIGTERM);
+  sigaddset(&stop, SIGUSR1);
+  sigaddset(&stop, SIGHUP);
+  sigaddset(&stop, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &stop, 0);
+  forwarder = pthread_self();
+
+  if (!(workers = (struct pf_worker*)calloc(config->workers, sizeof(struct pf_worker)))) {
+    perror("Workers");
     return;
   }
 
-  // tell the stack to let us handle the IP header
-  if (setsockopt(socket_descriptor, IPPROTO_IP, IP_HDRINCL, &hdrincl, sizeof(hdrincl)) == -1) {
-      perror("SetSockOpt IP_HDRINCL");
+  // everything mapped from here on is faulted in and kept, stacks included,
+  // and spinning workers need cpus to themselves
+  if (config->latency_mode == LATENCY_BUSY_POLL) {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+      perror("Warning: mlockall");
+    }
+    if (!sched_getaffinity(0, sizeof(cpus), &cpus) && CPU_COUNT(&cpus) <= config->workers) {
+      fprintf(stderr, "Warning: %d busy polling workers on %d cpus leave none for the kernel\n",
+        config->workers, CPU_COUNT(&cpus));
+    }
   }
 
-  while (running) {
+  // the fast path goes in before any worker can see a connection established
+  if (config->xdp != XDP_MODE_NONE && !(xdp = xdp_open(config))) {
+    running = 0;
+  }
 
-    // read raw socket
-    if ((datagram_length = recvfrom(socket_descriptor, buffer, IP_DATA_LEN, 0, 0, 0)) < 0) {
-      perror("Reading Raw Socket");
+  // counters for every target in each worker, with room for a reload to add
+  // more, served from their own thread
+  for (i = 0; running && config->metrics && i < config->workers; i++) {
+    if (posix_memalign((void**)&workers[i].metrics, 64, sizeof(struct pf_metrics) * slots)) {
+      perror("Metrics");
       running = 0;
-      return;
+      break;
     }
+    memset(workers[i].metrics, 0, sizeof(struct pf_metrics) * slots);
+  }
+  if (running && config->metrics
+    && !(metrics = metrics_open(config, workers, slots, table, xdp))) {
+    running = 0;
+  }
 
-    // get the header addresses
-    ip_header = (struct iphdr*)buffer;
-    tcp_header = (struct tcphdr*)(buffer + (ip_header->ihl * 4));
+  // open every worker in order, fanout groups number their members by join order
+  segments = filter_segments();
+  for (i = 0; running && i < config->workers; i++) {
+    opened++;
+    if (worker_open(&workers[i], i) == -1) {
+      running = 0;
+      break;
+    }
+  }
 
-    //check if the datagram is TCP.
-    if (ip_header->protocol != IPPROTO_TCP) {
-      continue;
+  // connections an earlier run saved go back before a packet can miss them
+  if (running && config->snapshot && snapshot_restore(config, &table->dispatch, workers) == -1) {
+    fprintf(stderr, "Starting without the saved connections\n");
+  }
+
+  // a standby holds off until the active stops, then starts with its connections
+  if (running && config->standby && sync_standby(config, &table->dispatch, workers, &stop) != 1) {
+    running = 0;
+  }
+
+  // memory for the connection tables is all taken up front
+  if (running) {
+    for (i = 0; i < config->workers; i++) {
+      table_bytes += workers[i].conntrack.bytes;
     }
+    printf("Connection table: %zu flows per worker, %.1fMB%s%s\n", workers[0].conntrack.capacity,
+      table_bytes / 1048576.0, workers[0].conntrack.hugepages ? ", huge pages" : "",
+      workers[0].conntrack.locked ? ", locked" : "");
+  }
 
-    // if the packet is coming from a target
-    target = find_source_target(ip_header->saddr, tcp_header->source);
-    if (target != 0) {
+  clock_gettime(CLOCK_MONOTONIC, &start);
 
-      host = find_host_by_target(ip_header->saddr, tcp_header->dest);
-      if (host == 0) {
-        continue;
+  for (i = 0; running && i < config->workers; i++) {
+    if (pthread_create(&workers[i].thread, 0, worker_run, &workers[i]) != 0) {
+      perror("Worker Thread");
+      running = 0;
+      break;
+    }
+    started++;
+  }
+
+  if (running) {
+    printf("Forwarding with %d workers%s\n", config->workers,
+      config->latency_mode == LATENCY_BUSY_POLL ? ", busy polling" : "");
+    fflush(stdout);
+    while ((sig = sigtimedwait(&stop, 0, &drain)) != SIGINT && sig != SIGTERM) {
+      if (sig == SIGUSR1) {
+        dispatch_report(&table->dispatch);
+        forward_filtered(workers, opened, segments);
+      }
+      else if (sig == SIGHUP) {
+        forward_reload(workers, metrics);
+      }
+      else {
+        forward_drain(workers, metrics);
+      }
+      for (i = 0; !first && i < config->workers; i++) {
+        if ((first = __atomic_load_n(&workers[i].first_forward, __ATOMIC_ACQUIRE))) {
+          printf("First packet forwarded %.1fms after %s\n", (first - config->started) / 1e3,
+            config->standby ? "taking over" : "startup");
+        }
       }
+      fflush(stdout);
+    }
+  }
+
+  // workers notice within their receive timeout
+  running = 0;
+  for (i = 0; i < started; i++) {
+    pthread_join(workers[i].thread, 0);
+  }
+  if (metrics) {
+    metrics_close(metrics);
+  }
+
+  // the tables are only read now nothing writes to them
+  if (config->snapshot && opened == config->workers) {
+    if ((i = snapshot_save(config, workers, opened)) != -1) {
+      printf("Saved %d connections to %s\n", i, config->snapshot);
+    }
+  }
 
-      // destination address
-      dst_addr.sin_family = AF_INET;
-      dst_addr.sin_addr.s_addr = host->host;
-      dst_addr.sin_port = target->port.a_port;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
 
-      // set the source ip to be this forwarder
-      ip_header->saddr = ip;
+  // report
+  for (i = 0; i < opened; i++) {
+    if (config->workers > 1) {
+      printf("Worker %d: forwarded %lu of %lu packets, %zu flows open\n", i,
+        workers[i].stats.forwarded, workers[i].stats.received, workers[i].conntrack.count);
+    }
+    total.received += workers[i].stats.received;
+    total.forwarded += workers[i].stats.forwarded;
+    total.recv_calls += workers[i].stats.recv_calls;
+    total.send_calls += workers[i].stats.send_calls;
+    total.send_errors += workers[i].stats.send_errors;
+    total.expired += workers[i].stats.expired;
+    total.syn_dropped += workers[i].stats.syn_dropped;
+    total.misses += workers[i].stats.misses;
+    total.sync_events += workers[i].stats.sync_events;
+    total.sync_batches += workers[i].stats.sync_batches;
+    total.sync_errors += workers[i].stats.sync_errors;
+    flows += workers[i].conntrack.count;
+  }
 
-      // set the target to be the original host
-      ip_header->daddr = host->host;
+  printf("Forwarded %lu of %lu packets in %.1fs (%.0f packets/sec)\n",
+    total.forwarded, total.received, seconds, total.received / seconds);
+  printf("%lu receive and %lu send syscalls, %.3f syscalls/packet, %lu send failures\n",
+    total.recv_calls, total.send_calls,
+    total.received ? (double)(total.recv_calls + total.send_calls) / total.received : 0.0,
+    total.send_errors);
+  printf("%zu flows open, %lu expired, %lu SYNs dropped with the table full\n", flows,
+    total.expired, total.syn_dropped);
+  printf("%lu packets to or from a target matched no connection\n", total.misses);
+  if (config->sync_peer) {
+    printf("%lu connection events sent to the standby in %lu datagrams, %lu failed\n",
+      total.sync_events, total.sync_batches, total.sync_errors);
+  }
+  forward_filtered(workers, opened, segments);
+  for (i = 0; i < opened; i++) {
+    worker_close(&workers[i]);
+  }
+  if (xdp) {
+    printf("XDP forwarded %lu packets\n", xdp_packets(xdp));
+    xdp_close(xdp);
+    xdp = 0;
+  }
+  dispatch_report(&table->dispatch);
 
-      // set the source port to be the forwarded port
-      tcp_header->source = target->port.a_port;
+  for (i = 0; i < config->workers; i++) {
+    free(workers[i].metrics);
+  }
+  free(workers);
+  forward_free();
+  if (config->latency_mode == LATENCY_BUSY_POLL) {
+    munlockall();
+  }
+}
 
-      // redo the checksum
-      tcp_header->check = 0;
-      tcp_header->check = tcp_csum(ip_header, tcp_header);
+/* ----------------------------------------------------------------------------
+FUNCTION
 
-      // forward
-      sendto(socket_descriptor, buffer, datagram_length, 0, (struct sockaddr*)&dst_addr, sizeof(struct sockaddr));
+Name:		Forward Init
 
-      continue;
+Prototype:  int forward_init(struct pf_target* m_targets, size_t m_targetCount,
+              struct pf_config* m_config)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  as forward
+
+Return Values:
+  0  success
+  -1 out of memory
+
+Description:
+  Sets the globals the forwarding functions work from and builds the dispatch
+  tables, without starting to forward. Used by forward, and by the benchmarks
+  to drive forward_packet. Whatever an earlier call or a reload left is
+  freed first.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Numbers the targets for the metrics
+
+  Andrew Burian
+  2026-10-18
+  Builds the first table, which a reload replaces, and the first generation
+  of targets, which stays the caller's
+
+  Andrew Burian
+  2026-10-18
+  Gives each target its load by id
+
+---------------------------------------------------------------------------- */
+int forward_init(struct pf_target* m_targets, size_t m_targetCount, struct pf_config* m_config) {
+
+  struct pf_generation* gen;
+  size_t i;
+
+  config = m_config;
+  running = 1;
+
+  forward_free();
+
+  // the workers' metrics are indexed by target
+  slots = m_targetCount * 2 + METRICS_SPARE_TARGETS;
+  for (i = 0; i < m_targetCount; i++) {
+    m_targets[i].id = i;
+    m_targets[i].refs = 0;
+    if (!(m_targets[i].load = forward_load(i))) {
+      return -1;
     }
+  }
+
+  if (!(gen = (struct pf_generation*)calloc(1, sizeof(struct pf_generation)))) {
+    return -1;
+  }
+  gen->targets = m_targets;
+  gen->targetCount = m_targetCount;
+  generations = gen;
 
-    // if the packet is heading to a target
-    target = find_dest_target(ip_header->daddr, tcp_header->dest);
-    if (target != 0) {
+  if (!(table = (struct pf_table*)calloc(1, sizeof(struct pf_table)))) {
+    return -1;
+  }
+  table->targets = m_targets;
+  table->targetCount = m_targetCount;
+  return dispatch_build(&table->dispatch, m_targets, m_targetCount, 0, 0);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
 
-      host = find_host(ip_header->saddr, tcp_header->source);
-      if (host != 0) { // host is known and already added
+Name:		Forward Reload
 
+Prototype:  static int forward_reload(struct pf_worker* workers,
+              struct pf_metrics_server* metrics)
 
-        // set header information
-        tcp_header->dest = host->target->port.b_port;
-        ip_header->saddr = ip;
-        ip_header->daddr = target->host;
+Developer:	Andrew Burian
 
-        dst_addr.sin_family = AF_INET;
-        dst_addr.sin_addr.s_addr = target->host;
-        dst_addr.sin_port = host->target->port.b_port;
+Created On:	2026-10-18
 
-        // set the checksums
-        ip_header->check = 0;
-        tcp_header->check = 0;
-        tcp_header->check = tcp_csum(ip_header, tcp_header);
+Parameters:
+  struct pf_worker* workers
+    the running workers
+  struct pf_metrics_server* metrics
+    the metrics server, or a null pointer
 
-        //forward
-        sendto(socket_descriptor, (char*)ip_header, datagram_length, 0, (struct sockaddr*)&dst_addr, sizeof(struct sockaddr));
+Return Values:
+  0  success
+  -1 error, with the reason printed, the forwards are left as they were
 
+Description:
+  Reads the forward sections of the config again and switches the workers
+  over to them. A target that is still in the config keeps its id, so its
+  counters carry on, and its load, which the old copy's connections still
+  count against. A target that is no longer in the config becomes
+  draining: it takes no new connections, but stays in the table, and its
+  ports in the firewall, until forward_drain finds its last one closed.
+  Connections keep the target they were given either way. The current
+  targets are found through a hash index, so a reload of many targets
+  isn't quadratic. Offloaded forwards are handed to the firewall, the root
+  section is only read at startup.
 
-        // check to see if the packet was a reset packet
-        if (tcp_header->rst == 1 || tcp_header->fin == 1) {
-          // remove from hosts list
+Revisions:
+  Andrew Burian
+  2026-10-18
+  A target carried over shares its load with the old copy instead of
+  copying its round trip, so its connections stay counted
 
-          // find the index of the host
-          for(i = 0; i < hostCount; i++) {
-            if (hosts[i].host == host->host && hosts[i].port == tcp_header->source) {
-              break;
-            }
-          }
+  Andrew Burian
+  2026-10-18
+  Matches the new targets through a hash index of the current ones,
+  instead of scanning them all for each
 
-          // swap the last host with it
-          memcpy(&hosts[i], &hosts[hostCount - 1], sizeof(struct pf_host));
+  Andrew Burian
+  2026-10-18
+  Leaves the current table untouched, removed targets are only draining
+  in the new one
 
-          // remove the last host in the list
-          hostCount--;
-          hosts = (struct pf_host*)realloc(hosts, sizeof(struct pf_host) * hostCount);
+---------------------------------------------------------------------------- */
+static int forward_reload(struct pf_worker* workers, struct pf_metrics_server* metrics) {
+
+  struct confread_file* confFile;
+  struct pf_target* targets = 0;
+  struct pf_target* offloads = 0;
+  size_t targetCount = 0;
+  size_t offloadCount = 0;
+
+  // the targets of the current table, then its draining ones, and a hash
+  // index on their forward and host, chained through their indices
+  struct pf_target** live;
+  size_t liveCount;
+  unsigned char* matched;
+  size_t* buckets = 0;
+  size_t* chain = 0;
+  size_t mask;
+
+  // what the new table drains, and the ids in use
+  struct pf_target** draining;
+  size_t drainingCount = 0;
+  unsigned char* used;
+  size_t idCount;
+
+  struct pf_generation* gen;
+  size_t i, j, h, id;
+  int failed = 0;
+
+  if (!(confFile = confread_open(config->file))) {
+    fprintf(stderr, "Reload: couldn't read %s, forwards unchanged\n", config->file);
+    return -1;
+  }
+  failed = config_forwards(confFile, &targets, &targetCount, &offloads, &offloadCount);
+  confread_close(&confFile);
+  if (failed) {
+    perror("Reload");
+    free(targets);
+    free(offloads);
+    return -1;
+  }
 
-        }
+  liveCount = table->targetCount + table->drainingCount;
+  idCount = slots > targetCount + liveCount ? slots : targetCount + liveCount;
+  live = (struct pf_target**)malloc(sizeof(struct pf_target*) * (liveCount + 1));
+  matched = (unsigned char*)calloc(liveCount + 1, 1);
+  draining = (struct pf_target**)malloc(sizeof(struct pf_target*) * (liveCount + 1));
+  used = (unsigned char*)calloc(idCount, 1);
+  gen = (struct pf_generation*)calloc(1, sizeof(struct pf_generation));
+  for (mask = 1; mask < liveCount * 2; mask <<= 1);
+  if (live && matched && draining && used && gen) {
+    buckets = (size_t*)malloc(sizeof(size_t) * (mask + liveCount));
+  }
+  if (!buckets) {
+    perror("Reload");
+    failed = -1;
+  }
 
-        continue;
-      }
-      else { // we do not have this host stored.
-        // check if the packet is a SYN
-        if (tcp_header->syn == 1) {
-          // add host to list
-          hostCount++;
-          hosts = (struct pf_host*)realloc(hosts, sizeof(struct pf_host) * hostCount);
-
-          hosts[hostCount - 1].host = ip_header->saddr;
-          hosts[hostCount - 1].port = tcp_header->source;
-          hosts[hostCount - 1].target = target;
-
-          // set header information
-          tcp_header->dest = target->port.b_port;
-          ip_header->saddr = ip;
-          ip_header->daddr = target->host;
-
-          dst_addr.sin_family = AF_INET;
-          dst_addr.sin_addr.s_addr = target->host;
-          dst_addr.sin_port = target->port.b_port;
-
-          // set the checksums
-          ip_header->check = 0;
-          tcp_header->check = 0;
-          tcp_header->check = tcp_csum(ip_header, tcp_header);
-
-          //forward
-          sendto(socket_descriptor, (char*)ip_header, datagram_length, 0, (struct sockaddr*)&dst_addr, sizeof(struct sockaddr));
-          continue;
-        }
+  // chained in reverse, so a lookup finds a target of the current table
+  // before a draining one
+  if (!failed) {
+    chain = buckets + mask;
+    mask--;
+    for (h = 0; h <= mask; h++) {
+      buckets[h] = liveCount;
+    }
+    for (i = liveCount; i-- > 0; ) {
+      live[i] = i < table->targetCount ? &table->targets[i]
+        : table->draining[i - table->targetCount];
+      h = target_hash(live[i]) & mask;
+      chain[i] = buckets[h];
+      buckets[h] = i;
+    }
+  }
+
+  // the same forward to the same host carries on as the same target, with
+  // the same load
+  for (i = 0; !failed && i < targetCount; i++) {
+    targets[i].id = idCount;
+    for (j = buckets[target_hash(&targets[i]) & mask]; j != liveCount; j = chain[j]) {
+      if (!matched[j] && live[j]->port.a_port == targets[i].port.a_port
+        && live[j]->host == targets[i].host && live[j]->port.b_port == targets[i].port.b_port) {
+        matched[j] = 1;
+        targets[i].id = live[j]->id;
+        targets[i].load = live[j]->load;
+        used[targets[i].id] = 1;
+        break;
       }
     }
+  }
+
+  // the rest drain, with a draining target that came back draining too, its
+  // connections are still on the old copy
+  for (i = 0; !failed && i < liveCount; i++) {
+    if (i >= table->targetCount || !matched[i]) {
+      draining[drainingCount++] = live[i];
+      used[live[i]->id] = 1;
+    }
+  }
+
+  // new targets take the free ids, with their counters from zero
+  for (i = 0, id = 0; !failed && i < targetCount; i++) {
+    if (targets[i].id != idCount) {
+      continue;
+    }
+    while (used[id]) {
+      id++;
+    }
+    if (metrics && id >= slots) {
+      fprintf(stderr, "Reload: no room to count more than %zu targets, restart to add them\n",
+        slots);
+      failed = -1;
+      break;
+    }
+    if (!(targets[i].load = forward_load(id))) {
+      perror("Reload");
+      failed = -1;
+      break;
+    }
+    memset(targets[i].load, 0, sizeof(struct pf_load));
+    targets[i].id = id;
+    used[id] = 1;
+    for (j = 0; metrics && j < (size_t)config->workers; j++) {
+      memset(&workers[j].metrics[id], 0, sizeof(struct pf_metrics));
+    }
+  }
+  if (!metrics && idCount > slots) {
+    slots = idCount;
+  }
+
+  // the current table is left as it is, only the new one lists the removed
+  // targets as draining
+  if (!failed) {
+    gen->targets = targets;
+    gen->targetCount = targetCount;
+    gen->owned = 1;
+    gen->next = generations;
+    generations = gen;
+
+    if ((failed = forward_publish(workers, metrics, targets, targetCount, draining,
+      drainingCount)) == -1) {
+      generations = gen->next;
+    }
+  }
 
+  if (!failed) {
+    if (firewall_offload(config, offloads, offloadCount) == -1) {
+      fprintf(stderr, "Reload: offloads left as they were\n");
+    }
+    printf("Reloaded %s: %zu forward targets, %zu draining, %zu offloads\n", config->file,
+      targetCount, drainingCount, offloadCount);
+  }
+  else {
+    fprintf(stderr, "Reload failed, forwards unchanged\n");
+    free(targets);
+    free(gen);
   }
 
-  free(hosts);
+  free(offloads);
+  free(live);
+  free(matched);
+  free(buckets);
+  free(draining);
+  free(used);
+  return failed;
 }
 
 /* ----------------------------------------------------------------------------
 FUNCTION
 
-Name:		Find Source Target
+Name:		Target Hash
 
-Prototype:  struct pf_target *find_source_target(unsigned int host, unsigned int port)
+Prototype:  static size_t target_hash(const struct pf_target* target)
 
-Developer:	Jordan Marling
+Developer:	Andrew Burian
 
-Created On:	2015-03-13
+Created On:	2026-10-18
 
 Parameters:
-  host: The host to find
-  port: The port to find
+  const struct pf_target* target
+    the target
 
 Return Values:
-  A pointer to the forwarding target or a null pointer if one wasn't found.
+  The hash of its forwarded port, address and port
 
 Description:
-  This function finds the target for the source port and hostname.
+  Multiplicative hash of what makes a target the same one across a reload,
+  for forward_reload's index of the current targets.
 
 Revisions:
   (none)
 
 ---------------------------------------------------------------------------- */
-struct pf_target *find_source_target(unsigned int host, unsigned int port) {
+static size_t target_hash(const struct pf_target* target) {
 
-  int i;
+  unsigned long long h;
 
-  //return if we find a target match
-  for (i = 0; i < targetCount; i++) {
-    if (targets[i].host == host && targets[i].port.b_port == port) {
-      return &targets[i];
-    }
-  }
+  h = ((unsigned long long)target->host << 32 | (unsigned int)target->port.a_port << 16
+    | target->port.b_port) * 0x9E3779B97F4A7C15ULL;
+  h ^= h >> 29;
+  h *= 0xBF58476D1CE4E5B9ULL;
 
-  // return a null pointer if a target isn't found
-  return 0;
+  return (size_t)(h >> 32);
 }
 
 /* ----------------------------------------------------------------------------
 FUNCTION
 
-Name:		Find Destionation Target
+Name:		Forward Drain
 
-Prototype:  struct pf_target *find_dest_target(unsigned int host, unsigned int port)
+Prototype:  static void forward_drain(struct pf_worker* workers,
+              struct pf_metrics_server* metrics)
 
-Developer:	Jordan Marling
+Developer:	Andrew Burian
 
-Created On:	2015-03-13
+Created On:	2026-10-18
 
 Parameters:
-  host: The host to find
-  port: The port to find
+  struct pf_worker* workers
+    the running workers
+  struct pf_metrics_server* metrics
+    the metrics server, or a null pointer
 
 Return Values:
-  A pointer to the forwarding target or a null pointer if one wasn't found.
+  void
 
 Description:
-  This function finds the target for the destination port and hostname.
+  Run every RELOAD_DRAIN_MS. Takes the draining targets whose last
+  connection has closed out of the table, and frees the targets of earlier
+  reloads nothing uses any more. Nothing to do unless there was a reload.
 
 Revisions:
   (none)
 
 ---------------------------------------------------------------------------- */
-struct pf_target *find_dest_target(unsigned int host, unsigned int port) {
+static void forward_drain(struct pf_worker* workers, struct pf_metrics_server* metrics) {
 
-  int i;
+  struct pf_target** draining;
+  size_t drainingCount = 0;
+  struct in_addr addr;
+  size_t i;
+
+  if (!generations || !generations->next) {
+    return;
+  }
 
-  //return if we find a target match
-  for (i = 0; i < targetCount; i++) {
-    // if (targets[i].host == host && targets[i].port.a_port == port) {
-    //   return &targets[i];
-    // }
-    if (targets[i].port.a_port == port) {
-      return &targets[i];
+  // draining targets take no new connections, so once at 0 refs stay there
+  for (i = 0; i < table->drainingCount; i++) {
+    if (!__atomic_load_n(&table->draining[i]->refs, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+  }
+  if (i < table->drainingCount) {
+    if (!(draining = (struct pf_target**)malloc(sizeof(struct pf_target*) * table->drainingCount))) {
+      return;
+    }
+    for (i = 0; i < table->drainingCount; i++) {
+      if (__atomic_load_n(&table->draining[i]->refs, __ATOMIC_ACQUIRE)) {
+        draining[drainingCount++] = table->draining[i];
+      }
+      else {
+        addr.s_addr = table->draining[i]->host;
+        printf("Drained port %hu to %s:%hu\n", ntohs(table->draining[i]->port.a_port),
+          inet_ntoa(addr), ntohs(table->draining[i]->port.b_port));
+      }
     }
+    forward_publish(workers, metrics, table->targets, table->targetCount, draining,
+      drainingCount);
+    free(draining);
   }
 
-  // return a null pointer if a target isn't found
-  return 0;
+  forward_sweep();
 }
 
 /* ----------------------------------------------------------------------------
 FUNCTION
 
-Name:		Find Host
+Name:		Forward Filtered
 
-Prototype:  struct pf_target *find_host(unsigned int host, unsigned int port)
+Prototype:  static void forward_filtered(struct pf_worker* workers, int workerCount,
+              unsigned long segments)
 
-Developer:	Jordan Marling
+Developer:	Andrew Burian
 
-Created On:	2015-03-13
+Created On:	2026-10-18
 
 Parameters:
-  host: The host to find
-  port: The port to find
+  struct pf_worker* workers
+    the workers
+  int workerCount
+    the number of them with sockets open
+  unsigned long segments
+    filter_segments when the sockets were opened
 
 Return Values:
-  A pointer to the forwarded host or a null pointer if one wasn't found.
+  void
 
 Description:
-  This function finds the forwarding client from the host and port.
+  Prints how many of the TCP segments the host received since the workers
+  opened their sockets passed the socket filters, and how many the kernel
+  dropped without copying them to us. Packets that passed but found a
+  worker's socket full are told apart, they were dropped too but not by the
+  filters. The workers' counters are only ever added to, so they can be
+  read while they run. Must be called before the workers are closed.
 
 Revisions:
   (none)
 
 ---------------------------------------------------------------------------- */
-struct pf_host *find_host(unsigned int host, unsigned int port) {
+static void forward_filtered(struct pf_worker* workers, int workerCount,
+  unsigned long segments) {
 
+  unsigned long passed = 0;
+  unsigned long overflowed = 0;
   int i;
 
-  //return if we find a host match
-  for (i = 0; i < hostCount; i++) {
-    if (hosts[i].host == host && hosts[i].port == port) {
-      return &hosts[i];
+  segments = filter_segments() - segments;
+  for (i = 0; i < workerCount; i++) {
+    passed += __atomic_load_n(&workers[i].stats.received, __ATOMIC_RELAXED);
+    if (workers[i].rings) {
+      overflowed += packet_mmap_drops(workers[i].rings);
+    }
+    else if (workers[i].socket_descriptor != -1) {
+      overflowed += filter_drops(workers[i].socket_descriptor);
     }
   }
 
-  // return a null pointer if a host isn't found
-  return 0;
+  printf("%lu of %lu TCP segments passed the socket filters, %lu filtered out in the kernel, "
+    "%lu lost to full receive buffers\n", passed, segments,
+    segments > passed + overflowed ? segments - passed - overflowed : 0, overflowed);
 }
 
 /* ----------------------------------------------------------------------------
 FUNCTION
 
-Name:		Find Host By Target
+Name:		Forward Publish
 
-Prototype:  struct pf_target *find_host_by_target(unsigned int target_host, unsigned int port)
+Prototype:  static int forward_publish(struct pf_worker* workers,
+              struct pf_metrics_server* metrics, struct pf_target* targets,
+              size_t targetCount, struct pf_target** draining,
+              size_t drainingCount)
 
-Developer:	Jordan Marling
+Developer:	Andrew Burian
 
-Created On:	2015-03-13
+Created On:	2026-10-18
 
 Parameters:
-  target_host: The target to find
-  port: The port to find
+  struct pf_worker* workers
+    the running workers
+  struct pf_metrics_server* metrics
+    the metrics server, or a null pointer
+  struct pf_target* targets
+    the targets new connections go to
+  size_t targetCount
+    the number of them
+  struct pf_target** draining
+    the targets only kept for the connections they have, copied
+  size_t drainingCount
+    the number of them
 
 Return Values:
-  A pointer to the forwarded host or a null pointer if one wasn't found.
+  0  success
+  -1 error, with the reason printed, the table is left as it was
 
 Description:
-  This function finds the forwarding client from the target host and port.
+  Builds a table and swaps it in for the current one, read-copy-update
+  style: everything that can fail is done first, the firewall is brought in
+  line, the workers are steered by the new targets, and then the pointer is
+  swapped. Workers pick it up with their next packet. The old table is
+  freed once every worker has ticked past it, which takes a poll interval
+  at most and holds up no packet.
 
 Revisions:
-  (none)
+  Andrew Burian
+  2026-10-18
+  Replaces every worker's socket filter as well as the fanout program
 
 ---------------------------------------------------------------------------- */
-struct pf_host *find_host_by_target(unsigned int target_host, unsigned int port) {
+static int forward_publish(struct pf_worker* workers, struct pf_metrics_server* metrics,
+  struct pf_target* targets, size_t targetCount, struct pf_target** draining,
+  size_t drainingCount) {
+
+  struct pf_table* next;
+  struct pf_table* old = table;
+  struct pf_target* all = 0;
+  struct sock_fprog* filters = 0;
+  size_t count = targetCount + drainingCount;
+  int steered = config->workers + (config->io == IO_PACKET_MMAP && config->workers > 1);
+  int failed = 0;
   int i;
 
-  //return if we find a host match
-  for (i = 0; i < hostCount; i++) {
-    if (hosts[i].target->host == target_host && hosts[i].port == port) {
-      return &hosts[i];
+  // the draining targets still have return traffic, to steer and keep from resets
+  next = (struct pf_table*)calloc(1, sizeof(struct pf_table));
+  all = (struct pf_target*)malloc(sizeof(struct pf_target) * (count + 1));
+  filters = (struct sock_fprog*)calloc(steered, sizeof(struct sock_fprog));
+  if (!next || !all || !filters || (drainingCount && !(next->draining
+    = (struct pf_target**)malloc(sizeof(struct pf_target*) * drainingCount)))) {
+    perror("Reload");
+    free(next);
+    free(all);
+    free(filters);
+    return -1;
+  }
+  next->targets = targets;
+  next->targetCount = targetCount;
+  if (drainingCount) {
+    memcpy(next->draining, draining, sizeof(struct pf_target*) * drainingCount);
+  }
+  next->drainingCount = drainingCount;
+  memcpy(all, targets, sizeof(struct pf_target) * targetCount);
+  for (i = 0; i < (int)drainingCount; i++) {
+    all[targetCount + i] = *draining[i];
+  }
+
+  if (dispatch_build(&next->dispatch, targets, targetCount, draining, drainingCount) == -1) {
+    perror("Dispatch Tables");
+    failed = -1;
+  }
+
+  // a socket filter for each worker, then the fanout program if there's a group
+  for (i = 0; !failed && i < steered; i++) {
+    if (filter_steer(&filters[i], all, count, config->workers,
+      i < config->workers ? i : -1) == -1) {
+      fprintf(stderr, "Too many forwards to filter for %d workers\n", config->workers);
+      failed = -1;
+    }
+  }
+
+  if (!failed && firewall_update(config, all, count) == -1) {
+    failed = -1;
+  }
+
+  // return traffic from a new target must reach the worker its client's on
+  for (i = 0; !failed && i < config->workers; i++) {
+    if (config->io == IO_PACKET_MMAP) {
+      packet_mmap_steer(workers[i].rings, i == 0 && steered > config->workers ? &filters[config->workers] : 0,
+        &filters[i]);
+    }
+    else if (setsockopt(workers[i].socket_descriptor, SOL_SOCKET, SO_ATTACH_FILTER, &filters[i],
+      sizeof(filters[i])) == -1) {
+      perror("SetSockOpt SO_ATTACH_FILTER");
     }
   }
 
-  // return a null pointer if a host isn't found
+  for (i = 0; i < steered; i++) {
+    free(filters[i].filter);
+  }
+  free(filters);
+  free(all);
+
+  if (failed) {
+    table_free(next);
+    return -1;
+  }
+
+  __atomic_store_n(&table, next, __ATOMIC_RELEASE);
+  if (metrics) {
+    metrics_update(metrics, next);
+  }
+
+  forward_synchronize(workers);
+  table_free(old);
+  forward_sweep();
+
   return 0;
 }
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Forward Synchronize
+
+Prototype:  static void forward_synchronize(struct pf_worker* workers)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_worker* workers
+    the running workers
+
+Return Values:
+  void
+
+Description:
+  Waits until no worker can still be using a table from before the last
+  swap. Each worker copies the epoch in worker_tick, between packets, so
+  once every one has the bumped value they have all loaded the table again.
+  A worker whose thread has returned holds no table and isn't waited for.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Skips workers that have stopped, which never tick again
+
+---------------------------------------------------------------------------- */
+static void forward_synchronize(struct pf_worker* workers) {
+
+  struct timespec wait = {0, 1000000};
+  unsigned long now = __atomic_add_fetch(&epoch, 1, __ATOMIC_ACQ_REL);
+  int i;
+
+  for (i = 0; i < config->workers; i++) {
+    while ((long)(__atomic_load_n(&workers[i].epoch, __ATOMIC_ACQUIRE) - now) < 0
+      && !__atomic_load_n(&workers[i].stopped, __ATOMIC_ACQUIRE)) {
+      nanosleep(&wait, 0);
+    }
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Forward Sweep
+
+Prototype:  static void forward_sweep(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  void
+
+Description:
+  Frees the targets of earlier reloads once no table and no connection
+  uses any of them. Only called with no old table left, so the current
+  table and the refs are all there is to check.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void forward_sweep(void) {
+
+  struct pf_generation** prev = &generations;
+  struct pf_generation* gen;
+  size_t i;
+
+  while ((gen = *prev)) {
+
+    // the newest is the current one
+    for (i = 0; gen != generations && i < gen->targetCount; i++) {
+      if (__atomic_load_n(&gen->targets[i].refs, __ATOMIC_ACQUIRE)) {
+        break;
+      }
+    }
+    if (gen == generations || i < gen->targetCount) {
+      prev = &gen->next;
+      continue;
+    }
+    for (i = 0; i < table->drainingCount; i++) {
+      if (table->draining[i] >= gen->targets
+        && table->draining[i] < gen->targets + gen->targetCount) {
+        break;
+      }
+    }
+    if (i < table->drainingCount) {
+      prev = &gen->next;
+      continue;
+    }
+
+    *prev = gen->next;
+    if (gen->owned) {
+      free(gen->targets);
+    }
+    free(gen);
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Worker Open
+
+Prototype:  static int worker_open(struct pf_worker* worker, int id)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_worker* worker
+    the worker to set up
+  int id
+    its index
+
+Return Values:
+  0  success
+  -1 error, with the reason printed
+
+Description:
+  Gives a worker its own connection table and its own sockets. With more than
+  one worker, packet_mmap rings join a fanout group per interface and raw
+  sockets get a filter, both steering each flow to one worker by the client
+  port (see filter.c). A worker's connections are only given snat ports that
+  steer to it, so both directions of a flow then land on the same worker and
+  no connection table is ever shared.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Sets up an io_uring on the raw socket for the io_uring backend
+
+  Andrew Burian
+  2026-10-18
+  Hands the worker's connection table the xdp fast path
+
+  Andrew Burian
+  2026-10-18
+  Every worker's sockets get a socket filter, even alone, so only forwarded
+  traffic is copied to it
+
+  Andrew Burian
+  2026-10-18
+  Gives the connection table its share of the snat ports
+
+  Andrew Burian
+  2026-10-18
+  In busy poll mode the sockets busy poll, and a worker with no cpus set is
+  pinned to one anyway so it doesn't spin its way around the machine
+
+  Andrew Burian
+  2026-10-18
+  Gives the connection table a socket to the standby
+
+---------------------------------------------------------------------------- */
+static int worker_open(struct pf_worker* worker, int id) {
+
+  cpu_set_t cpus;
+  int cpu, nth;
+  struct sock_fprog filter = {0};
+  struct sock_fprog fanout = {0};
+  struct timeval timeout = {0, WORKER_POLL_MS * 1000};
+  int hdrincl = 1;
+
+  worker->id = id;
+  worker->socket_descriptor = -1;
+  worker->cpu = config->cpuCount ? config->cpus[id % config->cpuCount] : -1;
+  if (worker->cpu == -1 && config->latency_mode == LATENCY_BUSY_POLL
+    && !sched_getaffinity(0, sizeof(cpus), &cpus)) {
+
+    // the id'th of the cpus we may run on, wrapping around
+    nth = id % CPU_COUNT(&cpus);
+    for (cpu = 0; worker->cpu == -1; cpu++) {
+      if (CPU_ISSET(cpu, &cpus) && !nth--) {
+        worker->cpu = cpu;
+      }
+    }
+  }
+
+  // setup the connection table, its share of max_flows
+  if (conntrack_init(&worker->conntrack, (config->max_flows + config->workers - 1) / config->workers,
+    config->flow_flags) == -1) {
+    perror("Connection Table");
+    return -1;
+  }
+  worker->conntrack.timeouts[CT_ESTABLISHED] = (unsigned long)config->idle_timeout * (1000 / CT_TICK_MS);
+  worker->conntrack.xdp = xdp;
+  if (conntrack_nat(&worker->conntrack, config->snat, config->snatCount, config->workers, id) == -1) {
+    perror("Connection Table");
+    return -1;
+  }
+
+  // and its changes go to the standby
+  if (config->sync_peer && !(worker->conntrack.sync = sync_open(config, &worker->stats, id))) {
+    return -1;
+  }
+
+  // only this worker's share of the forwarded traffic reaches it
+  if (filter_steer(&filter, table->targets, table->targetCount, config->workers, id) == -1
+    || (config->io == IO_PACKET_MMAP && config->workers > 1
+    && filter_steer(&fanout, table->targets, table->targetCount, config->workers, -1) == -1)) {
+    fprintf(stderr, "Too many forwards to filter for %d workers\n", config->workers);
+    free(filter.filter);
+    return -1;
+  }
+
+  if (config->io == IO_PACKET_MMAP) {
+    worker->rings = packet_mmap_open(config, fanout.filter ? &fanout : 0, &filter);
+    free(filter.filter);
+    free(fanout.filter);
+    return worker->rings ? 0 : -1;
+  }
+
+  // setup sockets
+  if ((worker->socket_descriptor = socket(AF_INET, SOCK_RAW, IPPROTO_TCP)) == -1) {
+    perror("TCP Server Socket");
+    free(filter.filter);
+    return -1;
+  }
+
+  // tell the stack to let us handle the IP header
+  if (setsockopt(worker->socket_descriptor, IPPROTO_IP, IP_HDRINCL, &hdrincl, sizeof(hdrincl)) == -1) {
+      perror("SetSockOpt IP_HDRINCL");
+  }
+
+  // wake up now and then to check for shutdown
+  setsockopt(worker->socket_descriptor, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  if (setsockopt(worker->socket_descriptor, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) == -1) {
+    perror("SetSockOpt SO_ATTACH_FILTER");
+    free(filter.filter);
+    return -1;
+  }
+  free(filter.filter);
+
+  if (config->latency_mode == LATENCY_BUSY_POLL) {
+    worker_busy_poll(id, worker->socket_descriptor);
+  }
+
+  // io_uring drives the same socket
+  if (config->io == IO_URING && !(worker->uring = uring_open(config, worker->socket_descriptor))) {
+    return -1;
+  }
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Worker Run
+
+Prototype:  static void *worker_run(void* arg)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  void* arg
+    the worker
+
+Return Values:
+  0
+
+Description:
+  Thread body of a worker. Pins itself if a cpu is set, then runs the loop
+  for the configured backend until shutdown.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Moves itself to SCHED_FIFO when sched_fifo is set
+
+  Andrew Burian
+  2026-10-18
+  Marks the worker stopped on its way out, so a reload doesn't wait on it
+
+  Andrew Burian
+  2026-10-18
+  A worker that stops on its own shuts the forwarder down
+
+---------------------------------------------------------------------------- */
+static void *worker_run(void* arg) {
+
+  struct pf_worker* worker = (struct pf_worker*)arg;
+  struct sched_param param = {0};
+  int err;
+
+  worker_pin(worker->id, worker->cpu);
+
+  // a realtime worker isn't preempted by ordinary threads on its cpu
+  if (config->sched_fifo > 0) {
+    param.sched_priority = config->sched_fifo;
+    if ((err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) != 0) {
+      fprintf(stderr, "Worker %d couldn't be given SCHED_FIFO: %s\n", worker->id, strerror(err));
+    }
+  }
+
+  if (config->io == IO_PACKET_MMAP) {
+    packet_mmap_forward(worker, &running);
+  }
+  else if (config->io == IO_URING) {
+    uring_forward(worker, &running);
+  }
+  else if (config->batch > 1) {
+    forward_batched(worker);
+  }
+  else {
+    forward_single(worker);
+  }
+
+  // nothing waits on this worker for a reload from here on
+  __atomic_store_n(&worker->stopped, 1, __ATOMIC_RELEASE);
+
+  // returning while still running is a failure, the whole forwarder stops
+  // as it would for kill, rather than leave this worker's flows unforwarded
+  if (running) {
+    fprintf(stderr, "Worker %d stopped on an error, shutting down\n", worker->id);
+    running = 0;
+    pthread_kill(forwarder, SIGTERM);
+  }
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Worker Pin
+
+Prototype:  void worker_pin(int id, int cpu)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  int id
+    the worker's index, for the warning
+  int cpu
+    the cpu to run on, or -1 to leave the thread where it is
+
+Return Values:
+  void
+
+Description:
+  Pins the calling thread to a cpu. Shared by every kind of worker.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+void worker_pin(int id, int cpu) {
+
+  cpu_set_t cpus;
+
+  if (cpu < 0) {
+    return;
+  }
+
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+    fprintf(stderr, "Worker %d couldn't be pinned to cpu %d\n", id, cpu);
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Worker Busy Poll
+
+Prototype:  void worker_busy_poll(int id, int socket_descriptor)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  int id
+    the worker's index, for the warning
+  int socket_descriptor
+    a receiving socket of the worker
+
+Return Values:
+  void
+
+Description:
+  Has receives on the socket poll the device's queue for up to busy_poll
+  microseconds instead of waiting for its interrupt, and asks the driver to
+  leave the queue to those polls (SO_PREFER_BUSY_POLL) while they keep up.
+  Only devices with NAPI, i.e. most real nics, can be polled, on anything
+  else the options do nothing. Shared by every backend.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+void worker_busy_poll(int id, int socket_descriptor) {
+
+  int prefer = 1;
+
+  if (setsockopt(socket_descriptor, SOL_SOCKET, SO_BUSY_POLL, &config->busy_poll,
+    sizeof(config->busy_poll)) == -1
+    || setsockopt(socket_descriptor, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer)) == -1) {
+    fprintf(stderr, "Worker %d socket can't busy poll: %s\n", id, strerror(errno));
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Worker Tick
+
+Prototype:  void worker_tick(struct pf_worker* worker)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_worker* worker
+    the worker
+
+Return Values:
+  void
+
+Description:
+  Called by every backend's loop between packets. Expires idle connections,
+  and tells a reload waiting in forward_synchronize that this worker is
+  done with whatever table it used before. A store the worker makes to its
+  own line, so the packet path never waits on a reload.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Notes when the worker first forwarded a packet, for the startup report
+
+  Andrew Burian
+  2026-10-18
+  Sends the worker's connection events to the standby once a tick
+
+---------------------------------------------------------------------------- */
+void worker_tick(struct pf_worker* worker) {
+
+  worker->stats.expired += conntrack_expire(&worker->conntrack);
+  if (worker->conntrack.sync) {
+    sync_tick(worker->conntrack.sync, &worker->conntrack);
+  }
+  if (!worker->first_forward && worker->stats.forwarded) {
+    __atomic_store_n(&worker->first_forward, dispatch_clock(), __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&worker->epoch, __atomic_load_n(&epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Worker Close
+
+Prototype:  static void worker_close(struct pf_worker* worker)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_worker* worker
+    the worker to release
+
+Return Values:
+  void
+
+Description:
+  Closes the worker's sockets and frees its connection table.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Closes the socket to the standby
+
+---------------------------------------------------------------------------- */
+static void worker_close(struct pf_worker* worker) {
+
+  if (worker->rings) {
+    packet_mmap_close(worker->rings);
+    worker->rings = 0;
+  }
+  if (worker->uring) {
+    uring_close(worker->uring);
+    worker->uring = 0;
+  }
+  if (worker->socket_descriptor != -1) {
+    close(worker->socket_descriptor);
+    worker->socket_descriptor = -1;
+  }
+  if (worker->conntrack.sync) {
+    sync_close(worker->conntrack.sync);
+    worker->conntrack.sync = 0;
+  }
+  conntrack_free(&worker->conntrack);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Forward Single
+
+Prototype:  static void forward_single(struct pf_worker* worker)
+
+Developer:	Jordan Marling
+
+Created On:	2015-03-13
+
+Parameters:
+  struct pf_worker* worker
+    the worker, with its raw socket
+
+Return Values:
+  void
+
+Description:
+  The classic loop, one recvfrom and one sendto per packet.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Split out of forward, the packet handling moved to forward_packet
+
+  Andrew Burian
+  2026-10-18
+  Runs per worker
+
+  Andrew Burian
+  2026-10-18
+  Expires idle connections on every pass
+
+  Andrew Burian
+  2026-10-18
+  Ticks the worker on every pass, which includes expiring connections
+
+  Andrew Burian
+  2026-10-18
+  Spins on non-blocking reads in busy poll mode
+
+---------------------------------------------------------------------------- */
+static void forward_single(struct pf_worker* worker) {
+
+  // socket descriptors
+  int socket_descriptor = worker->socket_descriptor;
+
+  // busy polling spins on reads that never sleep
+  int flags = config->latency_mode == LATENCY_BUSY_POLL ? MSG_DONTWAIT : 0;
+
+  // ip variables
+  char buffer[IP_DATA_LEN];
+  int datagram_length;
+
+  // transport layer
+  struct sockaddr_in dst_addr = {0};
+
+  while (running) {
+
+    worker_tick(worker);
+
+    // read raw socket
+    worker->stats.recv_calls++;
+    if ((datagram_length = recvfrom(socket_descriptor, buffer, IP_DATA_LEN, flags, 0, 0)) < 0) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      perror("Reading Raw Socket");
+      break;
+    }
+    worker->stats.received++;
+
+    if (forward_packet(worker, buffer, datagram_length, &dst_addr) <= 0) {
+      continue;
+    }
+
+    // forward
+    worker->stats.send_calls++;
+    if (sendto(socket_descriptor, buffer, datagram_length, 0, (struct sockaddr*)&dst_addr,
+      sizeof(struct sockaddr)) == -1) {
+      worker->stats.send_errors++;
+      continue;
+    }
+    worker->stats.forwarded++;
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Forward Batched
+
+Prototype:  static void forward_batched(struct pf_worker* worker)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_worker* worker
+    the worker, with its raw socket
+
+Return Values:
+  void
+
+Description:
+  Reads up to config->batch packets with one recvmmsg, rewrites the whole
+  batch, then sends everything that is being forwarded with one sendmmsg.
+  If config->batch_timeout is set, a partial batch waits up to that many
+  microseconds for more packets before it is processed.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Expires idle connections on every pass
+
+  Andrew Burian
+  2026-10-18
+  Ticks the worker on every pass, which includes expiring connections
+
+  Andrew Burian
+  2026-10-18
+  Spins on non-blocking reads in busy poll mode
+
+---------------------------------------------------------------------------- */
+static void forward_batched(struct pf_worker* worker) {
+
+  // socket descriptors
+  int socket_descriptor = worker->socket_descriptor;
+
+  // the batch
+  int batch = config->batch;
+  char* buffers;
+  struct mmsghdr* in_msgs;
+  struct mmsghdr* out_msgs;
+  struct iovec* iovecs;
+  struct sockaddr_in* dst_addrs;
+  int received, more, queued, sent;
+
+  // busy polling spins on reads that never sleep
+  int flags = config->latency_mode == LATENCY_BUSY_POLL ? MSG_DONTWAIT : MSG_WAITFORONE;
+
+  // flush timer
+  struct pollfd poll_fd;
+  struct timespec deadline, now;
+  int wait_ms;
+
+  // counter
+  int i;
+
+  buffers = (char*)malloc((size_t)batch * IP_DATA_LEN);
+  in_msgs = (struct mmsghdr*)calloc(batch, sizeof(struct mmsghdr));
+  out_msgs = (struct mmsghdr*)calloc(batch, sizeof(struct mmsghdr));
+  iovecs = (struct iovec*)calloc(batch, sizeof(struct iovec));
+  dst_addrs = (struct sockaddr_in*)calloc(batch, sizeof(struct sockaddr_in));
+  if (!buffers || !in_msgs || !out_msgs || !iovecs || !dst_addrs) {
+    fprintf(stderr, "Out of memory for a batch of %d\n", batch);
+    goto cleanup;
+  }
+
+  for (i = 0; i < batch; i++) {
+    iovecs[i].iov_base = buffers + (size_t)i * IP_DATA_LEN;
+    iovecs[i].iov_len = IP_DATA_LEN;
+    in_msgs[i].msg_hdr.msg_iov = &iovecs[i];
+    in_msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  poll_fd.fd = socket_descriptor;
+  poll_fd.events = POLLIN;
+
+  while (running) {
+
+    worker_tick(worker);
+
+    // block for the first packet unless busy polling, take whatever else is
+    // already queued
+    worker->stats.recv_calls++;
+    if ((received = recvmmsg(socket_descriptor, in_msgs, batch, flags, 0)) < 0) {
+      if (errno == EINTR || errno == EAGAIN) {
+        continue;
+      }
+      perror("Reading Raw Socket");
+      break;
+    }
+
+    // top up a partial batch until it fills or the flush timeout passes
+    if (received < batch && config->batch_timeout > 0) {
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      deadline.tv_nsec += (long)config->batch_timeout * 1000;
+      deadline.tv_sec += deadline.tv_nsec / 1000000000;
+      deadline.tv_nsec %= 1000000000;
+
+      while (received < batch && running) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        wait_ms = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000;
+        if (wait_ms < 0) {
+          break;
+        }
+
+        worker->stats.recv_calls++;
+        if (poll(&poll_fd, 1, wait_ms) <= 0) {
+          break;
+        }
+
+        worker->stats.recv_calls++;
+        if ((more = recvmmsg(socket_descriptor, in_msgs + received, batch - received,
+          MSG_DONTWAIT, 0)) <= 0) {
+          break;
+        }
+        received += more;
+      }
+    }
+    worker->stats.received += received;
+
+    // rewrite the batch
+    queued = 0;
+    for (i = 0; i < received; i++) {
+      if (forward_packet(worker, iovecs[i].iov_base, in_msgs[i].msg_len,
+        &dst_addrs[queued]) <= 0) {
+        continue;
+      }
+
+      // send only the packet, the buffer size is restored after the flush
+      iovecs[i].iov_len = in_msgs[i].msg_len;
+
+      out_msgs[queued].msg_hdr.msg_iov = &iovecs[i];
+      out_msgs[queued].msg_hdr.msg_iovlen = 1;
+      out_msgs[queued].msg_hdr.msg_name = &dst_addrs[queued];
+      out_msgs[queued].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+      queued++;
+    }
+
+    // flush
+    for (sent = 0; sent < queued; ) {
+      worker->stats.send_calls++;
+      if ((more = sendmmsg(socket_descriptor, out_msgs + sent, queued - sent, 0)) <= 0) {
+        // the first packet of the rest failed, drop it and carry on
+        worker->stats.send_errors++;
+        sent++;
+        continue;
+      }
+      worker->stats.forwarded += more;
+      sent += more;
+    }
+
+    for (i = 0; i < received; i++) {
+      iovecs[i].iov_len = IP_DATA_LEN;
+    }
+  }
+
+cleanup:
+  free(buffers);
+  free(in_msgs);
+  free(out_msgs);
+  free(iovecs);
+  free(dst_addrs);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Forward Packet
+
+Prototype:  int forward_packet(struct pf_worker* worker, char* buffer,
+              int datagram_length, struct sockaddr_in* dst_addr)
+
+Developer:	Jordan Marling
+
+Created On:	2015-03-13
+
+Parameters:
+  struct pf_worker* worker
+    the worker handling the packet, whose connection table is used
+  char* buffer
+    the ip packet, rewritten in place
+  int datagram_length
+    the length of the packet
+  struct sockaddr_in* dst_addr
+    filled with where to send the packet
+
+Return Values:
+  VERDICT_TO_TARGET or VERDICT_TO_CLIENT if the packet is to be sent to
+  dst_addr, otherwise VERDICT_IGNORE, VERDICT_MISS, VERDICT_FULL or
+  VERDICT_MALFORMED for why it isn't
+
+Description:
+  Looks up the target and host of a packet, tracks new and closing
+  connections, and rewrites the packet to be forwarded. Makes no system
+  calls and allocates nothing, so it can be driven from memory by the
+  benchmarks as well as by every I/O backend.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Split out of the forward loop so it can be run over batches
+
+  Andrew Burian
+  2026-10-18
+  Shared with the packet_mmap backend
+
+  Andrew Burian
+  2026-10-18
+  Uses the connection table of the worker
+
+  Andrew Burian
+  2026-10-18
+  Tracks the tcp state of connections instead of removing them on RST or FIN
+
+  Andrew Burian
+  2026-10-18
+  Counts SYNs dropped because the connection table is full
+
+  Andrew Burian
+  2026-10-18
+  New connections are given one of the targets of their port, and known
+  ones are rewritten for the target they were given
+
+  Andrew Burian
+  2026-10-18
+  Picks the target of a new connection by the balance policy
+
+  Andrew Burian
+  2026-10-18
+  Counts packets in the worker's metrics for their target
+
+  Andrew Burian
+  2026-10-18
+  Returns a verdict, and checks the headers fit in the packet
+
+  Andrew Burian
+  2026-10-18
+  Ignores SYNs for targets a reload removed
+
+  Andrew Burian
+  2026-10-18
+  Connections reach their targets from the snat address and port they were
+  given, and target packets are matched on it
+
+  Andrew Burian
+  2026-10-18
+  Tells a draining target by it not being one of the table's targets,
+  instead of by a flag a reload set while the old table was still in use
+
+---------------------------------------------------------------------------- */
+int forward_packet(struct pf_worker* worker, char* buffer, int datagram_length,
+  struct sockaddr_in* dst_addr) {
+
+  // ip variables
+  struct iphdr *ip_header;
+
+  // transport layer
+  struct tcphdr *tcp_header;
+
+  // forwarding
+  struct pf_table *current;
+  struct pf_target *target;
+  struct pf_host *host;
+  unsigned long rtt;
+  unsigned int nat;
+
+  // get the header addresses
+  ip_header = (struct iphdr*)buffer;
+  tcp_header = (struct tcphdr*)(buffer + (ip_header->ihl * 4));
+
+  if (datagram_length < (int)sizeof(struct iphdr)) {
+    return VERDICT_MALFORMED;
+  }
+
+  //check if the datagram is TCP.
+  if (ip_header->protocol != IPPROTO_TCP) {
+    return VERDICT_IGNORE;
+  }
+
+  if (ip_header->ihl < 5 || ip_header->ihl * 4 + (int)sizeof(struct tcphdr) > datagram_length) {
+    return VERDICT_MALFORMED;
+  }
+
+  // if the packet is coming from a target
+  target = find_source_target(ip_header->saddr, tcp_header->source);
+  if (target != 0) {
+
+    host = find_host_by_target(&worker->conntrack, ip_header->saddr, tcp_header->source,
+      ip_header->daddr, tcp_header->dest);
+    if (host == 0) {
+      worker->stats.misses++;
+      return VERDICT_MISS;
+    }
+    rtt = conntrack_update(&worker->conntrack, host, tcp_header, 0);
+
+    if (worker->metrics) {
+      count_packet(&worker->metrics[host->target->id], METRICS_TO_CLIENT, tcp_header,
+        datagram_length);
+      if (rtt) {
+        metrics_handshake(&worker->metrics[host->target->id], rtt);
+      }
+    }
+
+    // destination address
+    dst_addr->sin_family = AF_INET;
+    dst_addr->sin_addr.s_addr = host->host;
+    dst_addr->sin_port = host->target->port.a_port;
+
+    // set the source to be this forwarder on the forwarded port,
+    // and the target to be the original host and port
+    rewrite_packet(ip_header, tcp_header, config->ip, host->host,
+      host->target->port.a_port, host->port);
+
+    return VERDICT_TO_CLIENT;
+  }
+
+  // if the packet is heading to a target
+  target = find_dest_target(ip_header->daddr, tcp_header->dest);
+  if (target != 0) {
+
+    host = find_host(&worker->conntrack, ip_header->saddr, tcp_header->source, tcp_header->dest);
+    if (host != 0) { // host is known and already added
+
+      // set header information, from the snat address and port it was given
+      nat = worker->conntrack.nat[host->nat_addr].addr;
+      rewrite_packet(ip_header, tcp_header, nat, host->target->host,
+        host->nat_port, host->target->port.b_port);
+
+      dst_addr->sin_family = AF_INET;
+      dst_addr->sin_addr.s_addr = host->target->host;
+      dst_addr->sin_port = host->target->port.b_port;
+
+      // closing connections are left to idle out, so the last packets still get through
+      conntrack_update(&worker->conntrack, host, tcp_header, 1);
+
+      if (worker->metrics) {
+        count_packet(&worker->metrics[host->target->id], METRICS_TO_TARGET, tcp_header,
+          datagram_length);
+      }
+
+      return VERDICT_TO_TARGET;
+    }
+    else { // we do not have this host stored.
+      // check if the packet is a SYN
+      if (tcp_header->syn == 1) {
+        // a port with several targets gives the connection one of them, all
+        // from one table in case a reload swaps it meanwhile
+        current = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
+        if (!(target = current->dispatch.ports[tcp_header->dest])) {
+          return VERDICT_IGNORE;
+        }
+        target = dispatch_balance(&current->dispatch, target, ip_header->saddr,
+          tcp_header->source, config->balance);
+
+        // a target a reload removed is only on the table's draining list, to
+        // keep the connections it has
+        if (target < current->targets || target >= current->targets + current->targetCount) {
+          return VERDICT_IGNORE;
+        }
+
+        // add host to list, the SYN is dropped if the table or the snat ports are full
+        if ((host = add_host(&worker->conntrack, ip_header->saddr, tcp_header->source, target)) == 0) {
+          worker->stats.syn_dropped++;
+          return VERDICT_FULL;
+        }
+
+        // set header information
+        nat = worker->conntrack.nat[host->nat_addr].addr;
+        rewrite_packet(ip_header, tcp_header, nat, target->host,
+          host->nat_port, target->port.b_port);
+
+        dst_addr->sin_family = AF_INET;
+        dst_addr->sin_addr.s_addr = target->host;
+        dst_addr->sin_port = target->port.b_port;
+
+        if (worker->metrics) {
+          count_packet(&worker->metrics[target->id], METRICS_TO_TARGET, tcp_header,
+            datagram_length);
+        }
+
+        return VERDICT_TO_TARGET;
+      }
+      worker->stats.misses++;
+      return VERDICT_MISS;
+    }
+  }
+
+  return VERDICT_IGNORE;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Count Packet
+
+Prototype:  static void count_packet(struct pf_metrics* metrics, int dir,
+              struct tcphdr* tcp_header, int length)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_metrics* metrics
+    the worker's counters for the packet's target
+  int dir
+    METRICS_TO_TARGET or METRICS_TO_CLIENT
+  struct tcphdr* tcp_header
+    the packet's tcp header
+  int length
+    the length of the packet
+
+Return Values:
+  void
+
+Description:
+  Counts a forwarded packet. The counters belong to the worker alone, so
+  they are plain adds. The flags are added in from the flags byte, behind
+  one well predicted test, since nearly every packet has none of them.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Only adds in the flags of a packet that has any, which halves its cost
+
+---------------------------------------------------------------------------- */
+static void count_packet(struct pf_metrics* metrics, int dir, struct tcphdr* tcp_header,
+  int length) {
+
+  unsigned char flags = ((unsigned char*)tcp_header)[13];
+
+  metrics->packets[dir]++;
+  metrics->bytes[dir] += length;
+
+  // most packets carry none of SYN, FIN and RST, and skip their adds
+  if (flags & 0x07) {
+    metrics->syns[dir] += (flags >> 1) & 1;
+    metrics->fins[dir] += flags & 1;
+    metrics->rsts[dir] += (flags >> 2) & 1;
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Rewrite Packet
+
+Prototype:  void rewrite_packet(struct iphdr* ip_header, struct tcphdr* tcp_header,
+              unsigned int saddr, unsigned int daddr, unsigned short sport,
+              unsigned short dport)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct iphdr* ip_header
+    the packet's ip header
+  struct tcphdr* tcp_header
+    the packet's tcp header
+  unsigned int saddr, daddr
+    the new source and destination addresses (network order)
+  unsigned short sport, dport
+    the new source and destination ports (network order)
+
+Return Values:
+  void
+
+Description:
+  Rewrites the addresses and ports of a packet and fixes up the ip and tcp
+  checksums. By default the checksums are adjusted incrementally (RFC 1624)
+  from the fields that changed, so the cost doesn't depend on the payload.
+  With "checksum = full" both are recomputed from scratch instead, and with
+  "checksum = verify" the incremental result is checked against the full one.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+void rewrite_packet(struct iphdr* ip_header, struct tcphdr* tcp_header,
+  unsigned int saddr, unsigned int daddr, unsigned short sport,
+  unsigned short dport) {
+
+  static __thread int mismatched = 0;
+  unsigned short ip_check = ip_header->check;
+  unsigned short tcp_check = tcp_header->check;
+
+  if (config->checksum != CSUM_FULL) {
+
+    // the addresses are in both the ip header and the tcp pseudo header
+    if (ip_header->saddr != saddr) {
+      ip_check = csum_replace4(ip_check, ip_header->saddr, saddr);
+      tcp_check = csum_replace4(tcp_check, ip_header->saddr, saddr);
+    }
+    if (ip_header->daddr != daddr) {
+      ip_check = csum_replace4(ip_check, ip_header->daddr, daddr);
+      tcp_check = csum_replace4(tcp_check, ip_header->daddr, daddr);
+    }
+    if (tcp_header->source != sport) {
+      tcp_check = csum_replace2(tcp_check, tcp_header->source, sport);
+    }
+    if (tcp_header->dest != dport) {
+      tcp_check = csum_replace2(tcp_check, tcp_header->dest, dport);
+    }
+  }
+
+  ip_header->saddr = saddr;
+  ip_header->daddr = daddr;
+  tcp_header->source = sport;
+  tcp_header->dest = dport;
+
+  if (config->checksum == CSUM_INCREMENTAL) {
+    ip_header->check = ip_check;
+    tcp_header->check = tcp_check;
+    return;
+  }
+
+  // full recompute
+  ip_header->check = 0;
+  ip_header->check = csum((unsigned short*)ip_header, ip_header->ihl * 4);
+  tcp_header->check = 0;
+  tcp_header->check = tcp_csum(ip_header, tcp_header);
+
+  if (config->checksum == CSUM_VERIFY && !mismatched &&
+    (ip_check != ip_header->check || tcp_check != tcp_header->check)) {
+    fprintf(stderr, "Incremental checksum mismatch (ip %04x/%04x, tcp %04x/%04x). "
+      "Was the received checksum valid?\n", ip_check, ip_header->check, tcp_check,
+      tcp_header->check);
+    mismatched = 1;
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Find Source Target
+
+Prototype:  struct pf_target *find_source_target(unsigned int host, unsigned int port)
+
+Developer:	Jordan Marling
+
+Created On:	2015-03-13
+
+Parameters:
+  host: The host to find
+  port: The port to find
+
+Return Values:
+  A pointer to the forwarding target or a null pointer if one wasn't found.
+
+Description:
+  This function finds the target for the source port and hostname.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Looked up in the dispatch tables instead of scanning the targets
+
+  Andrew Burian
+  2026-10-18
+  Read from whichever table is current
+
+---------------------------------------------------------------------------- */
+struct pf_target *find_source_target(unsigned int host, unsigned int port) {
+
+  return dispatch_backend(&__atomic_load_n(&table, __ATOMIC_ACQUIRE)->dispatch, host, port);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Find Destionation Target
+
+Prototype:  struct pf_target *find_dest_target(unsigned int host, unsigned int port)
+
+Developer:	Jordan Marling
+
+Created On:	2015-03-13
+
+Parameters:
+  host: The host to find
+  port: The port to find
+
+Return Values:
+  A pointer to the forwarding target or a null pointer if one wasn't found.
+
+Description:
+  This function finds the target for the destination port and hostname.
+  Only the port is matched, traffic to any of our addresses is forwarded.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  A single load from the dispatch table instead of scanning the targets
+
+  Andrew Burian
+  2026-10-18
+  Read from whichever table is current
+
+---------------------------------------------------------------------------- */
+struct pf_target *find_dest_target(unsigned int host, unsigned int port) {
+
+  return __atomic_load_n(&table, __ATOMIC_ACQUIRE)->dispatch.ports[port & 0xffff];
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Table Free
+
+Prototype:  static void table_free(struct pf_table* old)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_table* old
+    a table no worker can be using, or a null pointer
+
+Return Values:
+  void
+
+Description:
+  Frees a table, but not the targets it points to, they belong to their
+  generation.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void table_free(struct pf_table* old) {
+
+  if (!old) {
+    return;
+  }
+  dispatch_free(&old->dispatch);
+  free(old->draining);
+  free(old);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Forward Load
+
+Prototype:  static struct pf_load *forward_load(size_t id)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  size_t id
+    the target id
+
+Return Values:
+  The load of the id, or a null pointer out of memory
+
+Description:
+  Finds the load a target id counts against, adding a zeroed chunk of them
+  if the id is past the last one. Chunks stay where they are, so targets of
+  any table can point into them while a later id is added.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static struct pf_load *forward_load(size_t id) {
+
+  struct pf_load** grown;
+  size_t chunk = id / LOAD_CHUNK;
+
+  if (chunk >= loadChunks) {
+    if (!(grown = (struct pf_load**)realloc(loads, sizeof(struct pf_load*) * (chunk + 1)))) {
+      return 0;
+    }
+    memset(&grown[loadChunks], 0, sizeof(struct pf_load*) * (chunk + 1 - loadChunks));
+    loads = grown;
+    loadChunks = chunk + 1;
+  }
+  if (!loads[chunk]
+    && !(loads[chunk] = (struct pf_load*)calloc(LOAD_CHUNK, sizeof(struct pf_load)))) {
+    return 0;
+  }
+
+  return &loads[chunk][id % LOAD_CHUNK];
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Forward Free
+
+Prototype:  static void forward_free(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  void
+
+Description:
+  Frees the table, the targets' loads and every generation of targets, the
+  first one excepted, it was the caller's. Only with no worker running.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Frees the loads
+
+---------------------------------------------------------------------------- */
+static void forward_free(void) {
+
+  struct pf_generation* gen;
+
+  table_free(table);
+  table = 0;
+
+  while ((gen = generations)) {
+    generations = gen->next;
+    if (gen->owned) {
+      free(gen->targets);
+    }
+    free(gen);
+  }
+
+  while (loadChunks) {
+    free(loads[--loadChunks]);
+  }
+  free(loads);
+  loads = 0;
+}
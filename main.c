@@ -58,31 +58,133 @@ Revisions:
   2015-03-15
   Added Checksum calculations for TCP at every sendto call
 
+  Andrew Burian
+  2026-10-18
+  Root section settings are gathered into a pf_config, added checksum mode
+
+  Andrew Burian
+  2026-10-18
+  Picks the checksum kernel at startup
+
+  Andrew Burian
+  2026-10-18
+  Added batch settings
+
+  Andrew Burian
+  2026-10-18
+  Added the io backend and packet_mmap settings
+
+  Andrew Burian
+  2026-10-18
+  Added the workers and cpus settings
+
+  Andrew Burian
+  2026-10-18
+  Added the idle_timeout setting
+
+  Andrew Burian
+  2026-10-18
+  Added the max_flows, hugepages and mlock settings
+
+  Andrew Burian
+  2026-10-18
+  Added the proxy mode, which needs no firewall rules
+
+  Andrew Burian
+  2026-10-18
+  Added the io_uring backend and its settings
+
+  Andrew Burian
+  2026-10-18
+  Firewall rules for all forwards are installed at once, and removed on exit
+
+  Andrew Burian
+  2026-10-18
+  Forward sections can be offloaded to the kernel
+
+  Andrew Burian
+  2026-10-18
+  Optional xdp fast path
+
+  Andrew Burian
+  2026-10-18
+  tohost takes a weighted list of hosts to balance the forward over
+
+  Andrew Burian
+  2026-10-18
+  Added the balance setting
+
+  Andrew Burian
+  2026-10-18
+  Added the metrics setting
+
+  Andrew Burian
+  2026-10-18
+  Forward sections are read by config_forwards, which a reload uses too
+
+  Andrew Burian
+  2026-10-18
+  Reports how long reading the config took
+
+  Andrew Burian
+  2026-10-18
+  Added the snat setting
+
+  Andrew Burian
+  2026-10-18
+  Added the latency_mode, busy_poll and sched_fifo settings
+
+  Andrew Burian
+  2026-10-18
+  Added the snapshot setting, the firewall rules are kept on exit with it
+
+  Andrew Burian
+  2026-10-18
+  Added the sync_peer, sync_listen, standby and sync_timeout settings
+
+  Andrew Burian
+  2026-10-18
+  Checks the cpus and snat allocations
+
 ---------------------------------------------------------------------------- */
 int main(int argc, char** argv){
 
   // the config file
   struct confread_file* confFile = 0;
   char* confFileName = 0;
-  struct confread_section* sec = 0;
-
-  // ports
-  unsigned short int aPort = 0;
-  unsigned short int bPort = 0;
-
-  // counter
-  size_t i = 0;
-  size_t j = 0;
 
   // the array of targets
   struct pf_target* targets = 0;
   size_t targetCount = 0;
 
-  // our ip to replace in forwarded packets
-  unsigned int myIp = 0;
+  // the targets forwarded by the kernel instead
+  struct pf_target* offloads = 0;
+  size_t offloadCount = 0;
+  int firewall = 0;
+  FILE* sysctl = 0;
+
+  // global settings, including our ip to replace in forwarded packets
+  struct pf_config config = {0};
   struct confread_pair* ip = 0;
+  char* value = 0;
+  char* token = 0;
+  char* save = 0;
+  int first = 0;
+  int last = 0;
+  unsigned int from = 0;
+  unsigned int to = 0;
+  char* dash = 0;
+  char address[16];
+
+  // how long the config takes to read
+  struct timespec start, end;
+
+  // pick the checksum kernel for this cpu
+  csum_init();
 
   // open the config
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  config.started = dispatch_clock();
   confFileName = (argc > 1 ? argv[1] : DEFAULT_CONFIG);
   if(!(confFile = confread_open(confFileName))){
     fprintf(stderr, "Failed to open conf file: %s\n", confFileName);
@@ -94,75 +196,390 @@ int main(int argc, char** argv){
     fprintf(stderr, "Local address required in %s\n", confFileName);
     return -1;
   }
-  if((myIp = inet_addr(ip->value)) == INADDR_NONE){
+  if((config.ip = inet_addr(ip->value)) == INADDR_NONE){
     fprintf(stderr, "Invalid local address\n");
     return -1;
   }
 
-  // allocate as many targets as there are sections (-1 to skip root section)
-  targets = (struct pf_target*)malloc(sizeof(struct pf_target) * confFile->count - 1);
-  targetCount = confFile->count - 1;
+  // rewrite packets, or relay connections
+  config.mode = MODE_NAT;
+  if((value = confread_find_value(confFile->sections[0], "mode"))){
+    if(!strcmp(value, "proxy")){
+      config.mode = MODE_PROXY;
+    }
+    else if(strcmp(value, "nat")){
+      fprintf(stderr, "Unknown mode %s\n", value);
+      return -1;
+    }
+  }
 
-  // setup the targets
-  j = 1; // to skip root
-  for(i = 0; i < targetCount; ++i, ++j){
-    sec = confFile->sections[j];
+  // how to fix checksums of rewritten packets
+  config.checksum = CSUM_INCREMENTAL;
+  if((value = confread_find_value(confFile->sections[0], "checksum"))){
+    if(!strcmp(value, "full")){
+      config.checksum = CSUM_FULL;
+    }
+    else if(!strcmp(value, "verify")){
+      config.checksum = CSUM_VERIFY;
+    }
+    else if(strcmp(value, "incremental")){
+      fprintf(stderr, "Unknown checksum mode %s, using incremental\n", value);
+    }
+  }
 
-    // check to see all sections are there
-    if(!confread_find_value(sec, "port") || !confread_find_value(sec, "toport")
-      || !confread_find_value(sec, "tohost")){
+  // packets per recvmmsg / sendmmsg, and how long to wait to fill a batch
+  config.batch = 1;
+  if((value = confread_find_value(confFile->sections[0], "batch"))){
+    if(!sscanf(value, "%d", &config.batch) || config.batch < 1 || config.batch > MAX_BATCH){
+      fprintf(stderr, "Batch size must be 1 to %d\n", MAX_BATCH);
+      return -1;
+    }
+  }
+  if((value = confread_find_value(confFile->sections[0], "batch_timeout"))){
+    if(!sscanf(value, "%d", &config.batch_timeout) || config.batch_timeout < 0){
+      fprintf(stderr, "Invalid batch timeout\n");
+      return -1;
+    }
+  }
 
-      // error
-      fprintf(stderr, "Forward section %s malformed: missing field.\nIgnored.\n", sec->name);
-      // shrink the number of targets needed
-      targets = realloc(targets, sizeof(struct pf_target) * --targetCount);
-      // don't advance i
-      --i;
-      continue;
+  // packet I/O backend
+  config.io = IO_RAW;
+  if((value = confread_find_value(confFile->sections[0], "io"))){
+    if(!strcmp(value, "packet_mmap")){
+      config.io = IO_PACKET_MMAP;
     }
+    else if(!strcmp(value, "io_uring")){
+      config.io = IO_URING;
+    }
+    else if(strcmp(value, "raw")){
+      fprintf(stderr, "Unknown io backend %s\n", value);
+      return -1;
+    }
+  }
 
-    // check to see we can scan the ports
-    if(!sscanf(confread_find_value(sec, "port"), "%hu", &aPort) ||
-      !sscanf(confread_find_value(sec, "toport"), "%hu", &bPort)){
+  // interfaces and ring geometry for packet_mmap
+  config.ring_blocks = 64;
+  config.ring_block_size = 1 << 18;
+  config.ring_frame_size = 2048;
+  if((value = confread_find_value(confFile->sections[0], "interface"))){
+    config.interfaces = strdup(value);
+  }
+  if((value = confread_find_value(confFile->sections[0], "ring_blocks"))){
+    sscanf(value, "%d", &config.ring_blocks);
+  }
+  if((value = confread_find_value(confFile->sections[0], "ring_block_size"))){
+    sscanf(value, "%d", &config.ring_block_size);
+  }
+  if((value = confread_find_value(confFile->sections[0], "ring_frame_size"))){
+    sscanf(value, "%d", &config.ring_frame_size);
+  }
+  if(config.io == IO_PACKET_MMAP){
+    if(!config.interfaces){
+      fprintf(stderr, "io = packet_mmap requires an interface\n");
+      return -1;
+    }
+    if(config.ring_blocks < 1 || config.ring_frame_size < 128
+      || config.ring_block_size % getpagesize() || config.ring_block_size % config.ring_frame_size){
+      fprintf(stderr, "Ring blocks must be a multiple of the page size and of the frame size\n");
+      return -1;
+    }
+  }
 
-      // error
-      fprintf(stderr, "Forward section %s malformed: port NaN\nIgnored\n", sec->name);
-      // shrink the number of targets needed
-      targets = realloc(targets, sizeof(struct pf_target) * --targetCount);
-      // don't advance i
-      --i;
-      continue;
+  // xdp fast path in front of the engine, on the same interfaces
+  if((value = confread_find_value(confFile->sections[0], "xdp")) && strcmp(value, "no")){
+    if(!strcmp(value, "generic")){
+      config.xdp = XDP_MODE_GENERIC;
+    }
+    else if(!strcmp(value, "native")){
+      config.xdp = XDP_MODE_NATIVE;
+    }
+    else{
+      fprintf(stderr, "xdp must be generic, native or no\n");
+      return -1;
     }
+    if(!config.interfaces){
+      fprintf(stderr, "xdp requires an interface\n");
+      return -1;
+    }
+  }
 
-    // assign the host
-    if((targets[i].host = inet_addr(confread_find_value(sec, "tohost"))) == INADDR_NONE){
-      // error
-      fprintf(stderr, "Forward section %s malformed: invalid host.\nIgnored.\n", sec->name);
-      // shrink the number of targets needed
-      targets = realloc(targets, sizeof(struct pf_target) * --targetCount);
-      // don't advance i
-      --i;
-      continue;
+  // how new connections pick among the hosts of a forward
+  if((value = confread_find_value(confFile->sections[0], "balance"))){
+    if(!strcmp(value, "maglev")){
+      config.balance = BALANCE_MAGLEV;
+    }
+    else if(!strcmp(value, "least_latency")){
+      config.balance = BALANCE_LEAST_LATENCY;
+    }
+    else if(!strcmp(value, "power_of_two")){
+      config.balance = BALANCE_POWER_OF_TWO;
+    }
+    else{
+      fprintf(stderr, "balance must be maglev, least_latency or power_of_two\n");
+      return -1;
     }
+  }
 
-    // assign the ports
-    targets[i].port.a_port = htons(aPort);
-    targets[i].port.b_port = htons(bPort);
+  // counters served on a unix socket, the proxy keeps none
+  if((value = confread_find_value(confFile->sections[0], "metrics"))){
+    if(config.mode == MODE_PROXY){
+      fprintf(stderr, "metrics are only kept in nat mode\n");
+    }
+    else{
+      config.metrics = strdup(value);
+    }
+  }
 
-    firewall_invoke_srcport(aPort);
-    firewall_invoke_dstport(bPort);
+  // connections saved on exit and picked up again by the next start
+  if((value = confread_find_value(confFile->sections[0], "snapshot"))){
+    if(config.mode == MODE_PROXY){
+      fprintf(stderr, "snapshots are only taken in nat mode\n");
+    }
+    else{
+      config.snapshot = strdup(value);
+    }
   }
 
-  printf("Initialized %zu forwards\n", targetCount);
+  // io_uring buffers, and a kernel thread to submit for each worker
+  config.uring_buffers = 256;
+  config.sqpoll_cpu = -1;
+  if((value = confread_find_value(confFile->sections[0], "uring_buffers"))){
+    if(!sscanf(value, "%d", &config.uring_buffers) || config.uring_buffers < 1
+      || config.uring_buffers > 16384 || (config.uring_buffers & (config.uring_buffers - 1))){
+      fprintf(stderr, "io_uring buffers must be a power of 2 up to 16384\n");
+      return -1;
+    }
+  }
+  if((value = confread_find_value(confFile->sections[0], "sqpoll")) && strcmp(value, "no")){
+    config.sqpoll = 1;
+    if(strcmp(value, "yes") && (!sscanf(value, "%d", &config.sqpoll_cpu) || config.sqpoll_cpu < 0)){
+      fprintf(stderr, "sqpoll must be yes, no or a cpu\n");
+      return -1;
+    }
+  }
+
+  // forwarding threads, and the cpus they are pinned to in order
+  config.workers = 1;
+  if((value = confread_find_value(confFile->sections[0], "workers"))){
+    if(!sscanf(value, "%d", &config.workers) || config.workers < 1 || config.workers > MAX_WORKERS){
+      fprintf(stderr, "Workers must be 1 to %d\n", MAX_WORKERS);
+      return -1;
+    }
+  }
+  if((value = confread_find_value(confFile->sections[0], "cpus"))){
+    if(!(config.cpus = (int*)malloc(sizeof(int) * CPU_SETSIZE)) || !(value = strdup(value))){
+      perror("Reading cpus");
+      return -1;
+    }
+    for(token = strtok_r(value, ", ", &save); token; token = strtok_r(0, ", ", &save)){
+      switch(sscanf(token, "%d-%d", &first, &last)){
+        case 1:
+          last = first;
+        case 2:
+          break;
+        default:
+          first = -1;
+      }
+      if(first < 0 || last < first || last >= CPU_SETSIZE){
+        fprintf(stderr, "Invalid cpu %s\n", token);
+        return -1;
+      }
+      for(; first <= last && config.cpuCount < CPU_SETSIZE; ++first){
+        config.cpus[config.cpuCount++] = first;
+      }
+    }
+    free(value);
+  }
+
+  // workers that spin on their sockets instead of sleeping, for the latency
+  // it takes the scheduler to wake them
+  config.latency_mode = LATENCY_BLOCKING;
+  config.busy_poll = LATENCY_BUSY_POLL_US;
+  if((value = confread_find_value(confFile->sections[0], "latency_mode"))){
+    if(!strcmp(value, "busy_poll")){
+      config.latency_mode = LATENCY_BUSY_POLL;
+    }
+    else if(strcmp(value, "blocking")){
+      fprintf(stderr, "latency_mode must be blocking or busy_poll\n");
+      return -1;
+    }
+    if(config.latency_mode == LATENCY_BUSY_POLL && config.mode == MODE_PROXY){
+      fprintf(stderr, "latency_mode is only used in nat mode\n");
+    }
+  }
+  if((value = confread_find_value(confFile->sections[0], "busy_poll"))){
+    if(!sscanf(value, "%d", &config.busy_poll) || config.busy_poll < 0){
+      fprintf(stderr, "Invalid busy poll time\n");
+      return -1;
+    }
+  }
+  if((value = confread_find_value(confFile->sections[0], "sched_fifo")) && strcmp(value, "no")){
+    if(!sscanf(value, "%d", &config.sched_fifo) || config.sched_fifo < 1 || config.sched_fifo > 99){
+      fprintf(stderr, "sched_fifo must be no or a priority from 1 to 99\n");
+      return -1;
+    }
+  }
+
+  // how long established connections may idle before they are dropped
+  config.idle_timeout = 7200;
+  if((value = confread_find_value(confFile->sections[0], "idle_timeout"))){
+    if(!sscanf(value, "%d", &config.idle_timeout) || config.idle_timeout < 1){
+      fprintf(stderr, "Invalid idle timeout\n");
+      return -1;
+    }
+  }
+
+  // connection table size, and how its memory is backed
+  config.max_flows = CT_DEFAULT_FLOWS;
+  if((value = confread_find_value(confFile->sections[0], "max_flows"))){
+    if(!sscanf(value, "%d", &config.max_flows) || config.max_flows < 1){
+      fprintf(stderr, "Invalid max flows\n");
+      return -1;
+    }
+  }
+  if((value = confread_find_value(confFile->sections[0], "hugepages")) && !strcmp(value, "yes")){
+    config.flow_flags |= CT_HUGEPAGES;
+  }
+  if((value = confread_find_value(confFile->sections[0], "mlock")) && !strcmp(value, "yes")){
+    config.flow_flags |= CT_MLOCK;
+  }
+
+  // the addresses connections reach their targets from, each with its own ports
+  if(!(config.snat = (unsigned int*)malloc(sizeof(unsigned int) * NAT_MAX_ADDRS))){
+    perror("Reading snat");
+    return -1;
+  }
+  if((value = confread_find_value(confFile->sections[0], "snat"))){
+    if(!(value = strdup(value))){
+      perror("Reading snat");
+      return -1;
+    }
+    for(token = strtok_r(value, ", ", &save); token; token = strtok_r(0, ", ", &save)){
+      if((dash = strchr(token, '-'))){
+        *dash = 0;
+      }
+      from = ntohl(inet_addr(token));
+      to = dash ? ntohl(inet_addr(dash + 1)) : from;
+      if(from == ntohl(INADDR_NONE) || to == ntohl(INADDR_NONE) || to < from
+        || to - from >= (unsigned int)(NAT_MAX_ADDRS - config.snatCount)){
+        fprintf(stderr, "Invalid snat address %s, or more than %d of them\n", token, NAT_MAX_ADDRS);
+        return -1;
+      }
+      for(; from <= to; ++from){
+        config.snat[config.snatCount++] = htonl(from);
+      }
+    }
+    free(value);
+  }
+  if(!config.snatCount){
+    config.snat[config.snatCount++] = config.ip;
+  }
+
+  // connections replicated to a peer, and taken from one while standing by
+  config.sync_timeout = SYNC_DEFAULT_TIMEOUT;
+  if(config.mode == MODE_PROXY){
+    if(confread_find_value(confFile->sections[0], "sync_peer")
+      || confread_find_value(confFile->sections[0], "standby")){
+      fprintf(stderr, "connections are only replicated in nat mode\n");
+    }
+  }
+  else{
+    if((value = confread_find_value(confFile->sections[0], "sync_peer"))){
+      if(sscanf(value, "%15[0-9.]:%d", address, &first) != 2 || first < 1 || first > 65535
+        || (config.sync_peer = inet_addr(address)) == INADDR_NONE){
+        fprintf(stderr, "sync_peer must be an address and port, e.g. 192.168.0.6:7000\n");
+        return -1;
+      }
+      config.sync_peer_port = htons(first);
+    }
+    if((value = confread_find_value(confFile->sections[0], "sync_listen"))){
+      if(sscanf(value, "%15[0-9.]:%d", address, &first) != 2 || first < 1 || first > 65535
+        || (config.sync_listen = inet_addr(address)) == INADDR_NONE){
+        fprintf(stderr, "sync_listen must be an address and port, e.g. 192.168.0.5:7000\n");
+        return -1;
+      }
+      config.sync_listen_port = htons(first);
+    }
+    if((value = confread_find_value(confFile->sections[0], "standby")) && !strcmp(value, "yes")){
+      if(!config.sync_listen_port){
+        fprintf(stderr, "A standby needs sync_listen\n");
+        return -1;
+      }
+      config.standby = 1;
+    }
+    if((value = confread_find_value(confFile->sections[0], "sync_timeout"))){
+      if(!sscanf(value, "%d", &config.sync_timeout) || config.sync_timeout < 1){
+        fprintf(stderr, "Invalid sync timeout\n");
+        return -1;
+      }
+    }
+  }
+
+  // the forward sections, read the same way again on a reload
+  config.file = confFileName;
+  if(config_forwards(confFile, &targets, &targetCount, &offloads, &offloadCount) == -1){
+    perror("Reading forwards");
+    return -1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("Initialized %zu forward targets in %.1fms\n", targetCount,
+    (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+  if(offloadCount){
+    printf("Offloaded %zu forwards to the kernel\n", offloadCount);
+  }
+
+  // the kernel only forwards between interfaces, or routes for xdp, if it's allowed to
+  if((offloadCount || (config.mode == MODE_NAT && config.xdp))
+    && (sysctl = fopen("/proc/sys/net/ipv4/ip_forward", "r"))){
+    if(fgetc(sysctl) == '0'){
+      fprintf(stderr, "%s need net.ipv4.ip_forward = 1\n",
+        offloadCount ? "Offloaded forwards" : "XDP forwards");
+    }
+    fclose(sysctl);
+  }
+
+  // the proxy's own sockets need their resets, offloads need their nat rules
+  if(config.mode == MODE_NAT || offloadCount){
+    if(firewall_install(&config, targets, config.mode == MODE_NAT ? targetCount : 0, offloads,
+      offloadCount) == -1){
+      fprintf(stderr, "Failed to install the firewall rules\n");
+      return -1;
+    }
+    firewall = 1;
+  }
+  if(config.mode == MODE_NAT){
+    printf("Checksum kernel: %s\n", csum_kernel());
+  }
 
   // close the config
   confread_close(&confFile);
 
   // run the forwarder
-  forward(targets, targetCount, myIp);
+  if(config.mode == MODE_PROXY){
+    proxy(targets, targetCount, &config);
+  }
+  else{
+    forward(targets, targetCount, &config);
+  }
+  // a saved or replicated connection would be reset by the kernel until
+  // the next start or the standby takes it over, so the rules stay for it,
+  // and it replaces them
+  if(firewall && (config.snapshot || config.sync_peer || config.standby)){
+    printf("Firewall rules kept for whoever takes over\n");
+  }
+  else if(firewall){
+    firewall_remove();
+  }
 
   // cleanup
   free(targets);
+  free(offloads);
+  free(config.interfaces);
+  free(config.cpus);
+  free(config.snat);
+  free(config.snapshot);
+  free(config.metrics);
 
   return 0;
 
@@ -0,0 +1,653 @@
+/* ----------------------------------------------------------------------------
+SOURCE FILE
+
+Name:		metrics.c
+
+Program:	Port Forwarder
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Functions:
+  struct pf_metrics_server *metrics_open(struct pf_config* config,
+    struct pf_worker* workers, size_t slots, struct pf_table* table,
+    struct pf_xdp* xdp)
+  void metrics_update(struct pf_metrics_server* server, struct pf_table* table)
+  void metrics_close(struct pf_metrics_server* server)
+  void metrics_handshake(struct pf_metrics* metrics, unsigned long rtt)
+
+Description:
+  Serves what the workers count, in the Prometheus text format, on a unix
+  socket named by "metrics" in the root section.
+
+  Each worker counts the packets of every target in its own pf_metrics
+  slots, on cache lines no other worker writes, with plain adds. Nothing is
+  added up until a client connects: then a thread of our own reads every
+  worker's slots and writes out the totals. The reads race with the
+  workers, but every counter is a single aligned word, so a client sees
+  each one either before or after a packet, never half way.
+
+  A client that sends an HTTP request (curl --unix-socket) gets an HTTP
+  response, one that sends nothing (nc -U) just gets the text.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Serves the targets of whichever table a reload last swapped in, slots are
+  found by target id
+
+---------------------------------------------------------------------------- */
+
+#include "portforward.h"
+
+#include <stddef.h>
+#include <sys/un.h>
+
+// how long a client has to send its request before it gets the bare text
+#define METRICS_REQUEST_MS 100
+
+// the metrics socket and the thread serving it
+struct pf_metrics_server{
+  int fd;
+  char* path;
+  pthread_t thread;
+  volatile int running;
+
+  // what is served, the table is swapped by a reload under the lock
+  struct pf_worker* workers;
+  int workerCount;
+  size_t slots;
+  struct pf_table* table;
+  pthread_mutex_t lock;
+  struct pf_xdp* xdp;
+};
+
+static void *metrics_run(void* arg);
+static void metrics_serve(struct pf_metrics_server* server, int fd);
+static void metrics_text(struct pf_metrics_server* server, FILE* out);
+static void metrics_counter(FILE* out, struct pf_target** targets,
+  struct pf_metrics* totals, size_t count, const char* name, const char* help,
+  size_t field);
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Metrics Open
+
+Prototype:  struct pf_metrics_server *metrics_open(struct pf_config* config,
+              struct pf_worker* workers, size_t slots,
+              struct pf_table* table, struct pf_xdp* xdp)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_config* config
+    the settings, with the socket path in metrics
+  struct pf_worker* workers
+    the workers, config->workers of them, with their metrics allocated
+  size_t slots
+    the metrics each worker has, every target id is below it
+  struct pf_table* table
+    the targets, their ids index the metrics
+  struct pf_xdp* xdp
+    the xdp fast path, or a null pointer
+
+Return Values:
+  The server, or a null pointer on error
+
+Description:
+  Listens on the socket, replacing whatever a previous run left at the path,
+  and starts the thread that serves it.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Takes the table instead of the array of targets
+
+  Andrew Burian
+  2026-10-18
+  Takes the number of slots, the ids of the targets are below it
+
+---------------------------------------------------------------------------- */
+struct pf_metrics_server *metrics_open(struct pf_config* config, struct pf_worker* workers,
+  size_t slots, struct pf_table* table, struct pf_xdp* xdp) {
+
+  struct pf_metrics_server* server;
+  struct sockaddr_un addr = {0};
+
+  if (strlen(config->metrics) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Metrics socket path too long: %s\n", config->metrics);
+    return 0;
+  }
+
+  if (!(server = (struct pf_metrics_server*)calloc(1, sizeof(struct pf_metrics_server)))) {
+    perror("Metrics");
+    return 0;
+  }
+  server->path = config->metrics;
+  server->workers = workers;
+  server->workerCount = config->workers;
+  server->slots = slots;
+  server->table = table;
+  pthread_mutex_init(&server->lock, 0);
+  server->xdp = xdp;
+  server->running = 1;
+
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, server->path);
+  unlink(server->path);
+
+  if ((server->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1
+    || bind(server->fd, (struct sockaddr*)&addr, sizeof(addr)) == -1
+    || listen(server->fd, 16) == -1) {
+    perror("Metrics Socket");
+    if (server->fd != -1) {
+      close(server->fd);
+    }
+    free(server);
+    return 0;
+  }
+
+  if (pthread_create(&server->thread, 0, metrics_run, server) != 0) {
+    perror("Metrics Thread");
+    close(server->fd);
+    unlink(server->path);
+    free(server);
+    return 0;
+  }
+
+  printf("Serving metrics on %s\n", server->path);
+  return server;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Metrics Close
+
+Prototype:  void metrics_close(struct pf_metrics_server* server)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_metrics_server* server
+    the server to stop
+
+Return Values:
+  void
+
+Description:
+  Stops the thread, within its poll timeout, and removes the socket.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+void metrics_close(struct pf_metrics_server* server) {
+
+  server->running = 0;
+  pthread_join(server->thread, 0);
+  close(server->fd);
+  unlink(server->path);
+  pthread_mutex_destroy(&server->lock);
+  free(server);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Metrics Update
+
+Prototype:  void metrics_update(struct pf_metrics_server* server,
+              struct pf_table* table)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_metrics_server* server
+    the server
+  struct pf_table* table
+    the table a reload swapped in
+
+Return Values:
+  void
+
+Description:
+  Serves the targets of a new table from now on. Waits for a client being
+  answered from the old one, so it can be freed after.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+void metrics_update(struct pf_metrics_server* server, struct pf_table* table) {
+
+  pthread_mutex_lock(&server->lock);
+  server->table = table;
+  pthread_mutex_unlock(&server->lock);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Metrics Handshake
+
+Prototype:  void metrics_handshake(struct pf_metrics* metrics, unsigned long rtt)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_metrics* metrics
+    the worker's counters for the target
+  unsigned long rtt
+    the handshake round trip in microseconds
+
+Return Values:
+  void
+
+Description:
+  Adds a handshake to the target's round trip histogram.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+void metrics_handshake(struct pf_metrics* metrics, unsigned long rtt) {
+
+  int i = 0;
+
+  while (i < METRICS_RTT_BUCKETS - 1 && rtt > (unsigned long)METRICS_RTT_FIRST_US << i) {
+    i++;
+  }
+  metrics->rtt[i]++;
+  metrics->rtt_sum += rtt;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Metrics Run
+
+Prototype:  static void *metrics_run(void* arg)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  void* arg
+    the server
+
+Return Values:
+  0
+
+Description:
+  Serves clients one at a time until the server is closed. The listening
+  socket is polled so a close is noticed within WORKER_POLL_MS.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void *metrics_run(void* arg) {
+
+  struct pf_metrics_server* server = (struct pf_metrics_server*)arg;
+  struct pollfd listener;
+  int fd;
+
+  listener.fd = server->fd;
+  listener.events = POLLIN;
+
+  while (server->running) {
+    if (poll(&listener, 1, WORKER_POLL_MS) < 1) {
+      continue;
+    }
+    if ((fd = accept4(server->fd, 0, 0, SOCK_CLOEXEC)) == -1) {
+      continue;
+    }
+    metrics_serve(server, fd);
+    close(fd);
+  }
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Metrics Serve
+
+Prototype:  static void metrics_serve(struct pf_metrics_server* server, int fd)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_metrics_server* server
+    the server
+  int fd
+    the client
+
+Return Values:
+  void
+
+Description:
+  Waits briefly for a request, then writes the metrics, as an HTTP response
+  if the request was one. A client that stops reading is given up on after a
+  second rather than holding up the next one.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void metrics_serve(struct pf_metrics_server* server, int fd) {
+
+  static const char header[] = "HTTP/1.0 200 OK\r\n"
+    "Content-Type: text/plain; version=0.0.4\r\n"
+    "Connection: close\r\n\r\n";
+
+  struct timeval timeout = {1, 0};
+  struct pollfd client;
+  char request[1024];
+  char* text = 0;
+  size_t length = 0;
+  size_t sent;
+  ssize_t n;
+  int http = 0;
+  FILE* out;
+
+  client.fd = fd;
+  client.events = POLLIN;
+  if (poll(&client, 1, METRICS_REQUEST_MS) == 1
+    && (n = recv(fd, request, sizeof(request) - 1, MSG_DONTWAIT)) > 0) {
+    request[n] = 0;
+    http = !strncmp(request, "GET ", 4) || !strncmp(request, "HEAD ", 5);
+  }
+
+  if (!(out = open_memstream(&text, &length))) {
+    return;
+  }
+  if (http) {
+    fputs(header, out);
+  }
+  pthread_mutex_lock(&server->lock);
+  metrics_text(server, out);
+  pthread_mutex_unlock(&server->lock);
+  fclose(out);
+
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  for (sent = 0; sent < length; sent += n) {
+    if ((n = send(fd, text + sent, length - sent, MSG_NOSIGNAL)) <= 0) {
+      break;
+    }
+  }
+
+  free(text);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Metrics Text
+
+Prototype:  static void metrics_text(struct pf_metrics_server* server, FILE* out)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_metrics_server* server
+    the server
+  FILE* out
+    where to write
+
+Return Values:
+  void
+
+Description:
+  Adds up every worker's counters for each target and writes them out,
+  followed by the targets' open connections and measured round trips, and
+  what each worker counts of its own. Draining targets are listed after the
+  current ones. Called with the lock held.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Lists the targets of the table, with the slots of their ids
+
+  Andrew Burian
+  2026-10-18
+  Finds a target whose id is already listed in a table of the ids seen,
+  instead of scanning the list
+
+---------------------------------------------------------------------------- */
+static void metrics_text(struct pf_metrics_server* server, FILE* out) {
+
+  struct pf_metrics* totals;
+  struct pf_target** targets;
+  struct pf_target* target;
+  unsigned char* seen;
+  size_t count = server->table->targetCount + server->table->drainingCount;
+  struct in_addr addr;
+  struct pf_stats* stats;
+  unsigned long* total;
+  unsigned long* slot;
+  unsigned long cumulative;
+  size_t words = sizeof(struct pf_metrics) / sizeof(unsigned long);
+  size_t t, k;
+  int i;
+
+  totals = (struct pf_metrics*)calloc(count + 1, sizeof(struct pf_metrics));
+  targets = (struct pf_target**)malloc(sizeof(struct pf_target*) * (count + 1));
+  seen = (unsigned char*)calloc(server->slots + 1, 1);
+  if (!totals || !targets || !seen) {
+    free(totals);
+    free(targets);
+    free(seen);
+    return;
+  }
+  // a draining target that came back shares its id, and counters, with the new one
+  for (t = 0, k = 0; t < server->table->targetCount + server->table->drainingCount; t++) {
+    target = t < server->table->targetCount ? &server->table->targets[t]
+      : server->table->draining[t - server->table->targetCount];
+    if (!seen[target->id]) {
+      seen[target->id] = 1;
+      targets[k++] = target;
+    }
+  }
+  count = k;
+  free(seen);
+
+  for (i = 0; i < server->workerCount; i++) {
+    for (t = 0; t < count; t++) {
+      total = (unsigned long*)&totals[t];
+      slot = (unsigned long*)&server->workers[i].metrics[targets[t]->id];
+      for (k = 0; k < words; k++) {
+        total[k] += __atomic_load_n(&slot[k], __ATOMIC_RELAXED);
+      }
+    }
+  }
+
+  metrics_counter(out, targets, totals, count, "portforward_packets_total",
+    "Packets forwarded for a target.", offsetof(struct pf_metrics, packets));
+  metrics_counter(out, targets, totals, count, "portforward_bytes_total",
+    "Bytes of ip packets forwarded for a target.", offsetof(struct pf_metrics, bytes));
+  metrics_counter(out, targets, totals, count, "portforward_syns_total",
+    "SYNs forwarded for a target.", offsetof(struct pf_metrics, syns));
+  metrics_counter(out, targets, totals, count, "portforward_fins_total",
+    "FINs forwarded for a target.", offsetof(struct pf_metrics, fins));
+  metrics_counter(out, targets, totals, count, "portforward_rsts_total",
+    "RSTs forwarded for a target.", offsetof(struct pf_metrics, rsts));
+
+  fprintf(out, "# HELP portforward_handshake_seconds Time from a client's SYN to the target's SYN-ACK.\n");
+  fprintf(out, "# TYPE portforward_handshake_seconds histogram\n");
+  for (t = 0; t < count; t++) {
+    target = targets[t];
+    addr.s_addr = target->host;
+    cumulative = 0;
+    for (k = 0; k < METRICS_RTT_BUCKETS; k++) {
+      cumulative += totals[t].rtt[k];
+      if (k < METRICS_RTT_BUCKETS - 1) {
+        fprintf(out, "portforward_handshake_seconds_bucket{port=\"%hu\",target=\"%s:%hu\",le=\"%g\"} %lu\n",
+          ntohs(target->port.a_port), inet_ntoa(addr), ntohs(target->port.b_port),
+          (double)((unsigned long)METRICS_RTT_FIRST_US << k) / 1e6, cumulative);
+      }
+      else {
+        fprintf(out, "portforward_handshake_seconds_bucket{port=\"%hu\",target=\"%s:%hu\",le=\"+Inf\"} %lu\n",
+          ntohs(target->port.a_port), inet_ntoa(addr), ntohs(target->port.b_port), cumulative);
+      }
+    }
+    fprintf(out, "portforward_handshake_seconds_sum{port=\"%hu\",target=\"%s:%hu\"} %g\n",
+      ntohs(target->port.a_port), inet_ntoa(addr), ntohs(target->port.b_port),
+      totals[t].rtt_sum / 1e6);
+    fprintf(out, "portforward_handshake_seconds_count{port=\"%hu\",target=\"%s:%hu\"} %lu\n",
+      ntohs(target->port.a_port), inet_ntoa(addr), ntohs(target->port.b_port), cumulative);
+  }
+
+  fprintf(out, "# HELP portforward_handshake_average_seconds Moving average of the target's handshakes.\n");
+  fprintf(out, "# TYPE portforward_handshake_average_seconds gauge\n");
+  for (t = 0; t < count; t++) {
+    target = targets[t];
+    addr.s_addr = target->host;
+    fprintf(out, "portforward_handshake_average_seconds{port=\"%hu\",target=\"%s:%hu\"} %g\n",
+      ntohs(target->port.a_port), inet_ntoa(addr), ntohs(target->port.b_port),
+      __atomic_load_n(&target->load->rtt, __ATOMIC_RELAXED) / 1e6);
+  }
+
+  fprintf(out, "# HELP portforward_flows Connections open to the target.\n");
+  fprintf(out, "# TYPE portforward_flows gauge\n");
+  for (t = 0; t < count; t++) {
+    target = targets[t];
+    addr.s_addr = target->host;
+    fprintf(out, "portforward_flows{port=\"%hu\",target=\"%s:%hu\"} %ld\n",
+      ntohs(target->port.a_port), inet_ntoa(addr), ntohs(target->port.b_port),
+      __atomic_load_n(&target->load->flows, __ATOMIC_RELAXED));
+  }
+
+  // what each worker counts whatever the target
+  fprintf(out, "# HELP portforward_received_packets_total Packets read by the worker.\n");
+  fprintf(out, "# TYPE portforward_received_packets_total counter\n");
+  for (i = 0; i < server->workerCount; i++) {
+    stats = &server->workers[i].stats;
+    fprintf(out, "portforward_received_packets_total{worker=\"%d\"} %lu\n", i,
+      __atomic_load_n(&stats->received, __ATOMIC_RELAXED));
+  }
+  fprintf(out, "# HELP portforward_lookup_misses_total Packets to or from a target of no known connection.\n");
+  fprintf(out, "# TYPE portforward_lookup_misses_total counter\n");
+  for (i = 0; i < server->workerCount; i++) {
+    stats = &server->workers[i].stats;
+    fprintf(out, "portforward_lookup_misses_total{worker=\"%d\"} %lu\n", i,
+      __atomic_load_n(&stats->misses, __ATOMIC_RELAXED));
+  }
+  fprintf(out, "# HELP portforward_send_failures_total Forwarded packets the kernel refused.\n");
+  fprintf(out, "# TYPE portforward_send_failures_total counter\n");
+  for (i = 0; i < server->workerCount; i++) {
+    stats = &server->workers[i].stats;
+    fprintf(out, "portforward_send_failures_total{worker=\"%d\"} %lu\n", i,
+      __atomic_load_n(&stats->send_errors, __ATOMIC_RELAXED));
+  }
+  fprintf(out, "# HELP portforward_syns_dropped_total SYNs dropped with the connection table full.\n");
+  fprintf(out, "# TYPE portforward_syns_dropped_total counter\n");
+  for (i = 0; i < server->workerCount; i++) {
+    stats = &server->workers[i].stats;
+    fprintf(out, "portforward_syns_dropped_total{worker=\"%d\"} %lu\n", i,
+      __atomic_load_n(&stats->syn_dropped, __ATOMIC_RELAXED));
+  }
+  fprintf(out, "# HELP portforward_expired_flows_total Connections that idled out.\n");
+  fprintf(out, "# TYPE portforward_expired_flows_total counter\n");
+  for (i = 0; i < server->workerCount; i++) {
+    stats = &server->workers[i].stats;
+    fprintf(out, "portforward_expired_flows_total{worker=\"%d\"} %lu\n", i,
+      __atomic_load_n(&stats->expired, __ATOMIC_RELAXED));
+  }
+  fprintf(out, "# HELP portforward_worker_flows Connections in the worker's table, closing ones included.\n");
+  fprintf(out, "# TYPE portforward_worker_flows gauge\n");
+  for (i = 0; i < server->workerCount; i++) {
+    fprintf(out, "portforward_worker_flows{worker=\"%d\"} %zu\n", i,
+      __atomic_load_n(&server->workers[i].conntrack.count, __ATOMIC_RELAXED));
+  }
+
+  if (server->xdp) {
+    fprintf(out, "# HELP portforward_xdp_packets_total Packets the xdp fast path forwarded.\n");
+    fprintf(out, "# TYPE portforward_xdp_packets_total counter\n");
+    fprintf(out, "portforward_xdp_packets_total %lu\n", xdp_packets(server->xdp));
+  }
+
+  free(totals);
+  free(targets);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Metrics Counter
+
+Prototype:  static void metrics_counter(FILE* out, struct pf_target** targets,
+              struct pf_metrics* totals, size_t count, const char* name,
+              const char* help, size_t field)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  FILE* out
+    where to write
+  struct pf_target** targets
+    the targets
+  struct pf_metrics* totals
+    their counters added up over the workers
+  size_t count
+    the number of targets
+  const char* name
+    the metric
+  const char* help
+    its description
+  size_t field
+    offset of the counter in pf_metrics, a pair indexed by direction
+
+Return Values:
+  void
+
+Description:
+  Writes a counter kept for each direction of each target.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void metrics_counter(FILE* out, struct pf_target** targets,
+  struct pf_metrics* totals, size_t count, const char* name, const char* help,
+  size_t field) {
+
+  static const char* directions[] = {"to_target", "to_client"};
+
+  struct in_addr addr;
+  unsigned long* pair;
+  size_t t;
+  int dir;
+
+  fprintf(out, "# HELP %s %s\n", name, help);
+  fprintf(out, "# TYPE %s counter\n", name);
+
+  for (t = 0; t < count; t++) {
+    addr.s_addr = targets[t]->host;
+    pair = (unsigned long*)((char*)&totals[t] + field);
+    for (dir = 0; dir < 2; dir++) {
+      fprintf(out, "%s{port=\"%hu\",target=\"%s:%hu\",direction=\"%s\"} %lu\n", name,
+        ntohs(targets[t]->port.a_port), inet_ntoa(addr), ntohs(targets[t]->port.b_port),
+        directions[dir], pair[dir]);
+    }
+  }
+}
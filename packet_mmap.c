@@ -0,0 +1,964 @@
+/* ----------------------------------------------------------------------------
+SOURCE FILE
+
+Name:		packet_mmap.c
+
+Program:	Port Forwarder
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Functions:
+  struct pf_rings *packet_mmap_open(struct pf_config* config,
+    struct sock_fprog* fanout, struct sock_fprog* filter)
+  void packet_mmap_forward(struct pf_worker* worker, volatile sig_atomic_t* running)
+  void packet_mmap_close(struct pf_rings* rings)
+  int packet_mmap_steer(struct pf_rings* rings, struct sock_fprog* fanout,
+    struct sock_fprog* filter)
+  unsigned long packet_mmap_drops(struct pf_rings* rings)
+
+Description:
+  The packet_mmap I/O backend. Instead of copying every packet through a raw
+  socket, each configured interface gets a TPACKET_V3 receive ring and a
+  TPACKET_V2 transmit ring (with the qdisc bypassed) shared with the kernel.
+  Packets are rewritten in place in the receive ring, then copied once into
+  the transmit ring behind a new ethernet header.
+
+  Next hops are learned from the source MAC of received frames. A packet for
+  a host not learned yet (usually the first SYN to a target) is sent through
+  a raw socket instead, so the kernel resolves it.
+
+  Every worker has its own rings. With several workers the receive rings of
+  each interface join one fanout group, steered by a program from filter.c,
+  and every receive socket has a socket filter so the rings only ever hold
+  forwarded traffic.
+
+  In busy poll mode the workers spin on the rings instead of sleeping in
+  poll, though a block is still only handed over when it fills or retires.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Rings are opened per worker and can join a fanout group
+
+  Andrew Burian
+  2026-10-18
+  The fanout program can be replaced when the forwards are reloaded
+
+  Andrew Burian
+  2026-10-18
+  Receive sockets are filtered down to forwarded traffic
+
+  Andrew Burian
+  2026-10-18
+  Packets to the addresses of the snat pool are forwarded too
+
+---------------------------------------------------------------------------- */
+
+#include "portforward.h"
+
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+// most interfaces one forwarder will bind
+#define MAX_INTERFACES 16
+
+// direct mapped cache of learned next hops
+#define NEIGHBOUR_SLOTS 4096
+
+// where frame data starts in a TPACKET_V2 transmit slot
+#define TX_DATA_OFFSET (TPACKET2_HDRLEN - sizeof(struct sockaddr_ll))
+
+// one interface and its rings
+struct pf_ring_if{
+  char name[IF_NAMESIZE];
+  int ifindex;
+  unsigned char mac[ETH_ALEN];
+
+  // receive ring, TPACKET_V3 blocks
+  int rx_fd;
+  char* rx_ring;
+  size_t rx_size;
+  unsigned int rx_block;
+
+  // transmit ring, TPACKET_V2 frames
+  int tx_fd;
+  char* tx_ring;
+  size_t tx_size;
+  unsigned int tx_frame;
+  unsigned int tx_frames;
+  int tx_pending;
+};
+
+// a learned next hop
+struct pf_neighbour{
+  unsigned int ip;
+  int iface;
+  unsigned char mac[ETH_ALEN];
+};
+
+// everything one worker forwards with
+struct pf_rings{
+  struct pf_ring_if ifaces[MAX_INTERFACES];
+  int ifaceCount;
+  struct pf_neighbour neighbours[NEIGHBOUR_SLOTS];
+
+  // our address and the snat pool, sorted, only packets to them are forwarded
+  unsigned int ip;
+  unsigned int* snat;
+  int snatCount;
+
+  // raw socket for packets to unknown next hops
+  int slow_fd;
+
+  // ring geometry
+  unsigned int block_size, block_count, frame_size;
+
+  // spin on the rings instead of sleeping in poll
+  int busy_poll;
+
+  // frames dropped with the receive rings full, PACKET_STATISTICS resets
+  // on every read
+  unsigned long drops;
+};
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Neighbour
+
+Prototype:  static struct pf_neighbour *neighbour(struct pf_rings* rings, unsigned int ip)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_rings* rings
+    the worker's rings
+  unsigned int ip
+    the address (network order)
+
+Return Values:
+  The cache slot the address maps to
+
+Description:
+  Cache slot for an address. Colliding addresses simply replace each other.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static struct pf_neighbour *neighbour(struct pf_rings* rings, unsigned int ip) {
+  return &rings->neighbours[(ip * 2654435761u) >> 20 & (NEIGHBOUR_SLOTS - 1)];
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Ring Open
+
+Prototype:  static int ring_open(struct pf_rings* rings, struct pf_ring_if* iface,
+              struct sock_fprog* fanout, struct sock_fprog* filter)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_rings* rings
+    the worker's rings, with the geometry filled in
+  struct pf_ring_if* iface
+    the interface, with its name filled in
+  struct sock_fprog* fanout
+    the fanout steering program, or a null pointer for a single worker
+  struct sock_fprog* filter
+    the worker's socket filter
+
+Return Values:
+  0  success
+  -1 error, with the reason printed
+
+Description:
+  Looks up the interface and maps its receive and transmit rings. The receive
+  ring joins the interface's fanout group if there is one.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  The receive socket is filtered before it is bound, so nothing but
+  forwarded traffic is ever put in the ring
+
+---------------------------------------------------------------------------- */
+static int ring_open(struct pf_rings* rings, struct pf_ring_if* iface,
+  struct sock_fprog* fanout, struct sock_fprog* filter) {
+
+  unsigned int block_size = rings->block_size;
+  unsigned int block_count = rings->block_count;
+  unsigned int frame_size = rings->frame_size;
+  int version;
+  int group;
+  int bypass = 1;
+  struct tpacket_req3 rx_req = {0};
+  struct tpacket_req tx_req = {0};
+  struct sockaddr_ll addr = {0};
+  struct ifreq ifr = {0};
+
+  if (!(iface->ifindex = if_nametoindex(iface->name))) {
+    fprintf(stderr, "Unknown interface %s\n", iface->name);
+    return -1;
+  }
+
+  // receive side
+  if ((iface->rx_fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_IP))) == -1) {
+    perror("Packet Socket");
+    return -1;
+  }
+
+  if (setsockopt(iface->rx_fd, SOL_SOCKET, SO_ATTACH_FILTER, filter, sizeof(*filter)) == -1) {
+    perror("SetSockOpt SO_ATTACH_FILTER");
+    return -1;
+  }
+
+  version = TPACKET_V3;
+  if (setsockopt(iface->rx_fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1) {
+    perror("SetSockOpt PACKET_VERSION");
+    return -1;
+  }
+
+  rx_req.tp_block_size = block_size;
+  rx_req.tp_block_nr = block_count;
+  rx_req.tp_frame_size = frame_size;
+  rx_req.tp_frame_nr = (block_size / frame_size) * block_count;
+  rx_req.tp_retire_blk_tov = 1;
+  if (setsockopt(iface->rx_fd, SOL_PACKET, PACKET_RX_RING, &rx_req, sizeof(rx_req)) == -1) {
+    perror("SetSockOpt PACKET_RX_RING");
+    return -1;
+  }
+
+  iface->rx_size = (size_t)block_size * block_count;
+  iface->rx_ring = mmap(0, iface->rx_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED | MAP_POPULATE,
+    iface->rx_fd, 0);
+  if (iface->rx_ring == MAP_FAILED) {
+    iface->rx_ring = 0;
+    perror("Map Receive Ring");
+    return -1;
+  }
+
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = htons(ETH_P_IP);
+  addr.sll_ifindex = iface->ifindex;
+  if (bind(iface->rx_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+    perror("Bind Receive Ring");
+    return -1;
+  }
+
+  // one group per interface, members are numbered by the order they join
+  if (fanout) {
+    group = ((getpid() + iface->ifindex) & 0xffff) | (PACKET_FANOUT_CBPF << 16);
+    if (setsockopt(iface->rx_fd, SOL_PACKET, PACKET_FANOUT, &group, sizeof(group)) == -1) {
+      perror("SetSockOpt PACKET_FANOUT");
+      return -1;
+    }
+    if (setsockopt(iface->rx_fd, SOL_PACKET, PACKET_FANOUT_DATA, fanout, sizeof(*fanout)) == -1) {
+      perror("SetSockOpt PACKET_FANOUT_DATA");
+      return -1;
+    }
+  }
+
+  // transmit side, protocol 0 so it never receives
+  if ((iface->tx_fd = socket(AF_PACKET, SOCK_RAW, 0)) == -1) {
+    perror("Packet Socket");
+    return -1;
+  }
+
+  version = TPACKET_V2;
+  if (setsockopt(iface->tx_fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) == -1) {
+    perror("SetSockOpt PACKET_VERSION");
+    return -1;
+  }
+
+  // hand frames straight to the driver
+  if (setsockopt(iface->tx_fd, SOL_PACKET, PACKET_QDISC_BYPASS, &bypass, sizeof(bypass)) == -1) {
+    perror("SetSockOpt PACKET_QDISC_BYPASS");
+  }
+
+  tx_req.tp_block_size = block_size;
+  tx_req.tp_block_nr = block_count;
+  tx_req.tp_frame_size = frame_size;
+  tx_req.tp_frame_nr = (block_size / frame_size) * block_count;
+  if (setsockopt(iface->tx_fd, SOL_PACKET, PACKET_TX_RING, &tx_req, sizeof(tx_req)) == -1) {
+    perror("SetSockOpt PACKET_TX_RING");
+    return -1;
+  }
+
+  iface->tx_frames = tx_req.tp_frame_nr;
+  iface->tx_size = (size_t)block_size * block_count;
+  iface->tx_ring = mmap(0, iface->tx_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED | MAP_POPULATE,
+    iface->tx_fd, 0);
+  if (iface->tx_ring == MAP_FAILED) {
+    iface->tx_ring = 0;
+    perror("Map Transmit Ring");
+    return -1;
+  }
+
+  addr.sll_protocol = 0;
+  if (bind(iface->tx_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+    perror("Bind Transmit Ring");
+    return -1;
+  }
+
+  // our source MAC for transmitted frames
+  strncpy(ifr.ifr_name, iface->name, IF_NAMESIZE - 1);
+  if (ioctl(iface->tx_fd, SIOCGIFHWADDR, &ifr) == -1) {
+    perror("Interface Address");
+    return -1;
+  }
+  memcpy(iface->mac, ifr.ifr_hwaddr.sa_data, ETH_ALEN);
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Ring Close
+
+Prototype:  static void ring_close(struct pf_ring_if* iface)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_ring_if* iface
+    the interface to release
+
+Return Values:
+  void
+
+Description:
+  Unmaps the rings and closes the sockets of an interface.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void ring_close(struct pf_ring_if* iface) {
+
+  if (iface->rx_ring) {
+    munmap(iface->rx_ring, iface->rx_size);
+  }
+  if (iface->tx_ring) {
+    munmap(iface->tx_ring, iface->tx_size);
+  }
+  if (iface->rx_fd > 0) {
+    close(iface->rx_fd);
+  }
+  if (iface->tx_fd > 0) {
+    close(iface->tx_fd);
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Ring Transmit
+
+Prototype:  static int ring_transmit(struct pf_rings* rings, struct pf_ring_if* iface,
+              const unsigned char* dst_mac, const char* packet, int length)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_rings* rings
+    the worker's rings
+  struct pf_ring_if* iface
+    the interface to send out of
+  const unsigned char* dst_mac
+    the next hop
+  const char* packet
+    the ip packet
+  int length
+    the length of the packet
+
+Return Values:
+  0  the frame is queued
+  -1 the transmit ring is full or the packet doesn't fit a frame
+
+Description:
+  Builds an ethernet frame for the packet in the next free transmit slot. The
+  frame goes out on the next ring_flush.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int ring_transmit(struct pf_rings* rings, struct pf_ring_if* iface,
+  const unsigned char* dst_mac, const char* packet, int length) {
+
+  unsigned int frame_size = rings->frame_size;
+  struct tpacket2_hdr* hdr;
+  struct ethhdr* eth;
+
+  if (length < 0 || (unsigned int)length + ETH_HLEN > frame_size - TX_DATA_OFFSET) {
+    return -1;
+  }
+
+  hdr = (struct tpacket2_hdr*)(iface->tx_ring + (size_t)iface->tx_frame * frame_size);
+  if (hdr->tp_status == TP_STATUS_WRONG_FORMAT) {
+    hdr->tp_status = TP_STATUS_AVAILABLE;
+  }
+  if (hdr->tp_status != TP_STATUS_AVAILABLE) {
+    return -1;
+  }
+
+  eth = (struct ethhdr*)((char*)hdr + TX_DATA_OFFSET);
+  memcpy(eth->h_dest, dst_mac, ETH_ALEN);
+  memcpy(eth->h_source, iface->mac, ETH_ALEN);
+  eth->h_proto = htons(ETH_P_IP);
+  memcpy(eth + 1, packet, length);
+
+  hdr->tp_len = length + ETH_HLEN;
+  __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+  iface->tx_frame = (iface->tx_frame + 1) % iface->tx_frames;
+  iface->tx_pending++;
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Ring Flush
+
+Prototype:  static void ring_flush(struct pf_rings* rings, struct pf_stats* stats)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_rings* rings
+    the worker's rings
+  struct pf_stats* stats
+    the counters to update
+
+Return Values:
+  void
+
+Description:
+  Tells the kernel to send the queued frames on every interface that has any.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void ring_flush(struct pf_rings* rings, struct pf_stats* stats) {
+
+  struct pf_ring_if* iface;
+  int i;
+
+  for (i = 0; i < rings->ifaceCount; i++) {
+    iface = &rings->ifaces[i];
+    if (!iface->tx_pending) {
+      continue;
+    }
+
+    stats->send_calls++;
+    if (send(iface->tx_fd, 0, 0, MSG_DONTWAIT) == -1 && errno != EAGAIN) {
+      stats->send_errors += iface->tx_pending;
+    }
+    else {
+      stats->forwarded += iface->tx_pending;
+    }
+    iface->tx_pending = 0;
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Ring Address
+
+Prototype:  static int ring_address(const void* a, const void* b)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  const void* a, b
+    two addresses
+
+Return Values:
+  Their order, for qsort and bsearch
+
+Description:
+  The snat pool is kept sorted so a packet to one of its addresses is found
+  in a few compares. Only packets not to our own address look in it.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int ring_address(const void* a, const void* b) {
+
+  unsigned int x = *(const unsigned int*)a;
+  unsigned int y = *(const unsigned int*)b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Ring Packet
+
+Prototype:  static void ring_packet(struct pf_worker* worker, int iface,
+              struct tpacket3_hdr* ppd)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_worker* worker
+    the worker, with its rings and counters
+  int iface
+    the interface the frame arrived on
+  struct tpacket3_hdr* ppd
+    the frame in the receive ring
+
+Return Values:
+  void
+
+Description:
+  Learns the next hop of the sender, rewrites the packet where it sits in
+  the receive ring and queues it on the interface its next hop was seen on.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Takes packets to the snat pool as well as to our address
+
+---------------------------------------------------------------------------- */
+static void ring_packet(struct pf_worker* worker, int iface,
+  struct tpacket3_hdr* ppd) {
+
+  struct pf_rings* rings = worker->rings;
+  struct pf_stats* stats = &worker->stats;
+
+  struct sockaddr_ll* sll;
+  struct ethhdr* eth;
+  struct iphdr* ip_header;
+  struct tcphdr* tcp_header;
+  struct pf_neighbour* hop;
+  struct sockaddr_in dst_addr = {0};
+  int length;
+
+  sll = (struct sockaddr_ll*)((char*)ppd + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+  eth = (struct ethhdr*)((char*)ppd + ppd->tp_mac);
+  ip_header = (struct iphdr*)((char*)ppd + ppd->tp_net);
+  length = ppd->tp_snaplen - (ppd->tp_net - ppd->tp_mac);
+
+  // only whole packets addressed to us or the snat pool
+  if (sll->sll_pkttype == PACKET_OUTGOING || ppd->tp_snaplen != ppd->tp_len
+    || length < (int)sizeof(struct iphdr) || (ip_header->daddr != rings->ip
+    && !bsearch(&ip_header->daddr, rings->snat, rings->snatCount, sizeof(unsigned int),
+    ring_address))) {
+    return;
+  }
+  stats->received++;
+
+  // learn where the sender is
+  hop = neighbour(rings, ip_header->saddr);
+  hop->ip = ip_header->saddr;
+  hop->iface = iface;
+  memcpy(hop->mac, eth->h_source, ETH_ALEN);
+
+  if (forward_packet(worker, (char*)ip_header, length, &dst_addr) <= 0) {
+    return;
+  }
+
+  // the sender left the checksum to offload, so there is nothing to adjust
+  if (ppd->tp_status & TP_STATUS_CSUMNOTREADY) {
+    tcp_header = (struct tcphdr*)((char*)ip_header + ip_header->ihl * 4);
+    tcp_header->check = 0;
+    tcp_header->check = tcp_csum(ip_header, tcp_header);
+  }
+
+  hop = neighbour(rings, dst_addr.sin_addr.s_addr);
+  if (hop->ip == dst_addr.sin_addr.s_addr) {
+    if (ring_transmit(rings, &rings->ifaces[hop->iface], hop->mac, (char*)ip_header, length) == -1) {
+      stats->send_errors++;
+    }
+    return;
+  }
+
+  // unknown next hop, let the kernel route this one
+  stats->send_calls++;
+  if (sendto(rings->slow_fd, ip_header, length, 0, (struct sockaddr*)&dst_addr, sizeof(dst_addr)) == -1) {
+    stats->send_errors++;
+  }
+  else {
+    stats->forwarded++;
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Packet Mmap Open
+
+Prototype:  struct pf_rings *packet_mmap_open(struct pf_config* config,
+              struct sock_fprog* fanout, struct sock_fprog* filter)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_config* config
+    the global settings, including the interfaces and ring geometry
+  struct sock_fprog* fanout
+    the fanout steering program, or a null pointer for a single worker
+  struct sock_fprog* filter
+    the worker's socket filter, dropping what isn't forwarded
+
+Return Values:
+  The rings for one worker, or a null pointer on error
+
+Description:
+  Maps the rings of every configured interface for one worker.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Takes a socket filter for the receive rings
+
+  Andrew Burian
+  2026-10-18
+  Keeps a sorted copy of the snat pool
+
+---------------------------------------------------------------------------- */
+struct pf_rings *packet_mmap_open(struct pf_config* config, struct sock_fprog* fanout,
+  struct sock_fprog* filter) {
+
+  struct pf_rings* rings;
+  char* names;
+  char* name;
+  char* save = 0;
+  int hdrincl = 1;
+
+  if (!(rings = (struct pf_rings*)calloc(1, sizeof(struct pf_rings)))) {
+    perror("Rings");
+    return 0;
+  }
+
+  rings->slow_fd = -1;
+  rings->ip = config->ip;
+  rings->busy_poll = config->latency_mode == LATENCY_BUSY_POLL;
+  if (!(rings->snat = (unsigned int*)malloc(sizeof(unsigned int) * config->snatCount))) {
+    perror("Rings");
+    free(rings);
+    return 0;
+  }
+  memcpy(rings->snat, config->snat, sizeof(unsigned int) * config->snatCount);
+  qsort(rings->snat, config->snatCount, sizeof(unsigned int), ring_address);
+  rings->snatCount = config->snatCount;
+  rings->block_size = config->ring_block_size;
+  rings->block_count = config->ring_blocks;
+  rings->frame_size = config->ring_frame_size;
+
+  // open every interface in the list
+  names = strdup(config->interfaces);
+  for (name = strtok_r(names, ", ", &save); name; name = strtok_r(0, ", ", &save)) {
+    if (rings->ifaceCount == MAX_INTERFACES) {
+      fprintf(stderr, "Only %d interfaces supported\n", MAX_INTERFACES);
+      break;
+    }
+    strncpy(rings->ifaces[rings->ifaceCount].name, name, IF_NAMESIZE - 1);
+    if (ring_open(rings, &rings->ifaces[rings->ifaceCount++], fanout, filter) == -1) {
+      free(names);
+      packet_mmap_close(rings);
+      return 0;
+    }
+  }
+  free(names);
+
+  if (rings->ifaceCount == 0) {
+    fprintf(stderr, "packet_mmap needs at least one interface\n");
+    packet_mmap_close(rings);
+    return 0;
+  }
+
+  // slow path for next hops not learned yet
+  if ((rings->slow_fd = socket(AF_INET, SOCK_RAW, IPPROTO_RAW)) == -1
+    || setsockopt(rings->slow_fd, IPPROTO_IP, IP_HDRINCL, &hdrincl, sizeof(hdrincl)) == -1) {
+    perror("Raw Socket");
+    packet_mmap_close(rings);
+    return 0;
+  }
+
+  return rings;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Packet Mmap Forward
+
+Prototype:  void packet_mmap_forward(struct pf_worker* worker,
+              volatile sig_atomic_t* running)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_worker* worker
+    the worker, with its rings open
+  volatile sig_atomic_t* running
+    cleared to stop forwarding
+
+Return Values:
+  void
+
+Description:
+  Forwards until stopped. Each pass waits for a receive block to be handed to
+  us, processes every frame in it and returns it, then flushes the transmit
+  rings once.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Runs per worker, the rings are opened by packet_mmap_open
+
+  Andrew Burian
+  2026-10-18
+  Expires idle connections on every pass
+
+  Andrew Burian
+  2026-10-18
+  Ticks the worker on every pass, which includes expiring connections
+
+  Andrew Burian
+  2026-10-18
+  Doesn't wait in poll when busy polling
+
+---------------------------------------------------------------------------- */
+void packet_mmap_forward(struct pf_worker* worker, volatile sig_atomic_t* running) {
+
+  struct pf_rings* rings = worker->rings;
+  struct pollfd poll_fds[MAX_INTERFACES];
+  struct tpacket_block_desc* block;
+  struct tpacket3_hdr* ppd;
+  struct pf_ring_if* iface;
+  unsigned int p;
+  int i;
+
+  // busy polling only checks, and has the driver polled, without sleeping
+  int timeout = rings->busy_poll ? 0 : WORKER_POLL_MS;
+
+  for (i = 0; i < rings->ifaceCount; i++) {
+    poll_fds[i].fd = rings->ifaces[i].rx_fd;
+    poll_fds[i].events = POLLIN | POLLERR;
+    if (rings->busy_poll) {
+      worker_busy_poll(worker->id, rings->ifaces[i].rx_fd);
+    }
+  }
+
+  if (worker->id == 0) {
+    printf("packet_mmap: %d interfaces, %u x %uKB blocks per ring\n", rings->ifaceCount,
+      rings->block_count, rings->block_size / 1024);
+  }
+
+  while (*running) {
+
+    worker_tick(worker);
+
+    worker->stats.recv_calls++;
+    if (poll(poll_fds, rings->ifaceCount, timeout) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Poll Receive Rings");
+      break;
+    }
+
+    // drain every ready block of every interface
+    for (i = 0; i < rings->ifaceCount; i++) {
+      iface = &rings->ifaces[i];
+      for (;;) {
+        block = (struct tpacket_block_desc*)(iface->rx_ring
+          + (size_t)iface->rx_block * rings->block_size);
+        if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+          break;
+        }
+
+        ppd = (struct tpacket3_hdr*)((char*)block + block->hdr.bh1.offset_to_first_pkt);
+        for (p = 0; p < block->hdr.bh1.num_pkts; p++) {
+          ring_packet(worker, i, ppd);
+          ppd = (struct tpacket3_hdr*)((char*)ppd + ppd->tp_next_offset);
+        }
+
+        // hand the block back
+        __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        iface->rx_block = (iface->rx_block + 1) % rings->block_count;
+      }
+    }
+
+    ring_flush(rings, &worker->stats);
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Packet Mmap Close
+
+Prototype:  void packet_mmap_close(struct pf_rings* rings)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_rings* rings
+    the rings to release
+
+Return Values:
+  void
+
+Description:
+  Unmaps and closes everything packet_mmap_open set up.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Frees the copy of the snat pool
+
+---------------------------------------------------------------------------- */
+void packet_mmap_close(struct pf_rings* rings) {
+
+  int i;
+
+  if (rings->slow_fd != -1) {
+    close(rings->slow_fd);
+  }
+  for (i = 0; i < rings->ifaceCount; i++) {
+    ring_close(&rings->ifaces[i]);
+  }
+  free(rings->snat);
+  free(rings);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Packet Mmap Steer
+
+Prototype:  int packet_mmap_steer(struct pf_rings* rings, struct sock_fprog* fanout,
+              struct sock_fprog* filter)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_rings* rings
+    the rings of a worker
+  struct sock_fprog* fanout
+    the new program steering packets to workers, or a null pointer to
+    leave it be
+  struct sock_fprog* filter
+    the worker's new socket filter
+
+Return Values:
+  0  success
+  -1 error, with the reason printed
+
+Description:
+  Replaces the program of every interface's fanout group. The group's
+  program is shared by its members, so setting it through one worker's
+  rings steers them all, and the kernel swaps it in without dropping
+  packets. The socket filters are the worker's own, and are replaced the
+  same way.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Replaces the worker's socket filters too
+
+---------------------------------------------------------------------------- */
+int packet_mmap_steer(struct pf_rings* rings, struct sock_fprog* fanout,
+  struct sock_fprog* filter) {
+
+  int i;
+
+  for (i = 0; i < rings->ifaceCount; i++) {
+    if (fanout && setsockopt(rings->ifaces[i].rx_fd, SOL_PACKET, PACKET_FANOUT_DATA, fanout,
+      sizeof(*fanout)) == -1) {
+      perror("SetSockOpt PACKET_FANOUT_DATA");
+      return -1;
+    }
+    if (setsockopt(rings->ifaces[i].rx_fd, SOL_SOCKET, SO_ATTACH_FILTER, filter,
+      sizeof(*filter)) == -1) {
+      perror("SetSockOpt SO_ATTACH_FILTER");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Packet Mmap Drops
+
+Prototype:  unsigned long packet_mmap_drops(struct pf_rings* rings)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_rings* rings
+    the rings of a worker
+
+Return Values:
+  the frames that passed the worker's socket filters but were dropped with
+  its receive rings full, since they were opened
+
+Description:
+  Adds up PACKET_STATISTICS for every interface. Safe to call while the
+  worker forwards, as long as only one thread calls it.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+unsigned long packet_mmap_drops(struct pf_rings* rings) {
+
+  struct tpacket_stats_v3 stats;
+  socklen_t length;
+  int i;
+
+  for (i = 0; i < rings->ifaceCount; i++) {
+    length = sizeof(stats);
+    if (getsockopt(rings->ifaces[i].rx_fd, SOL_PACKET, PACKET_STATISTICS, &stats, &length) == 0) {
+      rings->drops += stats.tp_drops;
+    }
+  }
+
+  return rings->drops;
+}
@@ -23,16 +23,148 @@ Revisions:
 #ifndef PORTFORWARD_H
 #define PORTFORWARD_H
 
+// for recvmmsg and sendmmsg
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #define DEFAULT_CONFIG  "forwards.conf"
 #define IP_DATA_LEN     65536
 
+// how forwarded packets are checksummed
+#define CSUM_INCREMENTAL  0
+#define CSUM_FULL         1
+#define CSUM_VERIFY       2
+
+// what forward_packet did with a packet, only those above 0 are sent on:
+// rewritten for a target or a client, not forwarded traffic left to the
+// kernel, or dropped as a miss, a SYN over max_flows, or a short packet
+#define VERDICT_TO_TARGET   1
+#define VERDICT_TO_CLIENT   2
+#define VERDICT_IGNORE      0
+#define VERDICT_MISS        -1
+#define VERDICT_FULL        -2
+#define VERDICT_MALFORMED   -3
+
+// largest batch for recvmmsg and sendmmsg
+#define MAX_BATCH       1024
+
+// forwarding engines, rewriting packets or relaying connections
+#define MODE_NAT        0
+#define MODE_PROXY      1
+
+// packet I/O backends
+#define IO_RAW          0
+#define IO_PACKET_MMAP  1
+#define IO_URING        2
+
+// how workers wait for packets, asleep in the kernel or spinning on them,
+// and how long a busy poll may spin in the driver by default (us)
+#define LATENCY_BLOCKING      0
+#define LATENCY_BUSY_POLL     1
+#define LATENCY_BUSY_POLL_US  50
+
+// xdp fast path, off or attached in the generic or the driver's mode
+#define XDP_MODE_NONE     0
+#define XDP_MODE_GENERIC  1
+#define XDP_MODE_NATIVE   2
+
+// maglev tables hold at least this many slots, a prime so every backend's
+// permutation reaches all of them, and are grown to this many per unit of weight
+#define MAGLEV_MIN_SIZE   65537
+#define MAGLEV_SCALE      100
+#define MAGLEV_MAX_WEIGHT 100
+
+// how new connections pick among a port's targets, by the maglev table alone
+// or by the cost of their handshake round trip times the connections open
+#define BALANCE_MAGLEV          0
+#define BALANCE_LEAST_LATENCY   1
+#define BALANCE_POWER_OF_TWO    2
+
+// round trip samples are weighted 1/2^BALANCE_EWMA_SHIFT, halve for every
+// BALANCE_DECAY_US without a new one so idle targets get tried again, and a
+// failed handshake counts as BALANCE_FAILED_US
+#define BALANCE_EWMA_SHIFT  3
+#define BALANCE_DECAY_US    10000000UL
+#define BALANCE_FAILED_US   1000000UL
+
+// metrics of each target, the direction of a packet, and the handshake
+// round trip histogram: bucket i holds up to METRICS_RTT_FIRST_US << i,
+// the last one everything above
+#define METRICS_TO_TARGET     0
+#define METRICS_TO_CLIENT     1
+#define METRICS_RTT_BUCKETS   16
+#define METRICS_RTT_FIRST_US  16
+
+// the workers' metrics have room for twice the targets the forwarder
+// started with and this many more, for the targets reloads add
+#define METRICS_SPARE_TARGETS 64
+
+// how often the forwarder checks whether forwards a reload removed have
+// closed their last connections
+#define RELOAD_DRAIN_MS 1000
+
+// most forwarding threads, and how often idle ones check for shutdown
+#define MAX_WORKERS     256
+#define WORKER_POLL_MS  200
+
+// flow replication to a standby: a worker's events go out when a datagram
+// fills or once a tick, along with a heartbeat, and its whole table is sent
+// again every SYNC_REFRESH_S. A standby takes over after the active has
+// been quiet for the sync_timeout (ms)
+#define SYNC_REFRESH_S        30
+#define SYNC_DEFAULT_TIMEOUT  1000
+
+// tcp states of a forwarded connection
+#define CT_SYN_SENT     0
+#define CT_SYN_RECV     1
+#define CT_ESTABLISHED  2
+#define CT_FIN_WAIT     3
+#define CT_TIME_WAIT    4
+#define CT_CLOSE        5
+#define CT_STATES       6
+
+// which sides of a connection have sent a FIN
+#define CT_FIN_CLIENT   1
+#define CT_FIN_TARGET   2
+
+// idle timer wheel, 4 levels of 64 slots of 100ms ticks cover about 19 days
+#define CT_TICK_MS        100
+#define CT_WHEEL_BITS     6
+#define CT_WHEEL_SLOTS    (1 << CT_WHEEL_BITS)
+#define CT_WHEEL_LEVELS   4
+
+// most flows looked at per call to conntrack_expire
+#define CT_EXPIRE_BUDGET  256
+
+// connection table memory, flows held when max_flows isn't set
+#define CT_DEFAULT_FLOWS  65536
+#define CT_HUGEPAGES      1
+#define CT_MLOCK          2
+#define CT_HUGEPAGE_SIZE  (2 * 1024 * 1024)
+
+// source addresses connections to targets are translated to, and the ports
+// of each that are handed out, shared out between the workers
+#define NAT_MAX_ADDRS     1024
+#define NAT_FIRST_PORT    1024
+
 #include <arpa/inet.h>
 #include <confread.h>
+#include <errno.h>
+#include <linux/filter.h>
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
 #include <netinet/udp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
 
 // for TCP checksumming
 struct pseudoTcpHeader {
@@ -49,28 +181,409 @@ struct pf_port{
   unsigned short int b_port;
 };
 
+// measured as connections open, shared by the workers and by the copies of a
+// target a reload makes: the EWMA of the handshake round trip and when it was
+// last sampled (microseconds), and the connections open to it
+struct pf_load{
+  unsigned long rtt;
+  unsigned long rtt_at;
+  long flows;
+};
+
 struct pf_target{
   unsigned int host;
   struct pf_port port;
+
+  // share of new connections among the targets of the same port, 0 counts as 1
+  unsigned short int weight;
+
+  // index in the array of targets, for the workers' metrics
+  unsigned int id;
+
+  // its load, kept by id so that it carries over a reload
+  struct pf_load* load;
+
+  // entries in the connection tables pointing at it, closed ones included.
+  // One a reload removed is only on the new table's draining list, it takes
+  // no new connections and is kept until refs reaches 0
+  long refs;
 };
 
 struct pf_host{
   unsigned int host;
   unsigned short int port;
+
+  // the port the target sees the connection come from, on the snat address
+  // at index nat_addr of the connection table's pool
+  unsigned short int nat_port;
   struct pf_target* target;
+
+  // tcp state, which sides have sent a FIN, when the SYN was forwarded
+  // (microseconds, wraps) and when it idles out (ticks)
+  unsigned char state;
+  unsigned char fins;
+  unsigned short int nat_addr;
+  unsigned int syn_at;
+  unsigned long expires;
+
+  // hash chains in the connection table
+  struct pf_host* client_next;
+  struct pf_host* target_next;
+
+  // timer wheel slot
+  struct pf_host* timer_next;
+  struct pf_host** timer_pprev;
+};
+
+// xdp fast path, shared by every worker
+struct pf_xdp;
+
+// flow events of one worker on their way to the standby
+struct pf_sync;
+
+// one snat address of a connection table, and a ring of its free ports
+struct pf_nat{
+  unsigned int addr;
+  unsigned short int* ports;
+  size_t head;
+  size_t free;
+};
+
+// connection table, indexed both by client and by target
+struct pf_conntrack{
+  struct pf_host** client_buckets;
+  struct pf_host** target_buckets;
+  size_t mask;
+  size_t count;
+  unsigned int seed;
+
+  // fixed pool of entries, and the one mapping everything lives in
+  struct pf_host* pool;
+  struct pf_host* free_list;
+  size_t capacity;
+  size_t bytes;
+  int hugepages;
+  int locked;
+
+  // idle expiry, times in ticks
+  struct pf_host* wheel[CT_WHEEL_LEVELS][CT_WHEEL_SLOTS];
+  struct pf_host* due;
+  int cascade;
+  unsigned long now;
+  unsigned long tick;
+  unsigned long timeouts[CT_STATES];
+
+  // established connections are handed to the fast path, if there is one
+  struct pf_xdp* xdp;
+
+  // and every change is sent to the standby, if there is one
+  struct pf_sync* sync;
+
+  // the snat addresses, each with the same ports, and the next one to use
+  struct pf_nat* nat;
+  int natCount;
+  int natNext;
+  size_t natPorts;
+};
+
+// the lookup table spreading the connections of a port over its targets,
+// ports whose targets have the same addresses and weights share one table
+struct pf_maglev{
+  struct pf_target** backends;
+  size_t count;
+  size_t size;
+  unsigned short int* table;
+  int shared;
+};
+
+// the forwards compiled for lookup, indexed by ports in network order
+struct pf_dispatch{
+  struct pf_target* ports[65536];
+  struct pf_maglev* maglev[65536];
+  unsigned char backend_ports[65536];
+  struct pf_target** backends;
+  size_t mask;
+};
+
+// what the workers forward by, built whole and swapped in by a reload,
+// never changed once published: the targets of the config as last read,
+// and the ones it no longer has that still have connections open
+struct pf_table{
+  struct pf_dispatch dispatch;
+  struct pf_target* targets;
+  size_t targetCount;
+  struct pf_target** draining;
+  size_t drainingCount;
+};
+
+// one connection as a snapshot or a standby keeps it, apart from the table
+// and the forwards, addresses and ports in network order
+struct pf_snapshot_flow{
+  unsigned int host;
+  unsigned int target;
+  unsigned int nat_addr;
+  unsigned short int port;
+  unsigned short int a_port;
+  unsigned short int b_port;
+  unsigned short int nat_port;
+  unsigned char state;
+  unsigned char fins;
+  unsigned short int reserved;
+
+  // milliseconds it had left to idle
+  unsigned int idle_ms;
+};
+
+// global settings from the root section of the config
+struct pf_config{
+  // the config file, read again on a reload
+  char* file;
+
+  unsigned int ip;
+
+  // addresses connections are translated to on the target side, addr
+  // unless set
+  unsigned int* snat;
+  int snatCount;
+
+  int mode;
+  int checksum;
+  int batch;
+  int batch_timeout;
+
+  // packet I/O backend, and the packet_mmap interfaces and ring geometry
+  int io;
+  char* interfaces;
+  int ring_blocks;
+  int ring_block_size;
+  int ring_frame_size;
+
+  // io_uring receive buffers per worker, and its kernel submission thread
+  int uring_buffers;
+  int sqpoll;
+  int sqpoll_cpu;
+
+  // xdp fast path on the interfaces
+  int xdp;
+
+  // how new connections pick among the targets of a port
+  int balance;
+
+  // forwarding threads, and the cpus they are pinned to
+  int workers;
+  int* cpus;
+  int cpuCount;
+
+  // whether workers spin instead of sleeping, the busy poll time of their
+  // sockets (us), and their SCHED_FIFO priority, 0 to leave them to the
+  // normal scheduler
+  int latency_mode;
+  int busy_poll;
+  int sched_fifo;
+
+  // seconds an established connection may sit idle
+  int idle_timeout;
+
+  // connection table size over all workers, and CT_HUGEPAGES / CT_MLOCK
+  int max_flows;
+  int flow_flags;
+
+  // unix socket the metrics are served on, if any
+  char* metrics;
+
+  // file the connections are saved to on exit and restored from at
+  // startup, if any, and when the forwarder started (microseconds)
+  char* snapshot;
+  unsigned long started;
+
+  // connections are streamed to the peer's address, unless it is 0, and
+  // taken from it at the listen address while this one is a standby, which
+  // takes over once the peer has been quiet for sync_timeout (ms)
+  unsigned int sync_peer;
+  unsigned short int sync_peer_port;
+  unsigned int sync_listen;
+  unsigned short int sync_listen_port;
+  int standby;
+  int sync_timeout;
+};
+
+// forwarding counters
+struct pf_stats{
+  unsigned long received;
+  unsigned long forwarded;
+  unsigned long recv_calls;
+  unsigned long send_calls;
+  unsigned long send_errors;
+  unsigned long expired;
+  unsigned long syn_dropped;
+  unsigned long misses;
+
+  // connection events sent to the standby, the datagrams they took, and
+  // the datagrams that failed to send
+  unsigned long sync_events;
+  unsigned long sync_batches;
+  unsigned long sync_errors;
+};
+
+// counters of one target kept by one worker, only ever written by it and
+// on cache lines of their own so the workers never share one
+struct pf_metrics{
+  unsigned long packets[2];
+  unsigned long bytes[2];
+  unsigned long syns[2];
+  unsigned long fins[2];
+  unsigned long rsts[2];
+  unsigned long rtt[METRICS_RTT_BUCKETS];
+  unsigned long rtt_sum;
+} __attribute__((aligned(64)));
+
+// the metrics socket and the thread serving it
+struct pf_metrics_server;
+
+// packet_mmap rings of one worker
+struct pf_rings;
+
+// io_uring of one worker
+struct pf_uring;
+
+// one forwarding thread and everything it owns
+struct pf_worker{
+  int id;
+  pthread_t thread;
+  int cpu;
+
+  // its sockets
+  int socket_descriptor;
+  struct pf_rings* rings;
+  struct pf_uring* uring;
+
+  // its share of the connections
+  struct pf_conntrack conntrack;
+  struct pf_stats stats;
+
+  // counters for each target, by its id, or null without metrics
+  struct pf_metrics* metrics;
+
+  // the last reload this worker has seen, it holds no older table
+  unsigned long epoch;
+
+  // set once its thread has returned, it sees no more reloads
+  int stopped;
+
+  // when it first forwarded a packet (microseconds), 0 until then
+  unsigned long first_forward;
 };
 
 //function prototypes
-void forward(struct pf_target* m_targets, size_t m_targetCount, unsigned int ip);
+void forward(struct pf_target* m_targets, size_t m_targetCount, struct pf_config* m_config);
+int forward_init(struct pf_target* m_targets, size_t m_targetCount, struct pf_config* m_config);
+int forward_packet(struct pf_worker* worker, char* buffer, int datagram_length,
+  struct sockaddr_in* dst_addr);
+void rewrite_packet(struct iphdr* ip_header, struct tcphdr* tcp_header,
+  unsigned int saddr, unsigned int daddr, unsigned short sport,
+  unsigned short dport);
 struct pf_target *find_source_target(unsigned int host, unsigned int port);
 struct pf_target *find_dest_target(unsigned int host, unsigned int port);
-struct pf_host *find_host_by_target(unsigned int target_host, unsigned int port);
-struct pf_host *find_host(unsigned int host, unsigned int port);
+void worker_pin(int id, int cpu);
+void worker_busy_poll(int id, int socket_descriptor);
+void worker_tick(struct pf_worker* worker);
+
+int config_forwards(struct confread_file* confFile, struct pf_target** targets,
+  size_t* targetCount, struct pf_target** offloads, size_t* offloadCount);
+
+void proxy(struct pf_target* m_targets, size_t m_targetCount, struct pf_config* m_config);
 
+int dispatch_build(struct pf_dispatch* dispatch, struct pf_target* targets,
+  size_t targetCount, struct pf_target** draining, size_t drainingCount);
+void dispatch_free(struct pf_dispatch* dispatch);
+struct pf_target *dispatch_backend(struct pf_dispatch* dispatch, unsigned int host,
+  unsigned int port);
+struct pf_target *dispatch_find(struct pf_dispatch* dispatch, unsigned int port,
+  unsigned int host, unsigned int to_port);
+struct pf_target *dispatch_pick(struct pf_dispatch* dispatch, struct pf_target* target,
+  unsigned int host, unsigned int port);
+struct pf_target *dispatch_balance(struct pf_dispatch* dispatch, struct pf_target* target,
+  unsigned int host, unsigned int port, int policy);
+unsigned long dispatch_clock(void);
+void dispatch_measure(struct pf_target* target, unsigned long rtt);
+void dispatch_report(struct pf_dispatch* dispatch);
+
+int conntrack_init(struct pf_conntrack* ct, size_t max_flows, int flags);
+void conntrack_free(struct pf_conntrack* ct);
+int conntrack_nat(struct pf_conntrack* ct, unsigned int* addrs, int addrCount, int workers,
+  int worker);
+struct pf_host *add_host(struct pf_conntrack* ct, unsigned int host, unsigned int port,
+  struct pf_target* target);
+void remove_host(struct pf_conntrack* ct, struct pf_host* host);
+struct pf_host *find_host(struct pf_conntrack* ct, unsigned int host, unsigned int port,
+  unsigned int to_port);
+struct pf_host *find_host_by_target(struct pf_conntrack* ct, unsigned int target_host,
+  unsigned int target_port, unsigned int addr, unsigned int port);
+unsigned long conntrack_update(struct pf_conntrack* ct, struct pf_host* host,
+  struct tcphdr* tcp_header, int from_client);
+size_t conntrack_expire(struct pf_conntrack* ct);
+size_t conntrack_advance(struct pf_conntrack* ct, unsigned long now, size_t budget);
+size_t conntrack_restore(struct pf_conntrack* ct, struct pf_host* hosts, size_t count);
+
+void csum_init(void);
+int csum_select(const char* name);
+const char *csum_kernel(void);
+unsigned int csum_partial(const void *buf, int len, unsigned int sum);
+unsigned short csum_fold(unsigned int sum);
 unsigned short csum(unsigned short *buf, int nwords);
 unsigned short tcp_csum(struct iphdr *ip_header, struct tcphdr *tcp_header);
+unsigned short csum_replace4(unsigned short check, unsigned int from, unsigned int to);
+unsigned short csum_replace2(unsigned short check, unsigned short from, unsigned short to);
+
+struct pf_rings *packet_mmap_open(struct pf_config* config, struct sock_fprog* fanout,
+  struct sock_fprog* filter);
+void packet_mmap_forward(struct pf_worker* worker, volatile sig_atomic_t* running);
+void packet_mmap_close(struct pf_rings* rings);
+int packet_mmap_steer(struct pf_rings* rings, struct sock_fprog* fanout,
+  struct sock_fprog* filter);
+unsigned long packet_mmap_drops(struct pf_rings* rings);
+
+struct pf_uring *uring_open(struct pf_config* config, int socket_descriptor);
+void uring_forward(struct pf_worker* worker, volatile sig_atomic_t* running);
+void uring_close(struct pf_uring* uring);
+
+struct pf_xdp *xdp_open(struct pf_config* config);
+void xdp_close(struct pf_xdp* xdp);
+void xdp_flow_add(struct pf_xdp* xdp, struct pf_host* host, unsigned int nat);
+void xdp_flow_remove(struct pf_xdp* xdp, struct pf_host* host, unsigned int nat);
+unsigned long xdp_flow_seen(struct pf_xdp* xdp, struct pf_host* host, unsigned int nat);
+unsigned long xdp_packets(struct pf_xdp* xdp);
+
+struct pf_metrics_server *metrics_open(struct pf_config* config, struct pf_worker* workers,
+  size_t slots, struct pf_table* table, struct pf_xdp* xdp);
+void metrics_update(struct pf_metrics_server* server, struct pf_table* table);
+void metrics_close(struct pf_metrics_server* server);
+void metrics_handshake(struct pf_metrics* metrics, unsigned long rtt);
+
+int filter_steer(struct sock_fprog* prog, struct pf_target* targets, size_t targetCount,
+  int workers, int worker);
+int filter_worker(unsigned short int port, int workers);
+unsigned long filter_segments(void);
+unsigned long filter_drops(int descriptor);
+
+int snapshot_save(struct pf_config* config, struct pf_worker* workers, int workerCount);
+int snapshot_restore(struct pf_config* config, struct pf_dispatch* dispatch,
+  struct pf_worker* workers);
+size_t snapshot_load(struct pf_config* config, struct pf_dispatch* dispatch,
+  struct pf_worker* workers, struct pf_snapshot_flow* flows, size_t count,
+  unsigned long long waited);
+
+struct pf_sync *sync_open(struct pf_config* config, struct pf_stats* stats, int id);
+void sync_close(struct pf_sync* sync);
+void sync_flow(struct pf_sync* sync, struct pf_conntrack* ct, struct pf_host* host, int gone);
+void sync_tick(struct pf_sync* sync, struct pf_conntrack* ct);
+int sync_standby(struct pf_config* config, struct pf_dispatch* dispatch,
+  struct pf_worker* workers, sigset_t* stop);
 
-void firewall_invoke_srcport(int port);
-void firewall_invoke_dstport(int port);
+int firewall_install(struct pf_config* config, struct pf_target* targets, size_t targetCount,
+  struct pf_target* offloads, size_t offloadCount);
+int firewall_update(struct pf_config* config, struct pf_target* targets, size_t targetCount);
+int firewall_offload(struct pf_config* config, struct pf_target* offloads, size_t offloadCount);
+void firewall_remove(void);
 
 #endif
@@ -0,0 +1,915 @@
+/* ----------------------------------------------------------------------------
+SOURCE FILE
+
+Name:		proxy.c
+
+Program:	Port Forwarder
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Functions:
+  void proxy(struct pf_target* targets, size_t targetCount, struct pf_config* config)
+
+Description:
+  The proxy engine, run with "mode = proxy". Instead of rewriting packets on a
+  raw socket, every forward port gets an ordinary listening socket, and each
+  accepted connection gets its own connection to the target. Payload is
+  moved between the two with splice() through a pair of pipes, so it stays in
+  kernel buffers and never gets copied into this process.
+
+  Needs no raw sockets or firewall rules, and the kernel's tcp stack (with
+  its offloads) handles both connections. The cost is two sockets and two
+  pipes per forwarded connection, and the target sees connections coming
+  from the forwarder's own ports.
+
+  Each worker thread has its own listeners on the same ports (SO_REUSEPORT),
+  so the kernel spreads new connections over the workers, and its own
+  edge-triggered epoll loop. Workers share nothing.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Ports with several targets are balanced over them
+
+---------------------------------------------------------------------------- */
+
+#include "portforward.h"
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+// events taken per epoll_wait
+#define PROXY_EVENTS 256
+
+// bytes in flight per direction of a connection, the size of its pipe
+#define PROXY_PIPE_SIZE (1 << 16)
+
+// pending connections per listener
+#define PROXY_BACKLOG 1024
+
+// what an epoll event points at, the kind is always the first field
+#define PROXY_LISTENER  0
+#define PROXY_END       1
+
+// directions, and the ends of a connection they read from
+#define PROXY_TO_TARGET 0
+#define PROXY_TO_CLIENT 1
+
+struct pf_proxy_conn;
+
+// a listening socket for one forward
+struct pf_proxy_listener{
+  int kind;
+  int fd;
+  struct pf_target* target;
+};
+
+// one of the two sockets of a connection, 0 the client and 1 the target
+struct pf_proxy_end{
+  int kind;
+  int fd;
+  struct pf_proxy_conn* conn;
+};
+
+// a relayed connection, direction 0 reads end 0 and writes end 1
+struct pf_proxy_conn{
+  struct pf_proxy_end ends[2];
+  int pipes[2][2];
+  size_t pending[2];
+  int eof[2];
+  int shut[2];
+  int connected;
+  int closed;
+
+  // the target, and when its connect was started (microseconds)
+  struct pf_target* target;
+  unsigned long started;
+
+  // the worker's list of open connections, or of ones closed this pass
+  struct pf_proxy_conn* next;
+  struct pf_proxy_conn* prev;
+};
+
+// proxy counters
+struct pf_proxy_stats{
+  unsigned long accepted;
+  unsigned long refused;
+  unsigned long failed;
+  unsigned long long bytes;
+};
+
+// one proxy thread
+struct pf_proxy_worker{
+  int id;
+  pthread_t thread;
+  int cpu;
+
+  int epoll_fd;
+  struct pf_proxy_listener* listeners;
+  size_t listenerCount;
+
+  struct pf_proxy_conn* conns;
+  struct pf_proxy_conn* closing;
+  size_t connCount;
+  size_t maxConns;
+
+  struct pf_proxy_stats stats;
+};
+
+// the array of targets
+static struct pf_target* targets = 0;
+static size_t targetCount = 0;
+
+// the targets compiled for lookup, to balance ports with several of them
+static struct pf_dispatch dispatch;
+
+// global settings
+static struct pf_config* config = 0;
+
+// listening loop
+static volatile sig_atomic_t running = 1;
+
+static int proxy_open(struct pf_proxy_worker* worker, int id);
+static void *proxy_run(void* arg);
+static void proxy_close(struct pf_proxy_worker* worker);
+static void proxy_accept(struct pf_proxy_worker* worker, struct pf_proxy_listener* listener);
+static void conn_open(struct pf_proxy_worker* worker, int client_fd, struct pf_target* target);
+static void conn_event(struct pf_proxy_worker* worker, struct pf_proxy_end* end, unsigned int events);
+static int conn_pump(struct pf_proxy_worker* worker, struct pf_proxy_conn* conn, int dir);
+static void conn_close(struct pf_proxy_worker* worker, struct pf_proxy_conn* conn);
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Proxy
+
+Prototype:  void proxy(struct pf_target* m_targets, size_t m_targetCount,
+              struct pf_config* m_config)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_target* m_targets
+    the array of targets
+  size_t m_targetCount
+    the number of targets in the array
+  struct pf_config* m_config
+    the global settings
+
+Return Values:
+  void
+
+Description:
+  Runs the configured number of proxy workers until SIGINT or SIGTERM, then
+  reports what they relayed.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Builds the dispatch tables to balance ports with several targets
+
+  Andrew Burian
+  2026-10-18
+  SIGUSR1 prints the targets' measured handshakes, as does the report
+
+  Andrew Burian
+  2026-10-18
+  SIGHUP is caught and ignored, only the packet engine reloads
+
+  Andrew Burian
+  2026-10-18
+  Gives each target a load of its own
+
+---------------------------------------------------------------------------- */
+void proxy(struct pf_target* m_targets, size_t m_targetCount, struct pf_config* m_config) {
+
+  struct pf_proxy_worker* workers;
+  struct pf_load* loads;
+  struct pf_proxy_stats total = {0};
+  int opened = 0;
+  int started = 0;
+
+  // shutdown signals
+  sigset_t stop;
+  int sig;
+
+  // timing
+  struct timespec start, end;
+  double seconds;
+
+  // counter
+  int i;
+  size_t t;
+
+  targets = m_targets;
+  targetCount = m_targetCount;
+  config = m_config;
+  running = 1;
+
+  // ctrl-c and kill are only taken by this thread, the workers inherit the mask,
+  // SIGUSR1 asks for the targets' measurements, and SIGHUP, which reloads the
+  // packet engine, mustn't kill the proxy
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGINT);
+  sigaddset(&stop, SIGTERM);
+  sigaddset(&stop, SIGUSR1);
+  sigaddset(&stop, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &stop, 0);
+
+  // the proxy never reloads, each target counts against a load of its own
+  if (!(loads = (struct pf_load*)calloc(targetCount + 1, sizeof(struct pf_load)))) {
+    perror("Targets");
+    return;
+  }
+  for (t = 0; t < targetCount; t++) {
+    targets[t].load = &loads[t];
+  }
+
+  if (dispatch_build(&dispatch, targets, targetCount, 0, 0) == -1) {
+    perror("Dispatch");
+    free(loads);
+    return;
+  }
+
+  if (!(workers = (struct pf_proxy_worker*)calloc(config->workers, sizeof(struct pf_proxy_worker)))) {
+    perror("Workers");
+    dispatch_free(&dispatch);
+    free(loads);
+    return;
+  }
+
+  for (i = 0; i < config->workers; i++) {
+    opened++;
+    if (proxy_open(&workers[i], i) == -1) {
+      running = 0;
+      break;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (i = 0; running && i < config->workers; i++) {
+    if (pthread_create(&workers[i].thread, 0, proxy_run, &workers[i]) != 0) {
+      perror("Worker Thread");
+      running = 0;
+      break;
+    }
+    started++;
+  }
+
+  if (running) {
+    printf("Proxying with %d workers\n", config->workers);
+    while (sigwait(&stop, &sig) == 0 && (sig == SIGUSR1 || sig == SIGHUP)) {
+      if (sig == SIGHUP) {
+        fprintf(stderr, "The proxy can't reload its forwards, restart it instead\n");
+        continue;
+      }
+      dispatch_report(&dispatch);
+      fflush(stdout);
+    }
+  }
+
+  // workers notice within their epoll timeout
+  running = 0;
+  for (i = 0; i < started; i++) {
+    pthread_join(workers[i].thread, 0);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  // report
+  for (i = 0; i < opened; i++) {
+    if (config->workers > 1) {
+      printf("Worker %d: %lu connections, %.1fMB relayed\n", i,
+        workers[i].stats.accepted, workers[i].stats.bytes / 1048576.0);
+    }
+    total.accepted += workers[i].stats.accepted;
+    total.refused += workers[i].stats.refused;
+    total.failed += workers[i].stats.failed;
+    total.bytes += workers[i].stats.bytes;
+    proxy_close(&workers[i]);
+  }
+
+  printf("Proxied %lu connections in %.1fs, %lu refused with the table full, %lu targets unreachable\n",
+    total.accepted, seconds, total.refused, total.failed);
+  printf("%.1fMB relayed (%.1fMB/sec)\n", total.bytes / 1048576.0, total.bytes / 1048576.0 / seconds);
+
+  dispatch_report(&dispatch);
+
+  free(workers);
+  dispatch_free(&dispatch);
+  free(loads);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Proxy Open
+
+Prototype:  static int proxy_open(struct pf_proxy_worker* worker, int id)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_proxy_worker* worker
+    the worker to set up
+  int id
+    its index
+
+Return Values:
+  0  success
+  -1 error, with the reason printed
+
+Description:
+  Gives a worker its epoll instance and a listener on every forward port.
+  Forwards sharing a port are listened for once, and the first one is used,
+  as the packet engine does.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int proxy_open(struct pf_proxy_worker* worker, int id) {
+
+  struct pf_proxy_listener* listener;
+  struct sockaddr_in addr = {0};
+  struct epoll_event event = {0};
+  int on = 1;
+  size_t i, j;
+
+  worker->id = id;
+  worker->cpu = config->cpuCount ? config->cpus[id % config->cpuCount] : -1;
+  worker->maxConns = (config->max_flows + config->workers - 1) / config->workers;
+
+  if ((worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+    perror("Epoll");
+    return -1;
+  }
+
+  if (!(worker->listeners = (struct pf_proxy_listener*)calloc(targetCount,
+    sizeof(struct pf_proxy_listener)))) {
+    perror("Listeners");
+    return -1;
+  }
+
+  for (i = 0; i < targetCount; i++) {
+
+    // one listener per port
+    for (j = 0; j < i; j++) {
+      if (targets[j].port.a_port == targets[i].port.a_port) {
+        break;
+      }
+    }
+    if (j < i) {
+      continue;
+    }
+
+    listener = &worker->listeners[worker->listenerCount];
+    listener->kind = PROXY_LISTENER;
+    listener->target = &targets[i];
+
+    if ((listener->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+      perror("Listen Socket");
+      return -1;
+    }
+    worker->listenerCount++;
+
+    // every worker listens on the same ports
+    setsockopt(listener->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (setsockopt(listener->fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == -1) {
+      perror("SetSockOpt SO_REUSEPORT");
+      return -1;
+    }
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = config->ip;
+    addr.sin_port = targets[i].port.a_port;
+    if (bind(listener->fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+      fprintf(stderr, "Bind port %d: %s\n", ntohs(addr.sin_port), strerror(errno));
+      return -1;
+    }
+
+    if (listen(listener->fd, PROXY_BACKLOG) == -1) {
+      perror("Listen");
+      return -1;
+    }
+
+    event.events = EPOLLIN | EPOLLET;
+    event.data.ptr = listener;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, listener->fd, &event) == -1) {
+      perror("Epoll Add Listener");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Proxy Run
+
+Prototype:  static void *proxy_run(void* arg)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  void* arg
+    the worker
+
+Return Values:
+  0
+
+Description:
+  Thread body of a proxy worker. Every event on a connection pumps both of
+  its directions, which is all edge-triggered readiness needs: whatever
+  changed, both directions run until they would block again. Connections
+  closed while handling a batch of events are only freed after it, since a
+  later event in the same batch may still point at them.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void *proxy_run(void* arg) {
+
+  struct pf_proxy_worker* worker = (struct pf_proxy_worker*)arg;
+  struct epoll_event events[PROXY_EVENTS];
+  struct pf_proxy_conn* conn;
+  int ready;
+  int i;
+
+  worker_pin(worker->id, worker->cpu);
+
+  while (running) {
+
+    if ((ready = epoll_wait(worker->epoll_fd, events, PROXY_EVENTS, WORKER_POLL_MS)) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Epoll Wait");
+      break;
+    }
+
+    for (i = 0; i < ready; i++) {
+      if (*(int*)events[i].data.ptr == PROXY_LISTENER) {
+        proxy_accept(worker, (struct pf_proxy_listener*)events[i].data.ptr);
+      }
+      else {
+        conn_event(worker, (struct pf_proxy_end*)events[i].data.ptr, events[i].events);
+      }
+    }
+
+    // nothing points at these any more
+    while ((conn = worker->closing) != 0) {
+      worker->closing = conn->next;
+      free(conn);
+    }
+  }
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Proxy Close
+
+Prototype:  static void proxy_close(struct pf_proxy_worker* worker)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_proxy_worker* worker
+    the worker to release
+
+Return Values:
+  void
+
+Description:
+  Closes every connection and listener of a worker.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void proxy_close(struct pf_proxy_worker* worker) {
+
+  struct pf_proxy_conn* conn;
+  size_t i;
+
+  while (worker->conns) {
+    conn_close(worker, worker->conns);
+  }
+  while ((conn = worker->closing) != 0) {
+    worker->closing = conn->next;
+    free(conn);
+  }
+
+  for (i = 0; i < worker->listenerCount; i++) {
+    close(worker->listeners[i].fd);
+  }
+  free(worker->listeners);
+
+  if (worker->epoll_fd > 0) {
+    close(worker->epoll_fd);
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Proxy Accept
+
+Prototype:  static void proxy_accept(struct pf_proxy_worker* worker,
+              struct pf_proxy_listener* listener)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_proxy_worker* worker
+    the worker
+  struct pf_proxy_listener* listener
+    the listener that is readable
+
+Return Values:
+  void
+
+Description:
+  Accepts every pending connection. Past the worker's share of max_flows new
+  connections are closed straight away. Each connection is given one of the
+  targets of the listener's port by its client address, as the packet engine
+  does.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Ports with several targets are balanced over them
+
+  Andrew Burian
+  2026-10-18
+  Picks the target by the balance policy
+
+---------------------------------------------------------------------------- */
+static void proxy_accept(struct pf_proxy_worker* worker, struct pf_proxy_listener* listener) {
+
+  struct sockaddr_in addr;
+  socklen_t len;
+  int fd;
+
+  for (;;) {
+    len = sizeof(addr);
+    if ((fd = accept4(listener->fd, (struct sockaddr*)&addr, &len,
+      SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno != EAGAIN) {
+        perror("Accept");
+      }
+      return;
+    }
+
+    if (worker->connCount >= worker->maxConns) {
+      worker->stats.refused++;
+      close(fd);
+      continue;
+    }
+
+    worker->stats.accepted++;
+    conn_open(worker, fd, dispatch_balance(&dispatch, listener->target, addr.sin_addr.s_addr,
+      addr.sin_port, config->balance));
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Conn Open
+
+Prototype:  static void conn_open(struct pf_proxy_worker* worker, int client_fd,
+              struct pf_target* target)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_proxy_worker* worker
+    the worker
+  int client_fd
+    the accepted client socket
+  struct pf_target* target
+    the forward it arrived on
+
+Return Values:
+  void
+
+Description:
+  Starts a non-blocking connect to the target and sets up the pipes. Data
+  from the client is held in its pipe until the connect completes.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Times the connect and counts the connection against its target
+
+---------------------------------------------------------------------------- */
+static void conn_open(struct pf_proxy_worker* worker, int client_fd, struct pf_target* target) {
+
+  struct pf_proxy_conn* conn;
+  struct sockaddr_in addr = {0};
+  struct epoll_event event = {0};
+  int on = 1;
+  int i;
+
+  if (!(conn = (struct pf_proxy_conn*)calloc(1, sizeof(struct pf_proxy_conn)))) {
+    close(client_fd);
+    return;
+  }
+
+  conn->ends[0].fd = client_fd;
+  conn->ends[1].fd = -1;
+  conn->target = target;
+  conn->started = dispatch_clock();
+  __atomic_fetch_add(&target->load->flows, 1, __ATOMIC_RELAXED);
+  conn->pipes[0][0] = conn->pipes[0][1] = conn->pipes[1][0] = conn->pipes[1][1] = -1;
+
+  // listed first, so conn_close can undo whatever got set up
+  conn->next = worker->conns;
+  if (worker->conns) {
+    worker->conns->prev = conn;
+  }
+  worker->conns = conn;
+  worker->connCount++;
+
+  for (i = 0; i < 2; i++) {
+    conn->ends[i].kind = PROXY_END;
+    conn->ends[i].conn = conn;
+
+    if (pipe2(conn->pipes[i], O_NONBLOCK | O_CLOEXEC) == -1) {
+      perror("Pipe");
+      conn_close(worker, conn);
+      return;
+    }
+    fcntl(conn->pipes[i][1], F_SETPIPE_SZ, PROXY_PIPE_SIZE);
+  }
+
+  if ((conn->ends[1].fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+    perror("Target Socket");
+    conn_close(worker, conn);
+    return;
+  }
+
+  // small writes are relayed as they come
+  setsockopt(conn->ends[0].fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  setsockopt(conn->ends[1].fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = target->host;
+  addr.sin_port = target->port.b_port;
+  if (connect(conn->ends[1].fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+    conn->connected = 1;
+  }
+  else if (errno != EINPROGRESS) {
+    worker->stats.failed++;
+    dispatch_measure(target, BALANCE_FAILED_US);
+    conn_close(worker, conn);
+    return;
+  }
+
+  for (i = 0; i < 2; i++) {
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = &conn->ends[i];
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, conn->ends[i].fd, &event) == -1) {
+      perror("Epoll Add Connection");
+      conn_close(worker, conn);
+      return;
+    }
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Conn Event
+
+Prototype:  static void conn_event(struct pf_proxy_worker* worker,
+              struct pf_proxy_end* end, unsigned int events)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_proxy_worker* worker
+    the worker
+  struct pf_proxy_end* end
+    the socket the event is for
+  unsigned int events
+    the epoll events
+
+Return Values:
+  void
+
+Description:
+  Completes the connect to the target when it becomes writable, then pumps
+  both directions. The connection is closed on an error, or once both
+  directions have been shut down.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Samples the target's connect time
+
+---------------------------------------------------------------------------- */
+static void conn_event(struct pf_proxy_worker* worker, struct pf_proxy_end* end, unsigned int events) {
+
+  struct pf_proxy_conn* conn = end->conn;
+  socklen_t len = sizeof(int);
+  int error = 0;
+
+  if (conn->closed) {
+    return;
+  }
+
+  // the connect finished, one way or the other
+  if (!conn->connected && end == &conn->ends[1]) {
+    if (getsockopt(end->fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error != 0) {
+      worker->stats.failed++;
+      dispatch_measure(conn->target, BALANCE_FAILED_US);
+      conn_close(worker, conn);
+      return;
+    }
+    if (!(events & EPOLLOUT)) {
+      return;
+    }
+    conn->connected = 1;
+    dispatch_measure(conn->target, dispatch_clock() - conn->started);
+  }
+
+  if (conn_pump(worker, conn, PROXY_TO_TARGET) == -1 || conn_pump(worker, conn, PROXY_TO_CLIENT) == -1
+    || (conn->shut[0] && conn->shut[1])) {
+    conn_close(worker, conn);
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Conn Pump
+
+Prototype:  static int conn_pump(struct pf_proxy_worker* worker,
+              struct pf_proxy_conn* conn, int dir)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_proxy_worker* worker
+    the worker
+  struct pf_proxy_conn* conn
+    the connection
+  int dir
+    PROXY_TO_TARGET or PROXY_TO_CLIENT
+
+Return Values:
+  0  nothing more can move until the next event
+  -1 the connection failed
+
+Description:
+  Splices from the source socket into the direction's pipe and from the pipe
+  into the destination socket until neither moves. Once the source has hit
+  end of file and the pipe is empty, the destination's write side is shut
+  down so the close is passed on.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int conn_pump(struct pf_proxy_worker* worker, struct pf_proxy_conn* conn, int dir) {
+
+  int src = conn->ends[dir].fd;
+  int dst = conn->ends[!dir].fd;
+  ssize_t moved;
+  int progress = 1;
+
+  while (progress) {
+    progress = 0;
+
+    // socket to pipe
+    if (!conn->eof[dir] && conn->pending[dir] < PROXY_PIPE_SIZE) {
+      moved = splice(src, 0, conn->pipes[dir][1], 0, PROXY_PIPE_SIZE - conn->pending[dir],
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (moved > 0) {
+        conn->pending[dir] += moved;
+        progress = 1;
+      }
+      else if (moved == 0) {
+        conn->eof[dir] = 1;
+      }
+      else if (errno != EAGAIN && errno != EINTR) {
+        return -1;
+      }
+    }
+
+    // pipe to socket, once the target is connected
+    if (conn->pending[dir] && conn->connected) {
+      moved = splice(conn->pipes[dir][0], 0, dst, 0, conn->pending[dir],
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (moved > 0) {
+        conn->pending[dir] -= moved;
+        worker->stats.bytes += moved;
+        progress = 1;
+      }
+      else if (moved == -1 && errno != EAGAIN && errno != EINTR) {
+        return -1;
+      }
+    }
+  }
+
+  // pass the close on
+  if (conn->eof[dir] && !conn->pending[dir] && !conn->shut[dir] && conn->connected) {
+    shutdown(dst, SHUT_WR);
+    conn->shut[dir] = 1;
+  }
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Conn Close
+
+Prototype:  static void conn_close(struct pf_proxy_worker* worker,
+              struct pf_proxy_conn* conn)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_proxy_worker* worker
+    the worker
+  struct pf_proxy_conn* conn
+    the connection
+
+Return Values:
+  void
+
+Description:
+  Closes both sockets and pipes and moves the connection to the list freed
+  at the end of the pass. Closing a socket takes it out of the epoll set.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Takes the connection off its target's count
+
+---------------------------------------------------------------------------- */
+static void conn_close(struct pf_proxy_worker* worker, struct pf_proxy_conn* conn) {
+
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    if (conn->ends[i].fd != -1) {
+      close(conn->ends[i].fd);
+    }
+    if (conn->pipes[i][0] != -1) {
+      close(conn->pipes[i][0]);
+      close(conn->pipes[i][1]);
+    }
+  }
+  conn->closed = 1;
+  __atomic_fetch_sub(&conn->target->load->flows, 1, __ATOMIC_RELAXED);
+
+  if (conn->prev) {
+    conn->prev->next = conn->next;
+  }
+  else {
+    worker->conns = conn->next;
+  }
+  if (conn->next) {
+    conn->next->prev = conn->prev;
+  }
+  worker->connCount--;
+
+  conn->next = worker->closing;
+  worker->closing = conn;
+}
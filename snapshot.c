@@ -0,0 +1,430 @@
+/* ----------------------------------------------------------------------------
+SOURCE FILE
+
+Name:		snapshot.c
+
+Program:	Port Forwarder
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Functions:
+  int snapshot_save(struct pf_config* config, struct pf_worker* workers,
+    int workerCount)
+  int snapshot_restore(struct pf_config* config, struct pf_dispatch* dispatch,
+    struct pf_worker* workers)
+  size_t snapshot_load(struct pf_config* config, struct pf_dispatch* dispatch,
+    struct pf_worker* workers, struct pf_snapshot_flow* flows, size_t count,
+    unsigned long long waited)
+
+Description:
+  Warm restarts. On the way out the forwarder writes every connection of
+  every worker to a file, and the next one to start maps that file and puts
+  the connections back in its tables before its workers take a packet, so
+  connections carry on through an upgrade or a restart with the snat
+  address and port they had.
+
+  The file is a header followed by a flat array of fixed size records, all
+  addresses and ports in network order, written through a shared mapping
+  to a temporary file that is then renamed over the old one, so a reader
+  never sees half of one. It is versioned, and the header carries the size
+  of a record and the forwarder's address, so a snapshot of another layout
+  or another forwarder is turned down whole.
+
+  Each connection is checked against the config being started with: its
+  forward must still go to the same host and port, its snat address must
+  still be in the pool, and it must still be steered to one worker from
+  both sides. The time the snapshot waited is taken off every connection's
+  idle time. Anything that fails is left out, and its client finds it gone
+  as if the forwarder had timed it out. A standby taking over puts its
+  replica back the same way.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Connections are put back by snapshot_load, shared with the standby
+
+---------------------------------------------------------------------------- */
+
+#include "portforward.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// what a snapshot starts with, and the layout of this one
+#define SNAPSHOT_MAGIC    "PFSNAP\0"
+#define SNAPSHOT_VERSION  1
+
+// the header of a snapshot
+struct pf_snapshot{
+  char magic[8];
+  unsigned int version;
+  unsigned int flow_size;
+  unsigned int ip;
+  unsigned int workers;
+  unsigned long long count;
+
+  // when it was written, wall clock milliseconds, the monotonic clock
+  // doesn't carry over a reboot
+  unsigned long long saved_ms;
+};
+
+static unsigned long long snapshot_clock(void);
+
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Snapshot Save
+
+Prototype:  int snapshot_save(struct pf_config* config,
+              struct pf_worker* workers, int workerCount)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_config* config
+    the global settings, with the path in snapshot
+  struct pf_worker* workers
+    the workers, stopped
+  int workerCount
+    the number of them with a connection table
+
+Return Values:
+  the number of connections saved
+  -1 error, with the reason printed
+
+Description:
+  Writes every connection of the workers to the snapshot. The workers must
+  have stopped, their tables are read without locks.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+int snapshot_save(struct pf_config* config, struct pf_worker* workers, int workerCount) {
+
+  struct pf_snapshot* header;
+  struct pf_snapshot_flow* flow;
+  struct pf_conntrack* ct;
+  struct pf_host* host;
+  char* temp;
+  size_t count = 0;
+  size_t size;
+  size_t b;
+  int fd, w;
+
+  for (w = 0; w < workerCount; w++) {
+    count += workers[w].conntrack.count;
+  }
+  size = sizeof(struct pf_snapshot) + count * sizeof(struct pf_snapshot_flow);
+
+  if (!(temp = (char*)malloc(strlen(config->snapshot) + 5))) {
+    perror("Snapshot");
+    return -1;
+  }
+  sprintf(temp, "%s.tmp", config->snapshot);
+
+  if ((fd = open(temp, O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1 || ftruncate(fd, size) == -1
+    || (header = (struct pf_snapshot*)mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0))
+    == MAP_FAILED) {
+    perror("Snapshot");
+    if (fd != -1) {
+      close(fd);
+      unlink(temp);
+    }
+    free(temp);
+    return -1;
+  }
+  close(fd);
+
+  memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+  header->version = SNAPSHOT_VERSION;
+  header->flow_size = sizeof(struct pf_snapshot_flow);
+  header->ip = config->ip;
+  header->workers = workerCount;
+  header->count = count;
+  header->saved_ms = snapshot_clock();
+
+  // every entry is on exactly one client chain
+  flow = (struct pf_snapshot_flow*)(header + 1);
+  for (w = 0; w < workerCount; w++) {
+    ct = &workers[w].conntrack;
+    for (b = 0; ct->client_buckets && b <= ct->mask; b++) {
+      for (host = ct->client_buckets[b]; host; host = host->client_next) {
+        flow->host = host->host;
+        flow->port = host->port;
+        flow->target = host->target->host;
+        flow->a_port = host->target->port.a_port;
+        flow->b_port = host->target->port.b_port;
+        flow->nat_addr = ct->nat[host->nat_addr].addr;
+        flow->nat_port = host->nat_port;
+        flow->state = host->state;
+        flow->fins = host->fins;
+        flow->reserved = 0;
+        flow->idle_ms = host->expires > ct->now ? (host->expires - ct->now) * CT_TICK_MS : 0;
+        flow++;
+      }
+    }
+  }
+
+  munmap(header, size);
+  if (rename(temp, config->snapshot) == -1) {
+    perror("Snapshot");
+    unlink(temp);
+    free(temp);
+    return -1;
+  }
+  free(temp);
+
+  return (int)count;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Snapshot Restore
+
+Prototype:  int snapshot_restore(struct pf_config* config,
+              struct pf_dispatch* dispatch, struct pf_worker* workers)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_config* config
+    the global settings, with the path in snapshot
+  struct pf_dispatch* dispatch
+    the forwards being started with
+  struct pf_worker* workers
+    the workers, config->workers of them, opened but not started
+
+Return Values:
+  the number of connections restored, 0 if there is no snapshot
+  -1 error, with the reason printed, nothing is restored
+
+Description:
+  Maps the snapshot and puts back every connection that still fits the
+  config with snapshot_load. The
+  snapshot is removed afterwards, its snat ports are ours again now, and
+  a snapshot restored twice could hand them out twice. Prints how many
+  connections came back and how long it took.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Leaves the connections to snapshot_load
+
+---------------------------------------------------------------------------- */
+int snapshot_restore(struct pf_config* config, struct pf_dispatch* dispatch,
+  struct pf_worker* workers) {
+
+  struct pf_snapshot* header;
+  struct pf_snapshot_flow* flows;
+  struct stat st;
+  unsigned long long waited;
+  unsigned long start;
+  size_t n;
+  int fd;
+
+  start = dispatch_clock();
+
+  if ((fd = open(config->snapshot, O_RDONLY)) == -1) {
+    if (errno == ENOENT) {
+      return 0;
+    }
+    perror("Snapshot");
+    return -1;
+  }
+  if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct pf_snapshot)
+    || (header = (struct pf_snapshot*)mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+    == MAP_FAILED) {
+    fprintf(stderr, "Snapshot %s unreadable, not restored\n", config->snapshot);
+    close(fd);
+    return -1;
+  }
+  close(fd);
+
+  if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic))
+    || header->version != SNAPSHOT_VERSION
+    || header->flow_size != sizeof(struct pf_snapshot_flow)
+    || header->count > (st.st_size - sizeof(struct pf_snapshot)) / sizeof(struct pf_snapshot_flow)) {
+    fprintf(stderr, "Snapshot %s isn't version %d, not restored\n", config->snapshot,
+      SNAPSHOT_VERSION);
+    munmap(header, st.st_size);
+    return -1;
+  }
+  if (header->ip != config->ip) {
+    fprintf(stderr, "Snapshot %s is of another address, not restored\n", config->snapshot);
+    munmap(header, st.st_size);
+    return -1;
+  }
+  flows = (struct pf_snapshot_flow*)(header + 1);
+  waited = snapshot_clock();
+  waited = waited > header->saved_ms ? waited - header->saved_ms : 0;
+
+  if ((n = snapshot_load(config, dispatch, workers, flows, header->count, waited)) == (size_t)-1) {
+    munmap(header, st.st_size);
+    return -1;
+  }
+
+  printf("Restored %zu of %llu connections from %s in %.1fms, saved %.1fs ago\n", n,
+    header->count, config->snapshot, (dispatch_clock() - start) / 1e3, waited / 1e3);
+
+  munmap(header, st.st_size);
+  unlink(config->snapshot);
+
+  return (int)n;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Snapshot Load
+
+Prototype:  size_t snapshot_load(struct pf_config* config,
+              struct pf_dispatch* dispatch, struct pf_worker* workers,
+              struct pf_snapshot_flow* flows, size_t count,
+              unsigned long long waited)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_config* config
+    the global settings
+  struct pf_dispatch* dispatch
+    the forwards being started with
+  struct pf_worker* workers
+    the workers, config->workers of them, not started
+  struct pf_snapshot_flow* flows
+  size_t count
+    the connections to put back
+  unsigned long long waited
+    milliseconds since their idle times were taken
+
+Return Values:
+  the number of connections put back
+  (size_t)-1 out of memory, nothing is put back
+
+Description:
+  Checks each connection against the config and puts those that still fit
+  into the table of the worker its client port steers to, with the snat
+  address and port they had.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+size_t snapshot_load(struct pf_config* config, struct pf_dispatch* dispatch,
+  struct pf_worker* workers, struct pf_snapshot_flow* flows, size_t count,
+  unsigned long long waited) {
+
+  struct pf_target* target;
+  struct pf_host* hosts;
+  struct pf_host* sorted;
+  struct pf_host* host;
+  size_t* counts;
+  int* owners;
+  size_t i, n = 0, restored = 0;
+  int w, a;
+
+  // the connections that still fit, in the form the tables take them,
+  // then grouped by the worker they belong to
+  counts = (size_t*)calloc(config->workers + 1, sizeof(size_t));
+  owners = (int*)malloc(sizeof(int) * (count + 1));
+  hosts = (struct pf_host*)malloc(sizeof(struct pf_host) * (count + 1));
+  sorted = (struct pf_host*)malloc(sizeof(struct pf_host) * (count + 1));
+  if (!counts || !owners || !hosts || !sorted) {
+    perror("Snapshot");
+    free(counts);
+    free(owners);
+    free(hosts);
+    free(sorted);
+    return (size_t)-1;
+  }
+
+  for (i = 0; i < count; i++) {
+
+    // idled out while we were away, or no longer forwarded as it was
+    if (flows[i].idle_ms <= waited || !(target = dispatch_find(dispatch, flows[i].a_port,
+      flows[i].target, flows[i].b_port))) {
+      continue;
+    }
+    for (a = 0; a < config->snatCount && config->snat[a] != flows[i].nat_addr; a++);
+    if (a == config->snatCount) {
+      continue;
+    }
+
+    // both sides have to land on the same worker, which only changes with
+    // the number of workers
+    w = filter_worker(ntohs(flows[i].port), config->workers);
+    if (filter_worker(ntohs(flows[i].nat_port), config->workers) != w) {
+      continue;
+    }
+
+    host = &hosts[n];
+    host->host = flows[i].host;
+    host->port = flows[i].port;
+    host->target = target;
+    host->nat_addr = (unsigned short int)a;
+    host->nat_port = flows[i].nat_port;
+    host->state = flows[i].state;
+    host->fins = flows[i].fins;
+    host->expires = (flows[i].idle_ms - waited) / CT_TICK_MS;
+    owners[n++] = w;
+    counts[w + 1]++;
+  }
+
+  for (w = 0; w < config->workers; w++) {
+    counts[w + 1] += counts[w];
+  }
+  for (i = 0; i < n; i++) {
+    sorted[counts[owners[i]]++] = hosts[i];
+  }
+  for (w = 0, i = 0; w < config->workers; i = counts[w++]) {
+    restored += conntrack_restore(&workers[w].conntrack, sorted + i, counts[w] - i);
+  }
+
+  free(counts);
+  free(owners);
+  free(hosts);
+  free(sorted);
+
+  return restored;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Snapshot Clock
+
+Prototype:  static unsigned long long snapshot_clock(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  The wall clock in milliseconds
+
+Description:
+  When a snapshot was written, and how long it has been since.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static unsigned long long snapshot_clock(void) {
+
+  struct timespec now;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
@@ -0,0 +1,603 @@
+/* ----------------------------------------------------------------------------
+SOURCE FILE
+
+Name:		sync.c
+
+Program:	Port Forwarder
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Functions:
+  struct pf_sync *sync_open(struct pf_config* config, struct pf_stats* stats, int id)
+  void sync_close(struct pf_sync* sync)
+  void sync_flow(struct pf_sync* sync, struct pf_conntrack* ct, struct pf_host* host,
+    int gone)
+  void sync_tick(struct pf_sync* sync, struct pf_conntrack* ct)
+  int sync_standby(struct pf_config* config, struct pf_dispatch* dispatch,
+    struct pf_worker* workers, sigset_t* stop)
+
+Description:
+  Active/standby replication of the connection tables. Every worker of
+  the active forwarder sends what happens to its connections, new ones,
+  changes of state and ones gone, to the peer named by sync_peer over UDP,
+  unicast or multicast. The standby, started with standby = yes, keeps a
+  replica of them and takes over when the active goes quiet, with every
+  connection it knew of already in its workers' tables.
+
+  An event is a snapshot record of the connection and its type. A worker
+  adds them to a datagram of its own as the connection table makes them,
+  without a lock or a system call, and sends the datagram when it is full
+  or at its next tick of the table's clock, whichever comes first. The
+  datagram goes even when empty, as the worker's heartbeat. So the packet
+  path pays for a copy of 32 bytes per change of state, and a send per
+  40 changes or per 100ms, never per packet. A send that would block is
+  dropped, the active never waits on its standby.
+
+  Datagrams carry a sequence number per worker, so the standby counts the
+  ones it lost. To make up for them, and so a standby started late catches
+  up, every worker also sends its whole table again, a slice each tick, so
+  all of it goes every SYNC_REFRESH_S. Connections the standby hasn't heard
+  of for twice that are left behind when it takes over.
+
+  The standby keeps its replica apart from the workers, indexed by snat
+  address and port, which stand for a connection on their own, and only
+  puts it in their tables when it takes over, through snapshot_load. Both
+  forwarders need the same addr, snat, workers and forwards.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+
+#include "portforward.h"
+
+#include <stddef.h>
+
+// what a datagram starts with, and the layout of this one
+#define SYNC_MAGIC    0x50465359
+#define SYNC_VERSION  1
+
+// events in one datagram, a little over 1300 bytes of them
+#define SYNC_BATCH_EVENTS 40
+
+// how often a standby checks on its peer and for signals
+#define SYNC_POLL_MS  100
+
+// what happened to a connection, it is new or changed, or it is gone
+#define SYNC_FLOW 0
+#define SYNC_GONE 1
+
+// one connection event
+struct pf_sync_event{
+  unsigned char type;
+  unsigned char reserved[3];
+  struct pf_snapshot_flow flow;
+};
+
+// one datagram, the header in network order, as is everything in the
+// events but their type and state
+struct pf_sync_batch{
+  unsigned int magic;
+  unsigned short int version;
+  unsigned short int count;
+  unsigned int ip;
+  unsigned short int workers;
+  unsigned short int worker;
+  unsigned int seq;
+  struct pf_sync_event events[SYNC_BATCH_EVENTS];
+};
+
+// the events of one worker on their way out
+struct pf_sync{
+  int fd;
+  struct pf_stats* stats;
+
+  // the tick they last went out on, and the next bucket sent again
+  unsigned long tick;
+  size_t cursor;
+
+  unsigned int seq;
+  int count;
+  struct pf_sync_batch batch;
+};
+
+// a connection the standby holds, and when it last heard of it (us)
+struct pf_replica{
+  struct pf_snapshot_flow flow;
+  unsigned long seen;
+};
+
+static void sync_send(struct pf_sync* sync);
+
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Sync Open
+
+Prototype:  struct pf_sync *sync_open(struct pf_config* config,
+              struct pf_stats* stats, int id)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_config* config
+    the global settings, with the peer in sync_peer
+  struct pf_stats* stats
+    the worker's counters, the events are counted in
+  int id
+    the worker
+
+Return Values:
+  the worker's events, for its connection table's sync
+  0 error, with the reason printed
+
+Description:
+  Opens a UDP socket to the peer for a worker.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+struct pf_sync *sync_open(struct pf_config* config, struct pf_stats* stats, int id) {
+
+  struct pf_sync* sync;
+  struct sockaddr_in peer = {0};
+
+  if (!(sync = (struct pf_sync*)calloc(1, sizeof(struct pf_sync)))) {
+    perror("Sync");
+    return 0;
+  }
+
+  peer.sin_family = AF_INET;
+  peer.sin_addr.s_addr = config->sync_peer;
+  peer.sin_port = config->sync_peer_port;
+  if ((sync->fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1
+    || connect(sync->fd, (struct sockaddr*)&peer, sizeof(peer)) == -1) {
+    perror("Sync");
+    if (sync->fd != -1) {
+      close(sync->fd);
+    }
+    free(sync);
+    return 0;
+  }
+
+  sync->stats = stats;
+  sync->batch.magic = htonl(SYNC_MAGIC);
+  sync->batch.version = htons(SYNC_VERSION);
+  sync->batch.ip = config->ip;
+  sync->batch.workers = htons(config->workers);
+  sync->batch.worker = htons(id);
+
+  return sync;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Sync Close
+
+Prototype:  void sync_close(struct pf_sync* sync)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_sync* sync
+    the worker's events
+
+Return Values:
+  void
+
+Description:
+  Sends whatever is left and closes the socket.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+void sync_close(struct pf_sync* sync) {
+
+  if (sync->count) {
+    sync_send(sync);
+  }
+  close(sync->fd);
+  free(sync);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Sync Flow
+
+Prototype:  void sync_flow(struct pf_sync* sync, struct pf_conntrack* ct,
+              struct pf_host* host, int gone)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_sync* sync
+    the worker's events
+  struct pf_conntrack* ct
+    the table the connection is in
+  struct pf_host* host
+    the connection, new or changed, or on its way out
+  int gone
+    whether it is on its way out
+
+Return Values:
+  void
+
+Description:
+  Called by the connection table. Adds the connection to the worker's
+  datagram, and sends it if that fills it.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+void sync_flow(struct pf_sync* sync, struct pf_conntrack* ct, struct pf_host* host, int gone) {
+
+  struct pf_sync_event* event = &sync->batch.events[sync->count];
+
+  event->type = gone ? SYNC_GONE : SYNC_FLOW;
+  event->flow.host = host->host;
+  event->flow.port = host->port;
+  event->flow.target = host->target->host;
+  event->flow.a_port = host->target->port.a_port;
+  event->flow.b_port = host->target->port.b_port;
+  event->flow.nat_addr = ct->nat[host->nat_addr].addr;
+  event->flow.nat_port = host->nat_port;
+  event->flow.state = host->state;
+  event->flow.fins = host->fins;
+  event->flow.idle_ms = htonl(host->expires > ct->now
+    ? (unsigned int)((host->expires - ct->now) * CT_TICK_MS) : 0);
+
+  sync->stats->sync_events++;
+  if (++sync->count == SYNC_BATCH_EVENTS) {
+    sync_send(sync);
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Sync Tick
+
+Prototype:  void sync_tick(struct pf_sync* sync, struct pf_conntrack* ct)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_sync* sync
+    the worker's events
+  struct pf_conntrack* ct
+    the worker's table, its clock just moved on by conntrack_expire
+
+Return Values:
+  void
+
+Description:
+  Called by worker_tick. Once per tick of the table's clock, adds the next
+  slice of the table to the datagram and sends it, events or not. The
+  slice is as many buckets as the ticks gone by are of SYNC_REFRESH_S.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+void sync_tick(struct pf_sync* sync, struct pf_conntrack* ct) {
+
+  struct pf_host* host;
+  unsigned long elapsed;
+  size_t buckets, b;
+
+  if (ct->now == sync->tick) {
+    return;
+  }
+  elapsed = ct->now - sync->tick;
+  sync->tick = ct->now;
+
+  buckets = ct->mask + 1;
+  if (elapsed < SYNC_REFRESH_S * (1000 / CT_TICK_MS)) {
+    buckets = buckets * elapsed / (SYNC_REFRESH_S * (1000 / CT_TICK_MS)) + 1;
+  }
+  for (b = 0; ct->client_buckets && b < buckets; b++) {
+    for (host = ct->client_buckets[sync->cursor]; host; host = host->client_next) {
+      sync_flow(sync, ct, host, 0);
+    }
+    sync->cursor = (sync->cursor + 1) & ct->mask;
+  }
+
+  sync_send(sync);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Sync Send
+
+Prototype:  static void sync_send(struct pf_sync* sync)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_sync* sync
+    the worker's events
+
+Return Values:
+  void
+
+Description:
+  Sends the datagram without blocking and starts the next one. A failed
+  send is counted and its events are lost to the standby until the table
+  is sent again.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void sync_send(struct pf_sync* sync) {
+
+  sync->batch.count = htons(sync->count);
+  sync->batch.seq = htonl(sync->seq++);
+  if (send(sync->fd, &sync->batch, offsetof(struct pf_sync_batch, events)
+    + sync->count * sizeof(struct pf_sync_event), MSG_DONTWAIT) == -1) {
+    sync->stats->sync_errors++;
+  }
+  sync->stats->sync_batches++;
+  sync->count = 0;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Sync Standby
+
+Prototype:  int sync_standby(struct pf_config* config,
+              struct pf_dispatch* dispatch, struct pf_worker* workers,
+              sigset_t* stop)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_config* config
+    the global settings, with the listen address in sync_listen
+  struct pf_dispatch* dispatch
+    the forwards the workers start with
+  struct pf_worker* workers
+    the workers, opened but not started
+  sigset_t* stop
+    the signals forward takes, blocked
+
+Return Values:
+  1  took over, the workers' tables hold the replica
+  0  told to stop while standing by
+  -1 error, with the reason printed
+
+Description:
+  Keeps the replica of the active's connections until the active has been
+  quiet for sync_timeout or SIGUSR2 says to take over, then puts it in the
+  workers' tables and reports how long that took. A standby that has never
+  heard from its peer waits for it, or for SIGUSR2. SIGUSR1 prints how
+  much is held.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Only counts a gap ahead in a worker's sequence as lost, a datagram from
+  behind resyncs it
+
+---------------------------------------------------------------------------- */
+int sync_standby(struct pf_config* config, struct pf_dispatch* dispatch,
+  struct pf_worker* workers, sigset_t* stop) {
+
+  struct pf_sync_batch batch;
+  struct pf_sync_event* event;
+  struct pf_replica* replica;
+  struct pf_snapshot_flow* flows;
+  struct sockaddr_in local = {0};
+  struct ip_mreq group;
+  struct pollfd poll_fd;
+  struct timespec zero = {0, 0};
+
+  // replica slots by snat address and port, 1 up, 0 for none, the slots
+  // free, and the next datagram due from each of the peer's workers
+  unsigned int* index;
+  unsigned int* spare;
+  long long* expect;
+
+  unsigned long now, heard = 0;
+  unsigned long batches = 0, lost = 0;
+  size_t capacity = (size_t)config->max_flows + config->workers;
+  size_t spareCount, held = 0, n = 0, i;
+  unsigned int* slot;
+  unsigned int seq;
+  ssize_t length;
+  int fd, sig, a, w, e;
+  int on = 1;
+  int result = -1;
+  int takeover = 0;
+
+  index = (unsigned int*)calloc((size_t)config->snatCount * 65536, sizeof(unsigned int));
+  spare = (unsigned int*)malloc(sizeof(unsigned int) * capacity);
+  replica = (struct pf_replica*)malloc(sizeof(struct pf_replica) * capacity);
+  expect = (long long*)malloc(sizeof(long long) * config->workers);
+  if (!index || !spare || !replica || !expect) {
+    perror("Standby");
+    free(index);
+    free(spare);
+    free(replica);
+    free(expect);
+    return -1;
+  }
+  for (spareCount = 0; spareCount < capacity; spareCount++) {
+    spare[spareCount] = capacity - 1 - spareCount;
+  }
+  for (w = 0; w < config->workers; w++) {
+    expect[w] = -1;
+  }
+
+  // a multicast group is joined on our own address
+  local.sin_family = AF_INET;
+  local.sin_addr.s_addr = config->sync_listen;
+  local.sin_port = config->sync_listen_port;
+  group.imr_multiaddr.s_addr = config->sync_listen;
+  group.imr_interface.s_addr = config->ip;
+  if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1
+    || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1
+    || bind(fd, (struct sockaddr*)&local, sizeof(local)) == -1
+    || (IN_MULTICAST(ntohl(config->sync_listen))
+    && setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &group, sizeof(group)) == -1)) {
+    perror("Standby");
+    if (fd != -1) {
+      close(fd);
+    }
+    free(index);
+    free(spare);
+    free(replica);
+    free(expect);
+    return -1;
+  }
+  poll_fd.fd = fd;
+  poll_fd.events = POLLIN;
+
+  printf("Standing by on %s:%d\n", inet_ntoa(local.sin_addr), ntohs(local.sin_port));
+  fflush(stdout);
+
+  while (!takeover) {
+    if (poll(&poll_fd, 1, SYNC_POLL_MS) == -1 && errno != EINTR) {
+      perror("Standby");
+      break;
+    }
+    now = dispatch_clock();
+
+    while ((length = recv(fd, &batch, sizeof(batch), MSG_DONTWAIT)) > 0) {
+
+      // another program, version, or forwarder
+      if ((size_t)length < offsetof(struct pf_sync_batch, events)
+        || batch.magic != htonl(SYNC_MAGIC) || batch.version != htons(SYNC_VERSION)
+        || batch.ip != config->ip || ntohs(batch.workers) != config->workers
+        || ntohs(batch.worker) >= config->workers
+        || ntohs(batch.count) > SYNC_BATCH_EVENTS || (size_t)length
+        != offsetof(struct pf_sync_batch, events) + ntohs(batch.count) * sizeof(struct pf_sync_event)) {
+        continue;
+      }
+      heard = now;
+      batches++;
+
+      // anything skipped in a worker's sequence was lost on the way, one
+      // from behind was reordered or the active restarted, and the count
+      // carries on from it
+      w = ntohs(batch.worker);
+      seq = ntohl(batch.seq);
+      if (expect[w] != -1 && (int)(seq - (unsigned int)expect[w]) > 0) {
+        lost += seq - (unsigned int)expect[w];
+      }
+      expect[w] = (unsigned int)(seq + 1);
+
+      for (e = 0; e < ntohs(batch.count); e++) {
+        event = &batch.events[e];
+        for (a = 0; a < config->snatCount && config->snat[a] != event->flow.nat_addr; a++);
+        if (a == config->snatCount) {
+          continue;
+        }
+        slot = &index[(size_t)a * 65536 + ntohs(event->flow.nat_port)];
+
+        if (event->type == SYNC_GONE) {
+          if (*slot) {
+            spare[spareCount++] = *slot - 1;
+            *slot = 0;
+            held--;
+          }
+          continue;
+        }
+        if (!*slot) {
+          if (!spareCount) {
+            continue;
+          }
+          *slot = spare[--spareCount] + 1;
+          held++;
+        }
+        replica[*slot - 1].flow = event->flow;
+        replica[*slot - 1].flow.idle_ms = ntohl(event->flow.idle_ms);
+        replica[*slot - 1].seen = now;
+      }
+    }
+
+    while ((sig = sigtimedwait(stop, 0, &zero)) > 0) {
+      if (sig == SIGINT || sig == SIGTERM) {
+        result = 0;
+        break;
+      }
+      else if (sig == SIGUSR2) {
+        takeover = 1;
+      }
+      else if (sig == SIGUSR1) {
+        printf("Standby: %zu connections held, %lu datagrams, %lu lost, peer %s\n", held,
+          batches, lost, heard ? "heard from" : "never heard from");
+      }
+      else {
+        printf("Standby: reloads wait until it takes over\n");
+      }
+      fflush(stdout);
+    }
+    if (sig == SIGINT || sig == SIGTERM) {
+      break;
+    }
+
+    if (heard && now - heard > (unsigned long)config->sync_timeout * 1000) {
+      takeover = 1;
+    }
+  }
+  close(fd);
+
+  // everything held but what the peer stopped sending again, with the idle
+  // time gone by since taken off
+  if (takeover && (flows = (struct pf_snapshot_flow*)malloc(sizeof(struct pf_snapshot_flow)
+    * (held + 1)))) {
+    now = dispatch_clock();
+    for (i = 0; i < (size_t)config->snatCount * 65536; i++) {
+      if (!index[i] || replica[index[i] - 1].seen + SYNC_REFRESH_S * 2000000UL < heard) {
+        continue;
+      }
+      flows[n] = replica[index[i] - 1].flow;
+      flows[n].idle_ms -= flows[n].idle_ms < (now - replica[index[i] - 1].seen) / 1000
+        ? flows[n].idle_ms : (now - replica[index[i] - 1].seen) / 1000;
+      if (flows[n].idle_ms) {
+        n++;
+      }
+    }
+    if ((i = snapshot_load(config, dispatch, workers, flows, n, 0)) != (size_t)-1) {
+      printf("Took over %zu of %zu connections in %.1fms, %.1fs after the peer was last "
+        "heard, %lu of %lu datagrams lost\n", i, held, (dispatch_clock() - now) / 1e3,
+        heard ? (now - heard) / 1e6 : 0.0, lost, batches + lost);
+      config->started = dispatch_clock();
+      result = 1;
+    }
+    free(flows);
+  }
+  else if (takeover) {
+    perror("Standby");
+  }
+
+  free(index);
+  free(spare);
+  free(replica);
+  free(expect);
+
+  return result;
+}
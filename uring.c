@@ -0,0 +1,624 @@
+/* ----------------------------------------------------------------------------
+SOURCE FILE
+
+Name:		uring.c
+
+Program:	Port Forwarder
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Functions:
+  struct pf_uring *uring_open(struct pf_config* config, int socket_descriptor)
+  void uring_forward(struct pf_worker* worker, volatile sig_atomic_t* running)
+  void uring_close(struct pf_uring* uring)
+
+Description:
+  The io_uring I/O backend. The worker's raw socket keeps one multishot
+  receive in flight, which the kernel completes once per packet into buffers
+  it takes from a ring of buffers we provide. A packet is rewritten where it
+  landed and sent straight from the same buffer, which goes back on the
+  buffer ring when the send completes (or at once if it's dropped).
+
+  Sends for everything reaped in a pass are queued together and submitted by
+  the same io_uring_enter that waits for the next completions, so a busy
+  worker makes one syscall per batch rather than two per packet. With sqpoll
+  a kernel thread picks the sends up itself, and the worker only enters the
+  ring when it has nothing left to do.
+
+  Talks to the kernel through the raw syscalls and the layout in
+  linux/io_uring.h, no liburing needed.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+
+#include "portforward.h"
+
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// what a completion is for, the buffer id is in the low bits
+#define URING_RECV  (1ULL << 32)
+#define URING_SEND  (2ULL << 32)
+
+// the buffer group the receive takes from
+#define URING_GROUP 0
+
+// a send in flight from one buffer
+struct pf_uring_slot{
+  struct msghdr msg;
+  struct iovec iov;
+  struct sockaddr_in addr;
+};
+
+// one worker's ring and buffers
+struct pf_uring{
+  int fd;
+  int socket_descriptor;
+  unsigned int flags;
+
+  // submission queue
+  void* sq_ring;
+  size_t sq_ring_size;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+  unsigned int* sq_head;
+  unsigned int* sq_tail;
+  unsigned int* sq_flags;
+  unsigned int sq_mask;
+  unsigned int sq_entries;
+  unsigned int sq_local;
+  unsigned int to_submit;
+
+  // completion queue, shares the mapping when the kernel allows
+  void* cq_ring;
+  size_t cq_ring_size;
+  struct io_uring_cqe* cqes;
+  unsigned int* cq_head;
+  unsigned int* cq_tail;
+  unsigned int cq_mask;
+
+  // provided buffers, and the ring they are handed to the kernel on
+  char* buffers;
+  unsigned int count;
+  struct io_uring_buf_ring* buf_ring;
+  size_t buf_ring_size;
+  unsigned short buf_tail;
+  struct pf_uring_slot* slots;
+
+  // the multishot receive is in flight, and buffers not given back yet
+  int armed;
+  unsigned int held;
+
+  // spin on the completion queue instead of waiting in the kernel
+  int busy_poll;
+};
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Uring Enter
+
+Prototype:  static int uring_enter(struct pf_uring* uring, int wait)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_uring* uring
+    the ring
+  int wait
+    whether to wait (up to WORKER_POLL_MS) for a completion
+
+Return Values:
+  1  entered the kernel
+  0  nothing to do, no syscall made
+  -1 error, with errno set
+
+Description:
+  Submits whatever has been queued and optionally waits for a completion, in
+  one syscall. With sqpoll the kernel thread submits on its own, so the ring
+  is only entered to wait, or to wake the thread once it has gone idle.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int uring_enter(struct pf_uring* uring, int wait) {
+
+  struct __kernel_timespec ts = {0, WORKER_POLL_MS * 1000000LL};
+  struct io_uring_getevents_arg arg = {0};
+  unsigned int to_submit = uring->to_submit;
+  unsigned int flags = 0;
+
+  if (uring->flags & IORING_SETUP_SQPOLL) {
+    to_submit = 0;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(uring->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP) {
+      flags |= IORING_ENTER_SQ_WAKEUP;
+    }
+  }
+
+  if (wait) {
+    flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+    arg.ts = (unsigned long long)(uintptr_t)&ts;
+  }
+
+  if (!to_submit && !flags) {
+    return 0;
+  }
+
+  if (syscall(__NR_io_uring_enter, uring->fd, to_submit, wait ? 1 : 0, flags, &arg,
+    sizeof(arg)) == -1) {
+    return -1;
+  }
+  uring->to_submit = 0;
+
+  return 1;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Uring Sqe
+
+Prototype:  static struct io_uring_sqe *uring_sqe(struct pf_uring* uring)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_uring* uring
+    the ring
+
+Return Values:
+  A cleared submission queue entry, published once the caller has filled it
+  in by uring_push
+
+Description:
+  Takes the next free submission entry. The queue has room for a send from
+  every buffer and the receive, so it only fills if the kernel falls behind,
+  and then what is queued is submitted first.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static struct io_uring_sqe *uring_sqe(struct pf_uring* uring) {
+
+  struct io_uring_sqe* sqe;
+
+  while (uring->sq_local - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE) >= uring->sq_entries) {
+    if (uring_enter(uring, 0) == -1 && errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+      return 0;
+    }
+  }
+
+  sqe = &uring->sqes[uring->sq_local & uring->sq_mask];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Uring Push
+
+Prototype:  static void uring_push(struct pf_uring* uring)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_uring* uring
+    the ring
+
+Return Values:
+  void
+
+Description:
+  Publishes the entry taken by uring_sqe. The sq array maps every slot to
+  itself, so only the tail moves.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void uring_push(struct pf_uring* uring) {
+
+  uring->sq_local++;
+  uring->to_submit++;
+  __atomic_store_n(uring->sq_tail, uring->sq_local, __ATOMIC_RELEASE);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Uring Recycle
+
+Prototype:  static void uring_recycle(struct pf_uring* uring, unsigned int bid)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_uring* uring
+    the ring
+  unsigned int bid
+    the buffer to give back
+
+Return Values:
+  void
+
+Description:
+  Puts a buffer back on the provided buffer ring. The kernel sees it once the
+  tail is published at the end of the pass.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void uring_recycle(struct pf_uring* uring, unsigned int bid) {
+
+  struct io_uring_buf* buf = &uring->buf_ring->bufs[uring->buf_tail & (uring->count - 1)];
+
+  buf->addr = (unsigned long long)(uintptr_t)(uring->buffers + (size_t)bid * IP_DATA_LEN);
+  buf->len = IP_DATA_LEN;
+  buf->bid = bid;
+  uring->buf_tail++;
+  uring->held--;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Uring Open
+
+Prototype:  struct pf_uring *uring_open(struct pf_config* config,
+              int socket_descriptor)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_config* config
+    the global settings, for the buffer count and sqpoll
+  int socket_descriptor
+    the worker's raw socket, left open by uring_close
+
+Return Values:
+  The ring for one worker, or a null pointer on error
+
+Description:
+  Sets up a ring for one worker, maps its queues, and registers
+  config->uring_buffers receive buffers of IP_DATA_LEN bytes as a provided
+  buffer ring. The buffers are mapped but only touched as packets land.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+struct pf_uring *uring_open(struct pf_config* config, int socket_descriptor) {
+
+  struct io_uring_params params = {0};
+  struct io_uring_buf_reg reg = {0};
+  struct pf_uring* uring;
+  unsigned int* array;
+  unsigned int i;
+
+  if (!(uring = (struct pf_uring*)calloc(1, sizeof(struct pf_uring)))) {
+    perror("io_uring");
+    return 0;
+  }
+
+  uring->socket_descriptor = socket_descriptor;
+  uring->count = config->uring_buffers;
+  uring->busy_poll = config->latency_mode == LATENCY_BUSY_POLL;
+  uring->sq_ring = uring->cq_ring = uring->sqes = MAP_FAILED;
+  uring->buffers = (char*)MAP_FAILED;
+  uring->buf_ring = (struct io_uring_buf_ring*)MAP_FAILED;
+
+  // room for a send from every buffer and the receive, and for all their completions
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = uring->count * 4;
+  if (config->sqpoll) {
+    params.flags |= IORING_SETUP_SQPOLL;
+    params.sq_thread_idle = WORKER_POLL_MS;
+    if (config->sqpoll_cpu >= 0) {
+      params.flags |= IORING_SETUP_SQ_AFF;
+      params.sq_thread_cpu = config->sqpoll_cpu;
+    }
+  }
+
+  if ((uring->fd = syscall(__NR_io_uring_setup, uring->count * 2, &params)) == -1) {
+    perror("io_uring_setup");
+    free(uring);
+    return 0;
+  }
+  uring->flags = params.flags;
+
+  // map the queues
+  uring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  uring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (uring->cq_ring_size > uring->sq_ring_size) {
+      uring->sq_ring_size = uring->cq_ring_size;
+    }
+    uring->cq_ring_size = 0;
+  }
+  uring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  uring->sq_ring = mmap(0, uring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+    uring->fd, IORING_OFF_SQ_RING);
+  uring->cq_ring = uring->cq_ring_size == 0 ? uring->sq_ring : mmap(0, uring->cq_ring_size,
+    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_CQ_RING);
+  uring->sqes = (struct io_uring_sqe*)mmap(0, uring->sqes_size, PROT_READ | PROT_WRITE,
+    MAP_SHARED | MAP_POPULATE, uring->fd, IORING_OFF_SQES);
+  if (uring->sq_ring == MAP_FAILED || uring->cq_ring == MAP_FAILED || uring->sqes == MAP_FAILED) {
+    perror("io_uring mmap");
+    uring_close(uring);
+    return 0;
+  }
+
+  uring->sq_head = (unsigned int*)((char*)uring->sq_ring + params.sq_off.head);
+  uring->sq_tail = (unsigned int*)((char*)uring->sq_ring + params.sq_off.tail);
+  uring->sq_flags = (unsigned int*)((char*)uring->sq_ring + params.sq_off.flags);
+  uring->sq_mask = *(unsigned int*)((char*)uring->sq_ring + params.sq_off.ring_mask);
+  uring->sq_entries = params.sq_entries;
+  uring->sq_local = *uring->sq_tail;
+
+  array = (unsigned int*)((char*)uring->sq_ring + params.sq_off.array);
+  for (i = 0; i < params.sq_entries; i++) {
+    array[i] = i;
+  }
+
+  uring->cq_head = (unsigned int*)((char*)uring->cq_ring + params.cq_off.head);
+  uring->cq_tail = (unsigned int*)((char*)uring->cq_ring + params.cq_off.tail);
+  uring->cq_mask = *(unsigned int*)((char*)uring->cq_ring + params.cq_off.ring_mask);
+  uring->cqes = (struct io_uring_cqe*)((char*)uring->cq_ring + params.cq_off.cqes);
+
+  // the buffers, and the ring that hands them to the kernel
+  uring->buf_ring_size = (uring->count * sizeof(struct io_uring_buf) + getpagesize() - 1)
+    & ~(size_t)(getpagesize() - 1);
+  uring->buffers = (char*)mmap(0, (size_t)uring->count * IP_DATA_LEN, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  uring->buf_ring = (struct io_uring_buf_ring*)mmap(0, uring->buf_ring_size,
+    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  uring->slots = (struct pf_uring_slot*)calloc(uring->count, sizeof(struct pf_uring_slot));
+  if (uring->buffers == MAP_FAILED || uring->buf_ring == MAP_FAILED || !uring->slots) {
+    perror("io_uring buffers");
+    uring_close(uring);
+    return 0;
+  }
+
+  reg.ring_addr = (unsigned long long)(uintptr_t)uring->buf_ring;
+  reg.ring_entries = uring->count;
+  reg.bgid = URING_GROUP;
+  if (syscall(__NR_io_uring_register, uring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+    perror("io_uring provided buffers");
+    uring_close(uring);
+    return 0;
+  }
+
+  uring->held = uring->count;
+  for (i = 0; i < uring->count; i++) {
+    uring->slots[i].iov.iov_base = uring->buffers + (size_t)i * IP_DATA_LEN;
+    uring->slots[i].msg.msg_name = &uring->slots[i].addr;
+    uring->slots[i].msg.msg_namelen = sizeof(struct sockaddr_in);
+    uring->slots[i].msg.msg_iov = &uring->slots[i].iov;
+    uring->slots[i].msg.msg_iovlen = 1;
+    uring_recycle(uring, i);
+  }
+  __atomic_store_n(&uring->buf_ring->tail, uring->buf_tail, __ATOMIC_RELEASE);
+
+  return uring;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Uring Forward
+
+Prototype:  void uring_forward(struct pf_worker* worker,
+              volatile sig_atomic_t* running)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_worker* worker
+    the worker, with its ring open
+  volatile sig_atomic_t* running
+    cleared to stop forwarding
+
+Return Values:
+  void
+
+Description:
+  Forwards until stopped. Each pass (re)arms the receive if it has stopped,
+  enters the ring once to submit the sends queued last pass and, if nothing
+  has completed yet, to wait for something to, then reaps every completion.
+  Received packets are rewritten and queued to be sent, finished sends are
+  counted, and buffers go back to the kernel at the end of the pass.
+
+  recv_calls counts io_uring_enter calls, there are no separate sends. A
+  failed receive returns, like any other backend, for worker_run to report.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Ticks the worker on every pass, which includes expiring connections
+
+  Andrew Burian
+  2026-10-18
+  Never waits when busy polling, an idle worker spins on the completion
+  queue, and without sqpoll only enters the ring to submit
+
+  Andrew Burian
+  2026-10-18
+  Returns on a failed receive instead of stopping every worker
+
+---------------------------------------------------------------------------- */
+void uring_forward(struct pf_worker* worker, volatile sig_atomic_t* running) {
+
+  struct pf_uring* uring = worker->uring;
+  struct pf_uring_slot* slot;
+  struct io_uring_sqe* sqe;
+  struct io_uring_cqe* cqe;
+  unsigned int head, tail, bid;
+  int entered;
+  int failed = 0;
+
+  if (worker->id == 0) {
+    printf("io_uring: %u x %dKB buffers per worker%s\n", uring->count, IP_DATA_LEN / 1024,
+      uring->flags & IORING_SETUP_SQPOLL ? ", sqpoll" : "");
+  }
+
+  while (*running && !failed) {
+
+    worker_tick(worker);
+
+    // one multishot receive covers every packet until it runs out of buffers
+    if (!uring->armed && uring->held < uring->count) {
+      if (!(sqe = uring_sqe(uring))) {
+        perror("io_uring submit");
+        break;
+      }
+      sqe->opcode = IORING_OP_RECV;
+      sqe->fd = uring->socket_descriptor;
+      sqe->ioprio = IORING_RECV_MULTISHOT;
+      sqe->flags = IOSQE_BUFFER_SELECT;
+      sqe->buf_group = URING_GROUP;
+      sqe->user_data = URING_RECV;
+      uring_push(uring);
+      uring->armed = 1;
+    }
+
+    // submit, and wait if there is nothing to reap and we aren't busy polling
+    head = *uring->cq_head;
+    entered = uring_enter(uring, !uring->busy_poll
+      && head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE));
+    if (entered == -1 && errno != EINTR && errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+      perror("io_uring_enter");
+      break;
+    }
+    worker->stats.recv_calls += entered == 1;
+
+    tail = __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      cqe = &uring->cqes[head & uring->cq_mask];
+
+      // a send finished, its buffer is free
+      if ((cqe->user_data & ~0xffffffffULL) == URING_SEND) {
+        if (cqe->res < 0) {
+          worker->stats.send_errors++;
+        }
+        else {
+          worker->stats.forwarded++;
+        }
+        uring_recycle(uring, (unsigned int)cqe->user_data);
+        continue;
+      }
+
+      if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        uring->armed = 0;
+      }
+
+      // out of buffers ends the receive, it is rearmed once some come back
+      if (cqe->res < 0) {
+        if (cqe->res != -ENOBUFS && cqe->res != -EINTR && cqe->res != -EAGAIN) {
+          errno = -cqe->res;
+          perror("Reading Raw Socket");
+          failed = 1;
+        }
+        continue;
+      }
+      if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+        continue;
+      }
+
+      bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      slot = &uring->slots[bid];
+      uring->held++;
+      worker->stats.received++;
+
+      if (forward_packet(worker, (char*)slot->iov.iov_base, cqe->res, &slot->addr) <= 0
+        || !(sqe = uring_sqe(uring))) {
+        uring_recycle(uring, bid);
+        continue;
+      }
+
+      // forward from the same buffer
+      slot->iov.iov_len = cqe->res;
+      sqe->opcode = IORING_OP_SENDMSG;
+      sqe->fd = uring->socket_descriptor;
+      sqe->addr = (unsigned long long)(uintptr_t)&slot->msg;
+      sqe->len = 1;
+      sqe->user_data = URING_SEND | bid;
+      uring_push(uring);
+    }
+
+    __atomic_store_n(uring->cq_head, head, __ATOMIC_RELEASE);
+    __atomic_store_n(&uring->buf_ring->tail, uring->buf_tail, __ATOMIC_RELEASE);
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Uring Close
+
+Prototype:  void uring_close(struct pf_uring* uring)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_uring* uring
+    the ring to release
+
+Return Values:
+  void
+
+Description:
+  Unmaps everything uring_open set up and closes the ring, which cancels
+  anything still in flight. The raw socket belongs to the worker.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+void uring_close(struct pf_uring* uring) {
+
+  if (uring->sqes != MAP_FAILED) {
+    munmap(uring->sqes, uring->sqes_size);
+  }
+  if (uring->cq_ring != MAP_FAILED && uring->cq_ring != uring->sq_ring) {
+    munmap(uring->cq_ring, uring->cq_ring_size);
+  }
+  if (uring->sq_ring != MAP_FAILED) {
+    munmap(uring->sq_ring, uring->sq_ring_size);
+  }
+  close(uring->fd);
+
+  if (uring->buffers != MAP_FAILED) {
+    munmap(uring->buffers, (size_t)uring->count * IP_DATA_LEN);
+  }
+  if (uring->buf_ring != MAP_FAILED) {
+    munmap(uring->buf_ring, uring->buf_ring_size);
+  }
+  free(uring->slots);
+  free(uring);
+}
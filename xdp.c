@@ -0,0 +1,968 @@
+/* ----------------------------------------------------------------------------
+SOURCE FILE
+
+Name:		xdp.c
+
+Program:	Port Forwarder
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Functions:
+  struct pf_xdp *xdp_open(struct pf_config* config)
+  void xdp_close(struct pf_xdp* xdp)
+  void xdp_flow_add(struct pf_xdp* xdp, struct pf_host* host, unsigned int nat)
+  void xdp_flow_remove(struct pf_xdp* xdp, struct pf_host* host, unsigned int nat)
+  unsigned long xdp_flow_seen(struct pf_xdp* xdp, struct pf_host* host,
+    unsigned int nat)
+  unsigned long xdp_packets(struct pf_xdp* xdp)
+
+Description:
+  The XDP fast path. An eBPF program on each configured interface forwards
+  packets of established connections before the kernel has built an skb for
+  them: it looks the packet up in a hash map of flows, rewrites the addresses
+  and ports, adjusts both checksums incrementally, fills in the ethernet
+  header from a fib lookup, and redirects it out of the egress interface.
+
+  Everything else is passed up to the stack untouched, where the userspace
+  engine handles it as before. That is the slow path: SYNs, FINs and RSTs,
+  connections it hasn't seen established yet, and packets the kernel can't
+  route straight away (no neighbour entry yet, forwarding turned off). When a
+  connection becomes established the connection table puts both directions
+  into the map, and takes them out again when the connection is removed.
+  The program stamps each flow with the time of its last packet, so the
+  table can tell a connection that is busy in the fast path from an idle one.
+
+  Each map entry is keyed on both addresses and both ports of a packet, and
+  holds the new ones, so both directions share one lookup and one rewrite:
+
+    client -> addr:port          becomes  snat:snat port -> tohost:toport
+    tohost:toport -> snat:port   becomes  addr:port -> client
+
+  There is no clang or libbpf involved, the program is assembled here from
+  the instruction set in linux/bpf.h and loaded, and attached with a bpf
+  link, through the raw bpf syscall. The link goes away with the process, so
+  a crash never leaves a stale program on an interface.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Flows are keyed on both addresses, and rewrite the source address too,
+  for connections given an address of the snat pool
+
+---------------------------------------------------------------------------- */
+
+#include "portforward.h"
+
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <net/if.h>
+#include <stddef.h>
+#include <sys/syscall.h>
+
+// room for the program, and the most interfaces it is attached to
+#define XDP_MAX_INSNS       192
+#define XDP_MAX_PASS        32
+#define XDP_MAX_INTERFACES  16
+
+// where the headers sit in a frame, only ipv4 without options is fast pathed
+#define XDP_IP    ETH_HLEN
+#define XDP_TCP   (ETH_HLEN + (int)sizeof(struct iphdr))
+#define XDP_END   (XDP_TCP + (int)sizeof(struct tcphdr))
+
+// the tcp flags byte, and the flags left to the slow path
+#define XDP_TCP_FLAGS   13
+#define XDP_SLOW_FLAGS  0x07
+
+// the program's stack: the flow key, the fib lookup, and the old and new
+// address and port words the checksum differences are taken over
+#define XDP_KEY   (-16)
+#define XDP_FIB   (XDP_KEY - (int)sizeof(struct bpf_fib_lookup))
+#define XDP_NEW   (XDP_FIB - 12)
+#define XDP_OLD   (XDP_NEW - 12)
+#define XDP_FIB_AT(field) (XDP_FIB + (int)offsetof(struct bpf_fib_lookup, field))
+
+// a flow, as the packets on the wire carry it (network order)
+struct pf_xdp_key{
+  unsigned int saddr;
+  unsigned int daddr;
+  unsigned short sport;
+  unsigned short dport;
+};
+
+// what it is rewritten to, and when the program last saw it (CLOCK_MONOTONIC)
+struct pf_xdp_flow{
+  unsigned int saddr;
+  unsigned int daddr;
+  unsigned short sport;
+  unsigned short dport;
+  unsigned long long seen;
+};
+
+// the program being assembled
+struct pf_xdp_asm{
+  struct bpf_insn insns[XDP_MAX_INSNS];
+  int count;
+  int pass[XDP_MAX_PASS];
+  int passCount;
+};
+
+// the loaded program, its maps, and where it is attached
+struct pf_xdp{
+  unsigned int ip;
+  int prog;
+  int flows;
+  int counters;
+  int cpus;
+  int links[XDP_MAX_INTERFACES];
+  int linkCount;
+};
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Xdp Bpf
+
+Prototype:  static int xdp_bpf(int cmd, union bpf_attr* attr)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  int cmd
+    the bpf command
+  union bpf_attr* attr
+    its arguments
+
+Return Values:
+  As the bpf syscall
+
+Description:
+  glibc has no wrapper for bpf.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int xdp_bpf(int cmd, union bpf_attr* attr) {
+
+  return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Xdp Emit
+
+Prototype:  static void xdp_emit(struct pf_xdp_asm* a, int code, int dst,
+              int src, int off, int imm)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_xdp_asm* a
+    the program
+  int code, dst, src, off, imm
+    the fields of the instruction
+
+Return Values:
+  void
+
+Description:
+  Appends one instruction.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void xdp_emit(struct pf_xdp_asm* a, int code, int dst, int src, int off, int imm) {
+
+  struct bpf_insn* insn = &a->insns[a->count++];
+
+  insn->code = code;
+  insn->dst_reg = dst;
+  insn->src_reg = src;
+  insn->off = off;
+  insn->imm = imm;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Xdp Pass If
+
+Prototype:  static void xdp_pass_if(struct pf_xdp_asm* a, int code, int dst,
+              int src, int imm)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_xdp_asm* a
+    the program
+  int code
+    the conditional jump
+  int dst, src, imm
+    what it compares
+
+Return Values:
+  void
+
+Description:
+  Appends a jump to the end of the program, where the packet is passed up to
+  the stack. The offset is filled in once the end is known.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void xdp_pass_if(struct pf_xdp_asm* a, int code, int dst, int src, int imm) {
+
+  a->pass[a->passCount++] = a->count;
+  xdp_emit(a, BPF_JMP | code, dst, src, 0, imm);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Xdp Fold
+
+Prototype:  static void xdp_fold(struct pf_xdp_asm* a, int offset)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_xdp_asm* a
+    the program
+  int offset
+    where the checksum is in the frame
+
+Return Values:
+  void
+
+Description:
+  Adds the difference bpf_csum_diff left in r0 to a checksum in the packet
+  (RFC 1624, HC' = ~(~HC + ~m + m')) and folds the sum back to 16 bits.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static void xdp_fold(struct pf_xdp_asm* a, int offset) {
+
+  int i;
+
+  xdp_emit(a, BPF_LDX | BPF_MEM | BPF_H, BPF_REG_1, BPF_REG_7, offset, 0);
+  xdp_emit(a, BPF_ALU64 | BPF_XOR | BPF_K, BPF_REG_1, 0, 0, 0xffff);
+  xdp_emit(a, BPF_ALU | BPF_MOV | BPF_X, BPF_REG_0, BPF_REG_0, 0, 0);
+  xdp_emit(a, BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_1, BPF_REG_0, 0, 0);
+  for (i = 0; i < 3; i++) {
+    xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_1, 0, 0);
+    xdp_emit(a, BPF_ALU64 | BPF_RSH | BPF_K, BPF_REG_2, 0, 0, 16);
+    xdp_emit(a, BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_1, 0, 0, 0xffff);
+    xdp_emit(a, BPF_ALU64 | BPF_ADD | BPF_X, BPF_REG_1, BPF_REG_2, 0, 0);
+  }
+  xdp_emit(a, BPF_ALU64 | BPF_XOR | BPF_K, BPF_REG_1, 0, 0, 0xffff);
+  xdp_emit(a, BPF_STX | BPF_MEM | BPF_H, BPF_REG_7, BPF_REG_1, offset, 0);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Xdp Assemble
+
+Prototype:  static void xdp_assemble(struct pf_xdp_asm* a, struct pf_xdp* xdp)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_xdp_asm* a
+    the program to fill in
+  struct pf_xdp* xdp
+    the maps it uses
+
+Return Values:
+  void
+
+Description:
+  Assembles the forwarding program. r6 holds the xdp context, r7 and r8 the
+  start and end of the frame, and r9 the flow once it is found.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Looks flows up by both addresses and takes the new source from the flow,
+  instead of testing for and writing our address
+
+---------------------------------------------------------------------------- */
+static void xdp_assemble(struct pf_xdp_asm* a, struct pf_xdp* xdp) {
+
+  int i;
+
+  a->count = 0;
+  a->passCount = 0;
+
+  // the frame, long enough for ethernet, ip and tcp headers
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_6, BPF_REG_1, 0, 0);
+  xdp_emit(a, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_7, BPF_REG_6, offsetof(struct xdp_md, data), 0);
+  xdp_emit(a, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_8, BPF_REG_6, offsetof(struct xdp_md, data_end), 0);
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_7, 0, 0);
+  xdp_emit(a, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_1, 0, 0, XDP_END);
+  xdp_pass_if(a, BPF_JGT | BPF_X, BPF_REG_1, BPF_REG_8, 0);
+
+  // ipv4 without options, tcp, not a fragment
+  xdp_emit(a, BPF_LDX | BPF_MEM | BPF_H, BPF_REG_1, BPF_REG_7, offsetof(struct ethhdr, h_proto), 0);
+  xdp_pass_if(a, BPF_JNE | BPF_K, BPF_REG_1, 0, htons(ETH_P_IP));
+  xdp_emit(a, BPF_LDX | BPF_MEM | BPF_B, BPF_REG_1, BPF_REG_7, XDP_IP, 0);
+  xdp_pass_if(a, BPF_JNE | BPF_K, BPF_REG_1, 0, 0x45);
+  xdp_emit(a, BPF_LDX | BPF_MEM | BPF_B, BPF_REG_1, BPF_REG_7,
+    XDP_IP + offsetof(struct iphdr, protocol), 0);
+  xdp_pass_if(a, BPF_JNE | BPF_K, BPF_REG_1, 0, IPPROTO_TCP);
+  xdp_emit(a, BPF_LDX | BPF_MEM | BPF_H, BPF_REG_1, BPF_REG_7,
+    XDP_IP + offsetof(struct iphdr, frag_off), 0);
+  xdp_emit(a, BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_1, 0, 0, htons(IP_MF | IP_OFFMASK));
+  xdp_pass_if(a, BPF_JNE | BPF_K, BPF_REG_1, 0, 0);
+
+  // not opening or closing a connection
+  xdp_emit(a, BPF_LDX | BPF_MEM | BPF_B, BPF_REG_1, BPF_REG_7, XDP_TCP + XDP_TCP_FLAGS, 0);
+  xdp_emit(a, BPF_ALU64 | BPF_AND | BPF_K, BPF_REG_1, 0, 0, XDP_SLOW_FLAGS);
+  xdp_pass_if(a, BPF_JNE | BPF_K, BPF_REG_1, 0, 0);
+
+  // r9 = the flow, keyed on both addresses and both ports
+  xdp_emit(a, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, BPF_REG_7,
+    XDP_IP + offsetof(struct iphdr, saddr), 0);
+  xdp_emit(a, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_1, XDP_KEY, 0);
+  xdp_emit(a, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, BPF_REG_7,
+    XDP_IP + offsetof(struct iphdr, daddr), 0);
+  xdp_emit(a, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_1, XDP_KEY + 4, 0);
+  xdp_emit(a, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, BPF_REG_7, XDP_TCP, 0);
+  xdp_emit(a, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_1, XDP_KEY + 8, 0);
+  xdp_emit(a, BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, xdp->flows);
+  xdp_emit(a, 0, 0, 0, 0, 0);
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+  xdp_emit(a, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, XDP_KEY);
+  xdp_emit(a, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+  xdp_pass_if(a, BPF_JEQ | BPF_K, BPF_REG_0, 0, 0);
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_9, BPF_REG_0, 0, 0);
+
+  // the next hop, the kernel's routes and neighbours decide where it goes
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_1, 0, 0, 0);
+  for (i = 0; i < (int)sizeof(struct bpf_fib_lookup); i += 8) {
+    xdp_emit(a, BPF_STX | BPF_MEM | BPF_DW, BPF_REG_10, BPF_REG_1, XDP_FIB + i, 0);
+  }
+  xdp_emit(a, BPF_ST | BPF_MEM | BPF_B, BPF_REG_10, 0, XDP_FIB_AT(family), AF_INET);
+  xdp_emit(a, BPF_ST | BPF_MEM | BPF_B, BPF_REG_10, 0, XDP_FIB_AT(l4_protocol), IPPROTO_TCP);
+  // the length for the mtu check, in host order
+  xdp_emit(a, BPF_LDX | BPF_MEM | BPF_H, BPF_REG_1, BPF_REG_7,
+    XDP_IP + offsetof(struct iphdr, tot_len), 0);
+  xdp_emit(a, BPF_ALU | BPF_END | BPF_TO_BE, BPF_REG_1, 0, 0, 16);
+  xdp_emit(a, BPF_STX | BPF_MEM | BPF_H, BPF_REG_10, BPF_REG_1, XDP_FIB_AT(tot_len), 0);
+  xdp_emit(a, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, BPF_REG_6,
+    offsetof(struct xdp_md, ingress_ifindex), 0);
+  xdp_emit(a, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_1, XDP_FIB_AT(ifindex), 0);
+  xdp_emit(a, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, BPF_REG_9,
+    offsetof(struct pf_xdp_flow, saddr), 0);
+  xdp_emit(a, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_1, XDP_FIB_AT(ipv4_src), 0);
+  xdp_emit(a, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, BPF_REG_9,
+    offsetof(struct pf_xdp_flow, daddr), 0);
+  xdp_emit(a, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_1, XDP_FIB_AT(ipv4_dst), 0);
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_6, 0, 0);
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+  xdp_emit(a, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, XDP_FIB);
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_3, 0, 0, sizeof(struct bpf_fib_lookup));
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, 0);
+  xdp_emit(a, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_fib_lookup);
+  xdp_pass_if(a, BPF_JNE | BPF_K, BPF_REG_0, 0, BPF_FIB_LKUP_RET_SUCCESS);
+
+  // the addresses and ports before and after
+  xdp_emit(a, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, BPF_REG_7,
+    XDP_IP + offsetof(struct iphdr, saddr), 0);
+  xdp_emit(a, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_1, XDP_OLD, 0);
+  xdp_emit(a, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, BPF_REG_7,
+    XDP_IP + offsetof(struct iphdr, daddr), 0);
+  xdp_emit(a, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_1, XDP_OLD + 4, 0);
+  xdp_emit(a, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, BPF_REG_7, XDP_TCP, 0);
+  xdp_emit(a, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_1, XDP_OLD + 8, 0);
+  for (i = 0; i < 12; i += 4) {
+    xdp_emit(a, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, BPF_REG_9,
+      offsetof(struct pf_xdp_flow, saddr) + i, 0);
+    xdp_emit(a, BPF_STX | BPF_MEM | BPF_W, BPF_REG_10, BPF_REG_1, XDP_NEW + i, 0);
+  }
+
+  // the ip checksum covers the addresses, the tcp one the ports as well
+  for (i = 8; i <= 12; i += 4) {
+    xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_1, BPF_REG_10, 0, 0);
+    xdp_emit(a, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_1, 0, 0, XDP_OLD);
+    xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, i);
+    xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_3, BPF_REG_10, 0, 0);
+    xdp_emit(a, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_3, 0, 0, XDP_NEW);
+    xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_4, 0, 0, i);
+    xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_5, 0, 0, 0);
+    xdp_emit(a, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_csum_diff);
+    xdp_fold(a, i == 8 ? XDP_IP + offsetof(struct iphdr, check)
+      : XDP_TCP + offsetof(struct tcphdr, check));
+  }
+
+  // rewrite the packet and its ethernet header
+  for (i = 0; i < 12; i += 4) {
+    xdp_emit(a, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, BPF_REG_10, XDP_NEW + i, 0);
+    xdp_emit(a, BPF_STX | BPF_MEM | BPF_W, BPF_REG_7, BPF_REG_1,
+      XDP_IP + offsetof(struct iphdr, saddr) + i, 0);
+  }
+  for (i = 0; i < ETH_ALEN; i += 2) {
+    xdp_emit(a, BPF_LDX | BPF_MEM | BPF_H, BPF_REG_1, BPF_REG_10, XDP_FIB_AT(dmac) + i, 0);
+    xdp_emit(a, BPF_STX | BPF_MEM | BPF_H, BPF_REG_7, BPF_REG_1,
+      offsetof(struct ethhdr, h_dest) + i, 0);
+    xdp_emit(a, BPF_LDX | BPF_MEM | BPF_H, BPF_REG_1, BPF_REG_10, XDP_FIB_AT(smac) + i, 0);
+    xdp_emit(a, BPF_STX | BPF_MEM | BPF_H, BPF_REG_7, BPF_REG_1,
+      offsetof(struct ethhdr, h_source) + i, 0);
+  }
+
+  // count it on this cpu, and stamp the flow
+  xdp_emit(a, BPF_ST | BPF_MEM | BPF_W, BPF_REG_10, 0, XDP_KEY, 0);
+  xdp_emit(a, BPF_LD | BPF_DW | BPF_IMM, BPF_REG_1, BPF_PSEUDO_MAP_FD, 0, xdp->counters);
+  xdp_emit(a, 0, 0, 0, 0, 0);
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_X, BPF_REG_2, BPF_REG_10, 0, 0);
+  xdp_emit(a, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_2, 0, 0, XDP_KEY);
+  xdp_emit(a, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_map_lookup_elem);
+  xdp_emit(a, BPF_JMP | BPF_JEQ | BPF_K, BPF_REG_0, 0, 3, 0);
+  xdp_emit(a, BPF_LDX | BPF_MEM | BPF_DW, BPF_REG_1, BPF_REG_0, 0, 0);
+  xdp_emit(a, BPF_ALU64 | BPF_ADD | BPF_K, BPF_REG_1, 0, 0, 1);
+  xdp_emit(a, BPF_STX | BPF_MEM | BPF_DW, BPF_REG_0, BPF_REG_1, 0, 0);
+  xdp_emit(a, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_ktime_get_ns);
+  xdp_emit(a, BPF_STX | BPF_MEM | BPF_DW, BPF_REG_9, BPF_REG_0, offsetof(struct pf_xdp_flow, seen), 0);
+
+  // out the interface the fib picked
+  xdp_emit(a, BPF_LDX | BPF_MEM | BPF_W, BPF_REG_1, BPF_REG_10, XDP_FIB_AT(ifindex), 0);
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_2, 0, 0, 0);
+  xdp_emit(a, BPF_JMP | BPF_CALL, 0, 0, 0, BPF_FUNC_redirect);
+  xdp_emit(a, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+
+  // pass: everything else is the stack's, and the slow path's
+  for (i = 0; i < a->passCount; i++) {
+    a->insns[a->pass[i]].off = a->count - (a->pass[i] + 1);
+  }
+  xdp_emit(a, BPF_ALU64 | BPF_MOV | BPF_K, BPF_REG_0, 0, 0, XDP_PASS);
+  xdp_emit(a, BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Xdp Map
+
+Prototype:  static int xdp_map(int type, int key, int value, int entries)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  int type
+    the map type
+  int key, value
+    their sizes
+  int entries
+    the most entries it holds
+
+Return Values:
+  The map, or -1 on error
+
+Description:
+  Creates a bpf map.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int xdp_map(int type, int key, int value, int entries) {
+
+  union bpf_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_type = type;
+  attr.key_size = key;
+  attr.value_size = value;
+  attr.max_entries = entries;
+
+  return xdp_bpf(BPF_MAP_CREATE, &attr);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Xdp Cpus
+
+Prototype:  static int xdp_cpus(void)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Return Values:
+  The number of possible cpus
+
+Description:
+  Per-cpu maps hold a value for every possible cpu, which can be more than
+  are online.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+static int xdp_cpus(void) {
+
+  FILE* possible;
+  int first = 0, last = 0;
+
+  if ((possible = fopen("/sys/devices/system/cpu/possible", "r"))) {
+    if (fscanf(possible, "%d-%d", &first, &last) < 2) {
+      last = first;
+    }
+    fclose(possible);
+  }
+
+  return last + 1;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Xdp Open
+
+Prototype:  struct pf_xdp *xdp_open(struct pf_config* config)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_config* config
+    the global settings, with our address, the interfaces and the xdp mode
+
+Return Values:
+  The fast path, or a null pointer on error with the reason printed
+
+Description:
+  Creates the maps, sized for two entries per connection, assembles and
+  loads the program, and attaches it to every configured interface in
+  generic or native mode.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+struct pf_xdp *xdp_open(struct pf_config* config) {
+
+  static char log[65536];
+
+  struct pf_xdp* xdp;
+  struct pf_xdp_asm a;
+  union bpf_attr attr;
+  char *names, *name, *save;
+  int flows = config->max_flows ? config->max_flows : CT_DEFAULT_FLOWS;
+  int ifindex, link;
+
+  if (!(xdp = (struct pf_xdp*)calloc(1, sizeof(struct pf_xdp)))) {
+    perror("XDP");
+    return 0;
+  }
+  xdp->ip = config->ip;
+  xdp->prog = -1;
+  xdp->counters = -1;
+  xdp->cpus = xdp_cpus();
+
+  xdp->flows = xdp_map(BPF_MAP_TYPE_HASH, sizeof(struct pf_xdp_key), sizeof(struct pf_xdp_flow),
+    flows * 2);
+  xdp->counters = xdp_map(BPF_MAP_TYPE_PERCPU_ARRAY, sizeof(int), sizeof(unsigned long long), 1);
+  if (xdp->flows == -1 || xdp->counters == -1) {
+    perror("XDP Maps");
+    xdp_close(xdp);
+    return 0;
+  }
+
+  xdp_assemble(&a, xdp);
+
+  memset(&attr, 0, sizeof(attr));
+  attr.prog_type = BPF_PROG_TYPE_XDP;
+  attr.insns = (unsigned long)a.insns;
+  attr.insn_cnt = a.count;
+  attr.license = (unsigned long)"GPL";
+  if ((xdp->prog = xdp_bpf(BPF_PROG_LOAD, &attr)) == -1) {
+    perror("XDP Program");
+
+    // load it again for the verifier's reasons
+    attr.log_buf = (unsigned long)log;
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    if (xdp_bpf(BPF_PROG_LOAD, &attr) == -1) {
+      fprintf(stderr, "%s", log);
+    }
+    xdp_close(xdp);
+    return 0;
+  }
+
+  names = strdup(config->interfaces);
+  for (name = strtok_r(names, ", ", &save); name; name = strtok_r(0, ", ", &save)) {
+    if (xdp->linkCount == XDP_MAX_INTERFACES) {
+      fprintf(stderr, "Only %d interfaces supported\n", XDP_MAX_INTERFACES);
+      break;
+    }
+    if (!(ifindex = if_nametoindex(name))) {
+      fprintf(stderr, "XDP: no interface %s\n", name);
+      break;
+    }
+
+    memset(&attr, 0, sizeof(attr));
+    attr.link_create.prog_fd = xdp->prog;
+    attr.link_create.target_ifindex = ifindex;
+    attr.link_create.attach_type = BPF_XDP;
+    attr.link_create.flags = config->xdp == XDP_MODE_NATIVE ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE;
+    if ((link = xdp_bpf(BPF_LINK_CREATE, &attr)) == -1) {
+      fprintf(stderr, "XDP: couldn't attach to %s: %s\n", name, strerror(errno));
+      break;
+    }
+    xdp->links[xdp->linkCount++] = link;
+  }
+
+  // every interface or none
+  if (name) {
+    free(names);
+    xdp_close(xdp);
+    return 0;
+  }
+  free(names);
+
+  printf("XDP: %d instruction program on %d interfaces (%s), %d flows\n", a.count,
+    xdp->linkCount, config->xdp == XDP_MODE_NATIVE ? "native" : "generic", flows * 2);
+
+  return xdp;
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Xdp Close
+
+Prototype:  void xdp_close(struct pf_xdp* xdp)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_xdp* xdp
+    the fast path to tear down
+
+Return Values:
+  void
+
+Description:
+  Detaches the program from every interface and frees it and its maps.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+void xdp_close(struct pf_xdp* xdp) {
+
+  int i;
+
+  for (i = 0; i < xdp->linkCount; i++) {
+    close(xdp->links[i]);
+  }
+  if (xdp->prog != -1) {
+    close(xdp->prog);
+  }
+  if (xdp->flows != -1) {
+    close(xdp->flows);
+  }
+  if (xdp->counters != -1) {
+    close(xdp->counters);
+  }
+  free(xdp);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Xdp Flow Keys
+
+Prototype:  static void xdp_flow_keys(struct pf_xdp* xdp, struct pf_host* host,
+              unsigned int nat, struct pf_xdp_key* keys, struct pf_xdp_flow* flows)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_xdp* xdp
+    the fast path, with our address
+  struct pf_host* host
+    the connection
+  unsigned int nat
+    the snat address it was given
+  struct pf_xdp_key* keys
+    filled in with the keys of both directions
+  struct pf_xdp_flow* flows
+    filled in with what each is rewritten to, or a null pointer
+
+Return Values:
+  void
+
+Description:
+  The map entries of a connection, the same rewrites as forward_packet.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Both addresses, and the snat address and port on the target's side
+
+---------------------------------------------------------------------------- */
+static void xdp_flow_keys(struct pf_xdp* xdp, struct pf_host* host, unsigned int nat,
+  struct pf_xdp_key* keys, struct pf_xdp_flow* flows) {
+
+  struct pf_target* target = host->target;
+
+  // from the client
+  keys[0].saddr = host->host;
+  keys[0].daddr = xdp->ip;
+  keys[0].sport = host->port;
+  keys[0].dport = target->port.a_port;
+
+  // from the target
+  keys[1].saddr = target->host;
+  keys[1].daddr = nat;
+  keys[1].sport = target->port.b_port;
+  keys[1].dport = host->nat_port;
+
+  if (flows) {
+    memset(flows, 0, sizeof(struct pf_xdp_flow) * 2);
+    flows[0].saddr = nat;
+    flows[0].daddr = target->host;
+    flows[0].sport = host->nat_port;
+    flows[0].dport = target->port.b_port;
+    flows[1].saddr = xdp->ip;
+    flows[1].daddr = host->host;
+    flows[1].sport = target->port.a_port;
+    flows[1].dport = host->port;
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Xdp Flow Add
+
+Prototype:  void xdp_flow_add(struct pf_xdp* xdp, struct pf_host* host,
+              unsigned int nat)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_xdp* xdp
+    the fast path
+  struct pf_host* host
+    a connection that just became established
+  unsigned int nat
+    the snat address it was given
+
+Return Values:
+  void
+
+Description:
+  Hands both directions of the connection to the fast path. If the map is
+  full the connection simply stays on the slow path.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Takes the snat address the connection was given
+
+---------------------------------------------------------------------------- */
+void xdp_flow_add(struct pf_xdp* xdp, struct pf_host* host, unsigned int nat) {
+
+  struct pf_xdp_key keys[2];
+  struct pf_xdp_flow flows[2];
+  union bpf_attr attr;
+  int i;
+
+  xdp_flow_keys(xdp, host, nat, keys, flows);
+
+  for (i = 0; i < 2; i++) {
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = xdp->flows;
+    attr.key = (unsigned long)&keys[i];
+    attr.value = (unsigned long)&flows[i];
+    attr.flags = BPF_ANY;
+    xdp_bpf(BPF_MAP_UPDATE_ELEM, &attr);
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Xdp Flow Remove
+
+Prototype:  void xdp_flow_remove(struct pf_xdp* xdp, struct pf_host* host,
+              unsigned int nat)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_xdp* xdp
+    the fast path
+  struct pf_host* host
+    a connection leaving the table
+  unsigned int nat
+    the snat address it was given
+
+Return Values:
+  void
+
+Description:
+  Takes both directions of the connection out of the fast path.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Takes the snat address the connection was given
+
+---------------------------------------------------------------------------- */
+void xdp_flow_remove(struct pf_xdp* xdp, struct pf_host* host, unsigned int nat) {
+
+  struct pf_xdp_key keys[2];
+  union bpf_attr attr;
+  int i;
+
+  xdp_flow_keys(xdp, host, nat, keys, 0);
+
+  for (i = 0; i < 2; i++) {
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = xdp->flows;
+    attr.key = (unsigned long)&keys[i];
+    xdp_bpf(BPF_MAP_DELETE_ELEM, &attr);
+  }
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Xdp Flow Seen
+
+Prototype:  unsigned long xdp_flow_seen(struct pf_xdp* xdp, struct pf_host* host,
+              unsigned int nat)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_xdp* xdp
+    the fast path
+  struct pf_host* host
+    the connection
+  unsigned int nat
+    the snat address it was given
+
+Return Values:
+  When the fast path last forwarded a packet of the connection, in
+  connection table ticks, or 0 if it never has
+
+Description:
+  Read by the connection table before it expires a connection, whose packets
+  it may not have seen for a long time.
+
+Revisions:
+  Andrew Burian
+  2026-10-18
+  Takes the snat address the connection was given
+
+---------------------------------------------------------------------------- */
+unsigned long xdp_flow_seen(struct pf_xdp* xdp, struct pf_host* host, unsigned int nat) {
+
+  struct pf_xdp_key keys[2];
+  struct pf_xdp_flow flow;
+  union bpf_attr attr;
+  unsigned long long seen = 0;
+  int i;
+
+  xdp_flow_keys(xdp, host, nat, keys, 0);
+
+  for (i = 0; i < 2; i++) {
+    memset(&attr, 0, sizeof(attr));
+    attr.map_fd = xdp->flows;
+    attr.key = (unsigned long)&keys[i];
+    attr.value = (unsigned long)&flow;
+    if (xdp_bpf(BPF_MAP_LOOKUP_ELEM, &attr) == 0 && flow.seen > seen) {
+      seen = flow.seen;
+    }
+  }
+
+  return seen / (CT_TICK_MS * 1000000ULL);
+}
+
+/* ----------------------------------------------------------------------------
+FUNCTION
+
+Name:		Xdp Packets
+
+Prototype:  unsigned long xdp_packets(struct pf_xdp* xdp)
+
+Developer:	Andrew Burian
+
+Created On:	2026-10-18
+
+Parameters:
+  struct pf_xdp* xdp
+    the fast path
+
+Return Values:
+  The packets it has forwarded
+
+Description:
+  Sums the program's per-cpu counters.
+
+Revisions:
+  (none)
+
+---------------------------------------------------------------------------- */
+unsigned long xdp_packets(struct pf_xdp* xdp) {
+
+  unsigned long long* counts;
+  unsigned long total = 0;
+  union bpf_attr attr;
+  int key = 0;
+  int i;
+
+  if (!(counts = (unsigned long long*)calloc(xdp->cpus, sizeof(unsigned long long)))) {
+    return 0;
+  }
+
+  memset(&attr, 0, sizeof(attr));
+  attr.map_fd = xdp->counters;
+  attr.key = (unsigned long)&key;
+  attr.value = (unsigned long)counts;
+  if (xdp_bpf(BPF_MAP_LOOKUP_ELEM, &attr) == 0) {
+    for (i = 0; i < xdp->cpus; i++) {
+      total += counts[i];
+    }
+  }
+
+  free(counts);
+  return total;
+}